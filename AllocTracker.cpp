@@ -0,0 +1,234 @@
+#include "AllocTracker.h"
+
+#ifndef QENGINE_TRACK_ALLOCS
+
+bool AllocTracker::IsCompiledIn() { return false; }
+void AllocTracker::Enable(bool on) {}
+bool AllocTracker::IsEnabled() { return false; }
+int AllocTracker::GetFrameCount() { return 0; }
+size_t AllocTracker::GetFrameBytes() { return 0; }
+void AllocTracker::EndFrame(int frame, Log * logger) {}
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <execinfo.h>
+#include <new>
+#include <algorithm>
+
+extern "C" {
+	void *	__libc_malloc(size_t size);
+	void *	__libc_calloc(size_t n, size_t size);
+	void *	__libc_realloc(void * p, size_t size);
+}
+
+struct alloc_site_t {
+	void *			frames[ALLOC_TRACK_DEPTH];
+	int				count;
+	size_t			bytes;
+};
+
+static alloc_site_t		sites[ALLOC_TRACK_SITES];
+static alloc_site_t		report[ALLOC_TRACK_SITES];
+static int				frameCount;
+static size_t			frameBytes;
+// Allocations whose site did not fit in the table
+static int				untracked;
+static volatile int		siteLock;
+static volatile bool	enabled;
+// Set while the tracker itself runs, its allocations pass through
+static __thread bool	inTracker;
+
+static void R_LockSites()
+{
+	while( __sync_lock_test_and_set(&siteLock, 1) ) {
+		while( siteLock ) {
+		}
+	}
+}
+
+static void R_UnlockSites()
+{
+	__sync_lock_release(&siteLock);
+}
+
+// Frames 0 and 1 are this function and the allocator entry point
+static void __attribute__((noinline)) R_TrackAlloc(size_t bytes)
+{
+	if( !enabled || inTracker ) {
+		return;
+	}
+	inTracker = true;
+
+	void * stack[ALLOC_TRACK_DEPTH + 2];
+	int depth = backtrace(stack, ALLOC_TRACK_DEPTH + 2) - 2;
+	void * frames[ALLOC_TRACK_DEPTH];
+	for( int i = 0; i < ALLOC_TRACK_DEPTH; ++i ) {
+		frames[i] = i < depth ? stack[i + 2] : NULL;
+	}
+
+	size_t hash = 0;
+	for( int i = 0; i < ALLOC_TRACK_DEPTH; ++i ) {
+		hash = hash * 31 + (size_t)frames[i];
+	}
+	hash ^= hash >> 17;
+
+	R_LockSites();
+	frameCount++;
+	frameBytes += bytes;
+	bool found = false;
+	for( int probe = 0; probe < ALLOC_TRACK_SITES; ++probe ) {
+		alloc_site_t& s = sites[(hash + probe) & (ALLOC_TRACK_SITES - 1)];
+		if( s.count && memcmp(s.frames, frames, sizeof(frames)) ) {
+			continue;
+		}
+		if( !s.count ) {
+			memcpy(s.frames, frames, sizeof(frames));
+		}
+		s.count++;
+		s.bytes += bytes;
+		found = true;
+		break;
+	}
+	if( !found ) {
+		untracked++;
+	}
+	R_UnlockSites();
+
+	inTracker = false;
+}
+
+extern "C" void * malloc(size_t size)
+{
+	R_TrackAlloc(size);
+	return __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t n, size_t size)
+{
+	R_TrackAlloc(n * size);
+	return __libc_calloc(n, size);
+}
+
+extern "C" void * realloc(void * p, size_t size)
+{
+	R_TrackAlloc(size);
+	return __libc_realloc(p, size);
+}
+
+void * operator new(size_t size)
+{
+	R_TrackAlloc(size);
+	void * p = __libc_malloc(size ? size : 1);
+	if( !p ) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void * operator new[](size_t size)
+{
+	R_TrackAlloc(size);
+	void * p = __libc_malloc(size ? size : 1);
+	if( !p ) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void * operator new(size_t size, const std::nothrow_t&) throw()
+{
+	R_TrackAlloc(size);
+	return __libc_malloc(size ? size : 1);
+}
+
+void * operator new[](size_t size, const std::nothrow_t&) throw()
+{
+	R_TrackAlloc(size);
+	return __libc_malloc(size ? size : 1);
+}
+
+bool AllocTracker::IsCompiledIn()
+{
+	return true;
+}
+
+void AllocTracker::Enable(bool on)
+{
+	R_LockSites();
+	memset(sites, 0, sizeof(sites));
+	frameCount = 0;
+	frameBytes = 0;
+	untracked = 0;
+	enabled = on;
+	R_UnlockSites();
+}
+
+bool AllocTracker::IsEnabled()
+{
+	return enabled;
+}
+
+int AllocTracker::GetFrameCount()
+{
+	return frameCount;
+}
+
+size_t AllocTracker::GetFrameBytes()
+{
+	return frameBytes;
+}
+
+static bool R_SiteCmp(const alloc_site_t& a, const alloc_site_t& b)
+{
+	return a.count > b.count;
+}
+
+void AllocTracker::EndFrame(int frame, Log * logger)
+{
+	if( !enabled ) {
+		return;
+	}
+	inTracker = true;
+
+	// Take the frame out so other threads can go on
+	R_LockSites();
+	int count = frameCount, lost = untracked;
+	size_t bytes = frameBytes;
+	int numSites = 0;
+	for( int i = 0; i < ALLOC_TRACK_SITES; ++i ) {
+		if( sites[i].count ) {
+			report[numSites++] = sites[i];
+		}
+	}
+	memset(sites, 0, sizeof(sites));
+	frameCount = 0;
+	frameBytes = 0;
+	untracked = 0;
+	R_UnlockSites();
+
+	if( count && logger ) {
+		logger->LogNormal("Frame %d: %d heap allocations, %u bytes", frame, count, (unsigned int)bytes);
+		std::sort(report, report + numSites, R_SiteCmp);
+		for( int i = 0; i < numSites && i < ALLOC_TRACK_REPORT; ++i ) {
+			const alloc_site_t& s = report[i];
+			char ** names = backtrace_symbols(s.frames, ALLOC_TRACK_DEPTH);
+			char line[1024];
+			int len = snprintf(line, sizeof(line), "  %5d x %8u bytes:", s.count, (unsigned int)s.bytes);
+			for( int k = 0; k < ALLOC_TRACK_DEPTH && s.frames[k] && len < (int)sizeof(line); ++k ) {
+				len += snprintf(line + len, sizeof(line) - len, "%s %s", k ? " <-" : "", names ? names[k] : "?");
+			}
+			logger->LogNormal("%s", line);
+			free(names);
+		}
+		if( lost ) {
+			logger->LogNormal("  %d allocations from sites that did not fit the table", lost);
+		}
+	}
+
+	inTracker = false;
+}
+
+#endif /* QENGINE_TRACK_ALLOCS */
@@ -0,0 +1,47 @@
+/*
+ * ===============================================================
+ *
+ * Debug heap allocation tracker.
+ *
+ * Built with QENGINE_TRACK_ALLOCS, malloc, calloc, realloc and
+ * operator new are replaced by versions that count every call
+ * per frame and per call site (a few return addresses) before
+ * handing it to glibc. EndFrame logs the frame's allocations with
+ * the busiest call sites and starts over; frames without any stay
+ * quiet. Link with -rdynamic to get function names in the report.
+ *
+ * Without QENGINE_TRACK_ALLOCS everything here is a no-op and the
+ * allocator is not touched.
+ *
+ *================================================================
+ */
+#ifndef _ALLOCTRACKER_H
+#define _ALLOCTRACKER_H
+
+#include <stddef.h>
+#include "Log.h"
+
+// Distinct call sites per frame, power of two
+#define ALLOC_TRACK_SITES		1024
+// Return addresses kept per call site
+#define ALLOC_TRACK_DEPTH		3
+// Call sites listed per frame
+#define ALLOC_TRACK_REPORT		8
+
+class AllocTracker
+{
+public:
+	static bool		IsCompiledIn();
+	// Nothing is counted until enabled
+	static void		Enable(bool on);
+	static bool		IsEnabled();
+
+	// Allocations since the last EndFrame
+	static int		GetFrameCount();
+	static size_t	GetFrameBytes();
+
+	// Report the frame to logger if it allocated, then reset
+	static void		EndFrame(int frame, Log * logger);
+};
+
+#endif /* !_ALLOCTRACKER_H */
@@ -0,0 +1,183 @@
+#include "Atom.h"
+#include "Thread.h"
+#include "Common.h"
+
+extern Common * common;
+
+// Text of interned names is packed into blocks of this size
+#define ATOM_TEXT_BLOCK		16384
+
+struct atom_entry_t {
+	const char *	str;
+	size_t			len;
+	unsigned int	hash;
+};
+
+// Pages never move once allocated, so Str() needs no lock
+static atom_entry_t *	pages[ATOM_MAX_PAGES];
+static int				numAtoms;
+// Open addressing, holds ids, 0 is a free slot
+static int *			slots;
+static unsigned int		numSlots;
+static char *			textBlock;
+static size_t			textUsed;
+static Mutex			atomLock;
+
+static atom_entry_t		emptyAtom = { "", 0, 0 };
+
+static unsigned int R_HashName(const char * s, size_t len)
+{
+	// FNV-1a
+	unsigned int h = 2166136261u;
+	for( size_t i = 0; i < len; ++i ) {
+		h = ( h ^ (unsigned char)s[i] ) * 16777619u;
+	}
+	return h;
+}
+
+static inline const atom_entry_t& R_Entry(int id)
+{
+	return pages[id >> ATOM_PAGE_BITS][id & (ATOM_PAGE_SIZE - 1)];
+}
+
+static void * R_AtomAlloc(size_t bytes)
+{
+	void * p = malloc(bytes);
+	if( !p ) {
+		common->FatalError("qAtom: Cannot allocate more memory");
+	}
+	return p;
+}
+
+static const char * R_StoreText(const char * s, size_t len)
+{
+	char * p;
+	if( len + 1 > ATOM_TEXT_BLOCK / 4 ) {
+		// Long names don't waste the rest of a block
+		p = (char*)R_AtomAlloc(len + 1);
+	} else {
+		if( !textBlock || textUsed + len + 1 > ATOM_TEXT_BLOCK ) {
+			textBlock = (char*)R_AtomAlloc(ATOM_TEXT_BLOCK);
+			textUsed = 0;
+		}
+		p = textBlock + textUsed;
+		textUsed += len + 1;
+	}
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+static void R_InsertSlot(int id)
+{
+	unsigned int mask = numSlots - 1;
+	for( unsigned int i = R_Entry(id).hash & mask; ; i = ( i + 1 ) & mask ) {
+		if( !slots[i] ) {
+			slots[i] = id;
+			return;
+		}
+	}
+}
+
+static void R_GrowSlots()
+{
+	int * old = slots;
+	unsigned int oldSlots = numSlots;
+	numSlots = numSlots ? numSlots * 2 : 256;
+	slots = (int*)R_AtomAlloc(numSlots * sizeof(int));
+	memset(slots, 0, numSlots * sizeof(int));
+	for( unsigned int i = 0; i < oldSlots; ++i ) {
+		if( old[i] ) {
+			R_InsertSlot(old[i]);
+		}
+	}
+	free(old);
+}
+
+// Caller holds atomLock
+static int R_FindSlot(const char * s, size_t len, unsigned int hash)
+{
+	if( !numSlots ) {
+		return 0;
+	}
+	unsigned int mask = numSlots - 1;
+	for( unsigned int i = hash & mask; slots[i]; i = ( i + 1 ) & mask ) {
+		const atom_entry_t& e = R_Entry(slots[i]);
+		if( e.hash == hash && e.len == len && !memcmp(e.str, s, len) ) {
+			return slots[i];
+		}
+	}
+	return 0;
+}
+
+int qAtom::Intern(const char * name)
+{
+	return Intern(name, name ? strlen(name) : 0);
+}
+
+int qAtom::Intern(const char * name, size_t len)
+{
+	if( !len ) {
+		return 0;
+	}
+	unsigned int hash = R_HashName(name, len);
+
+	atomLock.Lock();
+	int id = R_FindSlot(name, len, hash);
+	if( id ) {
+		atomLock.Unlock();
+		return id;
+	}
+
+	id = numAtoms + 1;
+	int page = id >> ATOM_PAGE_BITS;
+	if( page >= ATOM_MAX_PAGES ) {
+		atomLock.Unlock();
+		common->FatalError("qAtom: Too many names");
+		return 0;
+	}
+	if( !pages[page] ) {
+		pages[page] = (atom_entry_t*)R_AtomAlloc(ATOM_PAGE_SIZE * sizeof(atom_entry_t));
+	}
+	atom_entry_t& e = pages[page][id & (ATOM_PAGE_SIZE - 1)];
+	e.str = R_StoreText(name, len);
+	e.len = len;
+	e.hash = hash;
+	numAtoms = id;
+
+	// Keep the table at most half full
+	if( numAtoms * 2 > (int)numSlots ) {
+		R_GrowSlots();
+	}
+	R_InsertSlot(id);
+	atomLock.Unlock();
+	return id;
+}
+
+qAtom qAtom::Find(const char * name)
+{
+	qAtom atom;
+	size_t len = name ? strlen(name) : 0;
+	if( len ) {
+		unsigned int hash = R_HashName(name, len);
+		atomLock.Lock();
+		atom.id = R_FindSlot(name, len, hash);
+		atomLock.Unlock();
+	}
+	return atom;
+}
+
+int qAtom::NumAtoms()
+{
+	return numAtoms;
+}
+
+const char * qAtom::Str() const
+{
+	return id ? R_Entry(id).str : emptyAtom.str;
+}
+
+size_t qAtom::Length() const
+{
+	return id ? R_Entry(id).len : 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * ===============================================================
+ *
+ * Interned names.
+ *
+ * A qAtom stands for one string. Interning the same text twice
+ * gives the same id, so resource names (meshes, textures) compare
+ * and hash as integers and are stored once for the whole run.
+ * Id 0 is the empty string, which is also what a default qAtom is.
+ *
+ * Intern takes a lock and may allocate, so resolve names when
+ * loading, not per frame. Str() and comparisons are lock free and
+ * can be used from any thread. Atoms are never released.
+ *
+ *================================================================
+ */
+#ifndef _ATOM_H
+#define _ATOM_H
+
+#include "String.h"
+
+// Names kept per page of the id table
+#define ATOM_PAGE_BITS		10
+#define ATOM_PAGE_SIZE		(1 << ATOM_PAGE_BITS)
+// Pages of the id table, limits the number of atoms
+#define ATOM_MAX_PAGES		1024
+
+class qAtom
+{
+public:
+					qAtom() : id(0) {}
+	explicit		qAtom(const char * name) : id(Intern(name)) {}
+	explicit		qAtom(const qStr& name) : id(Intern(name.Ptr(), name.Length())) {}
+
+	bool			operator==(const qAtom other) const { return id == other.id; }
+	bool			operator!=(const qAtom other) const { return id != other.id; }
+	// Order of interning, not alphabetical
+	bool			operator<(const qAtom other) const { return id < other.id; }
+
+	int				GetId() const { return id; }
+	bool			IsEmpty() const { return id == 0; }
+	const char *	Str() const;
+	size_t			Length() const;
+
+	// Atom of name if it was ever interned, an empty atom
+	// otherwise. Does not add name, for lookups by string.
+	static qAtom	Find(const char * name);
+	static int		NumAtoms();
+
+private:
+	static int		Intern(const char * name);
+	static int		Intern(const char * name, size_t len);
+
+	int				id;
+};
+
+#endif /* !_ATOM_H */
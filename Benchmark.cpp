@@ -0,0 +1,116 @@
+#include "Benchmark.h"
+#include <stdio.h>
+#include <sys/resource.h>
+#include <algorithm>
+
+void Benchmark::BeginRun(bool record)
+{
+	recording = record;
+	if( recording ) {
+		runFrames.push_back(0);
+	}
+}
+
+void Benchmark::EndRun()
+{
+	recording = false;
+}
+
+void Benchmark::BeginFrame()
+{
+	frameStart = Sys_Nanoseconds();
+}
+
+void Benchmark::EndFrame(const render_stats_t& stats)
+{
+	if( !recording ) {
+		return;
+	}
+	bench_frame_t f;
+	f.ms = (Sys_Nanoseconds() - frameStart) * 1e-6f;
+	f.drawCalls = stats.drawCalls;
+	f.tris = stats.trisSubmitted;
+	f.culled = stats.entitiesCulled;
+	frames.push_back(f);
+	runFrames.back()++;
+}
+
+static float R_Percentile(const std::vector<float>& sorted, float p)
+{
+	return sorted[(int)(p * (sorted.size() - 1) + 0.5f)];
+}
+
+// "name":{"min":..,"avg":..,"max":..} of one per frame counter
+static void R_WriteCounter(FILE * fp, const char * name, const std::vector<bench_frame_t>& frames, int bench_frame_t::*field)
+{
+	int lo = frames[0].*field, hi = lo;
+	double sum = 0.0;
+	for( size_t i = 0; i < frames.size(); ++i ) {
+		int v = frames[i].*field;
+		lo = std::min(lo, v);
+		hi = std::max(hi, v);
+		sum += v;
+	}
+	fprintf(fp, "    \"%s\": {\"min\": %d, \"avg\": %.1f, \"max\": %d}", name, lo, sum / frames.size(), hi);
+}
+
+bool Benchmark::WriteReport(const char * path, const char * map, const char * cp, int warmup) const
+{
+	if( frames.empty() ) {
+		return false;
+	}
+	FILE * fp = fopen(path, "w");
+	if( !fp ) {
+		return false;
+	}
+
+	std::vector<float> sorted(frames.size());
+	double sum = 0.0;
+	for( size_t i = 0; i < frames.size(); ++i ) {
+		sorted[i] = frames[i].ms;
+		sum += frames[i].ms;
+	}
+	std::sort(sorted.begin(), sorted.end());
+
+	// Kilobytes on Linux
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"version\": \"%s\",\n", QENGINE_VERSION);
+	fprintf(fp, "  \"map\": \"%s\",\n", map);
+	fprintf(fp, "  \"cameraPath\": \"%s\",\n", cp);
+	fprintf(fp, "  \"warmupRuns\": %d,\n", warmup);
+	fprintf(fp, "  \"runs\": %d,\n", NumRuns());
+	fprintf(fp, "  \"frames\": %d,\n", (int)frames.size());
+	fprintf(fp, "  \"frameMs\": {\"min\": %.3f, \"avg\": %.3f, \"max\": %.3f, \"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f},\n",
+		sorted.front(), sum / frames.size(), sorted.back(),
+		R_Percentile(sorted, 0.50f), R_Percentile(sorted, 0.95f), R_Percentile(sorted, 0.99f));
+
+	// Spread between runs tells how much to trust a difference
+	fprintf(fp, "  \"runAvgMs\": [");
+	size_t first = 0;
+	for( size_t r = 0; r < runFrames.size(); ++r ) {
+		double runSum = 0.0;
+		for( int i = 0; i < runFrames[r]; ++i ) {
+			runSum += frames[first + i].ms;
+		}
+		fprintf(fp, "%s%.3f", r ? ", " : "", runFrames[r] ? runSum / runFrames[r] : 0.0);
+		first += runFrames[r];
+	}
+	fprintf(fp, "],\n");
+
+	fprintf(fp, "  \"perFrame\": {\n");
+	R_WriteCounter(fp, "drawCalls", frames, &bench_frame_t::drawCalls);
+	fprintf(fp, ",\n");
+	R_WriteCounter(fp, "triangles", frames, &bench_frame_t::tris);
+	fprintf(fp, ",\n");
+	R_WriteCounter(fp, "entitiesCulled", frames, &bench_frame_t::culled);
+	fprintf(fp, "\n  },\n");
+	fprintf(fp, "  \"maxRssKb\": %ld\n", usage.ru_maxrss);
+	fprintf(fp, "}\n");
+
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
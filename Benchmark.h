@@ -0,0 +1,53 @@
+/*
+ * ===============================================================
+ *
+ * Deterministic benchmark over a camera path.
+ *
+ * The path is played a number of times at uncapped frame rate.
+ * Simulation always advances by the fixed timer tick, so every
+ * run renders exactly the same frames no matter how fast they
+ * come out. The first runs only warm caches and streaming up and
+ * are thrown away; the rest are summarized in a JSON report that
+ * can be diffed between engine builds on the same content.
+ *
+ *================================================================
+ */
+#ifndef _BENCHMARK_H
+#define _BENCHMARK_H
+
+#include <vector>
+#include "qEngine.h"
+#include "Profiler.h"
+
+struct bench_frame_t {
+	float			ms;
+	int				drawCalls;
+	int				tris;
+	int				culled;
+};
+
+class Benchmark
+{
+public:
+					Benchmark() : recording(false), frameStart(0) {}
+
+	// Frames between BeginRun and EndRun go into the report
+	// only if the run is recorded
+	void			BeginRun(bool record);
+	void			EndRun();
+
+	void			BeginFrame();
+	void			EndFrame(const render_stats_t& stats);
+
+	int				NumRuns() const { return (int)runFrames.size(); }
+	bool			WriteReport(const char * path, const char * map, const char * cp, int warmup) const;
+
+private:
+	bool			recording;
+	profile_time_t	frameStart;
+	std::vector<bench_frame_t>	frames;
+	// Frames recorded in each run
+	std::vector<int>			runFrames;
+};
+
+#endif /* !_BENCHMARK_H */
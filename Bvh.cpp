@@ -0,0 +1,418 @@
+#include "Bvh.h"
+#include <algorithm>
+#include <string.h>
+
+// Direction components smaller than this are taken as this, so
+// the slab test never multiplies 0 by infinity
+#define BVH_MIN_DIR			1e-20f
+#define BVH_MIN_DET			1e-12f
+
+static float R_HalfArea(const Vec3& mins, const Vec3& maxs)
+{
+	Vec3 d = maxs - mins;
+	return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+
+void Bvh::Clear()
+{
+	nodes.clear();
+	prims.clear();
+}
+
+void Bvh::Build(const Vec3 * mins, const Vec3 * maxs, int count)
+{
+	Clear();
+	if( count <= 0 ) {
+		return;
+	}
+	primMins = mins;
+	primMaxs = maxs;
+	prims.resize(count);
+	centers.resize(count);
+	for( int i = 0; i < count; ++i ) {
+		prims[i] = i;
+		centers[i] = ( mins[i] + maxs[i] ).Scale(0.5f);
+	}
+	// About one node per BVH_WIDTH leaves
+	nodes.reserve(count / ( BVH_LEAF_SIZE * ( BVH_WIDTH - 1 ) ) + 1);
+	BuildNode(0, count, 0);
+	centers.clear();
+	primMins = NULL;
+	primMaxs = NULL;
+}
+
+int Bvh::BuildNode(int begin, int end, int depth)
+{
+	int index = (int)nodes.size();
+	nodes.push_back(bvh_node_t());
+
+	// Split the biggest range until there are four
+	int rangeBegin[BVH_WIDTH], rangeEnd[BVH_WIDTH];
+	int numRanges = 1;
+	rangeBegin[0] = begin;
+	rangeEnd[0] = end;
+	while( numRanges < BVH_WIDTH ) {
+		int biggest = -1;
+		for( int i = 0; i < numRanges; ++i ) {
+			int n = rangeEnd[i] - rangeBegin[i];
+			if( n > BVH_LEAF_SIZE && ( biggest < 0 || n > rangeEnd[biggest] - rangeBegin[biggest] ) ) {
+				biggest = i;
+			}
+		}
+		if( biggest < 0 ) {
+			break;
+		}
+		int mid = Split(rangeBegin[biggest], rangeEnd[biggest], depth);
+		rangeBegin[numRanges] = mid;
+		rangeEnd[numRanges] = rangeEnd[biggest];
+		rangeEnd[biggest] = mid;
+		numRanges++;
+	}
+
+	bvh_node_t node;
+	for( int i = 0; i < BVH_WIDTH; ++i ) {
+		Vec3 bmin(FLT_MAX), bmax(-FLT_MAX);
+		int child = BVH_LEAF(0, 0);
+		if( i < numRanges ) {
+			for( int p = rangeBegin[i]; p < rangeEnd[i]; ++p ) {
+				for( int k = 0; k < 3; ++k ) {
+					bmin[k] = std::min(bmin[k], primMins[prims[p]][k]);
+					bmax[k] = std::max(bmax[k], primMaxs[prims[p]][k]);
+				}
+			}
+			int n = rangeEnd[i] - rangeBegin[i];
+			child = n <= BVH_LEAF_SIZE ? BVH_LEAF(rangeBegin[i], n) : BuildNode(rangeBegin[i], rangeEnd[i], depth + 1);
+		}
+		for( int k = 0; k < 3; ++k ) {
+			node.bmin[k][i] = bmin[k];
+			node.bmax[k][i] = bmax[k];
+		}
+		node.child[i] = child;
+	}
+	// Children may have moved the array
+	nodes[index] = node;
+	return index;
+}
+
+struct bvh_center_cmp_t {
+	const Vec3 *	centers;
+	int				axis;
+	bool operator()(int a, int b) const { return centers[a][axis] < centers[b][axis]; }
+};
+
+// Binned SAH on the longest axis of the centers, median when
+// that doesn't split or the tree got deep. Returns the first
+// primitive of the second half.
+int Bvh::Split(int begin, int end, int depth)
+{
+	Vec3 cmin(FLT_MAX), cmax(-FLT_MAX);
+	for( int p = begin; p < end; ++p ) {
+		for( int k = 0; k < 3; ++k ) {
+			cmin[k] = std::min(cmin[k], centers[prims[p]][k]);
+			cmax[k] = std::max(cmax[k], centers[prims[p]][k]);
+		}
+	}
+	int axis = 0;
+	for( int k = 1; k < 3; ++k ) {
+		if( cmax[k] - cmin[k] > cmax[axis] - cmin[axis] ) {
+			axis = k;
+		}
+	}
+	float extent = cmax[axis] - cmin[axis];
+
+	if( extent > 0.0f && depth < BVH_SAH_DEPTH ) {
+		int binCount[BVH_SAH_BINS] = { 0 };
+		Vec3 binMin[BVH_SAH_BINS], binMax[BVH_SAH_BINS];
+		for( int b = 0; b < BVH_SAH_BINS; ++b ) {
+			binMin[b] = Vec3(FLT_MAX);
+			binMax[b] = Vec3(-FLT_MAX);
+		}
+		float scale = BVH_SAH_BINS / extent;
+		for( int p = begin; p < end; ++p ) {
+			int id = prims[p];
+			int b = std::min((int)( ( centers[id][axis] - cmin[axis] ) * scale ), BVH_SAH_BINS - 1);
+			binCount[b]++;
+			for( int k = 0; k < 3; ++k ) {
+				binMin[b][k] = std::min(binMin[b][k], primMins[id][k]);
+				binMax[b][k] = std::max(binMax[b][k], primMaxs[id][k]);
+			}
+		}
+
+		// Cost of everything left of each plane, then sweep back
+		float leftCost[BVH_SAH_BINS];
+		Vec3 bmin(FLT_MAX), bmax(-FLT_MAX);
+		int n = 0;
+		for( int b = 0; b < BVH_SAH_BINS - 1; ++b ) {
+			for( int k = 0; k < 3; ++k ) {
+				bmin[k] = std::min(bmin[k], binMin[b][k]);
+				bmax[k] = std::max(bmax[k], binMax[b][k]);
+			}
+			n += binCount[b];
+			leftCost[b] = n ? R_HalfArea(bmin, bmax) * n : 0.0f;
+		}
+		float bestCost = FLT_MAX;
+		int best = -1;
+		bmin = Vec3(FLT_MAX);
+		bmax = Vec3(-FLT_MAX);
+		n = 0;
+		for( int b = BVH_SAH_BINS - 1; b > 0; --b ) {
+			for( int k = 0; k < 3; ++k ) {
+				bmin[k] = std::min(bmin[k], binMin[b][k]);
+				bmax[k] = std::max(bmax[k], binMax[b][k]);
+			}
+			n += binCount[b];
+			if( n == end - begin ) {
+				continue;
+			}
+			float cost = leftCost[b - 1] + ( n ? R_HalfArea(bmin, bmax) * n : 0.0f );
+			if( n && cost < bestCost ) {
+				bestCost = cost;
+				best = b;
+			}
+		}
+
+		if( best > 0 ) {
+			int mid = begin;
+			for( int p = begin; p < end; ++p ) {
+				int b = std::min((int)( ( centers[prims[p]][axis] - cmin[axis] ) * scale ), BVH_SAH_BINS - 1);
+				if( b < best ) {
+					std::swap(prims[p], prims[mid++]);
+				}
+			}
+			if( mid > begin && mid < end ) {
+				return mid;
+			}
+		}
+	}
+
+	int mid = ( begin + end ) / 2;
+	bvh_center_cmp_t cmp = { &centers[0], axis };
+	std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end, cmp);
+	return mid;
+}
+
+void R_SetupBvhRay(const Vec3& origin, const Vec3& dir, bvh_ray_t& ray)
+{
+	for( int k = 0; k < 3; ++k ) {
+		float d = dir[k];
+		if( fabsf(d) < BVH_MIN_DIR ) {
+			d = d < 0.0f ? -BVH_MIN_DIR : BVH_MIN_DIR;
+		}
+		ray.origin[k] = origin[k];
+		ray.invDir[k] = 1.0f / d;
+		ray.dirNeg[k] = d < 0.0f;
+	}
+}
+
+int R_IntersectBvhNode(const bvh_node_t& node, const bvh_ray_t& ray, float tMax, float tNear[BVH_WIDTH])
+{
+#ifdef BVH_SSE
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(tMax);
+	for( int k = 0; k < 3; ++k ) {
+		// Entering on the near side, which depends on direction,
+		// keeps empty boxes (min > max) from looking infinite
+		const float * nearSide = ray.dirNeg[k] ? node.bmax[k] : node.bmin[k];
+		const float * farSide = ray.dirNeg[k] ? node.bmin[k] : node.bmax[k];
+		__m128 o = _mm_set1_ps(ray.origin[k]);
+		__m128 inv = _mm_set1_ps(ray.invDir[k]);
+		t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearSide), o), inv));
+		t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farSide), o), inv));
+	}
+	_mm_storeu_ps(tNear, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+	int mask = 0;
+	for( int i = 0; i < BVH_WIDTH; ++i ) {
+		float t0 = 0.0f, t1 = tMax;
+		for( int k = 0; k < 3; ++k ) {
+			float nearSide = ray.dirNeg[k] ? node.bmax[k][i] : node.bmin[k][i];
+			float farSide = ray.dirNeg[k] ? node.bmin[k][i] : node.bmax[k][i];
+			t0 = std::max(t0, ( nearSide - ray.origin[k] ) * ray.invDir[k]);
+			t1 = std::min(t1, ( farSide - ray.origin[k] ) * ray.invDir[k]);
+		}
+		tNear[i] = t0;
+		if( t0 <= t1 ) {
+			mask |= 1 << i;
+		}
+	}
+	return mask;
+#endif
+}
+
+/*
+==============================================================
+
+MeshBvh
+
+==============================================================
+*/
+
+void MeshBvh::Clear()
+{
+	bvh.Clear();
+	packets.clear();
+}
+
+void MeshBvh::Build(const Vec3 * corners, int numTris)
+{
+	Clear();
+	std::vector<Vec3> mins(numTris), maxs(numTris);
+	for( int t = 0; t < numTris; ++t ) {
+		mins[t] = Vec3(FLT_MAX);
+		maxs[t] = Vec3(-FLT_MAX);
+		for( int c = 0; c < 3; ++c ) {
+			for( int k = 0; k < 3; ++k ) {
+				mins[t][k] = std::min(mins[t][k], corners[t * 3 + c][k]);
+				maxs[t][k] = std::max(maxs[t][k], corners[t * 3 + c][k]);
+			}
+		}
+	}
+	bvh.Build(numTris ? &mins[0] : NULL, numTris ? &maxs[0] : NULL, numTris);
+
+	// Each leaf becomes a packet, leaves point at it instead
+	const int * prims = bvh.GetPrimitives();
+	for( int n = 0; n < bvh.GetNumNodes(); ++n ) {
+		for( int i = 0; i < BVH_WIDTH; ++i ) {
+			int c = bvh.GetNodes()[n].child[i];
+			int count = c < 0 ? BVH_LEAF_COUNT(c) : 0;
+			if( !count ) {
+				continue;
+			}
+			bvh_tri4_t p;
+			memset(&p, 0, sizeof(p));
+			for( int l = 0; l < 4; ++l ) {
+				p.tri[l] = -1;
+				if( l >= count ) {
+					continue;
+				}
+				int t = prims[BVH_LEAF_FIRST(c) + l];
+				const Vec3 * v = corners + t * 3;
+				Vec3 e1 = v[1] - v[0], e2 = v[2] - v[0];
+				for( int k = 0; k < 3; ++k ) {
+					p.v0[k][l] = v[0][k];
+					p.e1[k][l] = e1[k];
+					p.e2[k][l] = e2[k];
+				}
+				p.tri[l] = t;
+			}
+			bvh.SetChild(n, i, BVH_LEAF((int)packets.size(), count));
+			packets.push_back(p);
+		}
+	}
+}
+
+// Nearest of the four triangles hit before tMax, -1 for none
+static int R_IntersectTri4(const bvh_tri4_t& p, const Vec3& o, const Vec3& d, float tMax, float& t, float& u, float& v)
+{
+#ifdef BVH_SSE
+	__m128 dx = _mm_set1_ps(d[0]), dy = _mm_set1_ps(d[1]), dz = _mm_set1_ps(d[2]);
+	__m128 e1x = _mm_loadu_ps(p.e1[0]), e1y = _mm_loadu_ps(p.e1[1]), e1z = _mm_loadu_ps(p.e1[2]);
+	__m128 e2x = _mm_loadu_ps(p.e2[0]), e2y = _mm_loadu_ps(p.e2[1]), e2z = _mm_loadu_ps(p.e2[2]);
+	// p = d x e2
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 valid = _mm_cmpgt_ps(absDet, _mm_set1_ps(BVH_MIN_DET));
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+	// s = o - v0
+	__m128 sx = _mm_sub_ps(_mm_set1_ps(o[0]), _mm_loadu_ps(p.v0[0]));
+	__m128 sy = _mm_sub_ps(_mm_set1_ps(o[1]), _mm_loadu_ps(p.v0[1]));
+	__m128 sz = _mm_sub_ps(_mm_set1_ps(o[2]), _mm_loadu_ps(p.v0[2]));
+	__m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+	// q = s x e1
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+	__m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+	__m128 zero = _mm_setzero_ps();
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(uu, zero));
+	valid = _mm_and_ps(valid, _mm_cmpge_ps(vv, zero));
+	valid = _mm_and_ps(valid, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.0f)));
+	valid = _mm_and_ps(valid, _mm_cmpgt_ps(tt, zero));
+	valid = _mm_and_ps(valid, _mm_cmplt_ps(tt, _mm_set1_ps(tMax)));
+	int mask = _mm_movemask_ps(valid);
+	if( !mask ) {
+		return -1;
+	}
+	float ts[4], us[4], vs[4];
+	_mm_storeu_ps(ts, tt);
+	_mm_storeu_ps(us, uu);
+	_mm_storeu_ps(vs, vv);
+#else
+	float ts[4], us[4], vs[4];
+	int mask = 0;
+	for( int l = 0; l < 4; ++l ) {
+		Vec3 e1(p.e1[0][l], p.e1[1][l], p.e1[2][l]);
+		Vec3 e2(p.e2[0][l], p.e2[1][l], p.e2[2][l]);
+		Vec3 pv = d.CrossProduct(e2);
+		float det = e1.DotProduct(pv);
+		if( fabsf(det) <= BVH_MIN_DET ) {
+			continue;
+		}
+		float invDet = 1.0f / det;
+		Vec3 s = o - Vec3(p.v0[0][l], p.v0[1][l], p.v0[2][l]);
+		Vec3 q = s.CrossProduct(e1);
+		us[l] = s.DotProduct(pv) * invDet;
+		vs[l] = d.DotProduct(q) * invDet;
+		ts[l] = e2.DotProduct(q) * invDet;
+		if( us[l] >= 0.0f && vs[l] >= 0.0f && us[l] + vs[l] <= 1.0f && ts[l] > 0.0f && ts[l] < tMax ) {
+			mask |= 1 << l;
+		}
+	}
+	if( !mask ) {
+		return -1;
+	}
+#endif
+	int best = -1;
+	for( int l = 0; l < 4; ++l ) {
+		if( ( mask & ( 1 << l ) ) && ( best < 0 || ts[l] < ts[best] ) ) {
+			best = l;
+		}
+	}
+	t = ts[best];
+	u = us[best];
+	v = vs[best];
+	return best;
+}
+
+struct mesh_leaf_t {
+	const bvh_tri4_t *	packets;
+	const Vec3 *		origin;
+	const Vec3 *		dir;
+	ray_hit_t *			hit;
+	bool				anyHit;
+	bool				found;
+
+	bool operator()(int first, int count, float& tMax)
+	{
+		const bvh_tri4_t& p = packets[first];
+		float t, u, v;
+		int l = R_IntersectTri4(p, *origin, *dir, tMax, t, u, v);
+		if( l < 0 ) {
+			return false;
+		}
+		tMax = t;
+		hit->t = t;
+		hit->u = u;
+		hit->v = v;
+		hit->tri = p.tri[l];
+		found = true;
+		return anyHit;
+	}
+};
+
+bool MeshBvh::Intersect(const Vec3& origin, const Vec3& dir, ray_hit_t& hit, bool anyHit) const
+{
+	if( packets.empty() ) {
+		return false;
+	}
+	mesh_leaf_t leaf = { &packets[0], &origin, &dir, &hit, anyHit, false };
+	float tMax = hit.t;
+	bvh.Traverse(origin, dir, tMax, leaf);
+	return leaf.found;
+}
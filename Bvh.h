@@ -0,0 +1,202 @@
+/*
+ * ===============================================================
+ *
+ * Bounding volume hierarchies for ray casts on the CPU.
+ *
+ * Bvh is built over boxes with the surface area heuristic. Nodes
+ * have four children whose boxes are stored by axis, so one SSE
+ * pass tests a ray against all four. A leaf holds up to
+ * BVH_LEAF_SIZE primitives. Children the ray enters are walked
+ * nearest first, and the ones starting past the nearest hit so
+ * far are skipped.
+ *
+ * MeshBvh puts the full detail triangles of a mesh in one. Every
+ * leaf becomes a packet of four triangles that a single
+ * Moller-Trumbore pass tests at once. Rays there are in model
+ * space, WorldDB brings them from world space through a Bvh of
+ * the entity boxes.
+ *
+ *================================================================
+ */
+#ifndef _BVH_H
+#define _BVH_H
+
+#include "Math.h"
+#include <vector>
+#include <cfloat>
+
+#if defined(__SSE__) || defined(_M_X64)
+	#include <xmmintrin.h>
+	#define BVH_SSE
+#endif
+
+#define BVH_WIDTH			4
+#define BVH_LEAF_SIZE		4
+#define BVH_SAH_BINS		16
+// Deeper than this splits go to the median, so the tree stays
+// shallow enough for the traversal stack
+#define BVH_SAH_DEPTH		24
+#define BVH_STACK_SIZE		128
+
+// Children below 0 are leaves of count primitives from first
+#define BVH_LEAF(first, count)	( ~( ( (first) << 3 ) | (count) ) )
+#define BVH_LEAF_FIRST(c)		( ( ~(c) ) >> 3 )
+#define BVH_LEAF_COUNT(c)		( ( ~(c) ) & 7 )
+
+struct bvh_node_t {
+	float			bmin[3][BVH_WIDTH];	// axis, then child
+	float			bmax[3][BVH_WIDTH];
+	int				child[BVH_WIDTH];	// node index or BVH_LEAF
+};
+
+// Hits are at origin + t * dir, dir doesn't need to be unit length
+struct ray_t {
+	Vec3			origin;
+	Vec3			dir;
+	float			tMax;
+};
+
+struct ray_hit_t {
+	float			t;					// tMax when nothing was hit
+	int				tri;				// full detail triangle, -1 for none
+	float			u, v;				// weights of triangle vertices 1 and 2
+	int				entity;				// WorldDB index, world casts only
+};
+
+// Ray as the box test wants it
+struct bvh_ray_t {
+	float			origin[3];
+	float			invDir[3];
+	int				dirNeg[3];			// far side first on that axis
+};
+
+/*
+================================================
+
+Bvh over boxes, the caller owns what they bound
+
+================================================
+*/
+class Bvh
+{
+public:
+	// Primitive i is inside mins[i], maxs[i]
+	void				Build(const Vec3 * mins, const Vec3 * maxs, int count);
+	void				Clear();
+	bool				IsEmpty() const { return nodes.empty(); }
+
+	const bvh_node_t *	GetNodes() const { return nodes.empty() ? NULL : &nodes[0]; }
+	int					GetNumNodes() const { return (int)nodes.size(); }
+	// Primitive indices in leaf order, leaves point in here
+	const int *			GetPrimitives() const { return prims.empty() ? NULL : &prims[0]; }
+	// Moves leaf children, for owners packing primitives by leaf
+	void				SetChild(int node, int i, int child) { nodes[node].child[i] = child; }
+	size_t				GetMemory() const { return nodes.size() * sizeof(bvh_node_t) + prims.size() * sizeof(int); }
+
+	// leaf(first, count, tMax) is called for every leaf the ray
+	// gets to. It lowers tMax on a hit and returns true to stop.
+	template<class LEAF>
+	void				Traverse(const Vec3& origin, const Vec3& dir, float& tMax, LEAF& leaf) const;
+
+private:
+	int					BuildNode(int begin, int end, int depth);
+	int					Split(int begin, int end, int depth);
+
+private:
+	std::vector<bvh_node_t>	nodes;
+	std::vector<int>		prims;
+	// Build only
+	const Vec3 *			primMins;
+	const Vec3 *			primMaxs;
+	std::vector<Vec3>		centers;
+};
+
+// Four triangles, edges from v0, by axis
+struct bvh_tri4_t {
+	float			v0[3][4];
+	float			e1[3][4];
+	float			e2[3][4];
+	int				tri[4];				// -1 for padding
+};
+
+/*
+================================================
+
+Triangles of one mesh, in model space
+
+================================================
+*/
+class MeshBvh
+{
+public:
+	// Three corners per triangle
+	void				Build(const Vec3 * corners, int numTris);
+	void				Clear();
+	bool				IsEmpty() const { return bvh.IsEmpty(); }
+	size_t				GetMemory() const { return bvh.GetMemory() + packets.size() * sizeof(bvh_tri4_t); }
+
+	// hit.t is how far to look on entry. With anyHit the first
+	// triangle found ends it, otherwise the nearest is kept.
+	// Returns true and fills hit if something was hit.
+	bool				Intersect(const Vec3& origin, const Vec3& dir, ray_hit_t& hit, bool anyHit) const;
+
+private:
+	Bvh							bvh;
+	std::vector<bvh_tri4_t>		packets;
+};
+
+void	R_SetupBvhRay(const Vec3& origin, const Vec3& dir, bvh_ray_t& ray);
+// Children of node the ray enters before tMax, as a bit mask,
+// with where it enters each
+int		R_IntersectBvhNode(const bvh_node_t& node, const bvh_ray_t& ray, float tMax, float tNear[BVH_WIDTH]);
+
+template<class LEAF>
+inline void Bvh::Traverse(const Vec3& origin, const Vec3& dir, float& tMax, LEAF& leaf) const
+{
+	if( nodes.empty() ) {
+		return;
+	}
+	bvh_ray_t ray;
+	R_SetupBvhRay(origin, dir, ray);
+
+	int stack[BVH_STACK_SIZE];
+	float stackNear[BVH_STACK_SIZE];
+	int sp = 0;
+	stack[sp] = 0;
+	stackNear[sp++] = 0.0f;
+	while( sp ) {
+		--sp;
+		int c = stack[sp];
+		if( stackNear[sp] > tMax ) {
+			continue;
+		}
+		if( c < 0 ) {
+			if( leaf(BVH_LEAF_FIRST(c), BVH_LEAF_COUNT(c), tMax) ) {
+				return;
+			}
+			continue;
+		}
+
+		const bvh_node_t& node = nodes[c];
+		float tNear[BVH_WIDTH];
+		int mask = R_IntersectBvhNode(node, ray, tMax, tNear);
+		// Farthest pushed first so the nearest comes off next
+		int order[BVH_WIDTH];
+		int n = 0;
+		for( int i = 0; i < BVH_WIDTH; ++i ) {
+			if( mask & ( 1 << i ) ) {
+				int k = n++;
+				for( ; k > 0 && tNear[order[k - 1]] < tNear[i]; --k ) {
+					order[k] = order[k - 1];
+				}
+				order[k] = i;
+			}
+		}
+		for( int i = 0; i < n; ++i ) {
+			stack[sp] = node.child[order[i]];
+			stackNear[sp++] = tNear[order[i]];
+		}
+	}
+}
+
+#endif /* !_BVH_H */
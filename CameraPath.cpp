@@ -1,7 +1,8 @@
 #include "CameraPath.h"
+#include <algorithm>
 
 
-CameraPath::CameraPath(const char *filename) : startFrame(0), endFrame(0), playingFrame(0), numKeyFrames(0), numFrames(0)
+CameraPath::CameraPath(const char *filename) : playTime(0), finished(false)
 {
 	LoadPath(filename);
 }
@@ -29,37 +30,30 @@ void CameraPath::LoadPath(const char *filename)
 
 	lex.ReadToken();
 	lex.ReadToken();
-	numKeyFrames = lex.TokenValue().ToInteger();
+	int numKeyFrames = lex.TokenValue().ToInteger();
 	if (numKeyFrames <= 0) {
 		return;
 	}
 
-	
-	camera_frame_t * lastFrame = NULL, *head;
+	keys.clear();
+	keys.reserve(numKeyFrames);
 	Vec3 lookAt, up;
 	for (int i = 0; i < numKeyFrames; ++i) {
-		camera_frame_t * cf = (camera_frame_t*)malloc(sizeof(camera_frame_t));
-		memset(cf, 0, sizeof(*cf));
-
-		// first frame
-		if (!lastFrame)	
-			cf->id = 0;
-		else
-			cf->id = lastFrame->id + 1;
-		// 'time' label
+		camera_key_t key;
+
+		// 'time' label, milliseconds in the file
 		lex.ReadToken();	
 		lex.ReadToken();
-		qStr time = lex.TokenValue();
-		if (time == "00000")
-			cf->time = 0;
-		else
-			cf->time = time.ToInteger();
+		key.time = lex.TokenValue().ToInteger() * 0.001f;
+		// Keys have to be in order for the segment search
+		if (!keys.empty() && key.time < keys.back().time)
+			key.time = keys.back().time;
 
 		// position label
 		lex.ReadToken();
 		for (int k = 0; k < 3; ++k) {
 			lex.ReadToken();
-			cf->position[k] = lex.TokenValue().ToFloat();
+			key.position[k] = lex.TokenValue().ToFloat();
 		}
 
 		// lookat label
@@ -77,7 +71,7 @@ void CameraPath::LoadPath(const char *filename)
 		}
 
 		// Calculate quaternion
-		Vec3 zAxis = cf->position -	lookAt;
+		Vec3 zAxis = key.position -	lookAt;
 		zAxis = zAxis.Normalize();
 		up = up.Normalize();	
         
@@ -87,76 +81,126 @@ void CameraPath::LoadPath(const char *filename)
         rotMat[0][1] = xAxis[1]; rotMat[1][1] = up[1]; rotMat[2][1] = zAxis[1];
         rotMat[0][2] = xAxis[2]; rotMat[1][2] = up[2]; rotMat[2][2] = zAxis[2];
 
-        cf->orientation = Quaternion::FromMatrix(rotMat);
-        if( lastFrame ) {
-        	lastFrame->next = cf;
-        } else {
-        	head = cf;
-        }
-        lastFrame = cf;
+        key.orientation = Quaternion::FromMatrix(rotMat);
+        keys.push_back(key);
 	}
 
-	startFrame = head;
-    endFrame = lastFrame;
-	playingFrame = startFrame;
+	Rewind();
 }
 
-void CameraPath::ExpandPath()
+const camera_key_t * CameraPath::GetKeys() const
 {
-    if( numKeyFrames < 2 )
-        return;
-
-    int diff = endFrame->time - startFrame->time;
-    int timeStep = 0;
-    float extraAccuracyTimeStep = 0;
+    return keys.empty() ? NULL : &keys[0];
+}
 
-    camera_frame_t * currentFrame = startFrame, * newFrame;
+float CameraPath::GetDuration() const
+{
+    if( keys.empty() ) {
+        return 0.0f;
+    }
+    return keys.back().time - keys.front().time;
+}
 
-    while( currentFrame->time < endFrame->time ) {
-        newFrame = (camera_frame_t*)calloc(1, sizeof(camera_frame_t));
-        newFrame->time = currentFrame->time + timeStep;         
-        newFrame->next = endFrame;
-        currentFrame->next = newFrame;
+static bool R_KeyTimeLess(float time, const camera_key_t& key)
+{
+    return time < key.time;
+}
 
-        float factor = (newFrame->time - startFrame->time) / (float)diff;
-        // interpolating position
-        currentFrame->position = startFrame->position.Scale(factor) + endFrame->position.Scale(1-factor);
-        // interpolating orientation
-        currentFrame->orientation = (startFrame->orientation).Slerp(endFrame->orientation, factor);
+int CameraPath::FindSegment(float time) const
+{
+    // Last key at or before time, stays below the last key so
+    // there is always a next one
+    int seg = (int)( std::upper_bound(keys.begin(), keys.end(), time, R_KeyTimeLess) - keys.begin() ) - 1;
+    return std::max(0, std::min(seg, (int)keys.size() - 2));
+}
 
-        currentFrame = newFrame;
-        // What's the trick here? 
-        extraAccuracyTimeStep += 0.6666667f;
-        timeStep = 16 + (int)extraAccuracyTimeStep;
-        extraAccuracyTimeStep -= (int)extraAccuracyTimeStep;
-        numFrames++;
-    }  
+// Catmull-Rom tangent in units per second. Neighbours at
+// different distances in time are weighted by that time.
+Vec3 CameraPath::GetTangent(int key) const
+{
+    int prev = std::max(key - 1, 0);
+    int next = std::min(key + 1, (int)keys.size() - 1);
+    float dt = keys[next].time - keys[prev].time;
+    if( dt <= 0.0f ) {
+        return Vec3();
+    }
+    Vec3 d = keys[next].position - keys[prev].position;
+    return d.Scale(1.0f / dt);
+}
 
-} 
+void CameraPath::Evaluate(float time, camera_frame_t& frame) const
+{
+    if( keys.empty() ) {
+        frame.position = Vec3();
+        frame.orientation = Quaternion(0.0f, 0.0f, 0.0f, 1.0f);
+        return;
+    }
+    time += keys.front().time;
+    if( keys.size() == 1 || time <= keys.front().time ) {
+        frame.position = keys.front().position;
+        frame.orientation = keys.front().orientation;
+        return;
+    }
+    if( time >= keys.back().time ) {
+        frame.position = keys.back().position;
+        frame.orientation = keys.back().orientation;
+        return;
+    }
 
+    int seg = FindSegment(time);
+    const camera_key_t& k0 = keys[seg];
+    const camera_key_t& k1 = keys[seg + 1];
+    float h = k1.time - k0.time;
+    float u = ( h > 0.0f ) ? ( time - k0.time ) / h : 1.0f;
+
+    // Cubic Hermite basis
+    float u2 = u * u, u3 = u2 * u;
+    float h00 = 2 * u3 - 3 * u2 + 1;
+    float h10 = u3 - 2 * u2 + u;
+    float h01 = -2 * u3 + 3 * u2;
+    float h11 = u3 - u2;
+    Vec3 p0 = k0.position, p1 = k1.position;
+    Vec3 m0 = GetTangent(seg), m1 = GetTangent(seg + 1);
+    frame.position = p0.Scale(h00) + m0.Scale(h10 * h) + p1.Scale(h01) + m1.Scale(h11 * h);
+
+    Quaternion q0 = k0.orientation;
+    frame.orientation = q0.Slerp(k1.orientation, u);
+}
 
-const camera_frame_t*  CameraPath::GetRawPtr() const
+bool CameraPath::IsPlaying() const
 {
-    return startFrame;
+    return !keys.empty() && !finished;
 }
 
-int CameraPath::GetNumFrames() const
+bool CameraPath::GetPlayingFrame(camera_frame_t& frame) const
 {
-    return numFrames;
+    if( !IsPlaying() ) {
+        return false;
+    }
+    Evaluate(playTime, frame);
+    return true;
 }
 
-void CameraPath::Advance()
+void CameraPath::Advance(float seconds)
 {
-    if( playingFrame != NULL ) {
-        playingFrame = playingFrame->next;
+    float duration = GetDuration();
+    if( playTime >= duration ) {
+        // The last frame has been shown
+        finished = true;
+        return;
     }
+    playTime = std::min(playTime + std::max(seconds, 0.0f), duration);
 }
 
-camera_frame_t * CameraPath::GetPlayingFrame() const
+void CameraPath::Rewind()
 {
-    return playingFrame;
+    playTime = 0.0f;
+    finished = false;
 }
 
-
-
-
+void CameraPath::TakeKeys(CameraPath& from)
+{
+    keys.swap(from.keys);
+    // A longer path has more to play
+    finished = finished && playTime >= GetDuration();
+}
@@ -7,35 +7,71 @@
 #include "Math.h"
 #include "Quaternion.h"
 
+// Keyframe as read from a .cp file
+struct camera_key_t
+{
+	float			time;		// seconds from the start of the path
+	Vec3			position;
+	Quaternion		orientation;
+};
+
+// Camera at one point in time
 struct camera_frame_t
 {
-	unsigned short	id;
-	unsigned int	time;
 	Vec3			position;
 	Quaternion		orientation;
-	camera_frame_t *next;
 };
 
+/*
+================================================
+
+Keyframed camera path, evaluated at any time.
+
+Position follows a Catmull-Rom spline through the
+keys, with tangents scaled to uneven key spacing,
+orientation is slerped between neighbour keys.
+Only the keys are stored.
+
+Playback keeps its own clock: Advance moves it by
+the time that passed, so the path plays at the
+same speed at any frame rate. Sampling at a fixed
+step gives the same frames every run.
+
+================================================
+*/
 class CameraPath
 {
 public:
 					        CameraPath(const char * filename);	// Load camera path from a file
 	void			        LoadPath(const char * filename);
-    void                    ExpandPath();
-    int                     GetNumFrames() const;
-    const camera_frame_t *  GetRawPtr() const;
-    camera_frame_t *        GetPlayingFrame() const;
+    int                     GetNumKeys() const { return (int)keys.size(); }
+    const camera_key_t *    GetKeys() const;
+    // Seconds from first to last key
+    float                   GetDuration() const;
 
-    // Camera frame movement
-    void                    Advance();
-    //void                    Rewind();
+    // Camera time seconds after the first key, clamped to the path
+    void                    Evaluate(float time, camera_frame_t& frame) const;
+
+    // Playback, frame at the current play time
+    bool                    IsPlaying() const;
+    bool                    GetPlayingFrame(camera_frame_t& frame) const;
+    float                   GetPlayTime() const { return playTime; }
+    void                    Advance(float seconds);
+    // Back to the first frame, to play the path again
+    void                    Rewind();
+    // Keys of from, the same file loaded again. Playback goes
+    // on from the same time.
+    void                    TakeKeys(CameraPath& from);
+
+private:
+    // Key starting the segment holding time
+    int                     FindSegment(float time) const;
+    Vec3                    GetTangent(int key) const;
 
 private:
-	camera_frame_t* startFrame;
-    camera_frame_t* endFrame;  // for convenience of interpolation
-    camera_frame_t* playingFrame;
-	unsigned short	numKeyFrames;
-    unsigned short  numFrames;
+	std::vector<camera_key_t>	keys;
+	float					playTime;
+	bool					finished;
 
 private:
 	// Disable default and assignment ctor
@@ -1,6 +1,7 @@
 #include "Common.h"
+#include "Log.h"
 
-void Common::Warning(qStr msg)
+void Common::Warning(const qStr& msg)
 {
 #ifdef _WIN32
 	LPWSTR text = msg.GetWideStr();
@@ -11,7 +12,7 @@ void Common::Warning(qStr msg)
 #endif
 }
 
-void Common::Error(qStr msg)
+void Common::Error(const qStr& msg)
 {
 #ifdef _WIN32
 	LPWSTR text = msg.GetWideStr();
@@ -24,7 +25,7 @@ void Common::Error(qStr msg)
 }
 
 // it's something serious!
-void Common::FatalError(qStr msg)
+void Common::FatalError(const qStr& msg)
 {
 #ifdef _WIN32
 	LPWSTR text = msg.GetWideStr();
@@ -32,6 +33,10 @@ void Common::FatalError(qStr msg)
 
 	PostQuitMessage(CM_FATAL);
 #endif
+	// Lines still queued for the writer would be lost
+	if( logger ) {
+		logger->Flush();
+	}
 #ifdef __linux__
 	fprintf(stderr, msg.Ptr());
 	abort(); // nothing matters anymore
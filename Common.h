@@ -15,6 +15,8 @@
 #endif
 #include "String.h"
 
+class Log;
+
 /*
 =================================================
 
@@ -28,12 +30,18 @@ class Common
 public:
 	enum { CM_WARNING = 1, CM_ERROR, CM_FATAL };
 
-	void 				FatalError(qStr msg);
-	void 				Error(qStr msg);
-	void 				Warning(qStr msg);
+						Common() : logger(NULL) {}
+
+	// Flushed before a fatal error ends the program
+	void				SetLogger(Log * l) { logger = l; }
+	void 				FatalError(const qStr& msg);
+	void 				Error(const qStr& msg);
+	void 				Warning(const qStr& msg);
 	std::vector<qStr>	ListFiles(const char *szPath);
 	qStr				GetTime();
 
+private:
+	Log *				logger;
 };
 
 #endif /* !_COMMON_H */
@@ -1,12 +1,52 @@
 #include "Entity.h"
+#include "Quaternion.h"
 #include <cfloat>
+#include <string.h>
 
 static int entity_id = 0;
 
-Entity::Entity() : id(entity_id++), model(NULL)
+Entity::Entity() : id(entity_id++), model(NULL), tex(NULL), lod(0), resident(true), occluder(false)
 {
 	// make identity default
 	modelToWorldMat.Ident();
+	prevModelToWorldMat.Ident();
+	renderMat.Ident();
+}
+
+// Splits the upper 3x3 into a rotation and the scale of each axis
+static Quaternion R_Decompose(const Mat4& m, Vec3& scale)
+{
+	Mat3 rot;
+	for( int i = 0; i < 3; ++i ) {
+		Vec3 axis(m[i][0], m[i][1], m[i][2]);
+		scale[i] = sqrt(axis.DotProduct(axis));
+		float inv = scale[i] > 0.0f ? 1.0f / scale[i] : 0.0f;
+		rot[i] = axis.Scale(inv);
+	}
+	return Quaternion::FromMatrix(rot);
+}
+
+void Entity::Interpolate(float alpha)
+{
+	// Most entities don't move
+	if( alpha >= 1.0f || !memcmp(&prevModelToWorldMat, &modelToWorldMat, sizeof(Mat4)) ) {
+		renderMat = modelToWorldMat;
+		return;
+	}
+
+	Vec3 s0, s1;
+	Quaternion q0 = R_Decompose(prevModelToWorldMat, s0);
+	Quaternion q1 = R_Decompose(modelToWorldMat, s1);
+	Mat3 rot = q0.Slerp(q1, alpha).ToMatrix();
+	Vec3 scale = s0 + (s1 - s0).Scale(alpha);
+
+	renderMat.Ident();
+	for( int i = 0; i < 3; ++i ) {
+		renderMat[i][0] = rot[i][0] * scale[i];
+		renderMat[i][1] = rot[i][1] * scale[i];
+		renderMat[i][2] = rot[i][2] * scale[i];
+		renderMat[3][i] = prevModelToWorldMat[3][i] + ( modelToWorldMat[3][i] - prevModelToWorldMat[3][i] ) * alpha;
+	}
 }
 
 void Entity::MoveTo(const Vec3 pos) 
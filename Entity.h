@@ -31,14 +31,37 @@ public:
 	Mat4		GetModelToWorldMat() const { return modelToWorldMat; }
     void        SetModelToWorldMat(const Mat4 mat);
 
+    // Remember the placement before a simulation step
+    void        SavePrevState() { prevModelToWorldMat = modelToWorldMat; }
+    // Placement alpha of the way from the saved one to the
+    // current one, drawn with GetRenderMat
+    void        Interpolate(float alpha);
+    const Mat4& GetRenderMat() const { return renderMat; }
+
     BBox		Bound();
     Vec3		GetPosition() ;
 
+    // Level of detail picked for current frame
+    int         GetLod() const { return lod; }
+    void        SetLod(int level) { lod = level; }
+
+    // False while the world cell holding it is streamed out
+    bool        IsResident() const { return resident; }
+    void        SetResident(bool on) { resident = on; }
+
+    // Map asks for it to hide what is behind it, whatever
+    // its size on screen
+    bool        IsOccluder() const { return occluder; }
+    void        SetOccluder(bool on) { occluder = on; }
+
 private:
 	int				id;
 	Mesh *			model; 	// Entity doesn't own model
 	Texture *		tex;	// Texture belonging to entity
 	unsigned int 	vboId;
+	int				lod;
+	bool			resident;
+	bool			occluder;
 
 	// orientation
 	float	xAxis;
@@ -46,6 +69,8 @@ private:
 	float 	zAxis;
 
 	Mat4			modelToWorldMat;
+	Mat4			prevModelToWorldMat;
+	Mat4			renderMat;
 };
 
 inline void Entity::AttachMesh(Mesh *m)
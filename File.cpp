@@ -1,11 +1,16 @@
 #include "File.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-File::File(const qStr fileName, const qStr mode)
+File::File(const qStr& fileName, const qStr& mode)
 {
 	Init(fileName, mode);
 }
 
-File::File(const qStr fileName)
+File::File(const qStr& fileName)
 {
 	Init(fileName, "r");
 }
@@ -45,7 +50,7 @@ inline bool File::Exist()
 #endif
 }
 
-void File::Init(const qStr fileName, const qStr mode)
+void File::Init(const qStr& fileName, const qStr& mode)
 {
 	name = fileName;
 	isGood = false;
@@ -212,3 +217,94 @@ void File::Close()
 	ptr = ptrCurrent = ptrBeg = ptrEnd = 0;
 	isGood = isLoaded = false;
 }
+
+MappedFile::MappedFile() : data(NULL), size(0)
+{
+#ifdef _WIN32
+	file = INVALID_HANDLE_VALUE;
+	mapping = NULL;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+#ifdef _WIN32
+bool MappedFile::Open(const char * path)
+{
+	Close();
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if( file == INVALID_HANDLE_VALUE ) {
+		return false;
+	}
+	LARGE_INTEGER sz;
+	if( !GetFileSizeEx(file, &sz) || sz.QuadPart == 0 ) {
+		Close();
+		return false;
+	}
+	mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if( !mapping ) {
+		Close();
+		return false;
+	}
+	data = (byte*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if( !data ) {
+		Close();
+		return false;
+	}
+	size = (size_t)sz.QuadPart;
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if( data ) {
+		UnmapViewOfFile(data);
+	}
+	if( mapping ) {
+		CloseHandle(mapping);
+	}
+	if( file != INVALID_HANDLE_VALUE ) {
+		CloseHandle(file);
+	}
+	data = NULL;
+	size = 0;
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+}
+
+#else
+bool MappedFile::Open(const char * path)
+{
+	Close();
+	int fd = open(path, O_RDONLY);
+	if( fd < 0 ) {
+		return false;
+	}
+	struct stat st;
+	if( fstat(fd, &st) != 0 || st.st_size == 0 ) {
+		close(fd);
+		return false;
+	}
+	void * p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps the file alive
+	close(fd);
+	if( p == MAP_FAILED ) {
+		return false;
+	}
+	data = (byte*)p;
+	size = st.st_size;
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if( data ) {
+		munmap(data, size);
+	}
+	data = NULL;
+	size = 0;
+}
+#endif
@@ -29,17 +29,17 @@ class File
 {
 public:
 			File();
-			File(const qStr fileName);
-			File(const qStr fileName, qStr mode);
+			File(const qStr& fileName);
+			File(const qStr& fileName, const qStr& mode);
 			virtual ~File();
 
-	bool	Open(const qStr fileName, const qStr mode);
+	bool	Open(const qStr& fileName, const qStr& mode);
 	void	Write(const unsigned char *, int, int);
 	void	Close();
 	void	UploadToRAM();
 	bool	Exist();
 	size_t	GetSize();
-	qStr	GetName() { return name; }
+	const qStr&	GetName() const { return name; }
     void    Rewind();
     bool	Good() { return isGood; }
     bool 	Loaded() { return isLoaded; }
@@ -48,7 +48,7 @@ public:
     static bool	DirExist(const char *);
 
 private:
-	void	Init(const qStr fileName, const qStr mode);
+	void	Init(const qStr& fileName, const qStr& mode);
 	// If has access to write
 	bool	HasPermission();
 
@@ -69,6 +69,41 @@ private:
 };
 
 
+/*
+========================================================
+
+Read only view of a whole file in memory. Pages are
+brought in by the OS as they are touched, so opening
+a big file costs nothing until it is read.
+
+========================================================
+*/
+class MappedFile
+{
+public:
+				MappedFile();
+				~MappedFile();
+
+	bool		Open(const char * path);
+	void		Close();
+	bool		IsOpen() const { return data != NULL; }
+	const byte *	GetData() const { return data; }
+	size_t		GetSize() const { return size; }
+
+private:
+	byte *		data;
+	size_t		size;
+#ifdef _WIN32
+	HANDLE		file;
+	HANDLE		mapping;
+#endif
+
+	// Disable copy and assign constructor
+	MappedFile(const MappedFile&) {}
+	MappedFile& operator=(const MappedFile&) { return *this; }
+};
+
+
 /*
 ========================================================
 
@@ -84,7 +119,7 @@ public:
             ~LexerFile() {}
     bool    MoreToken();
     void    ReadToken();
-    qStr	TokenValue() { return currentToken; }
+    const qStr&	TokenValue() const { return currentToken; }
 private:
     LexerFile() {}
 
@@ -0,0 +1,82 @@
+#include "FrameArena.h"
+#include "Common.h"
+#include <stdlib.h>
+
+extern Common * common;
+
+static inline size_t R_AlignSize(size_t v)
+{
+	return (v + FRAME_ARENA_ALIGN - 1) & ~(size_t)(FRAME_ARENA_ALIGN - 1);
+}
+
+FrameArena::FrameArena() : base(NULL), size(0), used(0), overflow(NULL), overflowBytes(0), highWater(0)
+{
+}
+
+FrameArena::~FrameArena()
+{
+	Reset();
+	free(base);
+}
+
+void FrameArena::Init(size_t bytes)
+{
+	Reset();
+	free(base);
+	size = R_AlignSize(bytes);
+	base = (char*)malloc(size);
+	if( !base ) {
+		common->FatalError("FrameArena: Cannot allocate more memory");
+	}
+}
+
+void * FrameArena::Alloc(size_t bytes)
+{
+	bytes = R_AlignSize(bytes);
+	if( used + bytes <= size ) {
+		void * p = base + used;
+		used += bytes;
+		return p;
+	}
+
+	// Header padded so the data stays aligned
+	size_t header = R_AlignSize(sizeof(arena_overflow_t));
+	arena_overflow_t * block = (arena_overflow_t*)malloc(header + bytes);
+	if( !block ) {
+		common->FatalError("FrameArena: Cannot allocate more memory");
+	}
+	block->next = overflow;
+	overflow = block;
+	overflowBytes += bytes;
+	return (char*)block + header;
+}
+
+void FrameArena::Reset()
+{
+	size_t need = used + overflowBytes;
+	if( need > highWater ) {
+		highWater = need;
+	}
+
+	while( overflow ) {
+		arena_overflow_t * next = overflow->next;
+		free(overflow);
+		overflow = next;
+	}
+
+	if( overflowBytes ) {
+		// Next frame like this one fits without the heap
+		size_t grown = size ? size : FRAME_ARENA_ALIGN;
+		while( grown < need ) {
+			grown *= 2;
+		}
+		char * p = (char*)realloc(base, grown);
+		if( !p ) {
+			common->FatalError("FrameArena: Cannot allocate more memory");
+		}
+		base = p;
+		size = grown;
+	}
+	used = 0;
+	overflowBytes = 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * ===============================================================
+ *
+ * Linear allocator for data that lives one frame.
+ *
+ * Alloc bumps a pointer into one preallocated block and Reset at
+ * the end of the frame takes everything back at once, so transient
+ * buffers (debug geometry, silhouettes, readbacks) cost no heap
+ * traffic. A frame that needs more than the block gets extra heap
+ * blocks; they are freed on Reset and the block grows to fit, so
+ * only the frame after a spike pays for it.
+ *
+ * Not thread safe, main thread only. Memory is not cleared.
+ *
+ *================================================================
+ */
+#ifndef _FRAMEARENA_H
+#define _FRAMEARENA_H
+
+#include <stddef.h>
+
+#define FRAME_ARENA_SIZE	(1024 * 1024)
+#define FRAME_ARENA_ALIGN	16
+
+// Heap block of a frame that ran out of arena
+struct arena_overflow_t {
+	arena_overflow_t *	next;
+};
+
+class FrameArena
+{
+public:
+					FrameArena();
+					~FrameArena();
+
+	void			Init(size_t size);
+	void *			Alloc(size_t bytes);
+	template<class T>
+	T *				Alloc(size_t count) { return (T*)Alloc(count * sizeof(T)); }
+	// Everything allocated since the last Reset is gone
+	void			Reset();
+
+	size_t			GetUsed() const { return used + overflowBytes; }
+	size_t			GetSize() const { return size; }
+	size_t			GetHighWater() const { return highWater; }
+
+private:
+	char *			base;
+	size_t			size;
+	size_t			used;
+	arena_overflow_t *	overflow;
+	size_t			overflowBytes;
+	size_t			highWater;
+
+	FrameArena(const FrameArena&) {}
+	FrameArena& operator=(const FrameArena&) { return *this; }
+};
+
+#endif /* !_FRAMEARENA_H */
@@ -1,4 +1,11 @@
 #include "Geometry.h"
+#include <string.h>
+#include <algorithm>
+
+#if defined(__SSE__) || defined(_M_X64)
+	#include <xmmintrin.h>
+	#define GEO_SSE
+#endif
 
 // Deriving plane from triangle
 // see paper http://fabiensanglard.net/doom3_documentation/37729-293751.pdf
@@ -8,7 +15,7 @@ Plane::Plane(Vec3 n1, Vec3 n2, Vec3 n3)
     Vec3 d2 = n3 - n1;
     Vec3 n = d2.CrossProduct(d1);
     normal = n.Normalize();
-    dist = -(n[0] * n1[0] + n[1] * n1[1] + n[2] * n1[2]);
+    dist = normal.DotProduct(n1);
 }
 
 void Plane::operator=(const Plane& other)
@@ -20,13 +27,11 @@ void Plane::operator=(const Plane& other)
 // intersect is intact if not cross
 clipping_t Plane::Clip(const Line l, Vec3& intersect)
 {
-    // find a point on plane
-    Vec3 p = normal.Scale(sqrt(dist));
     Vec3 q1 = l.ends[0];
     Vec3 q2 = l.ends[1];
 
-    float d1 = (q1 - p).DotProduct(normal);
-    float d2 = (q2 - p).DotProduct(normal);
+    float d1 = Distance(q1);
+    float d2 = Distance(q2);
 
     if( (d1 >= 0 && d2 > MI_EPSILON) || (d1 > MI_EPSILON && d2 >= 0) )
         return CLIP_IN;
@@ -48,13 +53,12 @@ clipping_t Plane::Clip(const Line l, Vec3& intersect)
 
 int Plane::Side(const Vec3 p) const
 {
-	float d = p.DotProduct(normal);
-	float diff = abs(d - dist);
-	if( diff < MI_EPSILON ) {
+	float d = Distance(p);
+	if( fabsf(d) < MI_EPSILON ) {
 		return PS_ON;
 	}
 
-	return d - diff > 0 ? PS_OUT : PS_IN;
+	return d > 0.0f ? PS_IN : PS_OUT;
 }
 
 
@@ -88,49 +92,46 @@ bool BBox::Contain(const BBox b)
     return false;
 }
 
-// Generate the vertex list for box
-std::vector<Vec3> BBox::GetVertex() const
+// Generate the edge list for box, two vertices per edge
+void BBox::GetVertex(Vec3 vert[BBOX_LINE_VERTS]) const
 {
-    std::vector<Vec3> vert;
-    vert.reserve(8 * 3);
-
-    vert.push_back( min_ );
-    vert.push_back( Vec3(max_[0], min_[1], min_[2]) );
+    int n = 0;
 
-	vert.push_back( Vec3(max_[0], min_[1], min_[2]) );
-    vert.push_back( Vec3(max_[0], max_[1], min_[2]) );
+    vert[n++] = min_;
+    vert[n++] = Vec3(max_[0], min_[1], min_[2]);
 
-	vert.push_back( Vec3(max_[0], max_[1], min_[2]) );
-    vert.push_back( Vec3(min_[0], max_[1], min_[2]) );
+	vert[n++] = Vec3(max_[0], min_[1], min_[2]);
+    vert[n++] = Vec3(max_[0], max_[1], min_[2]);
 
-	vert.push_back( min_ );
-    vert.push_back( Vec3(min_[0], max_[1], min_[2]) );
+	vert[n++] = Vec3(max_[0], max_[1], min_[2]);
+    vert[n++] = Vec3(min_[0], max_[1], min_[2]);
 
-	vert.push_back( Vec3(min_[0], min_[1], max_[2]) );
-	vert.push_back( Vec3(min_[0], max_[1], max_[2]) );
+	vert[n++] = min_;
+    vert[n++] = Vec3(min_[0], max_[1], min_[2]);
 
-	vert.push_back( Vec3(min_[0], max_[1], max_[2]) );
-    vert.push_back( max_ );
+	vert[n++] = Vec3(min_[0], min_[1], max_[2]);
+	vert[n++] = Vec3(min_[0], max_[1], max_[2]);
 
-	vert.push_back( max_ );
-    vert.push_back( Vec3(max_[0], min_[1], max_[2]) );
+	vert[n++] = Vec3(min_[0], max_[1], max_[2]);
+    vert[n++] = max_;
 
-	vert.push_back( Vec3(max_[0], min_[1], max_[2]) );
-	vert.push_back( Vec3(min_[0], min_[1], max_[2]) );
+	vert[n++] = max_;
+    vert[n++] = Vec3(max_[0], min_[1], max_[2]);
 
-	vert.push_back( max_ );
-	vert.push_back( Vec3(max_[0], max_[1], min_[2]) );
+	vert[n++] = Vec3(max_[0], min_[1], max_[2]);
+	vert[n++] = Vec3(min_[0], min_[1], max_[2]);
 
-	vert.push_back( Vec3(min_[0], min_[1], max_[2]) );
-	vert.push_back( min_);
+	vert[n++] = max_;
+	vert[n++] = Vec3(max_[0], max_[1], min_[2]);
 
-	vert.push_back( Vec3(max_[0], min_[1], min_[2]) );
-	vert.push_back( Vec3(max_[0], min_[1], max_[2]) );
+	vert[n++] = Vec3(min_[0], min_[1], max_[2]);
+	vert[n++] = min_;
 
-	vert.push_back( Vec3(min_[0], max_[1], min_[2]) );
-	vert.push_back( Vec3(min_[0], max_[1], max_[2]) );
+	vert[n++] = Vec3(max_[0], min_[1], min_[2]);
+	vert[n++] = Vec3(max_[0], min_[1], max_[2]);
 
-    return vert;
+	vert[n++] = Vec3(min_[0], max_[1], min_[2]);
+	vert[n++] = Vec3(min_[0], max_[1], max_[2]);
 }
 
 
@@ -146,37 +147,129 @@ void Poly::operator=(const Poly& other)
 // and itself if whole clipped inside. 
 Poly Poly::Clip(const Plane p) const
 {
-    // Find p first
-    Vec3 n = p.GetNormal();
-    Vec3 q = n.Scale(sqrt(p.GetDist()));
-
-    float pdot = 0;
-    float idot = n.DotProduct(vert[0] - q);
     Poly inside;
-
-    for( int i = 1; i < numVert; ++i ) {
-        float dot = n.DotProduct(vert[i] - q);
-        // Have a cross 
-        if( pdot * idot < -MI_EPSILON ) {
-			Vec3 intersect = vert[i-1] + (vert[i] - vert[i-1]).Scale(pdot / (pdot - dot));
-            inside.Add(intersect);
-        }
-        // inside
-        if( dot > MI_EPSILON ) {
+    if( numVert == 0 ) {
+        return inside;
+    }
+    inside.vert.reserve(numVert + 1);
+
+    float first = p.Distance(vert[0]);
+    float dot = first;
+    for( int i = 0; i < numVert; ++i ) {
+        int next = i + 1 < numVert ? i + 1 : 0;
+        float nextDot = next ? p.Distance(vert[next]) : first;
+        // inside or on
+        if( dot >= -MI_EPSILON ) {
             inside.Add(vert[i]);
         }
-        pdot = dot;
+        // Have a cross
+        if( ( dot > MI_EPSILON && nextDot < -MI_EPSILON ) || ( dot < -MI_EPSILON && nextDot > MI_EPSILON ) ) {
+            inside.Add(vert[i] + (vert[next] - vert[i]).Scale(dot / (dot - nextDot)));
+        }
+        dot = nextDot;
     }
-    // for line sect Qn-1,Q0
-    if( pdot * idot < -MI_EPSILON ) {
-		Vec3 intersect = vert[numVert - 1] + (vert[0] - vert[numVert - 1]).Scale(pdot / (pdot - idot));
-        inside.Add(intersect);
-    }  
 
+    // Only touching the plane
+    if( inside.numVert < 3 ) {
+        return Poly();
+    }
     return inside;
 }
 
 
+/*
+==============================================================
+
+Windings
+
+==============================================================
+*/
+
+// Signed distances of count points to the plane
+static void R_PlaneDistances(const Plane& plane, const Vec3 * v, int count, float * dist)
+{
+    int i = 0;
+#ifdef GEO_SSE
+    Vec3 n = plane.GetNormal();
+    __m128 nx = _mm_set1_ps(n[0]);
+    __m128 ny = _mm_set1_ps(n[1]);
+    __m128 nz = _mm_set1_ps(n[2]);
+    __m128 d = _mm_set1_ps(plane.GetDist());
+    for( ; i + 4 <= count; i += 4 ) {
+        // Four packed points, x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+        const float * p = &v[i][0];
+        __m128 a = _mm_loadu_ps(p);
+        __m128 b = _mm_loadu_ps(p + 4);
+        __m128 c = _mm_loadu_ps(p + 8);
+        __m128 t = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2));	// x2 y2 x3 y3
+        __m128 x = _mm_shuffle_ps(a, t, _MM_SHUFFLE(2, 0, 3, 0));
+        __m128 u = _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1));	// y0 y0 y1 y1
+        __m128 y = _mm_shuffle_ps(u, t, _MM_SHUFFLE(3, 1, 2, 0));
+        __m128 w = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2));	// z0 z0 z1 z1
+        __m128 z = _mm_shuffle_ps(w, c, _MM_SHUFFLE(3, 0, 2, 0));
+        __m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, nx), _mm_mul_ps(y, ny)), _mm_mul_ps(z, nz));
+        _mm_storeu_ps(dist + i, _mm_sub_ps(r, d));
+    }
+#endif
+    for( ; i < count; ++i ) {
+        dist[i] = plane.Distance(v[i]);
+    }
+}
+
+// Sutherland-Hodgman, points on the plane count as inside
+int R_ClipWinding(const winding_t& in, const Plane& plane, winding_t& out)
+{
+    float dist[WINDING_MAX_VERTS];
+    int n = std::min(in.numVerts, WINDING_MAX_VERTS);
+    R_PlaneDistances(plane, in.verts, n, dist);
+
+    int numIn = 0, numOut = 0;
+    for( int i = 0; i < n; ++i ) {
+        numIn += dist[i] > MI_EPSILON;
+        numOut += dist[i] < -MI_EPSILON;
+    }
+    if( !numOut ) {
+        out.numVerts = n;
+        std::copy(in.verts, in.verts + n, out.verts);
+        return n;
+    }
+    out.numVerts = 0;
+    if( !numIn ) {
+        return 0;
+    }
+
+    for( int i = 0; i < n; ++i ) {
+        int next = i + 1 < n ? i + 1 : 0;
+        if( dist[i] >= -MI_EPSILON && out.numVerts < WINDING_MAX_VERTS ) {
+            out.verts[out.numVerts++] = in.verts[i];
+        }
+        if( ( ( dist[i] > MI_EPSILON && dist[next] < -MI_EPSILON ) || ( dist[i] < -MI_EPSILON && dist[next] > MI_EPSILON ) )
+            && out.numVerts < WINDING_MAX_VERTS ) {
+            const Vec3& a = in.verts[i];
+            out.verts[out.numVerts++] = a + (in.verts[next] - a).Scale(dist[i] / (dist[i] - dist[next]));
+        }
+    }
+    return out.numVerts;
+}
+
+int R_ClipWinding(winding_t& w, const Plane * planes, int numPlanes)
+{
+    // Back and forth between w and a spare
+    winding_t spare;
+    winding_t * src = &w;
+    winding_t * dst = &spare;
+    for( int i = 0; i < numPlanes && src->numVerts; ++i ) {
+        R_ClipWinding(*src, planes[i], *dst);
+        std::swap(src, dst);
+    }
+    if( src != &w ) {
+        w.numVerts = src->numVerts;
+        std::copy(src->verts, src->verts + src->numVerts, w.verts);
+    }
+    return w.numVerts;
+}
+
+
 
 Frustum::Frustum(float zNear, float zFar, float viewX, float viewY)
 {
@@ -184,34 +277,236 @@ Frustum::Frustum(float zNear, float zFar, float viewX, float viewY)
     // Near plane
     side[0] = Plane( Vec3(0, 0, -1), zNear );
     // Far plane
-    side[1] = Plane( Vec3(0, 0, 1), zFar );
+    side[1] = Plane( Vec3(0, 0, 1), -zFar );
     // Top plane
     side[2] = Plane( Vec3(0, -cos(viewY / 2), -sin(viewY / 2)), 0 );
     // Bottom plane
-    side[3] = Plane( Vec3(0, cos(viewY / 2), sin(viewY / 2)), 0 );
+    side[3] = Plane( Vec3(0, cos(viewY / 2), -sin(viewY / 2)), 0 );
     // Left plane
     side[4] = Plane( Vec3(cos(viewX / 2), 0, -sin(viewX / 2)), 0 );
     // Right plane
     side[5] = Plane( Vec3(-cos(viewX / 2), 0, -sin(viewX / 2)), 0 );
+    numPlanes = 6;
+}
+
+Frustum::Frustum(const Plane * planes, int count)
+{
+    numPlanes = std::min(count, FRUSTUM_MAX_PLANES);
+    for( int i = 0; i < numPlanes; ++i ) {
+        side[i] = planes[i];
+    }
+}
+
+// Closer than this to the portal plane the eye is taken to be in
+// the doorway, every edge plane would hold the eye and the portal
+#define PORTAL_EYE_EPSILON	0.01f
+
+bool Frustum::Narrow(const Vec3& eye, const winding_t& portal, Frustum& out) const
+{
+    if( portal.numVerts < 3 ) {
+        return false;
+    }
+    // Portal plane facing away from the eye. Before clipping, the
+    // eye in the doorway would clip all of it.
+    Vec3 n(0.0f);
+    for( int i = 1; i + 1 < portal.numVerts; ++i ) {
+        n = n + ( portal.verts[i] - portal.verts[0] ).CrossProduct(portal.verts[i + 1] - portal.verts[0]);
+    }
+    float len = sqrtf(n.DotProduct(n));
+    if( len < MI_EPSILON ) {
+        return false;
+    }
+    n = n.Scale(1.0f / len);
+    Plane portalPlane(n, n.DotProduct(portal.verts[0]));
+    float eyeDist = portalPlane.Distance(eye);
+    if( fabsf(eyeDist) < PORTAL_EYE_EPSILON ) {
+        out = *this;
+        return true;
+    }
+    if( eyeDist > 0.0f ) {
+        portalPlane = Plane(n.Scale(-1.0f), -portalPlane.GetDist());
+    }
+
+    winding_t w;
+    w.numVerts = std::min(portal.numVerts, WINDING_MAX_VERTS);
+    std::copy(portal.verts, portal.verts + w.numVerts, w.verts);
+    if( !ClipWinding(w) ) {
+        return false;
+    }
+    Vec3 center(0.0f);
+    for( int i = 0; i < w.numVerts; ++i ) {
+        center = center + w.verts[i];
+    }
+    center = center.Scale(1.0f / w.numVerts);
+
+    out.numPlanes = 0;
+    for( int i = 0; i < w.numVerts; ++i ) {
+        const Vec3& a = w.verts[i];
+        const Vec3& b = w.verts[i + 1 < w.numVerts ? i + 1 : 0];
+        Vec3 e = ( a - eye ).CrossProduct(b - eye);
+        float elen = sqrtf(e.DotProduct(e));
+        // Edges the clip made too short to matter
+        if( elen < MI_EPSILON ) {
+            continue;
+        }
+        e = e.Scale(1.0f / elen);
+        Plane p(e, e.DotProduct(eye));
+        if( p.Distance(center) < 0.0f ) {
+            p = Plane(e.Scale(-1.0f), -p.GetDist());
+        }
+        out.side[out.numPlanes++] = p;
+    }
+    out.side[out.numPlanes++] = portalPlane;
+    return true;
+}
+
+bool Frustum::CullSphere(const Vec3& center, float radius) const
+{
+    for( int i = 0; i < numPlanes; ++i ) {
+        if( side[i].Distance(center) < -radius ) {
+            return true;
+        }
+    }
+    return false;
 }
 
 // Clip polygon against viewing frustum.
-Poly Frustum::ClipPoly(Poly p)
+Poly Frustum::ClipPoly(const Poly& p) const
 {
-    // p against each plane of frustum utilizing previous clipping result
     if( p.Size() == 0 )
         return p;
-        
-    for( int i = 0; i < 6; ++i ) {
-        Plane pl = side[i];
-        p = p.Clip(pl);
-        // p is totally clipped out, 
-        if( p.Size() == 0 ) {
-            break;
+
+    // Too many corners for a winding, a Poly per plane then
+    if( p.Size() > WINDING_MAX_VERTS - numPlanes ) {
+        Poly r = p;
+        for( int i = 0; i < numPlanes && r.Size(); ++i ) {
+            r = r.Clip(side[i]);
+        }
+        return r;
+    }
+
+    winding_t w;
+    w.numVerts = p.Size();
+    for( int i = 0; i < w.numVerts; ++i ) {
+        w.verts[i] = p[i];
+    }
+    Poly r;
+    if( ClipWinding(w) ) {
+        for( int i = 0; i < w.numVerts; ++i ) {
+            r.Add(w.verts[i]);
         }
     }
+    return r;
+}
 
-    return p;
+bool Frustum::ClipWinding(winding_t& w) const
+{
+    return R_ClipWinding(w, side, numPlanes) >= 3;
+}
+
+// Bit per triangle of four: every corner inside all planes in
+// inMask, every corner outside one plane in outMask
+static void R_ClassifyTris(const Plane * planes, int numPlanes, const Vec3 * tri, int count, int& inMask, int& outMask)
+{
+#ifdef GEO_SSE
+    // Past count repeats the last triangle
+    const Vec3 * t[4];
+    for( int l = 0; l < 4; ++l ) {
+        t[l] = tri + std::min(l, count - 1) * 3;
+    }
+    __m128 x[3], y[3], z[3];
+    for( int c = 0; c < 3; ++c ) {
+        x[c] = _mm_setr_ps(t[0][c][0], t[1][c][0], t[2][c][0], t[3][c][0]);
+        y[c] = _mm_setr_ps(t[0][c][1], t[1][c][1], t[2][c][1], t[3][c][1]);
+        z[c] = _mm_setr_ps(t[0][c][2], t[1][c][2], t[2][c][2], t[3][c][2]);
+    }
+    __m128 eps = _mm_set1_ps(-MI_EPSILON);
+    __m128 allIn = _mm_cmpeq_ps(eps, eps);
+    __m128 anyOut = _mm_setzero_ps();
+    for( int i = 0; i < numPlanes; ++i ) {
+        Vec3 n = planes[i].GetNormal();
+        __m128 nx = _mm_set1_ps(n[0]);
+        __m128 ny = _mm_set1_ps(n[1]);
+        __m128 nz = _mm_set1_ps(n[2]);
+        __m128 d = _mm_set1_ps(planes[i].GetDist());
+        __m128 in = allIn;
+        __m128 out = anyOut;
+        __m128 planeOut = _mm_cmpeq_ps(eps, eps);
+        for( int c = 0; c < 3; ++c ) {
+            __m128 dist = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x[c], nx), _mm_mul_ps(y[c], ny)), _mm_mul_ps(z[c], nz)), d);
+            in = _mm_and_ps(in, _mm_cmpge_ps(dist, eps));
+            planeOut = _mm_and_ps(planeOut, _mm_cmplt_ps(dist, eps));
+        }
+        allIn = in;
+        anyOut = _mm_or_ps(out, planeOut);
+    }
+    int valid = ( 1 << count ) - 1;
+    inMask = _mm_movemask_ps(allIn) & valid;
+    outMask = _mm_movemask_ps(anyOut) & valid;
+#else
+    inMask = 0;
+    outMask = 0;
+    for( int l = 0; l < count; ++l ) {
+        bool in = true, out = false;
+        for( int i = 0; i < numPlanes && !out; ++i ) {
+            int numBehind = 0;
+            for( int c = 0; c < 3; ++c ) {
+                numBehind += planes[i].Distance(tri[l * 3 + c]) < -MI_EPSILON;
+            }
+            in = in && numBehind == 0;
+            out = numBehind == 3;
+        }
+        inMask |= in << l;
+        outMask |= out << l;
+    }
+#endif
+}
+
+// Four at a time are sorted into in, out and crossing, only
+// the crossing ones are clipped
+int Frustum::ClipTriangles(const Vec3 * in, int numTris, Vec3 * out, int maxOut) const
+{
+    int numOut = 0;
+    for( int t = 0; t < numTris; t += 4 ) {
+        int count = std::min(4, numTris - t);
+        int inMask, outMask;
+        R_ClassifyTris(side, numPlanes, in + t * 3, count, inMask, outMask);
+        for( int l = 0; l < count; ++l ) {
+            const Vec3 * tri = in + ( t + l ) * 3;
+            if( outMask & ( 1 << l ) ) {
+                continue;
+            }
+            if( inMask & ( 1 << l ) ) {
+                if( numOut == maxOut ) {
+                    return numOut;
+                }
+                out[numOut * 3] = tri[0];
+                out[numOut * 3 + 1] = tri[1];
+                out[numOut * 3 + 2] = tri[2];
+                numOut++;
+                continue;
+            }
+
+            winding_t w;
+            w.numVerts = 3;
+            w.verts[0] = tri[0];
+            w.verts[1] = tri[1];
+            w.verts[2] = tri[2];
+            if( !ClipWinding(w) ) {
+                continue;
+            }
+            for( int k = 2; k < w.numVerts; ++k ) {
+                if( numOut == maxOut ) {
+                    return numOut;
+                }
+                out[numOut * 3] = w.verts[0];
+                out[numOut * 3 + 1] = w.verts[k - 1];
+                out[numOut * 3 + 2] = w.verts[k];
+                numOut++;
+            }
+        }
+    }
+    return numOut;
 }
 
 // Quickly check if bounding box is culled
@@ -221,19 +516,16 @@ bool Frustum::ClipBBox(const BBox b) const
     Vec3 vmin = b.GetMin();
     Vec3 vmax = b.GetMax();    
 
-    bool inside = false;
-    for( int i = 0; i < 6; ++i ) {
-        int d1 = side[i].Side(vmin);
-        int d2 = side[i].Side(vmax);
-        if( d1 * d2 < -MI_EPSILON ) {
-            // Crossed one plane, surely inside frustum
-            return true;
-        } 
-
-        inside = inside || ( d1 > MI_EPSILON && d2 > MI_EPSILON );       
+    for( int i = 0; i < numPlanes; ++i ) {
+        // Corner furthest inside, the box is out if that is
+        Vec3 n = side[i].GetNormal();
+        Vec3 p(n[0] >= 0.0f ? vmax[0] : vmin[0], n[1] >= 0.0f ? vmax[1] : vmin[1], n[2] >= 0.0f ? vmax[2] : vmin[2]);
+        if( side[i].Distance(p) < -MI_EPSILON ) {
+            return false;
+        }
     }
 
-    // Culled if b falls outside of payramid
-    return inside;
+    // Some of b may be in the pyramid
+    return true;
 }
 
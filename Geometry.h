@@ -41,7 +41,8 @@ enum clipping_t { CLIP_IN, CLIP_OUT, CLIP_CROSS };
 enum {PS_OUT, PS_IN, PS_ON};
 
 /**
- * Plane definition
+ * Plane definition, points p on it have normal . p == dist and
+ * the side the normal points to is inside
  */
 class Plane
 {
@@ -55,8 +56,10 @@ public :
 public:
     Vec3        GetNormal() const { return normal; }
     float       GetDist() const { return dist; }
+    // Signed, above 0 inside
+    float       Distance(const Vec3& p) const { return normal.DotProduct(p) - dist; }
 	clipping_t 	Clip(const Line l, Vec3& intersect);
-	int 	    Side(const Vec3 p) const;						// 0 on, 1 inside, 2 outside						
+	int 	    Side(const Vec3 p) const;						// PS_OUT, PS_IN or PS_ON
 
 private:
 	Vec3	normal;	// Normal vector
@@ -65,6 +68,9 @@ private:
 
 
 
+// Twelve edges as line list
+#define BBOX_LINE_VERTS 24
+
 /**
  * Axis Aligned Bounding Box (AABB)
  */
@@ -82,7 +88,7 @@ public:
     Vec3                GetMin() const { return min_; }
     Vec3                GetMax() const { return max_; }
     // Those two are for debugging purpose only
-    std::vector<Vec3>   GetVertex() const;
+    void                GetVertex(Vec3 vert[BBOX_LINE_VERTS]) const;
 
 private:
 	Vec3 min_;
@@ -95,6 +101,25 @@ inline float BBox::Volumn() const
 	return volumn;
 }
 
+// Corners a winding can hold. Every plane adds at most one, a
+// triangle through the six frustum planes ends with nine.
+#define WINDING_MAX_VERTS	32
+
+/**
+ * Convex polygon with its corners in place, so clipping one
+ * needs no heap. For portals, decals and shadow volume caps.
+ */
+struct winding_t {
+	int		numVerts;
+	Vec3	verts[WINDING_MAX_VERTS];
+};
+
+// Part of in on the inside of plane into out, which can't be in.
+// Returns the corners left, 0 when all of it is outside.
+int		R_ClipWinding(const winding_t& in, const Plane& plane, winding_t& out);
+// w through every plane in turn
+int		R_ClipWinding(winding_t& w, const Plane * planes, int numPlanes);
+
 /**
  * Simple implementation for polygon.
  */
@@ -109,8 +134,9 @@ public:
 
 
     Poly	Clip(const Plane p) const;
-    void    Add(const Vec3 v) { vert.push_back(v); }
+    void    Add(const Vec3 v) { vert.push_back(v); numVert++; }
     int     Size() const { return numVert; }
+    const Vec3& operator[](int i) const { return vert[i]; }
 
 private:
     std::vector<Vec3> vert;
@@ -118,6 +144,9 @@ private:
 };
 
 
+// A plane per corner of a portal winding and one for the portal
+#define FRUSTUM_MAX_PLANES	( WINDING_MAX_VERTS + 1 )
+
 /**
  * Viewing pyramid used for culling, not for projection
  */
@@ -125,13 +154,33 @@ class Frustum
 {
 public:
 
+    Frustum() : numPlanes(0) {}
     Frustum(float zNear, float zFar, float viewX, float viewY);
-    Poly	ClipPoly(Poly p);
+    // Any convex volume, normals pointing in
+    Frustum(const Plane * planes, int count);
+    // What of this frustum is seen from eye through the portal
+    // into out: a plane through eye and each edge of the clipped
+    // portal, and the portal plane so nothing in front of it
+    // shows. Returns false when the portal is out of view. With
+    // the eye in the portal plane out is this frustum. A near
+    // plane would clip portals the eye is next to, leave it out.
+    bool    Narrow(const Vec3& eye, const winding_t& portal, Frustum& out) const;
+    bool    CullSphere(const Vec3& center, float radius) const;
+    Poly	ClipPoly(const Poly& p) const;
+    // In place, false when nothing is left
+    bool    ClipWinding(winding_t& w) const;
+    // Three corners per triangle in and out. Triangles across a
+    // plane come out as fans of their clipped polygon, at most
+    // maxOut of them. Returns the number written.
+    int     ClipTriangles(const Vec3 * in, int numTris, Vec3 * out, int maxOut) const;
     bool    ClipBBox(const BBox b) const;
+    const Plane& GetPlane(int i) const { return side[i]; }
+    int     GetNumPlanes() const { return numPlanes; }
 
 private:
-    // near, far, top, down, left, right
-    Plane side[6];
+    // near, far, top, down, left, right for a view frustum
+    Plane side[FRUSTUM_MAX_PLANES];
+    int   numPlanes;
 };
 
 
@@ -0,0 +1,173 @@
+#include "GpuTimer.h"
+#include "Mesh.h"	// R_HasGLExtension
+#include <string.h>
+#include <stdio.h>
+
+extern Profiler * profiler;
+
+// Same values in the EXT and ARB extensions
+#define QGL_TIMESTAMP				0x8E28
+#define QGL_QUERY_RESULT			0x8866
+#define QGL_QUERY_RESULT_AVAILABLE	0x8867
+#define QGL_GPU_DISJOINT			0x8FBB
+
+GpuTimer::GpuTimer() : available(false), hasDisjoint(false), current(0), frameCount(0), dropped(0), offset(0), calibrated(false)
+{
+	memset(frames, 0, sizeof(frames));
+	memset(queries, 0, sizeof(queries));
+	qglGenQueries = NULL;
+	qglDeleteQueries = NULL;
+	qglQueryCounter = NULL;
+	qglGetQueryObjectuiv = NULL;
+	qglGetQueryObjectui64v = NULL;
+	qglGetInteger64v = NULL;
+}
+
+GpuTimer::~GpuTimer()
+{
+	if( available ) {
+		qglDeleteQueries(GPU_TIMER_FRAMES * GPU_TIMER_MAX_ZONES * 2, &queries[0][0]);
+	}
+}
+
+bool GpuTimer::Init(gl_proc_loader_t loader)
+{
+	const char * suffix;
+	if( !loader ) {
+		return false;
+	}
+	if( R_HasGLExtension("GL_EXT_disjoint_timer_query") ) {
+		suffix = "EXT";
+		hasDisjoint = true;
+	} else if( R_HasGLExtension("GL_ARB_timer_query") ) {
+		suffix = "";
+	} else {
+		return false;
+	}
+
+	char name[64];
+#define QGL_LOAD(var, type, fn) \
+	snprintf(name, sizeof(name), "%s%s", fn, suffix); \
+	var = (type)loader(name);
+	QGL_LOAD(qglGenQueries,			qglGenQueries_t,			"glGenQueries");
+	QGL_LOAD(qglDeleteQueries,		qglDeleteQueries_t,			"glDeleteQueries");
+	QGL_LOAD(qglQueryCounter,		qglQueryCounter_t,			"glQueryCounter");
+	QGL_LOAD(qglGetQueryObjectuiv,	qglGetQueryObjectuiv_t,		"glGetQueryObjectuiv");
+	QGL_LOAD(qglGetQueryObjectui64v,	qglGetQueryObjectui64v_t,	"glGetQueryObjectui64v");
+	QGL_LOAD(qglGetInteger64v,		qglGetInteger64v_t,			"glGetInteger64v");
+#undef QGL_LOAD
+
+	// glGetInteger64v is optional, Collect falls back without it
+	if( !qglGenQueries || !qglDeleteQueries || !qglQueryCounter || !qglGetQueryObjectuiv || !qglGetQueryObjectui64v ) {
+		return false;
+	}
+
+	qglGenQueries(GPU_TIMER_FRAMES * GPU_TIMER_MAX_ZONES * 2, &queries[0][0]);
+	available = true;
+	Calibrate();
+	return true;
+}
+
+// GPU clock now against CPU clock now. The GPU value is the time
+// at which commands issued so far have been processed, close
+// enough once the pipe is idle at startup.
+void GpuTimer::Calibrate()
+{
+	if( !qglGetInteger64v ) {
+		return;
+	}
+	long long gpuNow = 0;
+	qglGetInteger64v(QGL_TIMESTAMP, &gpuNow);
+	if( gpuNow <= 0 ) {
+		return;
+	}
+	offset = (long long)Sys_Nanoseconds() - gpuNow;
+	calibrated = true;
+}
+
+void GpuTimer::BeginFrame()
+{
+	if( !available ) {
+		return;
+	}
+	// This slot was filled GPU_TIMER_FRAMES frames ago
+	if( frames[current].numZones ) {
+		Collect(current);
+	}
+	frames[current].numZones = 0;
+
+	if( ++frameCount % GPU_TIMER_CALIBRATE == 0 ) {
+		Calibrate();
+	}
+}
+
+void GpuTimer::EndFrame()
+{
+	if( !available ) {
+		return;
+	}
+	current = (current + 1) % GPU_TIMER_FRAMES;
+}
+
+int GpuTimer::Begin(const char * name)
+{
+	if( !available ) {
+		return -1;
+	}
+	gpu_frame_t& f = frames[current];
+	if( f.numZones == GPU_TIMER_MAX_ZONES ) {
+		return -1;
+	}
+	int zone = f.numZones++;
+	f.zones[zone].name = name;
+	f.zones[zone].cpuIssue = Sys_Nanoseconds();
+	qglQueryCounter(queries[current][zone * 2], QGL_TIMESTAMP);
+	return zone;
+}
+
+void GpuTimer::End(int zone)
+{
+	if( zone < 0 ) {
+		return;
+	}
+	qglQueryCounter(queries[current][zone * 2 + 1], QGL_TIMESTAMP);
+}
+
+void GpuTimer::Collect(int frame)
+{
+	gpu_frame_t& f = frames[frame];
+	GLuint * q = queries[frame];
+
+	// Power state or context changes make timestamps meaningless
+	if( hasDisjoint ) {
+		GLint disjoint = 0;
+		glGetIntegerv(QGL_GPU_DISJOINT, &disjoint);
+		if( disjoint ) {
+			dropped++;
+			return;
+		}
+	}
+	// Queries complete in order, the last one tells for all
+	GLuint ready = 0;
+	qglGetQueryObjectuiv(q[f.numZones * 2 - 1], QGL_QUERY_RESULT_AVAILABLE, &ready);
+	if( !ready ) {
+		dropped++;
+		return;
+	}
+
+	long long shift = offset;
+	for( int i = 0; i < f.numZones; ++i ) {
+		unsigned long long begin = 0, end = 0;
+		qglGetQueryObjectui64v(q[i * 2], QGL_QUERY_RESULT, &begin);
+		qglGetQueryObjectui64v(q[i * 2 + 1], QGL_QUERY_RESULT, &end);
+		if( !calibrated && i == 0 ) {
+			// No clock to compare with, line the first zone up with
+			// when it was issued. Hides queueing latency.
+			shift = (long long)f.zones[0].cpuIssue - (long long)begin;
+		}
+		if( end < begin ) {
+			continue;
+		}
+		profiler->AddGpuZone(f.zones[i].name, begin + shift, end + shift);
+	}
+}
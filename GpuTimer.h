@@ -0,0 +1,112 @@
+/*
+ * ===============================================================
+ *
+ * GPU pass timing with timestamp queries.
+ *
+ * Uses GL_EXT_disjoint_timer_query on GLES and GL_ARB_timer_query
+ * on desktop GL; without either every call is a no-op. Entry
+ * points come from the caller's GL loader since neither is core
+ * in GLES 1.x.
+ *
+ * Queries of a frame are read back GPU_TIMER_FRAMES frames later.
+ * If they are still not ready by then the frame's results are
+ * dropped rather than waited for, so timing never stalls the
+ * pipeline. Results go to the profiler on a "GPU" track, shifted
+ * into the CPU clock so both can be compared in one trace.
+ *
+ *================================================================
+ */
+#ifndef _GPUTIMER_H
+#define _GPUTIMER_H
+
+#include <GLES/gl.h>
+#include "Profiler.h"
+
+// Frames between issuing queries and reading them
+#define GPU_TIMER_FRAMES		4
+#define GPU_TIMER_MAX_ZONES		16
+// Re-measure GPU to CPU clock offset this often
+#define GPU_TIMER_CALIBRATE		256
+
+typedef void * (*gl_proc_loader_t)(const char * name);
+
+typedef void (GL_APIENTRY * qglGenQueries_t)(GLsizei n, GLuint * ids);
+typedef void (GL_APIENTRY * qglDeleteQueries_t)(GLsizei n, const GLuint * ids);
+typedef void (GL_APIENTRY * qglQueryCounter_t)(GLuint id, GLenum target);
+typedef void (GL_APIENTRY * qglGetQueryObjectuiv_t)(GLuint id, GLenum pname, GLuint * params);
+typedef void (GL_APIENTRY * qglGetQueryObjectui64v_t)(GLuint id, GLenum pname, unsigned long long * params);
+typedef void (GL_APIENTRY * qglGetInteger64v_t)(GLenum pname, long long * params);
+
+struct gpu_zone_t {
+	const char *	name;
+	profile_time_t	cpuIssue;	// when Begin was called
+};
+
+struct gpu_frame_t {
+	gpu_zone_t		zones[GPU_TIMER_MAX_ZONES];
+	int				numZones;
+};
+
+class GpuTimer
+{
+public:
+					GpuTimer();
+					~GpuTimer();
+
+	// Needs a current context. False if timestamps are not supported.
+	bool			Init(gl_proc_loader_t loader);
+	bool			IsAvailable() const { return available; }
+
+	// Around everything the GPU does for one frame
+	void			BeginFrame();
+	void			EndFrame();
+
+	// Returns zone id for End, -1 if not recorded
+	int				Begin(const char * name);
+	void			End(int zone);
+
+	// Frames whose results were not ready in time
+	int				GetDropped() const { return dropped; }
+
+private:
+	void			Collect(int frame);
+	void			Calibrate();
+
+private:
+	bool			available;
+	bool			hasDisjoint;
+	int				current;
+	int				frameCount;
+	int				dropped;
+	// GPU timestamp + offset = Sys_Nanoseconds
+	long long		offset;
+	bool			calibrated;
+
+	gpu_frame_t		frames[GPU_TIMER_FRAMES];
+	// Begin and end query of each zone of each frame
+	GLuint			queries[GPU_TIMER_FRAMES][GPU_TIMER_MAX_ZONES * 2];
+
+	qglGenQueries_t				qglGenQueries;
+	qglDeleteQueries_t			qglDeleteQueries;
+	qglQueryCounter_t			qglQueryCounter;
+	qglGetQueryObjectuiv_t		qglGetQueryObjectuiv;
+	qglGetQueryObjectui64v_t	qglGetQueryObjectui64v;
+	qglGetInteger64v_t			qglGetInteger64v;
+
+	GpuTimer(const GpuTimer&) {}
+	GpuTimer& operator=(const GpuTimer&) { return *this; }
+};
+
+// Times the rest of the block on the GPU
+class GpuScope
+{
+public:
+					GpuScope(GpuTimer& t, const char * name) : timer(t) { zone = t.Begin(name); }
+					~GpuScope() { timer.End(zone); }
+
+private:
+	GpuTimer&		timer;
+	int				zone;
+};
+
+#endif /* !_GPUTIMER_H */
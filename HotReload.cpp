@@ -0,0 +1,267 @@
+#include "HotReload.h"
+#include "Mesh.h"
+#include "CameraPath.h"
+#include "WorldDB.h"
+#include "Profiler.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef __linux__
+	#include <sys/inotify.h>
+	#include <poll.h>
+#endif
+
+// Folders under data/ and what their files are
+struct reload_folder_t {
+	const char *	dir;
+	reload_type_t	type;
+};
+
+static const reload_folder_t reloadFolders[] = {
+	{ "/model",		RELOAD_MESH },
+	{ "/texture",	RELOAD_TEXTURE },
+	{ "/map",		RELOAD_MAP },
+	{ "/cp",		RELOAD_CAMERAPATH },
+};
+
+ResourceWatcher::ResourceWatcher() : quit(false), notifyFd(-1)
+{
+}
+
+ResourceWatcher::~ResourceWatcher()
+{
+	Stop();
+}
+
+bool ResourceWatcher::Start(const qStr& dataDir)
+{
+#ifdef __linux__
+	if( IsActive() ) {
+		return true;
+	}
+	notifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if( notifyFd < 0 ) {
+		return false;
+	}
+	int numFolders = sizeof(reloadFolders) / sizeof(reloadFolders[0]);
+	for( int i = 0; i < numFolders; ++i ) {
+		qStr dir = dataDir.Concat(reloadFolders[i].dir);
+		// Written in place or saved aside and moved over
+		int wd = inotify_add_watch(notifyFd, dir.Ptr(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if( wd < 0 ) {
+			// Missing folders have nothing to reload
+			continue;
+		}
+		watches.push_back(wd);
+		folders.push_back(dir);
+		folderTypes.push_back(reloadFolders[i].type);
+	}
+	quit = false;
+	if( watches.empty() || !thread.Start(WatcherMain, this) ) {
+		close(notifyFd);
+		notifyFd = -1;
+		watches.clear();
+		folders.clear();
+		folderTypes.clear();
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+void ResourceWatcher::Stop()
+{
+	if( !IsActive() ) {
+		return;
+	}
+	quit = true;
+	thread.Join();
+	close(notifyFd);
+	notifyFd = -1;
+	watches.clear();
+	folders.clear();
+	folderTypes.clear();
+	changed.clear();
+	for( size_t i = 0; i < ready.size(); ++i ) {
+		FreeReload(ready[i]);
+	}
+	ready.clear();
+}
+
+void ResourceWatcher::TakeReloads(std::vector<reload_t>& out)
+{
+	readyLock.Lock();
+	out.insert(out.end(), ready.begin(), ready.end());
+	ready.clear();
+	readyLock.Unlock();
+}
+
+void ResourceWatcher::FreeReload(reload_t& r)
+{
+	delete r.mesh;
+	delete r.tex;
+	delete r.cameraPath;
+	delete r.map;
+	r.mesh = NULL;
+	r.tex = NULL;
+	r.cameraPath = NULL;
+	r.map = NULL;
+}
+
+void * ResourceWatcher::WatcherMain(void * arg)
+{
+	Profiler::SetThreadName("reload");
+	( (ResourceWatcher*)arg )->Run();
+	return NULL;
+}
+
+void ResourceWatcher::Run()
+{
+#ifdef __linux__
+	while( !quit ) {
+		// Wakes up now and then to see quit
+		struct pollfd p = { notifyFd, POLLIN, 0 };
+		int n = poll(&p, 1, RELOAD_SETTLE_MS);
+		if( n > 0 ) {
+			ReadEvents();
+			continue;
+		}
+		if( n < 0 && errno != EINTR ) {
+			fprintf(stderr, "Stopped watching for changes\n");
+			return;
+		}
+		if( changed.empty() ) {
+			continue;
+		}
+
+		// Quiet for a while, load what changed
+		PROFILE_SCOPE("HotReload");
+		for( size_t i = 0; i < changed.size() && !quit; ++i ) {
+			reload_t r = changed[i];
+			if( !Load(r) ) {
+				continue;
+			}
+			readyLock.Lock();
+			ready.push_back(r);
+			readyLock.Unlock();
+		}
+		changed.clear();
+	}
+#endif
+}
+
+void ResourceWatcher::ReadEvents()
+{
+#ifdef __linux__
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	for( ;; ) {
+		ssize_t len = read(notifyFd, buf, sizeof(buf));
+		if( len <= 0 ) {
+			return;
+		}
+		const struct inotify_event * ev;
+		for( char * p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len ) {
+			ev = (const struct inotify_event*)p;
+			if( !ev->len || ( ev->mask & IN_ISDIR ) ) {
+				continue;
+			}
+			size_t f = 0;
+			for( ; f < watches.size() && watches[f] != ev->wd; ++f );
+			if( f == watches.size() ) {
+				continue;
+			}
+			qStr path = folders[f].Concat("/");
+			path.ConcatSelf(ev->name);
+			size_t k = 0;
+			for( ; k < changed.size() && changed[k].path != path; ++k );
+			if( k < changed.size() ) {
+				continue;
+			}
+			reload_t r;
+			r.type = folderTypes[f];
+			r.path = path;
+			r.failed = false;
+			r.mesh = NULL;
+			r.tex = NULL;
+			r.cameraPath = NULL;
+			r.map = NULL;
+			changed.push_back(r);
+		}
+	}
+#endif
+}
+
+// Fills r for the engine. False for files it doesn't load, or
+// doesn't load as they are because a cooked one wins.
+bool ResourceWatcher::Load(reload_t& r) const
+{
+	qStr ext = r.path.GetFileExtension();
+	qStr cooked(r.path.Ptr(), r.path.Length() - ext.Length());
+	struct stat st;
+
+	switch( r.type ) {
+		case RELOAD_MESH:
+			r.mesh = new Mesh(r.path);
+			if( !r.mesh->LoadMD5() ) {
+				delete r.mesh;
+				r.mesh = NULL;
+				r.failed = true;
+			}
+			return true;
+
+		case RELOAD_TEXTURE:
+			if( ext == "png" ) {
+				cooked.ConcatSelf("qtex");
+				if( stat(cooked.Ptr(), &st) == 0 ) {
+					return false;
+				}
+				r.tex = new Texture(r.path);
+				r.failed = !r.tex->LoadPNG();
+			} else if( ext == "qtex" ) {
+				// All of it, so streaming never waits on disk
+				r.tex = new Texture(r.path);
+				r.failed = !r.tex->LoadCooked() || !r.tex->Prefetch();
+			} else {
+				return false;
+			}
+			if( r.failed ) {
+				delete r.tex;
+				r.tex = NULL;
+			}
+			return true;
+
+		case RELOAD_MAP:
+			if( ext == "bmap" ) {
+				return true;
+			}
+			if( ext != "map" ) {
+				return false;
+			}
+			cooked.ConcatSelf("bmap");
+			if( stat(cooked.Ptr(), &st) == 0 ) {
+				return false;
+			}
+			r.map = new map_source_t;
+			if( !WorldDB::ParseMap(r.path, *r.map) ) {
+				delete r.map;
+				r.map = NULL;
+				r.failed = true;
+			}
+			return true;
+
+		case RELOAD_CAMERAPATH:
+			if( ext != "cp" ) {
+				return false;
+			}
+			r.cameraPath = new CameraPath(r.path.Ptr());
+			if( r.cameraPath->GetNumKeys() == 0 ) {
+				delete r.cameraPath;
+				r.cameraPath = NULL;
+				r.failed = true;
+			}
+			return true;
+	}
+	return false;
+}
@@ -0,0 +1,97 @@
+/*
+ * ===============================================================
+ *
+ * Picks up assets edited under data/ while the engine runs.
+ *
+ * A thread watches the model, texture, map and cp folders with
+ * inotify. A file written and closed, or moved in as editors save,
+ * is noted. Once the folders have been quiet for RELOAD_SETTLE_MS
+ * the same thread loads what was noted into fresh objects: LoadMD5
+ * for meshes, a decode for PNG textures, the whole file for cooked
+ * ones, a CameraPath, or ParseMap for text maps. Nothing of the
+ * running engine is touched there.
+ *
+ * The engine takes finished loads at the start of a frame and
+ * moves their data into the objects it already has. Those are the
+ * handles: entities, the draw list and the streamer keep pointing
+ * at the same Mesh and Texture, only what they hold changes, and
+ * what is on the GPU is replaced under the same buffer and
+ * texture names.
+ *
+ * inotify is Linux only, elsewhere Start fails and nothing is
+ * watched.
+ *
+ *================================================================
+ */
+#ifndef _HOTRELOAD_H
+#define _HOTRELOAD_H
+
+#include "String.h"
+#include "Thread.h"
+#include <vector>
+
+// Quiet time after the last change before loading, editors
+// often write a file in a few goes
+#define RELOAD_SETTLE_MS	100
+
+class Mesh;
+class Texture;
+class CameraPath;
+struct map_source_t;
+
+typedef enum { RELOAD_MESH, RELOAD_TEXTURE, RELOAD_MAP, RELOAD_CAMERAPATH } reload_type_t;
+
+// One changed file, loaded. Whoever takes it owns what it points to.
+struct reload_t {
+	reload_type_t	type;
+	qStr			path;
+	bool			failed;		// didn't load, nothing below is set
+	Mesh *			mesh;
+	Texture *		tex;
+	CameraPath *	cameraPath;
+	// Text maps only, a cooked map is mapped by LoadMap
+	map_source_t *	map;
+};
+
+class ResourceWatcher
+{
+public:
+					ResourceWatcher();
+					~ResourceWatcher();
+
+	// Watch the asset folders under dataDir
+	bool			Start(const qStr& dataDir);
+	// Loads not taken yet are dropped
+	void			Stop();
+	bool			IsActive() const { return thread.IsRunning(); }
+
+	// Appends loads finished since the last call
+	void			TakeReloads(std::vector<reload_t>& out);
+	// Free what a reload holds, for ones not used
+	static void		FreeReload(reload_t& r);
+
+private:
+	static void *	WatcherMain(void * arg);
+	void			Run();
+	void			ReadEvents();
+	bool			Load(reload_t& r) const;
+
+private:
+	Thread					thread;
+	volatile bool			quit;
+	int						notifyFd;
+	// Watch descriptor, folder it is on and what is in there
+	std::vector<int>		watches;
+	std::vector<qStr>		folders;
+	std::vector<reload_type_t>	folderTypes;
+	// Changed since the last load, no duplicates. Only type
+	// and path are set.
+	std::vector<reload_t>	changed;
+	Mutex					readyLock;
+	std::vector<reload_t>	ready;
+
+	ResourceWatcher(const ResourceWatcher&) {}
+	ResourceWatcher& operator=(const ResourceWatcher&) { return *this; }
+};
+
+#endif /* !_HOTRELOAD_H */
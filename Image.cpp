@@ -0,0 +1,640 @@
+#include "Image.h"
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <png.h>
+
+// ETC1 intensity modifiers, indexed by table and (msb << 1 | lsb)
+static const int etc1Modifiers[8][4] = {
+	{  2,   8,  -2,   -8 },
+	{  5,  17,  -5,  -17 },
+	{  9,  29,  -9,  -29 },
+	{ 13,  42, -13,  -42 },
+	{ 18,  60, -18,  -60 },
+	{ 24,  80, -24,  -80 },
+	{ 33, 106, -33, -106 },
+	{ 47, 183, -47, -183 }
+};
+
+static inline int R_Clamp255(int v)
+{
+	return v < 0 ? 0 : ( v > 255 ? 255 : v );
+}
+
+bool R_IsCompressedFormat(image_format_t fmt)
+{
+	return fmt == IMAGE_FORMAT_ETC1 || fmt == IMAGE_FORMAT_BC1;
+}
+
+unsigned int R_ImageSize(image_format_t fmt, int width, int height)
+{
+	switch( fmt ) {
+		case IMAGE_FORMAT_RGB8:
+			return width * height * 3;
+		case IMAGE_FORMAT_RGBA8:
+			return width * height * 4;
+		case IMAGE_FORMAT_ETC1:
+		case IMAGE_FORMAT_BC1:
+			// 8 bytes per 4x4 block, partial blocks padded
+			return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+	}
+	return 0;
+}
+
+/*
+=====================================
+
+Mip chain
+
+=====================================
+*/
+void R_GenMipChain(const byte * src, int width, int height, int channels, std::vector<image_mip_t>& mips)
+{
+	mips.clear();
+	mips.resize(1);
+	mips[0].width = width;
+	mips[0].height = height;
+	mips[0].pixels.assign(src, src + width * height * channels);
+
+	while( width > 1 || height > 1 ) {
+		int w = width > 1 ? width / 2 : 1;
+		int h = height > 1 ? height / 2 : 1;
+		image_mip_t mip;
+		mip.width = w;
+		mip.height = h;
+		mip.pixels.resize(w * h * channels);
+
+		const byte * s = &mips.back().pixels[0];
+		byte * d = &mip.pixels[0];
+		for( int y = 0; y < h; ++y ) {
+			int y0 = y * 2;
+			int y1 = y0 + 1 < height ? y0 + 1 : y0;
+			for( int x = 0; x < w; ++x ) {
+				int x0 = x * 2;
+				int x1 = x0 + 1 < width ? x0 + 1 : x0;
+				for( int c = 0; c < channels; ++c ) {
+					int sum = s[(y0 * width + x0) * channels + c] + s[(y0 * width + x1) * channels + c]
+							+ s[(y1 * width + x0) * channels + c] + s[(y1 * width + x1) * channels + c];
+					d[(y * w + x) * channels + c] = (byte)((sum + 2) >> 2);
+				}
+			}
+		}
+		mips.push_back(mip);
+		width = w;
+		height = h;
+	}
+}
+
+// Gather a 4x4 block as RGB, repeating edge pixels for partial blocks
+static void R_FetchBlock(const byte * src, int width, int height, int channels, int bx, int by, int block[16][3])
+{
+	for( int y = 0; y < 4; ++y ) {
+		int sy = by + y < height ? by + y : height - 1;
+		for( int x = 0; x < 4; ++x ) {
+			int sx = bx + x < width ? bx + x : width - 1;
+			const byte * p = src + (sy * width + sx) * channels;
+			block[y * 4 + x][0] = p[0];
+			block[y * 4 + x][1] = p[1];
+			block[y * 4 + x][2] = p[2];
+		}
+	}
+}
+
+/*
+=====================================
+
+ETC1
+
+Pixel (x, y) of a block owns bit x * 4 + y of both selector
+words. A block is split into two 2x4 (flip 0) or 4x2 (flip 1)
+halves, each with a base color and a modifier table.
+
+=====================================
+*/
+
+// Best table and selectors for pixels of one half against a base
+// color. Returns squared error.
+static int R_ETC1FitHalf(const int block[16][3], const int * pixels, const int base[3], int * table, int * sel)
+{
+	int bestErr = INT_MAX;
+	for( int t = 0; t < 8; ++t ) {
+		int err = 0;
+		int s[8];
+		for( int i = 0; i < 8 && err < bestErr; ++i ) {
+			const int * p = block[pixels[i]];
+			int best = INT_MAX;
+			for( int m = 0; m < 4; ++m ) {
+				int mod = etc1Modifiers[t][m];
+				int dr = R_Clamp255(base[0] + mod) - p[0];
+				int dg = R_Clamp255(base[1] + mod) - p[1];
+				int db = R_Clamp255(base[2] + mod) - p[2];
+				int e = dr * dr + dg * dg + db * db;
+				if( e < best ) {
+					best = e;
+					s[i] = m;
+				}
+			}
+			err += best;
+		}
+		if( err < bestErr ) {
+			bestErr = err;
+			*table = t;
+			memcpy(sel, s, sizeof(s));
+		}
+	}
+	return bestErr;
+}
+
+static void R_ETC1EncodeBlock(const int block[16][3], byte * out)
+{
+	int bestErr = INT_MAX;
+
+	for( int flip = 0; flip < 2; ++flip ) {
+		// Pixel ids of each half
+		int half[2][8];
+		int n[2] = { 0, 0 };
+		for( int y = 0; y < 4; ++y ) {
+			for( int x = 0; x < 4; ++x ) {
+				int h = flip ? ( y >= 2 ) : ( x >= 2 );
+				half[h][n[h]++] = y * 4 + x;
+			}
+		}
+
+		int avg[2][3];
+		for( int h = 0; h < 2; ++h ) {
+			for( int c = 0; c < 3; ++c ) {
+				int sum = 0;
+				for( int i = 0; i < 8; ++i ) {
+					sum += block[half[h][i]][c];
+				}
+				avg[h][c] = (sum + 4) / 8;
+			}
+		}
+
+		for( int diff = 0; diff < 2; ++diff ) {
+			int q[2][3];	// quantized base colors
+			int base[2][3];	// expanded to 8 bits
+			bool valid = true;
+			for( int h = 0; h < 2; ++h ) {
+				for( int c = 0; c < 3; ++c ) {
+					if( diff ) {
+						q[h][c] = (avg[h][c] * 31 + 127) / 255;
+						base[h][c] = (q[h][c] << 3) | (q[h][c] >> 2);
+					} else {
+						q[h][c] = (avg[h][c] * 15 + 127) / 255;
+						base[h][c] = (q[h][c] << 4) | q[h][c];
+					}
+				}
+			}
+			if( diff ) {
+				for( int c = 0; c < 3; ++c ) {
+					int d = q[1][c] - q[0][c];
+					if( d < -4 || d > 3 ) {
+						valid = false;
+					}
+				}
+			}
+			if( !valid ) {
+				continue;
+			}
+
+			int table[2], sel[2][8];
+			int err = R_ETC1FitHalf(block, half[0], base[0], &table[0], sel[0])
+					+ R_ETC1FitHalf(block, half[1], base[1], &table[1], sel[1]);
+			if( err >= bestErr ) {
+				continue;
+			}
+			bestErr = err;
+
+			for( int c = 0; c < 3; ++c ) {
+				if( diff ) {
+					out[c] = (byte)((q[0][c] << 3) | ((q[1][c] - q[0][c]) & 7));
+				} else {
+					out[c] = (byte)((q[0][c] << 4) | q[1][c]);
+				}
+			}
+			out[3] = (byte)((table[0] << 5) | (table[1] << 2) | (diff << 1) | flip);
+
+			unsigned int msb = 0, lsb = 0;
+			for( int h = 0; h < 2; ++h ) {
+				for( int i = 0; i < 8; ++i ) {
+					int p = half[h][i];
+					int bit = (p & 3) * 4 + (p >> 2);
+					msb |= (unsigned int)(sel[h][i] >> 1) << bit;
+					lsb |= (unsigned int)(sel[h][i] & 1) << bit;
+				}
+			}
+			out[4] = (byte)(msb >> 8);
+			out[5] = (byte)msb;
+			out[6] = (byte)(lsb >> 8);
+			out[7] = (byte)lsb;
+		}
+	}
+}
+
+void R_CompressETC1(const byte * src, int width, int height, int channels, byte * out)
+{
+	int block[16][3];
+	for( int by = 0; by < height; by += 4 ) {
+		for( int bx = 0; bx < width; bx += 4 ) {
+			R_FetchBlock(src, width, height, channels, bx, by, block);
+			R_ETC1EncodeBlock(block, out);
+			out += 8;
+		}
+	}
+}
+
+void R_DecompressETC1(const byte * src, int width, int height, byte * out)
+{
+	for( int by = 0; by < height; by += 4 ) {
+		for( int bx = 0; bx < width; bx += 4, src += 8 ) {
+			int diff = (src[3] >> 1) & 1;
+			int flip = src[3] & 1;
+			int table[2] = { src[3] >> 5, (src[3] >> 2) & 7 };
+			int base[2][3];
+			for( int c = 0; c < 3; ++c ) {
+				if( diff ) {
+					int c0 = src[c] >> 3;
+					int d = src[c] & 7;
+					int c1 = c0 + ( d >= 4 ? d - 8 : d );
+					base[0][c] = (c0 << 3) | (c0 >> 2);
+					base[1][c] = (c1 << 3) | (c1 >> 2);
+				} else {
+					base[0][c] = (src[c] >> 4) * 0x11;
+					base[1][c] = (src[c] & 15) * 0x11;
+				}
+			}
+			unsigned int msb = (src[4] << 8) | src[5];
+			unsigned int lsb = (src[6] << 8) | src[7];
+
+			for( int y = 0; y < 4 && by + y < height; ++y ) {
+				for( int x = 0; x < 4 && bx + x < width; ++x ) {
+					int h = flip ? ( y >= 2 ) : ( x >= 2 );
+					int bit = x * 4 + y;
+					int s = (((msb >> bit) & 1) << 1) | ((lsb >> bit) & 1);
+					int mod = etc1Modifiers[table[h]][s];
+					byte * d = out + ((by + y) * width + bx + x) * 3;
+					for( int c = 0; c < 3; ++c ) {
+						d[c] = (byte)R_Clamp255(base[h][c] + mod);
+					}
+				}
+			}
+		}
+	}
+}
+
+/*
+=====================================
+
+BC1 (DXT1), always in four color mode
+
+=====================================
+*/
+static inline unsigned short R_Pack565(const float c[3])
+{
+	int r = (int)(c[0] * 31.0f / 255.0f + 0.5f);
+	int g = (int)(c[1] * 63.0f / 255.0f + 0.5f);
+	int b = (int)(c[2] * 31.0f / 255.0f + 0.5f);
+	r = r < 0 ? 0 : ( r > 31 ? 31 : r );
+	g = g < 0 ? 0 : ( g > 63 ? 63 : g );
+	b = b < 0 ? 0 : ( b > 31 ? 31 : b );
+	return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+static inline void R_Unpack565(unsigned short v, int c[3])
+{
+	int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+	c[0] = (r << 3) | (r >> 2);
+	c[1] = (g << 2) | (g >> 4);
+	c[2] = (b << 3) | (b >> 2);
+}
+
+static void R_BC1Palette(unsigned short c0, unsigned short c1, int pal[4][3])
+{
+	R_Unpack565(c0, pal[0]);
+	R_Unpack565(c1, pal[1]);
+	for( int c = 0; c < 3; ++c ) {
+		if( c0 > c1 ) {
+			pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3;
+			pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3;
+		} else {
+			pal[2][c] = (pal[0][c] + pal[1][c]) / 2;
+			pal[3][c] = 0;
+		}
+	}
+}
+
+static void R_BC1EncodeBlock(const int block[16][3], byte * out)
+{
+	// Principal axis of the colors by a few power iterations
+	float mean[3] = { 0, 0, 0 };
+	for( int i = 0; i < 16; ++i ) {
+		for( int c = 0; c < 3; ++c ) {
+			mean[c] += block[i][c];
+		}
+	}
+	for( int c = 0; c < 3; ++c ) {
+		mean[c] /= 16.0f;
+	}
+	float cov[6] = { 0, 0, 0, 0, 0, 0 };
+	for( int i = 0; i < 16; ++i ) {
+		float r = block[i][0] - mean[0], g = block[i][1] - mean[1], b = block[i][2] - mean[2];
+		cov[0] += r * r; cov[1] += r * g; cov[2] += r * b;
+		cov[3] += g * g; cov[4] += g * b; cov[5] += b * b;
+	}
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	for( int it = 0; it < 4; ++it ) {
+		float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+		float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+		float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+		float len = sqrtf(x * x + y * y + z * z);
+		if( len < 1e-6f ) {
+			break;
+		}
+		axis[0] = x / len; axis[1] = y / len; axis[2] = z / len;
+	}
+
+	// End points are the extreme projections, inset a little
+	float tmin = 1e30f, tmax = -1e30f;
+	for( int i = 0; i < 16; ++i ) {
+		float t = (block[i][0] - mean[0]) * axis[0] + (block[i][1] - mean[1]) * axis[1] + (block[i][2] - mean[2]) * axis[2];
+		if( t < tmin ) tmin = t;
+		if( t > tmax ) tmax = t;
+	}
+	float inset = (tmax - tmin) / 16.0f;
+	tmin += inset;
+	tmax -= inset;
+	float e0[3], e1[3];
+	for( int c = 0; c < 3; ++c ) {
+		e0[c] = mean[c] + axis[c] * tmax;
+		e1[c] = mean[c] + axis[c] * tmin;
+	}
+	unsigned short c0 = R_Pack565(e0);
+	unsigned short c1 = R_Pack565(e1);
+	if( c0 < c1 ) {
+		unsigned short t = c0; c0 = c1; c1 = t;
+	}
+
+	unsigned int indices = 0;
+	if( c0 != c1 ) {
+		int pal[4][3];
+		R_BC1Palette(c0, c1, pal);
+		for( int i = 0; i < 16; ++i ) {
+			int best = INT_MAX, bestIdx = 0;
+			for( int k = 0; k < 4; ++k ) {
+				int dr = pal[k][0] - block[i][0];
+				int dg = pal[k][1] - block[i][1];
+				int db = pal[k][2] - block[i][2];
+				int e = dr * dr + dg * dg + db * db;
+				if( e < best ) {
+					best = e;
+					bestIdx = k;
+				}
+			}
+			indices |= (unsigned int)bestIdx << (i * 2);
+		}
+	}
+
+	out[0] = (byte)c0; out[1] = (byte)(c0 >> 8);
+	out[2] = (byte)c1; out[3] = (byte)(c1 >> 8);
+	out[4] = (byte)indices; out[5] = (byte)(indices >> 8);
+	out[6] = (byte)(indices >> 16); out[7] = (byte)(indices >> 24);
+}
+
+void R_CompressBC1(const byte * src, int width, int height, int channels, byte * out)
+{
+	int block[16][3];
+	for( int by = 0; by < height; by += 4 ) {
+		for( int bx = 0; bx < width; bx += 4 ) {
+			R_FetchBlock(src, width, height, channels, bx, by, block);
+			R_BC1EncodeBlock(block, out);
+			out += 8;
+		}
+	}
+}
+
+void R_DecompressBC1(const byte * src, int width, int height, byte * out)
+{
+	for( int by = 0; by < height; by += 4 ) {
+		for( int bx = 0; bx < width; bx += 4, src += 8 ) {
+			unsigned short c0 = src[0] | (src[1] << 8);
+			unsigned short c1 = src[2] | (src[3] << 8);
+			unsigned int indices = src[4] | (src[5] << 8) | (src[6] << 16) | ((unsigned int)src[7] << 24);
+			int pal[4][3];
+			R_BC1Palette(c0, c1, pal);
+			for( int y = 0; y < 4 && by + y < height; ++y ) {
+				for( int x = 0; x < 4 && bx + x < width; ++x ) {
+					int k = (indices >> ((y * 4 + x) * 2)) & 3;
+					byte * d = out + ((by + y) * width + bx + x) * 3;
+					d[0] = (byte)pal[k][0];
+					d[1] = (byte)pal[k][1];
+					d[2] = (byte)pal[k][2];
+				}
+			}
+		}
+	}
+}
+
+/*
+=====================================
+
+PNG
+
+libpng reports errors by longjmp to the setjmp of the struct, no
+state is shared between calls.
+
+=====================================
+*/
+static FILE * R_OpenPNG(const char * path, png_structp * png, png_infop * info)
+{
+	FILE * fp = fopen(path, "rb");
+	if( !fp ) {
+		fprintf(stderr, "Cannot open %s\n", path);
+		return NULL;
+	}
+	png_byte sig[8];
+	if( fread(sig, 1, 8, fp) != 8 || png_sig_cmp(sig, 0, 8) ) {
+		fprintf(stderr, "%s is not a PNG file\n", path);
+		fclose(fp);
+		return NULL;
+	}
+	*png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	*info = *png ? png_create_info_struct(*png) : NULL;
+	if( !*info ) {
+		png_destroy_read_struct(png, NULL, NULL);
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+bool R_ReadPNGInfo(const char * path, int * width, int * height, int * channels)
+{
+	png_structp png;
+	png_infop info;
+	FILE * fp = R_OpenPNG(path, &png, &info);
+	if( !fp ) {
+		return false;
+	}
+	if( setjmp(png_jmpbuf(png)) ) {
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(fp);
+		return false;
+	}
+	png_init_io(png, fp);
+	png_set_sig_bytes(png, 8);
+	png_read_info(png, info);
+
+	int colorType = png_get_color_type(png, info);
+	*width = png_get_image_width(png, info);
+	*height = png_get_image_height(png, info);
+	*channels = ( (colorType & PNG_COLOR_MASK_ALPHA) || png_get_valid(png, info, PNG_INFO_tRNS) ) ? 4 : 3;
+
+	png_destroy_read_struct(&png, &info, NULL);
+	fclose(fp);
+	return true;
+}
+
+bool R_DecodePNG(const char * path, byte * out, int width, int height, int channels)
+{
+	png_structp png;
+	png_infop info;
+	FILE * fp = R_OpenPNG(path, &png, &info);
+	if( !fp ) {
+		return false;
+	}
+	if( setjmp(png_jmpbuf(png)) ) {
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(fp);
+		return false;
+	}
+	png_init_io(png, fp);
+	png_set_sig_bytes(png, 8);
+	png_read_info(png, info);
+
+	if( (int)png_get_image_width(png, info) != width || (int)png_get_image_height(png, info) != height ) {
+		fprintf(stderr, "%s changed size since its header was read\n", path);
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(fp);
+		return false;
+	}
+
+	// Whatever is in the file, come out as 8 bit RGB(A)
+	int colorType = png_get_color_type(png, info);
+	int depth = png_get_bit_depth(png, info);
+	bool alpha = (colorType & PNG_COLOR_MASK_ALPHA) != 0;
+	if( colorType == PNG_COLOR_TYPE_PALETTE ) {
+		png_set_palette_to_rgb(png);
+	}
+	if( !(colorType & PNG_COLOR_MASK_COLOR) ) {
+		if( depth < 8 ) {
+			png_set_expand_gray_1_2_4_to_8(png);
+		}
+		png_set_gray_to_rgb(png);
+	}
+	if( png_get_valid(png, info, PNG_INFO_tRNS) ) {
+		png_set_tRNS_to_alpha(png);
+		alpha = true;
+	}
+	if( depth == 16 ) {
+		png_set_strip_16(png);
+	}
+	if( alpha && channels == 3 ) {
+		png_set_strip_alpha(png);
+	} else if( !alpha && channels == 4 ) {
+		png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+	}
+	int passes = png_set_interlace_handling(png);
+	png_read_update_info(png, info);
+
+	size_t stride = (size_t)width * channels;
+	if( png_get_rowbytes(png, info) != stride ) {
+		fprintf(stderr, "%s: unexpected row size\n", path);
+		png_destroy_read_struct(&png, &info, NULL);
+		fclose(fp);
+		return false;
+	}
+	// Rows go straight to the caller's buffer, interlaced
+	// passes refine them in place
+	for( int pass = 0; pass < passes; ++pass ) {
+		for( int y = 0; y < height; ++y ) {
+			png_read_row(png, out + y * stride, NULL);
+		}
+	}
+	png_read_end(png, NULL);
+
+	png_destroy_read_struct(&png, &info, NULL);
+	fclose(fp);
+	return true;
+}
+
+/*
+=====================================
+
+.qtex writer
+
+=====================================
+*/
+bool R_WriteQtex(const char * path, const byte * pixels, int width, int height, int channels, image_format_t fmt)
+{
+	if( channels == 4 ) {
+		fmt = IMAGE_FORMAT_RGBA8;
+	} else if( !R_IsCompressedFormat(fmt) ) {
+		fmt = IMAGE_FORMAT_RGB8;
+	}
+
+	std::vector<image_mip_t> chain;
+	R_GenMipChain(pixels, width, height, channels, chain);
+	int numMips = (int)chain.size();
+
+	qtex_header_t header;
+	header.magic = QTEX_MAGIC;
+	header.version = QTEX_VERSION;
+	header.format = fmt;
+	header.width = width;
+	header.height = height;
+	header.numMips = numMips;
+
+	// Coarsest level goes right after the mip table
+	std::vector<qtex_mip_t> table(numMips);
+	unsigned int offset = sizeof(header) + numMips * sizeof(qtex_mip_t);
+	for( int i = numMips - 1; i >= 0; --i ) {
+		table[i].width = chain[i].width;
+		table[i].height = chain[i].height;
+		table[i].offset = offset;
+		table[i].size = R_ImageSize(fmt, chain[i].width, chain[i].height);
+		offset += table[i].size;
+	}
+
+	FILE * fp = fopen(path, "wb");
+	if( !fp ) {
+		fprintf(stderr, "Cannot open %s for writing\n", path);
+		return false;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, fp) == 1
+			&& fwrite(&table[0], sizeof(qtex_mip_t), numMips, fp) == (size_t)numMips;
+
+	std::vector<byte> buf;
+	for( int i = numMips - 1; i >= 0 && ok; --i ) {
+		const image_mip_t& m = chain[i];
+		const byte * data = &m.pixels[0];
+		if( R_IsCompressedFormat(fmt) ) {
+			buf.resize(table[i].size);
+			if( fmt == IMAGE_FORMAT_ETC1 ) {
+				R_CompressETC1(data, m.width, m.height, channels, &buf[0]);
+			} else {
+				R_CompressBC1(data, m.width, m.height, channels, &buf[0]);
+			}
+			data = &buf[0];
+		}
+		ok = fwrite(data, table[i].size, 1, fp) == 1;
+	}
+	fclose(fp);
+
+	if( !ok ) {
+		fprintf(stderr, "Failed writing %s\n", path);
+		remove(path);
+	}
+	return ok;
+}
@@ -0,0 +1,82 @@
+/*
+ * ===============================================================
+ *
+ * Image processing used by the texture cooker: mip chain
+ * generation, block compression and the .qtex container.
+ *
+ * A .qtex file holds a complete mip chain in one format. Mips are
+ * stored coarsest first so streaming reads the file front to back
+ * and the lowest levels are available after the first few bytes.
+ *
+ *================================================================
+ */
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include <stdio.h>
+#include <vector>
+
+typedef unsigned char byte;
+
+typedef enum {
+	IMAGE_FORMAT_RGB8,
+	IMAGE_FORMAT_RGBA8,
+	IMAGE_FORMAT_ETC1,		// GL_OES_compressed_ETC1_RGB8_texture
+	IMAGE_FORMAT_BC1		// GL_EXT_texture_compression_s3tc, DXT1
+} image_format_t;
+
+#define QTEX_MAGIC		0x58455451	// 'QTEX'
+#define QTEX_VERSION	1
+
+struct qtex_header_t {
+	unsigned int	magic;
+	unsigned int	version;
+	unsigned int	format;		// image_format_t
+	unsigned int	width;
+	unsigned int	height;
+	unsigned int	numMips;
+};
+
+// Level 0 is the full size image. Offsets are from file start.
+struct qtex_mip_t {
+	unsigned int	width;
+	unsigned int	height;
+	unsigned int	offset;
+	unsigned int	size;
+};
+
+// One uncompressed level
+struct image_mip_t {
+	int				width;
+	int				height;
+	std::vector<byte> pixels;
+};
+
+bool			R_IsCompressedFormat(image_format_t fmt);
+// Bytes needed for a w x h level
+unsigned int	R_ImageSize(image_format_t fmt, int width, int height);
+
+// 2x2 box filtered chain down to 1x1; level 0 is a copy of src
+void			R_GenMipChain(const byte * src, int width, int height, int channels, std::vector<image_mip_t>& mips);
+
+// 4x4 block encoders. src is RGB or RGBA with given channels.
+// out must hold R_ImageSize() bytes.
+void			R_CompressETC1(const byte * src, int width, int height, int channels, byte * out);
+void			R_CompressBC1(const byte * src, int width, int height, int channels, byte * out);
+// Decoders for drivers without the extension. Output is RGB.
+void			R_DecompressETC1(const byte * src, int width, int height, byte * out);
+void			R_DecompressBC1(const byte * src, int width, int height, byte * out);
+
+// PNG decoding through libpng. Every call owns its decoder state,
+// so any number of files can be decoded on different threads.
+// channels is 3 or 4; 4 when the file has alpha or transparency.
+bool			R_ReadPNGInfo(const char * path, int * width, int * height, int * channels);
+// out holds width * height * channels bytes, rows top to bottom.
+// Palette, gray and 16 bit files are converted on the way.
+bool			R_DecodePNG(const char * path, byte * out, int width, int height, int channels);
+
+// Cook an uncompressed image into a .qtex file. RGBA sources
+// keep RGBA8 since neither block format here carries alpha.
+bool			R_WriteQtex(const char * path, const byte * pixels, int width, int height, int channels, image_format_t fmt);
+
+#endif /* !_IMAGE_H */
@@ -1,7 +1,6 @@
-
 #include <stdarg.h>
-#include <ios>
-#include <istream>
+#include <stddef.h>
+#include <time.h>
 
 #include "Log.h"
 
@@ -11,122 +10,595 @@
 
 #ifdef __linux__
 	#include <sys/time.h>
+	#include <unistd.h>
 #endif
 
+// Level of the filler that skips the end of the ring
+#define LOG_PAD			0xffff
+// Text of one batch write
+#define LOG_BATCH_SIZE	(64 * 1024)
+
+/*
+================================================
+
+A record in the ring. seq is written last, when
+it holds the record's own offset the record is
+complete. Arguments follow the header in 8 byte
+slots, %s strings as a length and the bytes.
+
+================================================
+*/
+struct log_record_t {
+	volatile unsigned long long	seq;
+	unsigned int		size;		// with header, multiple of 8
+	unsigned short		level;
+	unsigned short		category;
+	long long			sec;
+	long				nsec;
+	const char *		fmt;
+	unsigned int		argBytes;
+};
+
+#define LOG_HEADER_SIZE	( ( sizeof(log_record_t) + 7 ) & ~(size_t)7 )
+
+// One conversion of a format string
+struct log_spec_t {
+	const char *	flags;		// after '%'
+	int				numFlags;
+	const char *	width;		// digits, or NULL for '*'
+	int				numWidth;
+	const char *	prec;		// digits after '.', NULL for '*'
+	int				numPrec;
+	bool			hasPrec;
+	int				length;		// count of 'l', or 'h', 'z', 'j', 't', 'L'
+	char			conv;
+};
+
+static inline size_t R_Align8(size_t v)
+{
+	return ( v + 7 ) & ~(size_t)7;
+}
+
+// p is at '%', returns the character after the conversion
+static const char * R_ParseSpec(const char * p, log_spec_t& spec)
+{
+	p++;
+	spec.flags = p;
+	while( *p && strchr("-+ #0'", *p) ) {
+		p++;
+	}
+	spec.numFlags = p - spec.flags;
+
+	spec.width = p;
+	if( *p == '*' ) {
+		spec.width = NULL;
+		p++;
+	}
+	while( *p >= '0' && *p <= '9' ) {
+		p++;
+	}
+	spec.numWidth = spec.width ? p - spec.width : 0;
+
+	spec.hasPrec = false;
+	spec.prec = NULL;
+	spec.numPrec = 0;
+	if( *p == '.' ) {
+		spec.hasPrec = true;
+		p++;
+		spec.prec = p;
+		if( *p == '*' ) {
+			spec.prec = NULL;
+			p++;
+		}
+		while( *p >= '0' && *p <= '9' ) {
+			p++;
+		}
+		spec.numPrec = spec.prec ? p - spec.prec : 0;
+	}
+
+	spec.length = 0;
+	if( *p == 'l' ) {
+		spec.length = ( p[1] == 'l' ) ? 2 : 1;
+		p += spec.length;
+	} else if( *p == 'h' ) {
+		spec.length = 'h';
+		p += ( p[1] == 'h' ) ? 2 : 1;
+	} else if( *p == 'z' || *p == 'j' || *p == 't' || *p == 'L' ) {
+		spec.length = *p++;
+	}
+	spec.conv = *p;
+	return *p ? p + 1 : p;
+}
+
+static inline bool R_IsIntConv(char c)
+{
+	return c == 'd' || c == 'i' || c == 'u' || c == 'x' || c == 'X' || c == 'o';
+}
+
+static inline bool R_IsFloatConv(char c)
+{
+	return c == 'f' || c == 'F' || c == 'e' || c == 'E' || c == 'g' || c == 'G' || c == 'a' || c == 'A';
+}
+
+// Pull each argument out of ap by the type fmt says it has.
+// Returns bytes used in args.
+static size_t R_CaptureArgs(const char * fmt, va_list ap, char * args, size_t size)
+{
+	size_t used = 0;
+	log_spec_t spec;
+	for( const char * p = fmt; *p; ) {
+		if( *p != '%' ) {
+			p++;
+			continue;
+		}
+		p = R_ParseSpec(p, spec);
+		if( spec.conv == '%' || !spec.conv ) {
+			continue;
+		}
+		if( used + 8 > size ) {
+			// Out of room, the rest prints as "?"
+			break;
+		}
+		long long * slot = (long long*)(args + used);
+		if( !spec.width ) {
+			*slot++ = va_arg(ap, int);
+			used += 8;
+		}
+		// Negative is no precision
+		int prec = -1;
+		if( spec.hasPrec ) {
+			prec = spec.prec ? atoi(spec.prec) : -1;
+		}
+		if( spec.hasPrec && !spec.prec && used + 8 <= size ) {
+			prec = va_arg(ap, int);
+			*slot++ = prec;
+			used += 8;
+		}
+		if( used + 8 > size ) {
+			break;
+		}
+
+		if( R_IsIntConv(spec.conv) ) {
+			bool sign = spec.conv == 'd' || spec.conv == 'i';
+			long long v;
+			switch( spec.length ) {
+			case 1:		v = sign ? va_arg(ap, long) : (long long)va_arg(ap, unsigned long); break;
+			case 2:		v = sign ? va_arg(ap, long long) : (long long)va_arg(ap, unsigned long long); break;
+			case 'z':	v = (long long)va_arg(ap, size_t); break;
+			case 'j':	v = (long long)va_arg(ap, long long); break;
+			case 't':	v = (long long)va_arg(ap, ptrdiff_t); break;
+			default:	v = sign ? va_arg(ap, int) : (long long)va_arg(ap, unsigned int); break;
+			}
+			*slot = v;
+			used += 8;
+		} else if( R_IsFloatConv(spec.conv) ) {
+			double d = ( spec.length == 'L' ) ? (double)va_arg(ap, long double) : va_arg(ap, double);
+			memcpy(slot, &d, sizeof(d));
+			used += 8;
+		} else if( spec.conv == 'c' ) {
+			*slot = va_arg(ap, int);
+			used += 8;
+		} else if( spec.conv == 'p' ) {
+			*slot = (long long)(size_t)va_arg(ap, void*);
+			used += 8;
+		} else if( spec.conv == 's' ) {
+			const char * s = va_arg(ap, const char*);
+			if( !s ) {
+				s = "(null)";
+			}
+			size_t room = size - used - 8;
+			size_t len = strlen(s);
+			if( prec >= 0 && len > (size_t)prec ) {
+				len = prec;
+			}
+			if( len > room ) {
+				len = room;
+			}
+			*slot = (long long)len;
+			memcpy(args + used + 8, s, len);
+			used = R_Align8(used + 8 + len);
+		} else {
+			// %n or unknown, nothing to print
+			va_arg(ap, void*);
+		}
+	}
+	return used;
+}
+
+// Re-run the conversions of fmt with the captured arguments
+static size_t R_FormatArgs(const char * fmt, const char * args, size_t argBytes, char * out, size_t size)
+{
+	size_t n = 0, used = 0;
+	log_spec_t spec;
+	for( const char * p = fmt; *p && n + 1 < size; ) {
+		if( *p != '%' ) {
+			out[n++] = *p++;
+			continue;
+		}
+		p = R_ParseSpec(p, spec);
+		if( spec.conv == '%' ) {
+			out[n++] = '%';
+			continue;
+		}
+		if( !spec.conv ) {
+			break;
+		}
+		if( used + 8 > argBytes ) {
+			out[n++] = '?';
+			continue;
+		}
+
+		// Same conversion, stars filled in, all integers as long long
+		char conv[64];
+		int c = 0;
+		conv[c++] = '%';
+		memcpy(conv + c, spec.flags, spec.numFlags);
+		c += spec.numFlags;
+		if( spec.width ) {
+			memcpy(conv + c, spec.width, spec.numWidth);
+			c += spec.numWidth;
+		} else {
+			c += snprintf(conv + c, sizeof(conv) - c, "%d", (int)*(const long long*)(args + used));
+			used += 8;
+		}
+		// Strings were cut to their precision when captured
+		if( spec.hasPrec && spec.conv != 's' ) {
+			conv[c++] = '.';
+			if( spec.prec ) {
+				memcpy(conv + c, spec.prec, spec.numPrec);
+				c += spec.numPrec;
+			} else if( used + 8 <= argBytes ) {
+				c += snprintf(conv + c, sizeof(conv) - c, "%d", (int)*(const long long*)(args + used));
+				used += 8;
+			}
+		} else if( spec.hasPrec && !spec.prec ) {
+			used += 8;
+		}
+		if( used + 8 > argBytes ) {
+			out[n++] = '?';
+			continue;
+		}
+
+		const long long * slot = (const long long*)(args + used);
+		int w = 0;
+		if( R_IsIntConv(spec.conv) ) {
+			conv[c++] = 'l';
+			conv[c++] = 'l';
+			conv[c++] = spec.conv;
+			conv[c] = '\0';
+			w = snprintf(out + n, size - n, conv, *slot);
+			used += 8;
+		} else if( R_IsFloatConv(spec.conv) ) {
+			conv[c++] = spec.conv;
+			conv[c] = '\0';
+			double d;
+			memcpy(&d, slot, sizeof(d));
+			w = snprintf(out + n, size - n, conv, d);
+			used += 8;
+		} else if( spec.conv == 'c' ) {
+			conv[c++] = 'c';
+			conv[c] = '\0';
+			w = snprintf(out + n, size - n, conv, (int)*slot);
+			used += 8;
+		} else if( spec.conv == 'p' ) {
+			conv[c++] = 'p';
+			conv[c] = '\0';
+			w = snprintf(out + n, size - n, conv, (void*)(size_t)*slot);
+			used += 8;
+		} else if( spec.conv == 's' ) {
+			// Stored without terminator
+			conv[c++] = '.';
+			conv[c++] = '*';
+			conv[c++] = 's';
+			conv[c] = '\0';
+			int len = (int)*slot;
+			w = snprintf(out + n, size - n, conv, len, args + used + 8);
+			used = R_Align8(used + 8 + len);
+		} else {
+			used += 8;
+		}
+		if( w > 0 ) {
+			n += w;
+		}
+		if( n >= size ) {
+			n = size - 1;
+		}
+	}
+	out[n] = '\0';
+	return n;
+}
+
 Log::Log()
 {
-	logToFile = false;
-	output = &std::cout;
-	SetLevel(L_NORMAL);
+	Init(stdout, false);
 	BeginLog(L_NORMAL, "Logging initialized: Output to screen");
 }
 
 Log::Log(const char *file)
 {
-	if( !file || file[0] == '\0' ) {
-		goto FALLBACK;
+	FILE * fp = NULL;
+	if( file && file[0] != '\0' ) {
+		fp = fopen(file, "a");
+	}
+	if( fp ) {
+		Init(fp, true);
+		BeginLog(L_NORMAL, "Logging initialized: Output to file");
+		return;
 	}
-	output = new std::ofstream(file, std::ofstream::out | std::ofstream::app);
-	SetLevel(L_NORMAL);
-
-	if( !output->good() ) 
-		goto FALLBACK;
-	logToFile = true;
-	BeginLog(L_NORMAL, "Logging initialized: Output to file");
-
-FALLBACK:
 	// cannot open file, fallback to logging to screen
-	logToFile = false;
-	output = &std::cout;
+	Init(stdout, false);
 	BeginLog(L_NORMAL, "Logging initialized: Output to screen");
 }
 
+void Log::Init(FILE * out, bool toFile)
+{
+	output = out;
+	logToFile = toFile;
+	level = L_NORMAL;
+	categories = LOG_ALL_CATEGORIES;
+	head = 0;
+	tail = 0;
+	dropped = 0;
+	batchUsed = 0;
+	stampSec = -1;
+	stamp[0] = '\0';
+	ring = (char*)malloc(LOG_RING_SIZE);
+	batch = (char*)malloc(LOG_BATCH_SIZE);
+	if( !ring || !batch ) {
+		fprintf(stderr, "Log: Cannot allocate the message ring\n");
+		abort();
+	}
+	running = true;
+	if( !writer.Start(WriterThread, this) ) {
+		// Still works, Flush writes from the calling thread
+		running = false;
+	}
+}
+
 Log::~Log()
 {
+	running = false;
+	writer.Join();
+	Drain();
 	// close the file stream if possible
 	if( logToFile ) {
-		dynamic_cast<std::ofstream*>(output)->close();
+		fclose(output);
 	}
+	free(ring);
+	free(batch);
 }
 
 qStr Log::GetTimestamp() const
 {
-	char stamp[256];
+	char buf[256];
+	FormatTimestamp(buf, sizeof(buf));
+	return qStr(buf);
+}
+
+void Log::FormatTimestamp(char * stamp, size_t size) const
+{
 	const char * fmt = "[%d-%d-%d %d:%d:%d] ";
 #ifdef _WIN32
 	SYSTEMTIME sysTime;
 	GetLocalTime(&sysTime);
-	sprintf(stamp, fmt, sysTime.wYear, sysTime.wMonth, sysTime.wDay, sysTime.wHour, sysTime.wMinute, sysTime.wSecond);
+	snprintf(stamp, size, fmt, sysTime.wYear, sysTime.wMonth, sysTime.wDay, sysTime.wHour, sysTime.wMinute, sysTime.wSecond);
 #else
 	time_t raw;
 	time(&raw);
-	struct tm * local = localtime( &raw );
-	
-	sprintf(stamp, fmt, local->tm_year + 1900, local->tm_mon + 1, local->tm_mday, local->tm_hour, local->tm_min, local->tm_sec);
-#endif
+	// localtime re-reads the time zone, allocating, on every call
+	struct tm local;
+	localtime_r( &raw, &local );
 
-	return qStr(stamp);
+	snprintf(stamp, size, fmt, local.tm_year + 1900, local.tm_mon + 1, local.tm_mday, local.tm_hour, local.tm_min, local.tm_sec);
+#endif
 }
 
-void Log::BeginLog(LOG_LEVEL l, const qStr msg)
+void Log::BeginLog(LOG_LEVEL l, const qStr& msg)
 {
-	qStr ts = GetTimestamp();
-	if( l >= level ) {
-		*output << ts.Ptr() << msg.Ptr() << std::endl;
+	if( !IsEnabled(l, LC_GENERAL) ) {
+		return;
 	}
+	// msg does not outlive the call, pass it as an argument
+	Printf(l, LC_GENERAL, "%s", msg.Ptr());
 }
 
 void Log::LogNormal(const char * fmt, ...)
 {
-	char buf[1024];
+	if( !IsEnabled(L_NORMAL, LC_GENERAL) ) {
+		return;
+	}
 	va_list ap;
 	va_start(ap, fmt);
-	int b = vsprintf(buf, fmt, ap);
+	Push(L_NORMAL, LC_GENERAL, fmt, ap);
 	va_end(ap);
-
-	// overflow? truncate
-	if( b == 1024 ) {
-		buf[1024 - 1] = 0;
-	}
-	BeginLog(L_NORMAL, qStr(buf)); 
 }
 
 void Log::LogWarning(const char * fmt, ...)
 {
-	char buf[1024];
+	if( !IsEnabled(L_WARNING, LC_GENERAL) ) {
+		return;
+	}
 	va_list ap;
 	va_start(ap, fmt);
-	int b = vsprintf(buf, fmt, ap);
+	Push(L_WARNING, LC_GENERAL, fmt, ap);
 	va_end(ap);
+}
 
-	// overflow? truncate
-	if( b == 1024 ) {
-		buf[1024 - 1] = 0;
+void Log::LogFatal(const char * fmt, ...)
+{
+	if( !IsEnabled(L_FATAL, LC_GENERAL) ) {
+		return;
 	}
-	BeginLog(L_WARNING, qStr(buf));
+	va_list ap;
+	va_start(ap, fmt);
+	Push(L_FATAL, LC_GENERAL, fmt, ap);
+	va_end(ap);
 }
 
-void Log::LogFatal(const char * fmt, ...)
+void Log::Printf(LOG_LEVEL l, int category, const char * fmt, ...)
 {
-	char buf[1024];
 	va_list ap;
 	va_start(ap, fmt);
-	int b = vsprintf(buf, fmt, ap);
+	Push(l, category, fmt, ap);
 	va_end(ap);
+}
+
+// Producer side, any thread
+void Log::Push(LOG_LEVEL l, int category, const char * fmt, va_list ap)
+{
+	char args[LOG_MAX_RECORD - LOG_HEADER_SIZE];
+	size_t argBytes = R_CaptureArgs(fmt, ap, args, sizeof(args));
+	size_t need = LOG_HEADER_SIZE + R_Align8(argBytes);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	// Reserve need bytes, plus the end of the ring if they
+	// don't fit there
+	unsigned long long h, start;
+	size_t pad;
+	for( ;; ) {
+		h = head;
+		size_t pos = (size_t)( h & ( LOG_RING_SIZE - 1 ) );
+		pad = ( pos + need > LOG_RING_SIZE ) ? LOG_RING_SIZE - pos : 0;
+		if( h + pad + need - tail > LOG_RING_SIZE ) {
+			if( l != L_FATAL ) {
+				__sync_fetch_and_add(&dropped, 1);
+				return;
+			}
+			// Never lose a fatal message
+			if( !running ) {
+				Drain();
+			}
+			usleep(100);
+			continue;
+		}
+		if( __sync_bool_compare_and_swap(&head, h, h + pad + need) ) {
+			break;
+		}
+	}
+
+	if( pad >= LOG_HEADER_SIZE ) {
+		log_record_t * filler = (log_record_t*)( ring + ( h & ( LOG_RING_SIZE - 1 ) ) );
+		filler->size = (unsigned int)pad;
+		filler->level = LOG_PAD;
+		__sync_synchronize();
+		filler->seq = h;
+	}
+	start = h + pad;
+
+	log_record_t * rec = (log_record_t*)( ring + ( start & ( LOG_RING_SIZE - 1 ) ) );
+	rec->size = (unsigned int)need;
+	rec->level = (unsigned short)l;
+	rec->category = (unsigned short)category;
+	rec->sec = now.tv_sec;
+	rec->nsec = now.tv_nsec;
+	rec->fmt = fmt;
+	rec->argBytes = (unsigned int)argBytes;
+	memcpy((char*)rec + LOG_HEADER_SIZE, args, argBytes);
+	__sync_synchronize();
+	rec->seq = start;
+
+	if( l == L_FATAL ) {
+		Flush();
+	}
+}
+
+void Log::Flush()
+{
+	unsigned long long target = head;
+	while( tail < target ) {
+		if( !running ) {
+			Drain();
+		} else {
+			usleep(100);
+		}
+	}
+}
 
-	// overflow? truncate
-	if( b == 1024 ) {
-		buf[1024 - 1] = 0;
+bool Log::Drain()
+{
+	writeLock.Lock();
+	unsigned long long t = tail;
+	bool any = false;
+	while( t != head ) {
+		size_t pos = (size_t)( t & ( LOG_RING_SIZE - 1 ) );
+		size_t rest = LOG_RING_SIZE - pos;
+		if( rest < LOG_HEADER_SIZE ) {
+			// Too short for a filler, skipped by agreement
+			t += rest;
+			continue;
+		}
+		const log_record_t * rec = (const log_record_t*)( ring + pos );
+		if( rec->seq != t ) {
+			// Reserved, not written yet
+			break;
+		}
+		__sync_synchronize();
+		if( rec->level != LOG_PAD ) {
+			if( batchUsed + LOG_MAX_RECORD + sizeof(stamp) + 2 > LOG_BATCH_SIZE ) {
+				fwrite(batch, 1, batchUsed, output);
+				batchUsed = 0;
+			}
+			// Dates only change once a second
+			if( rec->sec != stampSec ) {
+				time_t raw = (time_t)rec->sec;
+				struct tm local;
+				localtime_r(&raw, &local);
+				snprintf(stamp, sizeof(stamp), "[%d-%d-%d %d:%d:%d] ", local.tm_year + 1900, local.tm_mon + 1,
+					local.tm_mday, local.tm_hour, local.tm_min, local.tm_sec);
+				stampSec = rec->sec;
+			}
+			size_t len = strlen(stamp);
+			memcpy(batch + batchUsed, stamp, len);
+			batchUsed += len;
+			batchUsed += R_FormatArgs(rec->fmt, (const char*)rec + LOG_HEADER_SIZE, rec->argBytes,
+				batch + batchUsed, LOG_MAX_RECORD);
+			batch[batchUsed++] = '\n';
+		}
+		t += rec->size;
+		any = true;
+		// Give the space back as we go
+		__sync_synchronize();
+		tail = t;
+	}
+
+	if( batchUsed ) {
+		fwrite(batch, 1, batchUsed, output);
+		batchUsed = 0;
 	}
-	BeginLog(L_FATAL, qStr(buf));
+	int lost = dropped;
+	if( lost ) {
+		__sync_fetch_and_sub(&dropped, lost);
+		fprintf(output, "%s%d log messages dropped, ring full\n", stamp, lost);
+	}
+	if( any || lost ) {
+		fflush(output);
+	}
+	writeLock.Unlock();
+	return any;
+}
+
+void * Log::WriterThread(void * arg)
+{
+	Log * log = (Log*)arg;
+	while( log->running ) {
+		if( !log->Drain() ) {
+			usleep(LOG_IDLE_USEC);
+		}
+	}
+	return NULL;
 }
 
 void Log::Clear()
 {
 	if( logToFile ) {
-		output->seekp(std::ios::beg);
+		Flush();
+		writeLock.Lock();
+		if( ftruncate(fileno(output), 0) == 0 ) {
+			rewind(output);
+		}
+		writeLock.Unlock();
 		BeginLog(level, "Logging reset for file stream");
 	}
 }
-
-
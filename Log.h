@@ -1,21 +1,70 @@
 #ifndef _LOG_H
 #define _LOG_H
 
-#include <ostream>
-#include <iostream>
-// We don't use our File system because we want to
-// take advantage of same interface of both file and
-// console. 
-#include <fstream>
+#include <stdio.h>
+#include <stdarg.h>
 #include "String.h"
+#include "Thread.h"
 
 enum LOG_LEVEL { L_NORMAL, L_WARNING, L_FATAL };
+
+// Where a message comes from, each can be muted on its own
+enum LOG_CATEGORY {
+	LC_GENERAL,
+	LC_RESOURCE,	// loading and streaming
+	LC_RENDER,		// GL state and errors
+	LC_FRAME,		// per frame statistics
+	LC_PROFILE,
+	LC_NUM
+};
+
+#define LOG_CATEGORY_BIT(c)		(1u << (c))
+#define LOG_ALL_CATEGORIES		((1u << LC_NUM) - 1)
+
+// LOG_* macros below these are compiled out, arguments and all.
+// Build with e.g. -DLOG_COMPILE_LEVEL=L_WARNING for release.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL		L_NORMAL
+#endif
+#ifndef LOG_COMPILE_CATEGORIES
+#define LOG_COMPILE_CATEGORIES	LOG_ALL_CATEGORIES
+#endif
+
+// Bytes of pending messages, power of two
+#define LOG_RING_SIZE			(256 * 1024)
+// One message with its arguments, longer strings are cut
+#define LOG_MAX_RECORD			4096
+// Writer thread sleep when there is nothing to write
+#define LOG_IDLE_USEC			2000
+
+#define LOG_PRINTF(log, lev, cat, ...) \
+	do { \
+		if( (lev) >= LOG_COMPILE_LEVEL && ( LOG_COMPILE_CATEGORIES & LOG_CATEGORY_BIT(cat) ) \
+			&& (log)->IsEnabled(lev, cat) ) { \
+			(log)->Printf(lev, cat, __VA_ARGS__); \
+		} \
+	} while( 0 )
+#define LOG_NORMAL(log, cat, ...)	LOG_PRINTF(log, L_NORMAL, cat, __VA_ARGS__)
+#define LOG_WARNING(log, cat, ...)	LOG_PRINTF(log, L_WARNING, cat, __VA_ARGS__)
+#define LOG_FATAL(log, cat, ...)	LOG_PRINTF(log, L_FATAL, cat, __VA_ARGS__)
+
 /*
 ================================================
 
 Class definition for logging. User can choose to
 output logging information to the screen or file
 
+The calling thread does not format or write. It
+takes the time, copies the format pointer and the
+arguments into a lock free ring and returns. A
+writer thread formats the messages, adds the
+timestamp and writes them out in batches.
+
+The format has to outlive the program run, use
+string literals. %s arguments are copied. When
+the ring is full messages are dropped and counted,
+except fatal ones, which wait and are flushed.
+
 ================================================
 */
 class Log
@@ -28,21 +77,57 @@ public:
 public:
 	void 			SetLevel(LOG_LEVEL lev) { level = lev; }
 	LOG_LEVEL		GetLevel() const { return level; }
+	// Bits from LOG_CATEGORY_BIT
+	void			SetCategories(unsigned int mask) { categories = mask; }
+	unsigned int	GetCategories() const { return categories; }
+	bool			IsEnabled(LOG_LEVEL l, int category) const { return l >= level && ( categories & LOG_CATEGORY_BIT(category) ); }
 
-	void 			BeginLog(LOG_LEVEL l, const qStr msg);
+	void 			BeginLog(LOG_LEVEL l, const qStr& msg);
 	void 			LogNormal(const char * fmt, ...);
 	void 			LogWarning(const char * fmt, ...);
 	void 			LogFatal(const char * fmt, ...);
+	// Use through LOG_PRINTF, does not check the filters
+	void			Printf(LOG_LEVEL l, int category, const char * fmt, ...);
+
+	// Wait until everything logged so far is written
+	void			Flush();
+	// Messages lost to a full ring
+	int				GetDropped() const { return dropped; }
 
 	// Only viable for file log
 	// Reset the log content
 	void			Clear();
 	qStr			GetTimestamp() const;
 
+private:
+	void			Init(FILE * out, bool toFile);
+	void			FormatTimestamp(char * stamp, size_t size) const;
+	void			Push(LOG_LEVEL l, int category, const char * fmt, va_list ap);
+	static void *	WriterThread(void * arg);
+	// Writes out what is in the ring, returns false if it was empty
+	bool			Drain();
+
 private:
 	bool 			logToFile;
-	std::ostream * 	output;
+	FILE *			output;
 	LOG_LEVEL		level;
+	unsigned int	categories;
+
+	char *			ring;
+	// Absolute byte offsets, masked when indexing ring
+	volatile unsigned long long	head;		// reserved by producers
+	volatile unsigned long long	tail;		// written out by the writer
+	volatile int	dropped;
+	volatile bool	running;
+	Thread			writer;
+	// Held while writing so Clear can truncate
+	Mutex			writeLock;
+
+	// Writer side, text waiting for one fwrite
+	char *			batch;
+	size_t			batchUsed;
+	long long		stampSec;
+	char			stamp[64];
 
 private:
 	// Disable copy and assign constructor
@@ -50,4 +135,4 @@ private:
 	Log(const Log&) {}
 };
 
-#endif /* !_LOG_H */
\ No newline at end of file
+#endif /* !_LOG_H */
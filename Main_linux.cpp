@@ -8,15 +8,36 @@
 #include "InputEvent.h"
 #include "Log.h"
 #include "Timer.h"
+#include "Thread.h"
+#include "Profiler.h"
+#include "Benchmark.h"
+#include "AllocTracker.h"
+#include <algorithm>
 
 #define SCREEN_WIDTH 320
 #define SCREEN_HEIGHT 480
+#define BENCH_WARMUP_RUNS	1
+#define BENCH_RUNS			5
+// Camera path seconds per benchmark frame
+#define BENCH_CAMERA_STEP	(1.0f / 60.0f)
+#define DEFAULT_FPS			60
+
+// How the main loop waits between frames
+enum pacing_t {
+	PACING_UNCAPPED,	// as fast as it goes
+	PACING_VSYNC,		// swap waits for the display
+	PACING_SLEEP		// sleep to a fixed frame rate
+};
 
 qEngine * engine;
 Common commonInstance;
 Common * common = &commonInstance;
 Timer timer_obj;
 Timer * timer = &timer_obj;
+JobSystem jobs_obj;
+JobSystem * jobs = &jobs_obj;
+Profiler profiler_obj;
+Profiler * profiler = &profiler_obj;
 
 
 static void ReadInput(void)
@@ -44,10 +65,145 @@ static void ReadInput(void)
 	}
 }
 
+/*
+================================================
+
+Play the camera path warmup + runs times without
+frame pacing, then write the report. Returns the
+process exit code.
 
-int main(void)
+================================================
+*/
+static int RunBenchmark(const char * map, const char * cpName, int warmup, int runs, const char * reportPath)
+{
+	engine->LoadMap(map);
+	int cp = engine->LoadCameraPath(cpName);
+	if( cp < 0 ) {
+		fprintf(stderr, "Cannot load camera path %s\n", cpName);
+		return 1;
+	}
+	engine->SetCurrentCameraPath(cp);
+	CameraPath * path = engine->GetCurrentCameraPath();
+	// Per frame logging and screenshots would be measured too
+	engine->GetLogger()->SetLevel(L_WARNING);
+	engine->SetSnapshotFrame(-1);
+	// Same frames on every run, whatever the frame times
+	engine->SetCameraStep(BENCH_CAMERA_STEP);
+
+	Benchmark bench;
+	for( int run = 0; run < warmup + runs && engine->IsOn(); ++run ) {
+		path->Rewind();
+		bench.BeginRun(run >= warmup);
+		while( path->IsPlaying() && engine->IsOn() ) {
+			profiler->BeginFrame();
+			bench.BeginFrame();
+			ReadInput();
+			engine->UpdateWorld();
+			engine->RenderFrame();
+			{
+				PROFILE_SCOPE("SwapBuffers");
+				SDL_GL_SwapBuffers();
+			}
+			bench.EndFrame(engine->GetFrameStats());
+			profiler->EndFrame();
+			engine->EndFrame();
+		}
+		bench.EndRun();
+	}
+
+	if( bench.NumRuns() < runs ) {
+		fprintf(stderr, "Benchmark interrupted after %d of %d runs\n", bench.NumRuns(), runs);
+		return 1;
+	}
+	if( !bench.WriteReport(reportPath, map, cpName, warmup) ) {
+		fprintf(stderr, "Cannot write benchmark report %s\n", reportPath);
+		return 1;
+	}
+	printf("Benchmark report written to %s\n", reportPath);
+	return 0;
+}
+
+int main(int argc, char ** argv)
 {
 	SDL_Surface * screen;
+	bool compactVertex = false;
+	bool lod = true;
+	bool occlusion = true;
+	bool portals = true;
+	bool hotReload = false;
+	bool cook = false;
+	image_format_t cookFormat = IMAGE_FORMAT_ETC1;
+	const char * tracePath = NULL;
+	bool debugDraw = false;
+	bool trackAllocs = false;
+	const char * benchMap = NULL;
+	const char * cookMap = NULL;
+	bool cookPvs = false;
+	const char * benchCp = NULL;
+	const char * benchReport = "benchmark.json";
+	int benchWarmup = BENCH_WARMUP_RUNS;
+	int benchRuns = BENCH_RUNS;
+	pacing_t pacing = PACING_SLEEP;
+	int fps = DEFAULT_FPS;
+
+	for( int i = 1; i < argc; ++i ) {
+		if( !strcmp(argv[i], "--compact-vertex") ) {
+			compactVertex = true;
+		} else if( !strcmp(argv[i], "--no-lod") ) {
+			lod = false;
+		} else if( !strcmp(argv[i], "--no-occlusion") ) {
+			occlusion = false;
+		} else if( !strcmp(argv[i], "--no-portals") ) {
+			portals = false;
+		} else if( !strcmp(argv[i], "--hot-reload") ) {
+			hotReload = true;
+		} else if( !strcmp(argv[i], "--debug-draw") ) {
+			debugDraw = true;
+		} else if( !strcmp(argv[i], "--track-allocs") ) {
+			trackAllocs = true;
+		} else if( !strcmp(argv[i], "--profile") && i + 1 < argc ) {
+			// Chrome trace of the whole run
+			tracePath = argv[++i];
+		} else if( !strcmp(argv[i], "--benchmark") && i + 2 < argc ) {
+			benchMap = argv[++i];
+			benchCp = argv[++i];
+		} else if( !strcmp(argv[i], "--bench-runs") && i + 1 < argc ) {
+			benchRuns = std::max(atoi(argv[++i]), 1);
+		} else if( !strcmp(argv[i], "--bench-warmup") && i + 1 < argc ) {
+			benchWarmup = std::max(atoi(argv[++i]), 0);
+		} else if( !strcmp(argv[i], "--bench-out") && i + 1 < argc ) {
+			benchReport = argv[++i];
+		} else if( !strcmp(argv[i], "--pacing") && i + 1 < argc ) {
+			++i;
+			if( !strcmp(argv[i], "uncapped") ) {
+				pacing = PACING_UNCAPPED;
+			} else if( !strcmp(argv[i], "vsync") ) {
+				pacing = PACING_VSYNC;
+			} else if( !strcmp(argv[i], "sleep") ) {
+				pacing = PACING_SLEEP;
+			} else {
+				fprintf(stderr, "Unknown pacing %s, use uncapped, vsync or sleep\n", argv[i]);
+			}
+		} else if( !strcmp(argv[i], "--fps") && i + 1 < argc ) {
+			fps = std::max(atoi(argv[++i]), 1);
+		} else if( !strcmp(argv[i], "--cook-map") && i + 1 < argc ) {
+			cookMap = argv[++i];
+		} else if( !strcmp(argv[i], "--pvs") ) {
+			// With --cook-map
+			cookPvs = true;
+		} else if( !strcmp(argv[i], "--cook-textures") ) {
+			// Optional target format, etc1 for GLES devices
+			cook = true;
+			if( i + 1 < argc && !strcmp(argv[i + 1], "bc1") ) {
+				cookFormat = IMAGE_FORMAT_BC1;
+				i++;
+			} else if( i + 1 < argc && !strcmp(argv[i + 1], "etc1") ) {
+				i++;
+			}
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+		}
+	}
 
 	if( SDL_Init(SDL_INIT_EVERYTHING) != 0 ) {
         fprintf(stderr, "Unable to init SDL: %s\n", SDL_GetError());
@@ -60,33 +216,106 @@ int main(void)
 	SDL_ShowCursor(SDL_ENABLE);
 
 	SDL_GL_SetAttribute(SDL_GL_DOUBLEBUFFER, 1);
+	// Benchmark is uncapped, vsync would hide everything under 16ms
+	SDL_GL_SetAttribute(SDL_GL_SWAP_CONTROL, !benchMap && pacing == PACING_VSYNC ? 1 : 0);
 
 	const SDL_VideoInfo * info = SDL_GetVideoInfo();
 	screen = SDL_SetVideoMode(SCREEN_WIDTH, SCREEN_HEIGHT, info->vfmt->BitsPerPixel, SDL_OPENGL);
     
+	Profiler::SetThreadName("main");
+	if( tracePath ) {
+		// Before loading, so it shows up in the trace
+		profiler->StartCapture(tracePath);
+	}
+	// Workers are needed as soon as resources start loading
+	jobs->Init(0);
+
 	qEngine engineInstance(SCREEN_WIDTH, SCREEN_HEIGHT);
 	engine = &engineInstance;
+	profiler->SetLogger(engine->GetLogger());
+	engine->InitGpuTimer((gl_proc_loader_t)SDL_GL_GetProcAddress);
+	engine->SetDebugDraw(debugDraw);
+	if( cook || cookMap ) {
+		// Cooked files are picked up on the next run
+		bool ok = true;
+		if( cook ) {
+			engine->CookTextures(cookFormat);
+		}
+		if( cookMap ) {
+			ok = engine->CookMap(cookMap, cookPvs);
+		}
+		jobs->Shutdown();
+		SDL_Quit();
+		return ok ? 0 : 1;
+	}
+	if( compactVertex ) {
+		engine->SetCompactVertex(true);
+	}
+	engine->SetLodEnabled(lod);
+	engine->SetOcclusionEnabled(occlusion);
+	engine->SetPortalsEnabled(portals);
+	if( trackAllocs ) {
+		if( AllocTracker::IsCompiledIn() ) {
+			// Loading allocates plenty, frames are what matter
+			AllocTracker::Enable(true);
+		} else {
+			fprintf(stderr, "--track-allocs needs a build with QENGINE_TRACK_ALLOCS\n");
+		}
+	}
+	if( benchMap ) {
+		int ret = RunBenchmark(benchMap, benchCp, benchWarmup, benchRuns, benchReport);
+		profiler->StopCapture();
+		profiler->SetLogger(NULL);
+		jobs->Shutdown();
+		SDL_Quit();
+		return ret;
+	}
 	engine->LoadMap("act1.map");
     engine->SetCurrentCameraPath(0);
+	// Not for benchmarks, they measure the same content every run
+	if( hotReload ) {
+		engine->SetHotReload(true);
+	}
 
-    int prev_time, now_time, time_for_frame, sleep_time;
-    prev_time = SDL_GetTicks();
+	// Simulation runs in fixed steps, frames draw between them
+	long long framePeriod = 1000000000LL / fps;
+	long long nextFrame = Timer::GetSysNanoseconds();
+	timer->Reset();
 
 	while( engine->IsOn() ) {
+		profiler->BeginFrame();
+		timer->Tick();
 		ReadInput();
-		engine->UpdateWorld();
-		engine->RenderFrame();
+		while( timer->StepSimulation() ) {
+			engine->UpdateWorld();
+		}
+		engine->RenderFrame(timer->GetAlpha());
 
-		SDL_GL_SwapBuffers();
+		{
+			PROFILE_SCOPE("SwapBuffers");
+			SDL_GL_SwapBuffers();
+		}
 
-        now_time = SDL_GetTicks();
-        time_for_frame = now_time - prev_time;
-        prev_time = now_time;
-        sleep_time = 16.7 - time_for_frame;
-        if( sleep_time > 0 )
-            SDL_Delay(sleep_time);
+		if( pacing == PACING_SLEEP ) {
+			PROFILE_SCOPE("Sleep");
+			// Absolute deadlines, so oversleeping one frame
+			// doesn't push back every frame after it
+			nextFrame += framePeriod;
+			long long now = Timer::GetSysNanoseconds();
+			if( nextFrame < now ) {
+				// Too far behind to catch up, start over
+				nextFrame = now;
+			} else {
+				Timer::SleepUntil(nextFrame);
+			}
+		}
+		profiler->EndFrame();
+		engine->EndFrame();
 	}
 
+	profiler->StopCapture();
+	profiler->SetLogger(NULL);
+	jobs->Shutdown();
 	SDL_Quit();
 
 	return 0;
@@ -236,6 +236,39 @@ inline Vec4 Vec3::ToV4() const
     return ret;
 }
 
+// Octahedral mapping of a unit vector into two snorm8 values.
+// Sphere is projected onto octahedron and the lower half folded
+// over the upper one, so the full sphere fits in a square.
+inline void OctEncode(const Vec3& n, signed char out[2])
+{
+	float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+	float x = n[0] / l1;
+	float y = n[1] / l1;
+	if( n[2] < 0 ) {
+		float fx = (1.0f - std::abs(y)) * (x >= 0 ? 1.0f : -1.0f);
+		float fy = (1.0f - std::abs(x)) * (y >= 0 ? 1.0f : -1.0f);
+		x = fx;
+		y = fy;
+	}
+	out[0] = (signed char)floorf(x * 127.0f + 0.5f);
+	out[1] = (signed char)floorf(y * 127.0f + 0.5f);
+}
+
+inline Vec3 OctDecode(const signed char in[2])
+{
+	float x = in[0] / 127.0f;
+	float y = in[1] / 127.0f;
+	float z = 1.0f - std::abs(x) - std::abs(y);
+	if( z < 0 ) {
+		float fx = (1.0f - std::abs(y)) * (x >= 0 ? 1.0f : -1.0f);
+		float fy = (1.0f - std::abs(x)) * (y >= 0 ? 1.0f : -1.0f);
+		x = fx;
+		y = fy;
+	}
+	Vec3 n(x, y, z);
+	return n.Normalize();
+}
+
 /*
 ================================================
 
@@ -453,6 +486,9 @@ public:
 	// Right multiply a column
 	Vec4	Mul(const Vec4) const;
 	Vec4	Mul(const Vec3) const;
+	// Inverse of a rotation, scale and translation, the last
+	// row has to be 0 0 0 1
+	Mat4	AffineInverse() const;
 	const float * GetRawPtr() const;
 };
 
@@ -580,6 +616,32 @@ inline Vec4 Mat4::Mul(const Vec3 v) const
 	return Mul(w);
 }
 
+inline Mat4 Mat4::AffineInverse() const
+{
+	// Rows of the inverse of the 3x3 part are cross products
+	// of its columns over the determinant
+	Vec3 c0(mat[0][0], mat[0][1], mat[0][2]);
+	Vec3 c1(mat[1][0], mat[1][1], mat[1][2]);
+	Vec3 c2(mat[2][0], mat[2][1], mat[2][2]);
+	Vec3 r[3] = { c1.CrossProduct(c2), c2.CrossProduct(c0), c0.CrossProduct(c1) };
+	float det = c0.DotProduct(r[0]);
+	if( std::abs(det) <= MI_EPSILON ) {
+		return *this;	// Singular, same as Mat3::Inverse
+	}
+	float detInv = 1.0f / det;
+	Vec3 t(mat[3][0], mat[3][1], mat[3][2]);
+	Mat4 inverse;
+	for( int i = 0; i < 3; ++i ) {
+		for( int j = 0; j < 3; ++j ) {
+			inverse[j][i] = r[i][j] * detInv;
+		}
+		inverse[3][i] = -r[i].DotProduct(t) * detInv;
+		inverse[i][3] = 0.0f;
+	}
+	inverse[3][3] = 1.0f;
+	return inverse;
+}
+
 inline Mat4 Mat4::LeftMul(const Mat4& m) const {
 	Vec4 col1 = m.Mul(mat[0]);
 	Vec4 col2 = m.Mul(mat[1]);
@@ -1,13 +1,35 @@
 #include "Mesh.h"
+#include "MeshOpt.h"
+#include "TangentSpace.h"
+#include "MeshSimplify.h"
+#include "Profiler.h"
 #include <algorithm>
 #include <assert.h>
+#include <stddef.h>	// offsetof
+#include <cfloat>
 
 extern Common * common;
 
-Mesh::Mesh(const qStr sPath) : vertexArray(NULL), indexArray(NULL), isBind(false) 
+// Compressed formats come from extensions, not every glext.h has them
+#ifndef GL_ETC1_RGB8_OES
+#define GL_ETC1_RGB8_OES					0x8D64
+#endif
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT		0x83F0
+#endif
+
+Mesh::Mesh(const qStr& sPath) : vertexArray(NULL), indexArray(NULL), vboId(0), iboId(0), isBind(false), nIndex(0), nVert(0), tangentSpace(NULL), acmrBefore(0), acmrAfter(0), numLods(0), numIndexTotal(0), boundRadius(0) 
 {
 	meshFileName = sPath;
 	name = sPath.GetFileName();
+	nameAtom = qAtom(name);
+
+	vertexFormat = VERTEX_FORMAT_FLOAT;
+	dequantMat.Ident();
+	// vertex_t stores texture coordinates scaled by 32767
+	texMat.Ident();
+	texMat[0][0] = 1.0f / 32767;
+	texMat[1][1] = 1.0f / 32767;
 }
 
 Mesh::~Mesh()
@@ -16,11 +38,17 @@ Mesh::~Mesh()
 		free(vertexArray);
 	if( indexArray )
 		free(indexArray);
+	delete tangentSpace;
+	if( isBind ) {
+		glDeleteBuffers(1, &vboId);
+		glDeleteBuffers(1, &iboId);
+	}
 }
 
 // checkout md5 format spec http://tfc.duke.free.fr/coding/md5-specs-en.html
 bool Mesh::LoadMD5()
 {
+	PROFILE_SCOPE("LoadMD5");
 	if( meshFileName.Empty() ) {
 		printf("Model name doesn't exist or is empty");
 		return false;
@@ -91,6 +119,7 @@ void Mesh::ReadMesh(LexerFile *lex)
 	lex->ReadToken();
 	textureFileName = lex->TokenValue();
 	textureFileName.RemoveQuotes();
+	texAtom = qAtom(textureFileName);
 
 	// numverts
 	lex->ReadToken();
@@ -226,35 +255,329 @@ void Mesh::MingleData(std::vector<float>& vVert, std::vector<float>& vText, std:
 
 	std::copy(vTris.begin(), vTris.end(), indexArray);
 
-	CalcNormal(vertexArray, indexArray, nVert, nIndex);	// Calculate the normal per vertex
+	// Optimize reorders vertices, so topology is analysed after it
+	Optimize();
+	CalcBoundSphere();
+	GenerateLods();
+	BuildBvh();
+
+	tangentSpace = new TangentSpace();
+	tangentSpace->Build(indexArray, nIndex, nVert);
+	CalcNormals(true);
 }
 
-void Mesh::UploadGPU()
+// Triangle order in md5 is whatever the exporter wrote. Fix it
+// up once at load time so every draw benefits.
+void Mesh::Optimize()
 {
-	if (isBind) {
+	PROFILE_SCOPE("OptimizeMesh");
+	acmrBefore = R_CalcACMR(indexArray, nIndex, nVert, MESHOPT_CACHE_SIZE);
+
+	R_OptimizeVertexCache(indexArray, nIndex, nVert);
+	R_OptimizeOverdraw(indexArray, nIndex, vertexArray, nVert, MESHOPT_OVERDRAW_SLACK);
+	R_OptimizeVertexFetch(vertexArray, indexArray, nIndex, nVert);
+
+	acmrAfter = R_CalcACMR(indexArray, nIndex, nVert, MESHOPT_CACHE_SIZE);
+}
+
+void Mesh::CalcBoundSphere()
+{
+	Vec3 vmin(FLT_MAX), vmax(-FLT_MAX);
+	for( int i = 0; i < nVert; ++i ) {
+		for( int j = 0; j < 3; ++j ) {
+			vmin[j] = std::min(vmin[j], vertexArray[i].pos[j]);
+			vmax[j] = std::max(vmax[j], vertexArray[i].pos[j]);
+		}
+	}
+	boundMins = vmin;
+	boundMaxs = vmax;
+	boundCenter = (vmin + vmax).Scale(0.5f);
+	float r2 = 0.0f;
+	for( int i = 0; i < nVert; ++i ) {
+		Vec3 d = vertexArray[i].pos - boundCenter;
+		r2 = std::max(r2, d.DotProduct(d));
+	}
+	boundRadius = sqrtf(r2);
+}
+
+// Full detail triangles only, ray casts don't use the LODs
+void Mesh::BuildBvh()
+{
+	PROFILE_SCOPE("BuildMeshBvh");
+	const mesh_lod_t& lod = lods[0];
+	std::vector<Vec3> corners(lod.numIndex);
+	for( int i = 0; i < lod.numIndex; ++i ) {
+		corners[i] = vertexArray[indexArray[lod.firstIndex + i]].pos;
+	}
+	bvh.Build(corners.empty() ? NULL : &corners[0], lod.numIndex / 3);
+}
+
+// Each level halves the triangle count of the previous one,
+// simplified from it so collapses stay consistent between
+// levels. Coarser levels are appended to indexArray.
+void Mesh::GenerateLods()
+{
+	PROFILE_SCOPE("GenerateLods");
+	lods[0].firstIndex = 0;
+	lods[0].numIndex = nIndex;
+	lods[0].error = 0.0f;
+	numLods = 1;
+	numIndexTotal = nIndex;
+
+	unsigned short * all = (unsigned short*)malloc(nIndex * MAX_MESH_LOD * sizeof(unsigned short));
+	if( !all ) {
+		common->FatalError("Cannot allocate more memory");
+	}
+	memcpy(all, indexArray, nIndex * sizeof(unsigned short));
+
+	for( int level = 1; level < MAX_MESH_LOD; ++level ) {
+		const mesh_lod_t& prev = lods[level - 1];
+		unsigned short * dst = all + numIndexTotal;
+		int target = (prev.numIndex / 2) / 3 * 3;
+		float error;
+		int count = R_SimplifyMesh(vertexArray, nVert, all + prev.firstIndex, prev.numIndex,
+									target, MESH_LOD_MAX_ERROR, dst, &error);
+		// Not worth a level of its own
+		if( count == 0 || count > prev.numIndex * 4 / 5 ) {
+			break;
+		}
+		R_OptimizeVertexCache(dst, count, nVert);
+
+		mesh_lod_t& lod = lods[numLods++];
+		lod.firstIndex = numIndexTotal;
+		lod.numIndex = count;
+		lod.error = std::max(error, prev.error);
+		numIndexTotal += count;
+	}
+
+	free(indexArray);
+	indexArray = (unsigned short*)realloc(all, numIndexTotal * sizeof(unsigned short));
+}
+
+void Mesh::SetVertexFormat(vertex_format_t fmt)
+{
+	if( isBind ) {
+		fprintf(stderr, "Mesh %s is already uploaded, vertex format unchanged\n", name.Ptr());
 		return;
 	}
+	vertexFormat = fmt;
+}
+
+static short R_Quantize(float v, float center, float halfExtent)
+{
+	float q = (v - center) / halfExtent * 32767.0f;
+	q = floorf(q + 0.5f);
+	if( q > 32767.0f ) q = 32767.0f;
+	if( q < -32767.0f ) q = -32767.0f;
+	return (short)q;
+}
+
+static signed char R_ToSnorm8(float v)
+{
+	float q = floorf(v * 127.0f + 0.5f);
+	if( q > 127.0f ) q = 127.0f;
+	if( q < -127.0f ) q = -127.0f;
+	return (signed char)q;
+}
+
+// Build the compact stream and the matrices expanding it back.
+// Position uses one scale for all axes, so normals survive the
+// dequantization transform with just a rescale.
+vertex_compact_t * Mesh::PackCompact()
+{
+	Vec3 vmin(FLT_MAX), vmax(-FLT_MAX);
+	float smin[2] = { FLT_MAX, FLT_MAX }, smax[2] = { -FLT_MAX, -FLT_MAX };
+	for( int i = 0; i < nVert; ++i ) {
+		const vertex_t& v = vertexArray[i];
+		for( int j = 0; j < 3; ++j ) {
+			vmin[j] = std::min(vmin[j], v.pos[j]);
+			vmax[j] = std::max(vmax[j], v.pos[j]);
+		}
+		for( int j = 0; j < 2; ++j ) {
+			smin[j] = std::min(smin[j], (float)v.st[j]);
+			smax[j] = std::max(smax[j], (float)v.st[j]);
+		}
+	}
+
+	Vec3 center = (vmin + vmax).Scale(0.5f);
+	float half = 0.0f;
+	for( int j = 0; j < 3; ++j ) {
+		half = std::max(half, (vmax[j] - vmin[j]) * 0.5f);
+	}
+	if( half <= 0.0f ) {
+		half = 1.0f;
+	}
+	float stCenter[2], stHalf[2];
+	for( int j = 0; j < 2; ++j ) {
+		stCenter[j] = (smin[j] + smax[j]) * 0.5f;
+		stHalf[j] = std::max((smax[j] - smin[j]) * 0.5f, 1.0f);
+	}
+
+	Vec4 * tangents = (Vec4*)malloc(nVert * sizeof(Vec4));
+	CalcTangents(tangents);
+
+	vertex_compact_t * packed = (vertex_compact_t*)malloc(nVert * sizeof(vertex_compact_t));
+	if( !packed || !tangents ) {
+		common->FatalError("Cannot allocate more memory");
+	}
+	for( int i = 0; i < nVert; ++i ) {
+		const vertex_t& v = vertexArray[i];
+		vertex_compact_t& c = packed[i];
+		for( int j = 0; j < 3; ++j ) {
+			c.pos[j] = R_Quantize(v.pos[j], center[j], half);
+			c.normal[j] = R_ToSnorm8(v.normal[j]);
+		}
+		for( int j = 0; j < 2; ++j ) {
+			c.st[j] = R_Quantize(v.st[j], stCenter[j], stHalf[j]);
+		}
+		Vec3 t(tangents[i][0], tangents[i][1], tangents[i][2]);
+		OctEncode(t, c.tangent);
+		c.tangentSign = tangents[i][3] < 0 ? -127 : 127;
+	}
+	free(tangents);
+
+	float s = half / 32767.0f;
+	dequantMat.Ident();
+	dequantMat[0][0] = dequantMat[1][1] = dequantMat[2][2] = s;
+	dequantMat[3][0] = center[0];
+	dequantMat[3][1] = center[1];
+	dequantMat[3][2] = center[2];
+
+	// st was stored scaled by 32767, fold that in as well
+	texMat.Ident();
+	for( int j = 0; j < 2; ++j ) {
+		texMat[j][j] = stHalf[j] / 32767.0f / 32767.0f;
+		texMat[3][j] = stCenter[j] / 32767.0f;
+	}
+
+	return packed;
+}
+
+// Vertices and indices both live in buffer objects, so
+// glDrawElements never has to pull indices out of client
+// memory on every draw.
+unsigned int Mesh::UploadGPU()
+{
+	if (isBind) {
+		return 0;
+	}
+
+	const GLvoid * vertData = (const GLvoid*)vertexArray;
+	vertex_compact_t * packed = NULL;
+	if( vertexFormat == VERTEX_FORMAT_COMPACT ) {
+		packed = PackCompact();
+		vertData = (const GLvoid*)packed;
+	}
 
-	glGenBuffers(1, &vboId);
+	// Names are kept when the data is replaced
+	if( !vboId ) {
+		glGenBuffers(1, &vboId);
+	}
 	glBindBuffer(GL_ARRAY_BUFFER, vboId);
-	glBufferData(GL_ARRAY_BUFFER, nVert * sizeof(vertex_t), (const GLvoid*)vertexArray, GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, nVert * GetVertexStride(), vertData, GL_STATIC_DRAW);
+	if( packed ) {
+		free(packed);
+	}
+
+	if( !iboId ) {
+		glGenBuffers(1, &iboId);
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, iboId);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, numIndexTotal * sizeof(unsigned short), (const GLvoid*)indexArray, GL_STATIC_DRAW);
 
 	GLenum err = glGetError();
 	if (err != GL_NO_ERROR) {
 		fprintf(stderr, "glBufferData() failed. %d\n", err);
-		return;
+		glDeleteBuffers(1, &vboId);
+		glDeleteBuffers(1, &iboId);
+		vboId = iboId = 0;
+		return 0;
 	}
 	isBind = true;
+	return GetGPUSize();
 }
 
-void Mesh::UnBind()
+unsigned int Mesh::ReleaseGPU()
+{
+	if( !isBind ) {
+		return 0;
+	}
+	glDeleteBuffers(1, &vboId);
+	glDeleteBuffers(1, &iboId);
+	vboId = iboId = 0;
+	isBind = false;
+	return GetGPUSize();
+}
+
+void Mesh::TakeData(Mesh& from)
+{
+	std::swap(textureFileName, from.textureFileName);
+	std::swap(texAtom, from.texAtom);
+	std::swap(vertexArray, from.vertexArray);
+	std::swap(indexArray, from.indexArray);
+	std::swap(nIndex, from.nIndex);
+	std::swap(nVert, from.nVert);
+	std::swap(tangentSpace, from.tangentSpace);
+	std::swap(acmrBefore, from.acmrBefore);
+	std::swap(acmrAfter, from.acmrAfter);
+	for( int i = 0; i < MAX_MESH_LOD; ++i ) {
+		std::swap(lods[i], from.lods[i]);
+	}
+	std::swap(numLods, from.numLods);
+	std::swap(numIndexTotal, from.numIndexTotal);
+	std::swap(boundCenter, from.boundCenter);
+	std::swap(boundRadius, from.boundRadius);
+	std::swap(boundMins, from.boundMins);
+	std::swap(boundMaxs, from.boundMaxs);
+	std::swap(bvh, from.bvh);
+	// Not drawable until UpdateGPU, which keeps the buffer names.
+	// Lets the atlas remap the new texture coordinates first.
+	isBind = false;
+}
+
+// glBufferData on the old names, anything bound to them
+// draws the new mesh from here on
+unsigned int Mesh::UpdateGPU()
+{
+	if( !vboId ) {
+		return 0;
+	}
+	return UploadGPU();
+}
+
+// Vertex array state only depends on the mesh, so engine
+// calls this once for a run of entities sharing the mesh
+void Mesh::Bind()
 {
 	if( !isBind ) {
 		return;
 	}
 
+	glBindBuffer(GL_ARRAY_BUFFER, vboId);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, iboId);
+
+	if( vertexFormat == VERTEX_FORMAT_COMPACT ) {
+		glVertexPointer(3, GL_SHORT, sizeof(vertex_compact_t), (const GLvoid*)offsetof(vertex_compact_t, pos));
+		glTexCoordPointer(2, GL_SHORT, sizeof(vertex_compact_t), (const GLvoid*)offsetof(vertex_compact_t, st));
+		glNormalPointer(     GL_BYTE, sizeof(vertex_compact_t), (const GLvoid*)offsetof(vertex_compact_t, normal));
+	} else {
+		glVertexPointer(3, GL_FLOAT, sizeof(vertex_t), (const GLvoid*)offsetof(vertex_t, pos));
+		glTexCoordPointer(2, GL_SHORT, sizeof(vertex_t), (const GLvoid*)offsetof(vertex_t, st));
+		glNormalPointer(     GL_FLOAT, sizeof(vertex_t), (const GLvoid*)offsetof(vertex_t, normal));
+	}
+
+	// Texture coordinate expansion is per mesh
+	glMatrixMode(GL_TEXTURE);
+	glLoadMatrixf(texMat.GetRawPtr());
+	glMatrixMode(GL_MODELVIEW);
+}
+
+// Release buffer bindings so client arrays can be used for
+// debug geometry. Buffers stay resident on GPU.
+void Mesh::UnBind()
+{
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	isBind = false;
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 
@@ -271,36 +594,42 @@ qArr<edge_t> Mesh::GenEdgeList()
     return edges;
 }
 
-void Mesh::CalcNormal(vertex_t * varr, const unsigned short * iarr, const int vsize, const int isize)
+void Mesh::CalcNormals(bool angleWeighted)
 {
-	short iV1, iV2, iV3;
-	for( int i = 0; i < vsize; ++i ) {
-		vertex_t * pv = varr + i;
-		pv->normal.Zero();
+	if( !tangentSpace ) {
+		return;
 	}
+	tangentSpace->CalcNormals(vertexArray, angleWeighted ? NORMAL_WEIGHT_ANGLE : NORMAL_WEIGHT_AREA);
+}
 
-	for( int i = 0; i < isize; i += 3) {
-		iV1 = *iarr++;
-		iV2 = *iarr++;
-		iV3 = *iarr++;
-
-		vertex_t * pV1 = varr + iV1;
-		vertex_t * pV2 = varr + iV2;
-		vertex_t * pV3 = varr + iV3;
-
-		Vec3 n = (pV2->pos - pV1->pos).CrossProduct(pV3->pos - pV1->pos);
-		n = n.Normalize();
-
-		pV1->normal = pV1->normal + n;
-		pV2->normal = pV2->normal + n;
-		pV3->normal = pV3->normal + n;
+bool Mesh::HasUnitTexCoords() const
+{
+	// st is unsigned, only the upper end can be out
+	for( int i = 0; i < nVert; ++i ) {
+		if( vertexArray[i].st[0] > 32767 || vertexArray[i].st[1] > 32767 ) {
+			return false;
+		}
+	}
+	return true;
+}
 
+void Mesh::RemapTexCoords(const float scale[2], const float offset[2])
+{
+	assert( !isBind );
+	for( int i = 0; i < nVert; ++i ) {
+		for( int j = 0; j < 2; ++j ) {
+			float st = vertexArray[i].st[j] * scale[j] + offset[j] * 32767.0f;
+			vertexArray[i].st[j] = (unsigned short)std::min(st + 0.5f, 32767.0f);
+		}
 	}
+}
 
-	for( int i = 0; i < vsize; ++i ) {
-		vertex_t * pv = varr + i;
-		pv->normal = pv->normal.Normalize();
+void Mesh::CalcTangents(Vec4 * out)
+{
+	if( !tangentSpace ) {
+		return;
 	}
+	tangentSpace->CalcTangents(vertexArray, out);
 }
 
 
@@ -310,7 +639,8 @@ void Mesh::CalcNormal(vertex_t * varr, const unsigned short * iarr, const int vs
  * 
  *============================================================
  */
-bool Texture::LoadPNG()
+// Header only: size and pixel layout. Cheap, no pixel data.
+bool Texture::ReadPNGHeader()
 {
 	// Currently only support .png format
 	qStr ext = texFileName.GetFileExtension();
@@ -319,60 +649,366 @@ bool Texture::LoadPNG()
 		return false;
 	}
 
-	// Does it hurt to call it multiple times
-	ilInit();
+	int w, h, channels;
+	if( !R_ReadPNGInfo(texFileName.Ptr(), &w, &h, &channels) ) {
+		fprintf(stderr, "Failed loading image %s\n", texFileName.Ptr());
+		return false;
+	}
+	width = w;
+	height = h;
+	format = ( channels == 4 ) ? TEXTURE_GL_RGBA : TEXTURE_GL_RGB;
+	return true;
+}
 
-	ILuint	imgId;
-	ilGenImages(1, &imgId);
-	ilBindImage(imgId);
+unsigned int Texture::GetDataSize() const
+{
+	return width * height * ( format == TEXTURE_GL_RGBA ? 4 : 3 );
+}
 
-	ILenum iErr;
+// Thread safe, touches nothing but dst and the file
+bool Texture::DecodePNG(void * dst) const
+{
+	int channels = ( format == TEXTURE_GL_RGBA ) ? 4 : 3;
+	if( !R_DecodePNG(texFileName.Ptr(), (byte*)dst, width, height, channels) ) {
+		fprintf(stderr, "Failed decoding image %s\n", texFileName.Ptr());
+		return false;
+	}
+	return true;
+}
 
-	if( ilLoadImage((ILstring)texFileName.Ptr()) == false ) {
-		iErr = ilGetError();
-		fprintf(stderr, "Failed loading image %s:%d\n", texFileName.Ptr(), iErr);
+bool Texture::LoadPNG()
+{
+	if( !width && !ReadPNGHeader() ) {
 		return false;
-	} 
+	}
 
-	unsigned int bytePerPixel;
-	height = ilGetInteger(IL_IMAGE_HEIGHT);
-	width =  ilGetInteger(IL_IMAGE_WIDTH);
-	bytePerPixel = ilGetInteger(IL_IMAGE_BPP);
+	// Sized for the converted layout, not what is in the file
+	apiData = malloc(GetDataSize());
+	if( !apiData ) {
+		common->FatalError("Cannot allocate memory. Aborting...");
+	}
+	if( !DecodePNG(apiData) ) {
+		free(apiData);
+		apiData = NULL;
+		return false;
+	}
+	return true;
+}
 
-	// Determine Format
-	if( bytePerPixel == 4 ) {
-		ilConvertImage(IL_RGBA, IL_UNSIGNED_BYTE);
-		format = TEXTURE_GL_RGBA;
-	} else {
-		ilConvertImage(IL_RGB, IL_UNSIGNED_BYTE);
-		format = TEXTURE_GL_RGB;
+void Texture::LoadMemory(image_format_t fmt, const std::vector<image_mip_t>& levels)
+{
+	numMips = (int)levels.size();
+	mips = (qtex_mip_t*)malloc(numMips * sizeof(qtex_mip_t));
+	if( !mips ) {
+		common->FatalError("Cannot allocate memory. Aborting...");
 	}
+	// Coarsest first, like in a .qtex
+	unsigned int offset = 0;
+	for( int i = numMips - 1; i >= 0; --i ) {
+		mips[i].width = levels[i].width;
+		mips[i].height = levels[i].height;
+		mips[i].offset = offset;
+		mips[i].size = R_ImageSize(fmt, levels[i].width, levels[i].height);
+		offset += mips[i].size;
+	}
+	streamData = (byte*)malloc(offset);
+	if( !streamData ) {
+		common->FatalError("Cannot allocate memory. Aborting...");
+	}
+	for( int i = 0; i < numMips; ++i ) {
+		memcpy(streamData + mips[i].offset, &levels[i].pixels[0], mips[i].size);
+	}
+	// Everything is in streamData, ReadCooked never goes to disk
+	streamSize = offset;
 
-	// Allocating memory and copy image data
-	apiData = (char*)malloc(height * width  * bytePerPixel);
+	format = ( fmt == IMAGE_FORMAT_RGBA8 ) ? TEXTURE_GL_RGBA : TEXTURE_GL_RGB;
+	width = levels[0].width;
+	height = levels[0].height;
+	residentMip = numMips;
+}
+
+// Cook pixels loaded by LoadPNG into a .qtex mip chain
+bool Texture::Cook(image_format_t fmt, const char * outPath)
+{
 	if( !apiData ) {
+		return false;
+	}
+	int channels = ( format == TEXTURE_GL_RGBA ) ? 4 : 3;
+	return R_WriteQtex(outPath, (const byte*)apiData, width, height, channels, fmt);
+}
+
+bool Texture::LoadCooked()
+{
+	FILE * fp = fopen(texFileName.Ptr(), "rb");
+	if( !fp ) {
+		fprintf(stderr, "Cannot open %s\n", texFileName.Ptr());
+		return false;
+	}
+	qtex_header_t header;
+	if( fread(&header, sizeof(header), 1, fp) != 1 || header.magic != QTEX_MAGIC
+		|| header.version != QTEX_VERSION || header.numMips == 0 ) {
+		fprintf(stderr, "%s is not a valid cooked texture\n", texFileName.Ptr());
+		fclose(fp);
+		return false;
+	}
+
+	mips = (qtex_mip_t*)malloc(header.numMips * sizeof(qtex_mip_t));
+	if( !mips ) {
+		common->FatalError("Cannot allocate memory. Aborting...");
+	}
+	if( fread(mips, sizeof(qtex_mip_t), header.numMips, fp) != header.numMips ) {
+		fprintf(stderr, "%s is truncated\n", texFileName.Ptr());
+		fclose(fp);
+		free(mips);
+		mips = NULL;
+		return false;
+	}
+	fclose(fp);
+
+	switch( header.format ) {
+		case IMAGE_FORMAT_RGB8:		format = TEXTURE_GL_RGB; break;
+		case IMAGE_FORMAT_RGBA8:	format = TEXTURE_GL_RGBA; break;
+		case IMAGE_FORMAT_ETC1:		format = TEXTURE_GL_ETC1; break;
+		case IMAGE_FORMAT_BC1:		format = TEXTURE_GL_BC1; break;
+		default:
+			fprintf(stderr, "%s has unknown format %u\n", texFileName.Ptr(), header.format);
+			free(mips);
+			mips = NULL;
+			return false;
+	}
+	width = header.width;
+	height = header.height;
+	numMips = header.numMips;
+	residentMip = numMips;
+	fromFile = true;
+	return true;
+}
+
+bool Texture::Prefetch()
+{
+	if( !fromFile || isBind ) {
+		return false;
+	}
+	return ReadCooked(0);
+}
+
+unsigned int Texture::ReleaseGPU()
+{
+	if( !fromFile || !isBind ) {
+		return 0;
+	}
+	glDeleteTextures(1, &apiId);
+	apiId = 0;
+	isBind = false;
+	residentMip = numMips;
+	if( streamData ) {
+		free(streamData);
+		streamData = NULL;
+		streamSize = 0;
+	}
+	unsigned int bytes = gpuSize;
+	gpuSize = 0;
+	return bytes;
+}
+
+// Make sure file bytes of 'level' are in streamData. Levels are
+// stored coarsest first, so this only ever appends.
+bool Texture::ReadCooked(int level)
+{
+	unsigned int start = mips[numMips - 1].offset;
+	unsigned int need = mips[level].offset + mips[level].size - start;
+	if( need <= streamSize ) {
+		return true;
+	}
+
+	FILE * fp = fopen(texFileName.Ptr(), "rb");
+	if( !fp ) {
+		fprintf(stderr, "Cannot open %s\n", texFileName.Ptr());
+		return false;
+	}
+	byte * buf = (byte*)realloc(streamData, need);
+	if( !buf ) {
 		common->FatalError("Cannot allocate memory. Aborting...");
 	}
-	memcpy(apiData, ilGetData(), height * width * bytePerPixel);
+	streamData = buf;
+	bool ok = fseek(fp, start + streamSize, SEEK_SET) == 0
+			&& fread(streamData + streamSize, need - streamSize, 1, fp) == 1;
+	fclose(fp);
+	if( !ok ) {
+		fprintf(stderr, "%s is truncated\n", texFileName.Ptr());
+		return false;
+	}
+	streamSize = need;
+	return true;
+}
 
-	ilDeleteImage(imgId);
+// Exact match in the extension string
+bool R_HasGLExtension(const char * ext)
+{
+	const char * all = (const char*)glGetString(GL_EXTENSIONS);
+	if( !all ) {
+		return false;
+	}
+	size_t len = strlen(ext);
+	for( const char * p = strstr(all, ext); p; p = strstr(p + len, ext) ) {
+		if( ( p == all || p[-1] == ' ' ) && ( p[len] == ' ' || p[len] == '\0' ) ) {
+			return true;
+		}
+	}
+	return false;
+}
 
-	if( ilGetError() != IL_NO_ERROR ) {
-		fprintf(stderr, "Something wrong with IL library.\n");
+static bool R_DriverHasFormat(texture_format_t fmt)
+{
+	static int etc1 = -1, bc1 = -1;
+	if( fmt == TEXTURE_GL_ETC1 ) {
+		if( etc1 < 0 ) {
+			etc1 = R_HasGLExtension("GL_OES_compressed_ETC1_RGB8_texture");
+		}
+		return etc1 != 0;
+	}
+	if( fmt == TEXTURE_GL_BC1 ) {
+		if( bc1 < 0 ) {
+			bc1 = R_HasGLExtension("GL_EXT_texture_compression_s3tc")
+				|| R_HasGLExtension("GL_EXT_texture_compression_dxt1");
+		}
+		return bc1 != 0;
 	}
 	return true;
 }
 
+// Specify levels base .. numMips-1 as GL levels 0 .. n. Texture
+// must be bound. Returns bytes handed to the driver.
+unsigned int Texture::SpecifyLevels(int base)
+{
+	unsigned int start = mips[numMips - 1].offset;
+	bool native = R_DriverHasFormat(format);
+	unsigned int bytes = 0;
+	byte * decoded = NULL;
+
+	// RGB rows are width * 3 bytes, tightly packed, which the
+	// default alignment of 4 misreads for odd widths and tail mips
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for( int i = base; i < numMips; ++i ) {
+		const qtex_mip_t& m = mips[i];
+		const byte * data = streamData + (m.offset - start);
+		GLint level = i - base;
+
+		if( format == TEXTURE_GL_RGB || format == TEXTURE_GL_RGBA ) {
+			GLenum glFmt = ( format == TEXTURE_GL_RGBA ) ? GL_RGBA : GL_RGB;
+			glTexImage2D(GL_TEXTURE_2D, level, glFmt, m.width, m.height, 0, glFmt, GL_UNSIGNED_BYTE, data);
+			bytes += m.size;
+		} else if( native ) {
+			GLenum glFmt = ( format == TEXTURE_GL_ETC1 ) ? GL_ETC1_RGB8_OES : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+			glCompressedTexImage2D(GL_TEXTURE_2D, level, glFmt, m.width, m.height, 0, m.size, data);
+			bytes += m.size;
+		} else {
+			// No driver support, expand on the CPU
+			if( !decoded ) {
+				decoded = (byte*)malloc(mips[base].width * mips[base].height * 3);
+				if( !decoded ) {
+					common->FatalError("Cannot allocate memory. Aborting...");
+				}
+			}
+			if( format == TEXTURE_GL_ETC1 ) {
+				R_DecompressETC1(data, m.width, m.height, decoded);
+			} else {
+				R_DecompressBC1(data, m.width, m.height, decoded);
+			}
+			glTexImage2D(GL_TEXTURE_2D, level, GL_RGB, m.width, m.height, 0, GL_RGB, GL_UNSIGNED_BYTE, decoded);
+			bytes += m.width * m.height * 3;
+		}
+	}
+	if( decoded ) {
+		free(decoded);
+	}
+	gpuSize = bytes;
+	return bytes;
+}
+
+unsigned int Texture::StreamNext()
+{
+	if( !isBind || !numMips || residentMip == 0 ) {
+		return 0;
+	}
+
+	int level = residentMip - 1;
+	if( residentMip == numMips ) {
+		// First step takes all the small levels at once
+		level = numMips - 1;
+		while( level > 0 && mips[level - 1].width <= TEXTURE_STREAM_MIN_SIZE
+				&& mips[level - 1].height <= TEXTURE_STREAM_MIN_SIZE ) {
+			level--;
+		}
+	}
+	if( !ReadCooked(level) ) {
+		// Keep what we have rather than retry every frame
+		residentMip = 0;
+		return 0;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, apiId);
+	unsigned int bytes = SpecifyLevels(level);
+	residentMip = level;
 
-void Texture::UploadGPU()
+	if( residentMip == 0 ) {
+		free(streamData);
+		streamData = NULL;
+		streamSize = 0;
+	}
+	return bytes;
+}
+
+void Texture::TakeData(Texture& from)
+{
+	std::swap(apiData, from.apiData);
+	std::swap(size, from.size);
+	std::swap(width, from.width);
+	std::swap(height, from.height);
+	std::swap(format, from.format);
+	std::swap(mips, from.mips);
+	std::swap(numMips, from.numMips);
+	std::swap(streamData, from.streamData);
+	std::swap(streamSize, from.streamSize);
+	std::swap(fromFile, from.fromFile);
+	// None of the new levels are on the GPU
+	residentMip = numMips;
+}
+
+unsigned int Texture::UpdateGPU()
+{
+	if( !isBind ) {
+		return 0;
+	}
+	isBind = false;
+	gpuSize = 0;
+	return UploadGPU();
+}
+
+unsigned int Texture::UploadGPU()
 {
 	if( isBind)
-		return;
+		return 0;
 
-	glGenTextures(1, &apiId);
+	// Names are kept when the pixels are replaced
+	if( !apiId ) {
+		glGenTextures(1, &apiId);
+	}
 	glBindTexture(GL_TEXTURE_2D, apiId);
 
+	if( numMips ) {
+		// Cooked, carries its own mips. Start with the coarse end.
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		isBind = true;
+		return StreamNext();
+	}
+
 	if( format == TEXTURE_GL_RGB || format == TEXTURE_GL_RGBA ) {
+		// Decoded rows are tightly packed
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 		glTexParameterf(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
 		if( format == TEXTURE_GL_RGBA) {
 			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, apiData);
@@ -381,7 +1017,7 @@ void Texture::UploadGPU()
 		}
 	} else {
         fprintf(stderr, "UploadGPU() unimplemented path !\n");
-        return;
+        return 0;
 	}
 
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST);
@@ -390,8 +1026,15 @@ void Texture::UploadGPU()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
     
 
+	// Full mip chain adds roughly a third on top of level 0
+	unsigned int bytes = width * height * (format == TEXTURE_GL_RGBA ? 4 : 3);
+	bytes += bytes / 3;
+	gpuSize = bytes;
+
 	// Free apiData ?
 	free(apiData);
+	apiData = NULL;
 	size = 0;
 	isBind = true;
+	return bytes;
 }
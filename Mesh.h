@@ -11,15 +11,18 @@
 #include <string.h>	// for memcpy
 #endif
 
-#include "IL/il.h"	// For loading texure resources
 #include "File.h"
 #include "String.h"
+#include "Atom.h"
 #include "Common.h"
 #include "Math.h"
 #include "qArr.h"
+#include "Image.h"
+#include "Bvh.h"
 
 #include <stdio.h>
 #include <vector>
+#include <assert.h>
 
 typedef enum { ENT_PLAYER, ENT_ENEMY } entity_type_t;
 typedef unsigned char byte;
@@ -45,6 +48,21 @@ typedef struct {
 	Vec3 			normal;
 } vertex_t;
 
+// Opt-in compact layout, 16 bytes against 28 of vertex_t.
+// Position is quantized against mesh bounds and texture
+// coordinates against the mesh uv range; both are expanded
+// back by per mesh matrices. Fixed function consumes normal
+// as snorm8 directly, tangent is octahedral encoded.
+typedef struct {
+	short			pos[3];
+	signed char		normal[3];
+	signed char		tangentSign;	// bitangent handedness, +/-127
+	short			st[2];
+	signed char		tangent[2];
+} vertex_compact_t;
+
+typedef enum { VERTEX_FORMAT_FLOAT, VERTEX_FORMAT_COMPACT } vertex_format_t;
+
 // p2-p1 is the ccw about normal to triangle plane
 typedef struct {
     unsigned short  p1, p2;
@@ -52,6 +70,21 @@ typedef struct {
     byte            marked;
 } edge_t;
 
+class TangentSpace;
+
+#define MAX_MESH_LOD		4
+// Give up on further levels once simplification error
+// grows past this fraction of mesh radius
+#define MESH_LOD_MAX_ERROR	0.05f
+
+// One level of detail. All levels share the vertex buffer and
+// are ranges of the same index buffer.
+struct mesh_lod_t {
+	int		firstIndex;
+	int		numIndex;
+	float	error;		// geometric error relative to bound radius
+};
+
 /*
 ==============================================
 
@@ -64,24 +97,71 @@ class Mesh
 {
 public:
 
-						Mesh(qStr path);
+						Mesh(const qStr& path);
 						~Mesh();
 
 	bool 				LoadMD5();
-	qStr				GetName() const;
+	const qStr&			GetName() const;
+	qAtom				GetNameAtom() const { return nameAtom; }
 	vertex_t * 			GetVertexArray() const;
 	unsigned short *	GetIndexArray() const;
 	unsigned short		GetNumIndex() const;
 	unsigned short		GetNumVert() const;
 
-	qStr				GetTexName() const;
-	unsigned int& 		GetVboId() const;
+	int					GetNumLods() const { return numLods; }
+	const mesh_lod_t&	GetLod(int level) const;
+	// Bounding sphere in model space
+	Vec3				GetBoundCenter() const { return boundCenter; }
+	float				GetBoundRadius() const { return boundRadius; }
+	// Bounding box in model space
+	const Vec3&			GetBoundMins() const { return boundMins; }
+	const Vec3&			GetBoundMaxs() const { return boundMaxs; }
+	// Full detail triangles for ray casts, model space
+	const MeshBvh&		GetBvh() const { return bvh; }
+
+	const qStr&			GetTexName() const;
+	qAtom				GetTexAtom() const { return texAtom; }
+	// All st within [0, 1], so they can be moved into an atlas
+	bool				HasUnitTexCoords() const;
+	// st = st * scale + offset, before upload
+	void				RemapTexCoords(const float scale[2], const float offset[2]);
 	bool				IsUploaded() const;
-	void				UploadGPU();
+	// Returns the number of bytes handed to the driver
+	unsigned int		UploadGPU();
+	// Drop the GPU copy, the CPU side stays for the next
+	// UploadGPU. Returns the bytes freed.
+	unsigned int		ReleaseGPU();
+	// Take the CPU side of from, the same file loaded again.
+	// The old data goes to from for its destructor. The mesh
+	// is unbound until UpdateGPU.
+	void				TakeData(Mesh& from);
+	// New data into the buffers already on the GPU, under the
+	// same names. Returns bytes handed to the driver.
+	unsigned int		UpdateGPU();
+	// Bind vertex and index buffers and point the client
+	// arrays at the vertex layout
+	void				Bind();
 	void				UnBind();
+	unsigned int		GetGPUSize() const;
+	// Layout used on GPU. Has to be chosen before upload,
+	// CPU side always keeps the vertex_t array.
+	void				SetVertexFormat(vertex_format_t fmt);
+	vertex_format_t		GetVertexFormat() const { return vertexFormat; }
+	unsigned int		GetVertexStride() const;
+	// Expands quantized positions back to model space
+	const Mat4&			GetDequantMat() const { return dequantMat; }
+	// Vertex cache efficiency before and after load time optimization
+	float				GetACMRBefore() const { return acmrBefore; }
+	float				GetACMRAfter() const { return acmrAfter; }
 
     qArr<edge_t>        GenEdgeList();
 
+	// Regenerate normals from current positions, cheap enough
+	// to run every frame on deformed vertices
+	void				CalcNormals(bool angleWeighted);
+	// One tangent per vertex, w is bitangent sign
+	void				CalcTangents(Vec4 * out);
+
 private:
 	void				ReadJoin(LexerFile *lex);
 	void				ReadMesh(LexerFile *lex);
@@ -89,7 +169,12 @@ private:
 	void				ReadTriangle(LexerFile *lex, std::vector<unsigned short>& tris);
 	md5_weight_t		ReadWeight(LexerFile *lex);
 
-	void				CalcNormal(vertex_t * varr, const unsigned short * iarr, const int vsize, const int isize);
+	// Reorder triangles and vertices for the GPU caches
+	void				Optimize();
+	void				GenerateLods();
+	void				CalcBoundSphere();
+	void				BuildBvh();
+	vertex_compact_t *	PackCompact();
 	
 	// Merge vertex, texture, normal into one big chunk and
 	// then feed into GPU pipeline
@@ -99,19 +184,41 @@ private:
 	qStr					name;
 	qStr					meshFileName;
 	qStr					textureFileName;
+	qAtom					nameAtom;
+	qAtom					texAtom;
 	
 	// Everything in bundle to upload to GPU
 	vertex_t *				vertexArray;				
 	// Indices is separate stream of data
 	unsigned short *		indexArray;
 	unsigned int 			vboId;
+	unsigned int			iboId;
+	vertex_format_t			vertexFormat;
+	Mat4					dequantMat;
+	// Maps st of the uploaded layout into [0, 1]
+	Mat4					texMat;
 	// If the data is in GPU
 	bool					isBind;
 	unsigned short			nIndex; 
 	unsigned short			nVert;
+	// Topology for normal and tangent generation
+	TangentSpace *			tangentSpace;
+	float					acmrBefore;
+	float					acmrAfter;
+
+	// Levels of detail, level 0 is the full mesh
+	mesh_lod_t				lods[MAX_MESH_LOD];
+	int						numLods;
+	// Indices of all levels
+	int						numIndexTotal;
+	Vec3					boundCenter;
+	float					boundRadius;
+	Vec3					boundMins;
+	Vec3					boundMaxs;
+	MeshBvh					bvh;
 };
 
-inline qStr Mesh::GetName() const {
+inline const qStr& Mesh::GetName() const {
 	return name;
 }
 
@@ -140,13 +247,34 @@ inline unsigned short Mesh::GetNumVert() const
 	return nVert;
 }
 
-inline qStr Mesh::GetTexName() const
+inline const qStr& Mesh::GetTexName() const
 {
 	return textureFileName;
 }
 
+inline unsigned int Mesh::GetVertexStride() const
+{
+	return vertexFormat == VERTEX_FORMAT_COMPACT ? sizeof(vertex_compact_t) : sizeof(vertex_t);
+}
+
+inline unsigned int Mesh::GetGPUSize() const
+{
+	return nVert * GetVertexStride() + numIndexTotal * sizeof(unsigned short);
+}
+
+inline const mesh_lod_t& Mesh::GetLod(int level) const
+{
+	assert( level >= 0 && level < numLods );
+	return lods[level];
+}
+
 
-typedef enum { TEXTURE_GL_RGBA, TEXTURE_GL_RGB } texture_format_t;
+// Needs a current context
+bool R_HasGLExtension(const char * ext);
+
+typedef enum { TEXTURE_GL_RGBA, TEXTURE_GL_RGB, TEXTURE_GL_ETC1, TEXTURE_GL_BC1 } texture_format_t;
+// Cooked textures start with the levels up to this size
+#define TEXTURE_STREAM_MIN_SIZE		32
 /*
 ===========================================================
 
@@ -155,20 +283,69 @@ It's awkward for MD5 file contains the texture coordinates.
 So this class just handles load and upload actual texture
 file. 
 
+A cooked .qtex texture is streamed: the first upload puts the
+small levels on the GPU, then each StreamNext() re-specifies
+the texture with one more, finer level at its base. Only file
+bytes up to the finest level wanted are kept in RAM.
+
 ============================================================
 */
 class Texture
 {
 public:
-					Texture(qStr path);
+					Texture(const qStr& path);
 					~Texture();
 
 	bool			IsUploaded();
-	void 			UploadGPU();
+	// Returns the number of bytes handed to the driver
+	unsigned int	UploadGPU();
+	void			Bind() const { glBindTexture(GL_TEXTURE_2D, apiId); }
 	unsigned int 	GetHeight();
 	unsigned int 	GetWidth();
-	qStr			GetName() const;
+	const qStr&		GetName() const;
+	qAtom			GetNameAtom() const { return nameAtom; }
+	// Header, then decode into apiData
 	bool			LoadPNG();
+	// Split steps of LoadPNG. DecodePNG is thread safe and can
+	// run on workers for many textures at once.
+	bool			ReadPNGHeader();
+	bool			DecodePNG(void * dst) const;
+	// Bytes DecodePNG writes, valid after ReadPNGHeader
+	unsigned int	GetDataSize() const;
+	// Read .qtex header, pixel data is read while streaming
+	bool			LoadCooked();
+	// Same as a cooked texture, but levels (finest first) come
+	// from memory rather than a .qtex
+	void			LoadMemory(image_format_t fmt, const std::vector<image_mip_t>& levels);
+	// Decoded PNG pixels, NULL once uploaded or for cooked ones
+	const byte *	GetPixels() const { return numMips ? NULL : (const byte*)apiData; }
+	// Write a .qtex next to the source. Needs LoadPNG() first.
+	bool			Cook(image_format_t fmt, const char * outPath);
+
+	// All levels on the GPU
+	bool			IsResident() const;
+	// A cooked texture can go back to its file: ReleaseGPU
+	// drops every level and the next UploadGPU streams again
+	bool			CanRelease() const { return fromFile; }
+	unsigned int	ReleaseGPU();
+	// Read the whole cooked file into RAM so streaming never
+	// waits on disk. Safe on any thread while the texture is
+	// not uploaded and nothing else uses it.
+	bool			Prefetch();
+	// Upload next finer level, returns bytes handed to driver
+	unsigned int	StreamNext();
+	// Same as for Mesh: take the pixels of from, loaded again
+	// from the same file, then refill the texture on the GPU
+	// under the same name. Nothing may be streaming from.
+	void			TakeData(Texture& from);
+	unsigned int	UpdateGPU();
+	// Texture memory in use on the GPU
+	unsigned int	GetGPUSize() const { return gpuSize; }
+	texture_format_t GetFormat() const { return format; }
+
+private:
+	bool			ReadCooked(int level);
+	unsigned int	SpecifyLevels(int base);
 
 private:
 	void * 			apiData;
@@ -176,12 +353,23 @@ private:
 	unsigned int 	apiId;
 	qStr			texFileName;
 	qStr			name;
+	qAtom			nameAtom;
 	bool			isBind;
 
 	unsigned int 	height;
 	unsigned int 	width;
 	texture_format_t format;
 
+	// Cooked texture streaming state
+	qtex_mip_t *	mips;
+	int				numMips;
+	int				residentMip;	// finest level on GPU, numMips if none
+	byte *			streamData;		// file bytes from coarsest level on
+	unsigned int	streamSize;
+	unsigned int	gpuSize;
+	// Levels come from a .qtex, not memory
+	bool			fromFile;
+
 private:
 	Texture() {}
 	Texture(const Texture&) {}
@@ -192,20 +380,30 @@ inline Texture::~Texture()
 {
 	if (apiData)
 		free(apiData);
+	if( mips )
+		free(mips);
+	if( streamData )
+		free(streamData);
 }
 
-inline Texture::Texture(qStr path) : apiData(NULL), isBind(false), height(0), width(0) 
+inline Texture::Texture(const qStr& path) : apiData(NULL), size(0), apiId(0), isBind(false), height(0), width(0), format(TEXTURE_GL_RGB), mips(NULL), numMips(0), residentMip(0), streamData(NULL), streamSize(0), gpuSize(0), fromFile(false)
 {
 	texFileName = path;
 	name = texFileName.GetFileName();
+	nameAtom = qAtom(name);
 }
 
-
 inline bool Texture::IsUploaded()
 {
 	return isBind;
 }
 
+inline bool Texture::IsResident() const
+{
+	// PNG textures go up in one piece
+	return isBind && ( !numMips || residentMip == 0 );
+}
+
 inline unsigned int Texture::GetHeight()
 {
 	return height;
@@ -216,7 +414,7 @@ inline unsigned int Texture::GetWidth()
 	return width;
 }
 
-inline qStr Texture::GetName() const
+inline const qStr& Texture::GetName() const
 {
 	return name;
 }
@@ -0,0 +1,430 @@
+#include "MeshOpt.h"
+#include <algorithm>
+#include <math.h>
+
+extern Common * common;
+
+/*=============================================================
+ *
+ *  Cache simulation
+ *
+ *============================================================
+ */
+
+// FIFO cache simulation using time stamps. A vertex is a hit
+// if it entered the cache less than cacheSize misses ago.
+static int R_CountCacheMisses(const unsigned short * idx, int numIndex, unsigned int * stamp, int numVert, int cacheSize, unsigned int& clock)
+{
+	int misses = 0;
+	for( int i = 0; i < numIndex; ++i ) {
+		unsigned short v = idx[i];
+		if( clock - stamp[v] >= (unsigned int)cacheSize ) {
+			stamp[v] = clock++;
+			misses++;
+		}
+	}
+	return misses;
+}
+
+float R_CalcACMR(const unsigned short * idx, int numIndex, int numVert, int cacheSize)
+{
+	if( numIndex < 3 || numVert <= 0 ) {
+		return 0.0f;
+	}
+
+	unsigned int * stamp = (unsigned int*)malloc(numVert * sizeof(unsigned int));
+	// Make every vertex a miss initially
+	unsigned int clock = cacheSize + 1;
+	memset(stamp, 0, numVert * sizeof(unsigned int));
+
+	int misses = R_CountCacheMisses(idx, numIndex, stamp, numVert, cacheSize, clock);
+	free(stamp);
+
+	return (float)misses / (numIndex / 3);
+}
+
+
+/*=============================================================
+ *
+ *  Forsyth vertex cache optimization
+ *
+ *============================================================
+ */
+
+#define FORSYTH_MAX_VALENCE		32
+#define FORSYTH_LAST_TRI_SCORE	0.75f
+#define FORSYTH_DECAY_POWER		1.5f
+#define FORSYTH_VALENCE_SCALE	2.0f
+
+static float forsythCacheScore[MESHOPT_CACHE_SIZE];
+static float forsythValenceScore[FORSYTH_MAX_VALENCE];
+static bool  forsythTablesReady = false;
+
+static void R_ForsythInitTables()
+{
+	if( forsythTablesReady ) {
+		return;
+	}
+	for( int i = 0; i < MESHOPT_CACHE_SIZE; ++i ) {
+		if( i < 3 ) {
+			// Vertices of the triangle just emitted. Fixed score
+			// so we don't favour using them straight away
+			forsythCacheScore[i] = FORSYTH_LAST_TRI_SCORE;
+		} else {
+			float s = 1.0f - (float)(i - 3) / (MESHOPT_CACHE_SIZE - 3);
+			forsythCacheScore[i] = powf(s, FORSYTH_DECAY_POWER);
+		}
+	}
+	for( int i = 1; i < FORSYTH_MAX_VALENCE; ++i ) {
+		forsythValenceScore[i] = FORSYTH_VALENCE_SCALE * powf((float)i, -0.5f);
+	}
+	forsythValenceScore[0] = 0.0f;
+	forsythTablesReady = true;
+}
+
+static float R_ForsythVertexScore(int cachePos, int liveTris)
+{
+	if( liveTris == 0 ) {
+		// Nothing left to use it
+		return -1.0f;
+	}
+
+	float score = 0.0f;
+	if( cachePos >= 0 ) {
+		score = forsythCacheScore[cachePos];
+	}
+	if( liveTris >= FORSYTH_MAX_VALENCE ) {
+		liveTris = FORSYTH_MAX_VALENCE - 1;
+	}
+	return score + forsythValenceScore[liveTris];
+}
+
+void R_OptimizeVertexCache(unsigned short * idx, int numIndex, int numVert)
+{
+	int numTri = numIndex / 3;
+	if( numTri < 2 || numVert <= 0 ) {
+		return;
+	}
+	R_ForsythInitTables();
+
+	// Build vertex -> triangle adjacency in compressed rows
+	int * liveTris   = (int*)calloc(numVert, sizeof(int));
+	int * adjOffset  = (int*)malloc((numVert + 1) * sizeof(int));
+	int * adjTris    = (int*)malloc(numIndex * sizeof(int));
+	int * cachePos   = (int*)malloc(numVert * sizeof(int));
+	float * vScore   = (float*)malloc(numVert * sizeof(float));
+	float * tScore   = (float*)malloc(numTri * sizeof(float));
+	byte * emitted   = (byte*)calloc(numTri, sizeof(byte));
+	unsigned short * out = (unsigned short*)malloc(numIndex * sizeof(unsigned short));
+	if( !liveTris || !adjOffset || !adjTris || !cachePos || !vScore || !tScore || !emitted || !out ) {
+		common->FatalError("R_OptimizeVertexCache: Cannot allocate more memory");
+	}
+
+	for( int i = 0; i < numIndex; ++i ) {
+		liveTris[idx[i]]++;
+	}
+	adjOffset[0] = 0;
+	for( int v = 0; v < numVert; ++v ) {
+		adjOffset[v + 1] = adjOffset[v] + liveTris[v];
+	}
+	// Use cachePos as fill cursor before it takes its real meaning
+	memcpy(cachePos, adjOffset, numVert * sizeof(int));
+	for( int t = 0; t < numTri; ++t ) {
+		for( int k = 0; k < 3; ++k ) {
+			int v = idx[t * 3 + k];
+			adjTris[cachePos[v]++] = t;
+		}
+	}
+
+	for( int v = 0; v < numVert; ++v ) {
+		cachePos[v] = -1;
+		vScore[v] = R_ForsythVertexScore(-1, liveTris[v]);
+	}
+	for( int t = 0; t < numTri; ++t ) {
+		tScore[t] = vScore[idx[t*3]] + vScore[idx[t*3+1]] + vScore[idx[t*3+2]];
+	}
+
+	// Two cache buffers, three extra slots for the vertices
+	// pushed by the emitted triangle
+	int cacheA[MESHOPT_CACHE_SIZE + 3], cacheB[MESHOPT_CACHE_SIZE + 3];
+	int * cache = cacheA, * newCache = cacheB;
+	int cacheCount = 0;
+
+	int bestTri = -1;
+	float bestScore = -1.0f;
+	int scanCursor = 0;
+	int numOut = 0;
+
+	for( int emittedCount = 0; emittedCount < numTri; ++emittedCount ) {
+		if( bestTri < 0 ) {
+			// Nothing useful in cache. Find best remaining triangle
+			// starting from where we left last time
+			bestScore = -1.0f;
+			for( int t = scanCursor; t < numTri; ++t ) {
+				if( !emitted[t] ) {
+					if( bestTri < 0 ) {
+						scanCursor = t;
+					}
+					if( tScore[t] > bestScore ) {
+						bestScore = tScore[t];
+						bestTri = t;
+					}
+				}
+			}
+		}
+
+		int tri = bestTri;
+		emitted[tri] = 1;
+		const unsigned short * tv = idx + tri * 3;
+		out[numOut++] = tv[0];
+		out[numOut++] = tv[1];
+		out[numOut++] = tv[2];
+
+		// Remove triangle from its vertices' live lists
+		for( int k = 0; k < 3; ++k ) {
+			int v = tv[k];
+			int * beg = adjTris + adjOffset[v];
+			int * end = beg + liveTris[v];
+			for( int * p = beg; p < end; ++p ) {
+				if( *p == tri ) {
+					*p = *(end - 1);
+					break;
+				}
+			}
+			liveTris[v]--;
+		}
+
+		// Emitted vertices go to the front of the cache
+		int newCount = 0;
+		newCache[newCount++] = tv[0];
+		newCache[newCount++] = tv[1];
+		newCache[newCount++] = tv[2];
+		for( int i = 0; i < cacheCount; ++i ) {
+			int v = cache[i];
+			if( v != tv[0] && v != tv[1] && v != tv[2] ) {
+				newCache[newCount++] = v;
+			}
+		}
+
+		// Update scores of all vertices that were or are in cache
+		for( int i = 0; i < newCount; ++i ) {
+			int v = newCache[i];
+			cachePos[v] = ( i < MESHOPT_CACHE_SIZE ) ? i : -1;
+			vScore[v] = R_ForsythVertexScore(cachePos[v], liveTris[v]);
+		}
+
+		// Retally triangle scores touched by cache, tracking best
+		bestTri = -1;
+		bestScore = -1.0f;
+		for( int i = 0; i < newCount; ++i ) {
+			int v = newCache[i];
+			const int * adj = adjTris + adjOffset[v];
+			for( int j = 0; j < liveTris[v]; ++j ) {
+				int t = adj[j];
+				const unsigned short * w = idx + t * 3;
+				float s = vScore[w[0]] + vScore[w[1]] + vScore[w[2]];
+				tScore[t] = s;
+				if( s > bestScore ) {
+					bestScore = s;
+					bestTri = t;
+				}
+			}
+		}
+
+		cacheCount = std::min(newCount, MESHOPT_CACHE_SIZE);
+		int * tmp = cache;
+		cache = newCache;
+		newCache = tmp;
+	}
+
+	memcpy(idx, out, numIndex * sizeof(unsigned short));
+
+	free(liveTris);
+	free(adjOffset);
+	free(adjTris);
+	free(cachePos);
+	free(vScore);
+	free(tScore);
+	free(emitted);
+	free(out);
+}
+
+
+/*=============================================================
+ *
+ *  Overdraw optimization
+ *
+ *============================================================
+ */
+
+struct meshopt_cluster_t {
+	int		start;		// first triangle
+	int		count;
+	float	sortKey;
+};
+
+static bool R_ClusterCmp(const meshopt_cluster_t& a, const meshopt_cluster_t& b)
+{
+	return a.sortKey > b.sortKey;
+}
+
+// Split index stream into clusters. A hard boundary is a
+// triangle that misses on all three vertices: cache is
+// effectively flushed there, so moving clusters around costs
+// nothing. Clusters are further split while the cluster ACMR
+// stays within slack of the whole mesh ACMR.
+static int R_GenClusters(const unsigned short * idx, int numTri, int numVert, float slack, float meshACMR, meshopt_cluster_t * clusters)
+{
+	unsigned int * stamp = (unsigned int*)calloc(numVert, sizeof(unsigned int));
+	unsigned int clock = MESHOPT_CACHE_SIZE + 1;
+	int numClusters = 0;
+	int clusterStart = 0;
+	int clusterMisses = 0;
+
+	for( int t = 0; t < numTri; ++t ) {
+		int misses = R_CountCacheMisses(idx + t * 3, 3, stamp, numVert, MESHOPT_CACHE_SIZE, clock);
+		int clusterTris = t - clusterStart;
+
+		bool split = false;
+		if( clusterTris > 0 && misses == 3 ) {
+			split = true;
+		} else if( clusterTris > 0 ) {
+			// Soft boundary, cluster already cheap enough on its own
+			float acmr = (float)clusterMisses / clusterTris;
+			if( acmr <= meshACMR * slack && misses == 2 ) {
+				split = true;
+			}
+		}
+
+		if( split ) {
+			clusters[numClusters].start = clusterStart;
+			clusters[numClusters].count = clusterTris;
+			numClusters++;
+			clusterStart = t;
+			clusterMisses = 0;
+		}
+		clusterMisses += misses;
+	}
+	clusters[numClusters].start = clusterStart;
+	clusters[numClusters].count = numTri - clusterStart;
+	numClusters++;
+
+	free(stamp);
+	return numClusters;
+}
+
+void R_OptimizeOverdraw(unsigned short * idx, int numIndex, const vertex_t * verts, int numVert, float slack)
+{
+	int numTri = numIndex / 3;
+	if( numTri < 2 ) {
+		return;
+	}
+
+	float acmr = R_CalcACMR(idx, numIndex, numVert, MESHOPT_CACHE_SIZE);
+	meshopt_cluster_t * clusters = (meshopt_cluster_t*)malloc(numTri * sizeof(meshopt_cluster_t));
+	int numClusters = R_GenClusters(idx, numTri, numVert, slack, acmr, clusters);
+	if( numClusters < 2 ) {
+		free(clusters);
+		return;
+	}
+
+	// Area weighted mesh centroid
+	Vec3 meshCenter;
+	float meshArea = 0.0f;
+	for( int t = 0; t < numTri; ++t ) {
+		const Vec3& a = verts[idx[t*3]].pos;
+		const Vec3& b = verts[idx[t*3+1]].pos;
+		const Vec3& c = verts[idx[t*3+2]].pos;
+		Vec3 n = (b - a).CrossProduct(c - a);
+		float area = sqrtf(n.DotProduct(n));
+		meshCenter = meshCenter + (a + b + c).Scale(area / 3.0f);
+		meshArea += area;
+	}
+	if( meshArea > 0.0f ) {
+		meshCenter = meshCenter.Scale(1.0f / meshArea);
+	}
+
+	// Clusters facing away from the centroid and far out on
+	// their side are likely occluders, draw them first
+	for( int i = 0; i < numClusters; ++i ) {
+		meshopt_cluster_t& cl = clusters[i];
+		Vec3 center, normal;
+		float area = 0.0f;
+		for( int t = cl.start; t < cl.start + cl.count; ++t ) {
+			const Vec3& a = verts[idx[t*3]].pos;
+			const Vec3& b = verts[idx[t*3+1]].pos;
+			const Vec3& c = verts[idx[t*3+2]].pos;
+			Vec3 n = (b - a).CrossProduct(c - a);
+			float ta = sqrtf(n.DotProduct(n));
+			center = center + (a + b + c).Scale(ta / 3.0f);
+			normal = normal + n;
+			area += ta;
+		}
+		if( area > 0.0f ) {
+			center = center.Scale(1.0f / area);
+		}
+		float nlen = sqrtf(normal.DotProduct(normal));
+		if( nlen > 0.0f ) {
+			normal = normal.Scale(1.0f / nlen);
+		}
+		cl.sortKey = (center - meshCenter).DotProduct(normal);
+	}
+
+	std::stable_sort(clusters, clusters + numClusters, R_ClusterCmp);
+
+	unsigned short * out = (unsigned short*)malloc(numIndex * sizeof(unsigned short));
+	int n = 0;
+	for( int i = 0; i < numClusters; ++i ) {
+		memcpy(out + n, idx + clusters[i].start * 3, clusters[i].count * 3 * sizeof(unsigned short));
+		n += clusters[i].count * 3;
+	}
+
+	// Clusters may not line up as well as before. Keep the
+	// new order only if we stay within slack.
+	float newAcmr = R_CalcACMR(out, numIndex, numVert, MESHOPT_CACHE_SIZE);
+	if( newAcmr <= acmr * slack ) {
+		memcpy(idx, out, numIndex * sizeof(unsigned short));
+	}
+
+	free(out);
+	free(clusters);
+}
+
+
+/*=============================================================
+ *
+ *  Vertex fetch optimization
+ *
+ *============================================================
+ */
+
+void R_OptimizeVertexFetch(vertex_t * verts, unsigned short * idx, int numIndex, int numVert)
+{
+	if( numVert <= 0 ) {
+		return;
+	}
+
+	int * remap = (int*)malloc(numVert * sizeof(int));
+	memset(remap, -1, numVert * sizeof(int));
+
+	vertex_t * out = (vertex_t*)malloc(numVert * sizeof(vertex_t));
+	int next = 0;
+	for( int i = 0; i < numIndex; ++i ) {
+		unsigned short v = idx[i];
+		if( remap[v] < 0 ) {
+			remap[v] = next;
+			out[next++] = verts[v];
+		}
+		idx[i] = (unsigned short)remap[v];
+	}
+	// Unreferenced vertices go to the end, keeps count intact
+	for( int v = 0; v < numVert; ++v ) {
+		if( remap[v] < 0 ) {
+			out[next++] = verts[v];
+		}
+	}
+
+	std::copy(out, out + numVert, verts);
+	free(out);
+	free(remap);
+}
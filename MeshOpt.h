@@ -0,0 +1,42 @@
+/*
+ * ===============================================================
+ *
+ * Index and vertex reordering passes run on meshes at load time.
+ * Triangle order from the MD5 file is whatever the exporter
+ * produced, so we rearrange it for the post-transform vertex
+ * cache, then for overdraw, then reorder vertices to match their
+ * first use in the index stream.
+ *
+ * Reference: Tom Forsyth, "Linear-Speed Vertex Cache Optimisation"
+ *            Sander et al., "Fast Triangle Reordering for Vertex
+ *            Locality and Reduced Overdraw" (Tipsify)
+ *
+ *================================================================
+ */
+#ifndef _MESHOPT_H
+#define _MESHOPT_H
+
+#include "Mesh.h"
+
+// Post-transform cache size we optimize for. Small enough
+// to be a safe bet on both PowerVR and desktop parts
+#define MESHOPT_CACHE_SIZE		16
+// Overdraw pass may not make ACMR worse than this factor
+#define MESHOPT_OVERDRAW_SLACK	1.05f
+
+// Average cache miss ratio: transformed vertices per triangle
+// with a FIFO cache of given size. 0.5 is ideal, 3 is worst.
+float	R_CalcACMR(const unsigned short * idx, int numIndex, int numVert, int cacheSize);
+
+// Reorder triangles for vertex cache locality
+void	R_OptimizeVertexCache(unsigned short * idx, int numIndex, int numVert);
+
+// Reorder clusters of triangles front-to-back from outside
+// view points, keeping cache efficiency within slack
+void	R_OptimizeOverdraw(unsigned short * idx, int numIndex, const vertex_t * verts, int numVert, float slack);
+
+// Reorder vertex array by first reference in index stream
+// and rewrite indices accordingly
+void	R_OptimizeVertexFetch(vertex_t * verts, unsigned short * idx, int numIndex, int numVert);
+
+#endif /* !_MESHOPT_H */
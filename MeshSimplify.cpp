@@ -0,0 +1,312 @@
+#include "MeshSimplify.h"
+#include <algorithm>
+#include <math.h>
+#include <cfloat>
+
+extern Common * common;
+
+// Symmetric 4x4 matrix plus the weight accumulated into it,
+// so error can be reported as an average distance
+struct quadric_t {
+	double	a00, a01, a02, a03;
+	double	     a11, a12, a13;
+	double	          a22, a23;
+	double	               a33;
+	double	w;
+};
+
+struct collapse_t {
+	int		from;
+	int		to;
+	float	error;
+};
+
+static bool R_CollapseCmp(const collapse_t& a, const collapse_t& b)
+{
+	return a.error < b.error;
+}
+
+static void R_QuadricZero(quadric_t& q)
+{
+	memset(&q, 0, sizeof(q));
+}
+
+static void R_QuadricAddPlane(quadric_t& q, double a, double b, double c, double d, double w)
+{
+	q.a00 += w * a * a; q.a01 += w * a * b; q.a02 += w * a * c; q.a03 += w * a * d;
+	q.a11 += w * b * b; q.a12 += w * b * c; q.a13 += w * b * d;
+	q.a22 += w * c * c; q.a23 += w * c * d;
+	q.a33 += w * d * d;
+	q.w += w;
+}
+
+static void R_QuadricAdd(quadric_t& q, const quadric_t& o)
+{
+	q.a00 += o.a00; q.a01 += o.a01; q.a02 += o.a02; q.a03 += o.a03;
+	q.a11 += o.a11; q.a12 += o.a12; q.a13 += o.a13;
+	q.a22 += o.a22; q.a23 += o.a23;
+	q.a33 += o.a33;
+	q.w += o.w;
+}
+
+// Average squared distance of p to the planes in q
+static double R_QuadricEval(const quadric_t& q, const Vec3& p)
+{
+	double x = p[0], y = p[1], z = p[2];
+	double r = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z + q.a33
+		+ 2.0 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z)
+		+ 2.0 * (q.a03 * x + q.a13 * y + q.a23 * z);
+	if( r < 0.0 ) {
+		r = 0.0;
+	}
+	return q.w > 0.0 ? r / q.w : r;
+}
+
+// Lock vertices we must not move: uv seams, where several
+// vertices share one position, and open borders
+static void R_FindLocked(const vertex_t * verts, int numVert, const unsigned short * idx, int numIndex, byte * locked)
+{
+	memset(locked, 0, numVert);
+
+	// Seams. Sort vertex ids by position and look for runs.
+	int * order = (int*)malloc(numVert * sizeof(int));
+	for( int i = 0; i < numVert; ++i ) {
+		order[i] = i;
+	}
+	struct PosLess {
+		const vertex_t * v;
+		bool operator()(int a, int b) const {
+			const Vec3& pa = v[a].pos;
+			const Vec3& pb = v[b].pos;
+			if( pa[0] != pb[0] ) return pa[0] < pb[0];
+			if( pa[1] != pb[1] ) return pa[1] < pb[1];
+			return pa[2] < pb[2];
+		}
+	} less = { verts };
+	std::sort(order, order + numVert, less);
+	for( int i = 1; i < numVert; ++i ) {
+		if( !less(order[i - 1], order[i]) ) {
+			locked[order[i - 1]] = 1;
+			locked[order[i]] = 1;
+		}
+	}
+	free(order);
+
+	// Borders. An edge used once is open.
+	int numEdge = numIndex;
+	unsigned int * edges = (unsigned int*)malloc(numEdge * sizeof(unsigned int));
+	for( int i = 0; i < numIndex; i += 3 ) {
+		for( int k = 0; k < 3; ++k ) {
+			unsigned int a = idx[i + k];
+			unsigned int b = idx[i + (k + 1) % 3];
+			edges[i + k] = a < b ? (a << 16 | b) : (b << 16 | a);
+		}
+	}
+	std::sort(edges, edges + numEdge);
+	for( int i = 0; i < numEdge; ) {
+		int j = i + 1;
+		while( j < numEdge && edges[j] == edges[i] ) {
+			j++;
+		}
+		if( j - i == 1 ) {
+			locked[edges[i] >> 16] = 1;
+			locked[edges[i] & 0xffff] = 1;
+		}
+		i = j;
+	}
+	free(edges);
+}
+
+static Vec3 R_TriNormal(const Vec3& a, const Vec3& b, const Vec3& c)
+{
+	return (b - a).CrossProduct(c - a);
+}
+
+// Would moving 'from' onto 'to' turn any remaining triangle
+// around 'from' over?
+static bool R_CollapseFlips(const vertex_t * verts, const unsigned short * cur, const int * adjOffset, const int * adjTris, int from, int to)
+{
+	for( int i = adjOffset[from]; i < adjOffset[from + 1]; ++i ) {
+		const unsigned short * t = cur + adjTris[i] * 3;
+		if( t[0] == to || t[1] == to || t[2] == to ) {
+			// Disappears with the collapse
+			continue;
+		}
+		Vec3 p[3], q[3];
+		for( int k = 0; k < 3; ++k ) {
+			p[k] = verts[t[k]].pos;
+			q[k] = t[k] == from ? verts[to].pos : p[k];
+		}
+		Vec3 n0 = R_TriNormal(p[0], p[1], p[2]);
+		Vec3 n1 = R_TriNormal(q[0], q[1], q[2]);
+		if( n0.DotProduct(n1) <= 0.0f ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int R_SimplifyMesh(const vertex_t * verts, int numVert, const unsigned short * idx, int numIndex,
+					int targetIndex, float maxError, unsigned short * out, float * resultError)
+{
+	memcpy(out, idx, numIndex * sizeof(unsigned short));
+	*resultError = 0.0f;
+	if( numIndex <= targetIndex || numVert <= 0 ) {
+		return numIndex;
+	}
+
+	// Errors are relative to mesh size
+	Vec3 vmin(FLT_MAX), vmax(-FLT_MAX);
+	for( int i = 0; i < numVert; ++i ) {
+		for( int j = 0; j < 3; ++j ) {
+			vmin[j] = std::min(vmin[j], verts[i].pos[j]);
+			vmax[j] = std::max(vmax[j], verts[i].pos[j]);
+		}
+	}
+	Vec3 ext = vmax - vmin;
+	float radius = 0.5f * sqrtf(ext.DotProduct(ext));
+	if( radius <= 0.0f ) {
+		return numIndex;
+	}
+	double maxCost = (double)maxError * radius;
+	maxCost *= maxCost;
+
+	quadric_t * quadrics = (quadric_t*)malloc(numVert * sizeof(quadric_t));
+	byte * locked = (byte*)malloc(numVert);
+	byte * touched = (byte*)malloc(numVert);
+	int * remap = (int*)malloc(numVert * sizeof(int));
+	int * adjOffset = (int*)malloc((numVert + 1) * sizeof(int));
+	int * adjTris = (int*)malloc(numIndex * sizeof(int));
+	collapse_t * cands = (collapse_t*)malloc(numIndex * sizeof(collapse_t));
+	if( !quadrics || !locked || !touched || !remap || !adjOffset || !adjTris || !cands ) {
+		common->FatalError("R_SimplifyMesh: Cannot allocate more memory");
+	}
+
+	for( int i = 0; i < numVert; ++i ) {
+		R_QuadricZero(quadrics[i]);
+	}
+	for( int i = 0; i < numIndex; i += 3 ) {
+		const Vec3& a = verts[idx[i]].pos;
+		const Vec3& b = verts[idx[i + 1]].pos;
+		const Vec3& c = verts[idx[i + 2]].pos;
+		Vec3 n = R_TriNormal(a, b, c);
+		float area = sqrtf(n.DotProduct(n));
+		if( area <= 0.0f ) {
+			continue;
+		}
+		n = n.Scale(1.0f / area);
+		double d = -n.DotProduct(a);
+		for( int k = 0; k < 3; ++k ) {
+			R_QuadricAddPlane(quadrics[idx[i + k]], n[0], n[1], n[2], d, area);
+		}
+	}
+	R_FindLocked(verts, numVert, idx, numIndex, locked);
+
+	int count = numIndex;
+	double worst = 0.0;
+
+	while( count > targetIndex ) {
+		// Vertex -> triangle adjacency of current buffer
+		memset(adjOffset, 0, (numVert + 1) * sizeof(int));
+		for( int i = 0; i < count; ++i ) {
+			adjOffset[out[i] + 1]++;
+		}
+		for( int v = 0; v < numVert; ++v ) {
+			adjOffset[v + 1] += adjOffset[v];
+		}
+		memcpy(remap, adjOffset, numVert * sizeof(int));
+		for( int i = 0; i < count; ++i ) {
+			adjTris[remap[out[i]]++] = i / 3;
+		}
+
+		// Every half edge is a candidate, keep cheaper direction
+		int numCands = 0;
+		for( int i = 0; i < count; i += 3 ) {
+			for( int k = 0; k < 3; ++k ) {
+				int a = out[i + k];
+				int b = out[i + (k + 1) % 3];
+				if( a > b ) {
+					// Other half edge of a manifold pair handles it,
+					// borders are locked anyway
+					continue;
+				}
+				quadric_t q = quadrics[a];
+				R_QuadricAdd(q, quadrics[b]);
+				double ea = locked[a] ? DBL_MAX : R_QuadricEval(q, verts[b].pos);
+				double eb = locked[b] ? DBL_MAX : R_QuadricEval(q, verts[a].pos);
+				if( ea == DBL_MAX && eb == DBL_MAX ) {
+					continue;
+				}
+				collapse_t& c = cands[numCands++];
+				if( ea <= eb ) {
+					c.from = a; c.to = b; c.error = (float)ea;
+				} else {
+					c.from = b; c.to = a; c.error = (float)eb;
+				}
+			}
+		}
+		if( !numCands ) {
+			break;
+		}
+		std::sort(cands, cands + numCands, R_CollapseCmp);
+
+		// Each collapse removes about two triangles
+		int limit = (count - targetIndex) / 6 + 1;
+		int done = 0;
+		for( int v = 0; v < numVert; ++v ) {
+			remap[v] = v;
+		}
+		memset(touched, 0, numVert);
+
+		for( int i = 0; i < numCands && done < limit; ++i ) {
+			const collapse_t& c = cands[i];
+			if( c.error > maxCost ) {
+				break;
+			}
+			if( touched[c.from] || touched[c.to] ) {
+				continue;
+			}
+			if( R_CollapseFlips(verts, out, adjOffset, adjTris, c.from, c.to) ) {
+				continue;
+			}
+
+			remap[c.from] = c.to;
+			R_QuadricAdd(quadrics[c.to], quadrics[c.from]);
+			// Freeze the one ring so adjacency stays valid this pass
+			for( int j = adjOffset[c.from]; j < adjOffset[c.from + 1]; ++j ) {
+				const unsigned short * t = out + adjTris[j] * 3;
+				touched[t[0]] = touched[t[1]] = touched[t[2]] = 1;
+			}
+			touched[c.to] = 1;
+			worst = std::max(worst, (double)c.error);
+			done++;
+		}
+		if( !done ) {
+			break;
+		}
+
+		// Apply and drop triangles that collapsed to a line
+		int n = 0;
+		for( int i = 0; i < count; i += 3 ) {
+			int a = remap[out[i]], b = remap[out[i + 1]], c = remap[out[i + 2]];
+			if( a == b || b == c || c == a ) {
+				continue;
+			}
+			out[n++] = a;
+			out[n++] = b;
+			out[n++] = c;
+		}
+		count = n;
+	}
+
+	*resultError = (float)(sqrt(worst) / radius);
+
+	free(quadrics);
+	free(locked);
+	free(touched);
+	free(remap);
+	free(adjOffset);
+	free(adjTris);
+	free(cands);
+	return count;
+}
@@ -0,0 +1,29 @@
+/*
+ * ===============================================================
+ *
+ * Quadric error metric simplification (Garland & Heckbert).
+ *
+ * Edges are collapsed onto one of their end points, never onto a
+ * new position, so a simplified level is only a new index list
+ * over the original vertex array. All levels of a mesh share one
+ * vertex buffer and are drawn from ranges of one index buffer.
+ *
+ * Vertices on open borders and on uv seams (same position, more
+ * than one vertex) are locked to keep the silhouette and texture
+ * mapping intact.
+ *
+ *================================================================
+ */
+#ifndef _MESHSIMPLIFY_H
+#define _MESHSIMPLIFY_H
+
+#include "Mesh.h"
+
+// Simplify idx down to about targetIndex indices, stopping early
+// if collapse error exceeds maxError (relative to mesh radius).
+// out must hold numIndex entries. Returns index count written,
+// error reached is stored in resultError.
+int		R_SimplifyMesh(const vertex_t * verts, int numVert, const unsigned short * idx, int numIndex,
+						int targetIndex, float maxError, unsigned short * out, float * resultError);
+
+#endif /* !_MESHSIMPLIFY_H */
@@ -0,0 +1,293 @@
+#include "Occlusion.h"
+#include "Entity.h"
+#include "Mesh.h"
+#include "Thread.h"
+#include "Profiler.h"
+#include "Common.h"
+#include <math.h>
+#include <string.h>
+#include <cfloat>
+#include <algorithm>
+
+#if defined(__SSE__) || defined(_M_X64)
+	#include <xmmintrin.h>
+	#define OCC_SSE
+#endif
+
+extern Common * common;
+extern JobSystem * jobs;
+
+static inline int R_RoundUp(int v, int a)
+{
+	return ( v + a - 1 ) / a * a;
+}
+
+OcclusionBuffer::OcclusionBuffer() : viewW(0), viewH(0), width(0), height(0), depth(NULL), curNear(0.0f), curOccluders(NULL)
+{
+	for( int i = 0; i <= OCC_HIZ_LEVELS; ++i ) {
+		levels[i] = NULL;
+	}
+}
+
+OcclusionBuffer::~OcclusionBuffer()
+{
+	free(depth);
+}
+
+void OcclusionBuffer::Init(int w, int h)
+{
+	viewW = std::max(w, 1);
+	viewH = std::max(h, 1);
+	width = R_RoundUp(viewW, 1 << OCC_HIZ_LEVELS);
+	height = R_RoundUp(viewH, OCC_BAND_HEIGHT);
+
+	size_t total = 0;
+	for( int i = 0; i <= OCC_HIZ_LEVELS; ++i ) {
+		total += ( width >> i ) * ( height >> i );
+	}
+	free(depth);
+	depth = (float*)malloc(total * sizeof(float));
+	if( !depth ) {
+		common->FatalError("OcclusionBuffer: Cannot allocate more memory");
+	}
+	// Nothing drawn yet hides nothing
+	memset(depth, 0, total * sizeof(float));
+	float * p = depth;
+	for( int i = 0; i <= OCC_HIZ_LEVELS; ++i ) {
+		levels[i] = p;
+		p += ( width >> i ) * ( height >> i );
+	}
+}
+
+const float * OcclusionBuffer::GetLevel(int level, int& w, int& h) const
+{
+	w = width >> level;
+	h = height >> level;
+	return levels[level];
+}
+
+void OcclusionBuffer::Render(const Mat4& viewProj, float zNear, Entity ** occluders, int count)
+{
+	PROFILE_SCOPE("OcclusionRender");
+	curViewProj = viewProj;
+	curNear = zNear;
+	curOccluders = occluders;
+
+	// Triangles of each occluder go to a fixed slot so the
+	// setup jobs can write them without locking
+	triStart.resize(count + 1);
+	int numTris = 0;
+	for( int i = 0; i < count; ++i ) {
+		triStart[i] = numTris;
+		Mesh * mesh = occluders[i]->GetModel();
+		int level = 0;
+		while( level + 1 < mesh->GetNumLods() && mesh->GetLod(level).numIndex / 3 > OCC_MAX_TRIS ) {
+			level++;
+		}
+		numTris += mesh->GetLod(level).numIndex / 3;
+	}
+	triStart[count] = numTris;
+	tris.resize(numTris);
+
+	jobs->ParallelFor(count, 1, SetupJob, this);
+	jobs->ParallelFor(height / OCC_BAND_HEIGHT, 1, BandJob, this);
+	curOccluders = NULL;
+}
+
+// Occluders [begin, end) to screen space triangles
+void OcclusionBuffer::SetupJob(void * data, int begin, int end)
+{
+	OcclusionBuffer * ob = (OcclusionBuffer*)data;
+	for( int i = begin; i < end; ++i ) {
+		Entity * ent = ob->curOccluders[i];
+		Mesh * mesh = ent->GetModel();
+		int numTris = ob->triStart[i + 1] - ob->triStart[i];
+		int level = 0;
+		while( mesh->GetLod(level).numIndex / 3 != numTris ) {
+			level++;
+		}
+		const mesh_lod_t& lod = mesh->GetLod(level);
+		const unsigned short * idx = mesh->GetIndexArray() + lod.firstIndex;
+		const vertex_t * verts = mesh->GetVertexArray();
+		Mat4 clip = ob->curViewProj.RightMul(ent->GetRenderMat());
+
+		for( int t = 0; t < numTris; ++t ) {
+			occ_tri_t& tri = ob->tris[ob->triStart[i] + t];
+			tri.minX = 1;
+			tri.maxX = 0;
+			bool nearClipped = false;
+			for( int k = 0; k < 3; ++k ) {
+				Vec4 c = clip.Mul(verts[idx[t * 3 + k]].pos);
+				if( c[3] < ob->curNear ) {
+					nearClipped = true;
+					break;
+				}
+				float iw = 1.0f / c[3];
+				tri.x[k] = ( c[0] * iw * 0.5f + 0.5f ) * ob->viewW;
+				tri.y[k] = ( c[1] * iw * 0.5f + 0.5f ) * ob->viewH;
+				tri.iz[k] = iw;
+			}
+			if( nearClipped ) {
+				continue;
+			}
+			// Counter clockwise is front facing, same as GL
+			float area = ( tri.x[1] - tri.x[0] ) * ( tri.y[2] - tri.y[0] ) - ( tri.x[2] - tri.x[0] ) * ( tri.y[1] - tri.y[0] );
+			if( area <= 0.0f ) {
+				continue;
+			}
+			// Texels whose centers may be inside
+			float x0 = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+			float x1 = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+			float y0 = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+			float y1 = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+			tri.minX = std::max((int)ceilf(x0 - 0.5f), 0);
+			tri.maxX = std::min((int)floorf(x1 - 0.5f), ob->viewW - 1);
+			tri.minY = std::max((int)ceilf(y0 - 0.5f), 0);
+			tri.maxY = std::min((int)floorf(y1 - 0.5f), ob->viewH - 1);
+		}
+	}
+}
+
+void OcclusionBuffer::BandJob(void * data, int begin, int end)
+{
+	OcclusionBuffer * ob = (OcclusionBuffer*)data;
+	for( int band = begin; band < end; ++band ) {
+		ob->RasterBand(band);
+		ob->ReduceBand(band);
+	}
+}
+
+void OcclusionBuffer::RasterBand(int band)
+{
+	int bandY0 = band * OCC_BAND_HEIGHT;
+	int bandY1 = bandY0 + OCC_BAND_HEIGHT - 1;
+	float * rows = levels[0] + bandY0 * width;
+	memset(rows, 0, OCC_BAND_HEIGHT * width * sizeof(float));
+
+	for( size_t i = 0; i < tris.size(); ++i ) {
+		const occ_tri_t& tri = tris[i];
+		int y0 = std::max(tri.minY, bandY0);
+		int y1 = std::min(tri.maxY, bandY1);
+		if( tri.minX > tri.maxX || y0 > y1 ) {
+			continue;
+		}
+
+		// Edge k is opposite vertex k, E = A x + B y + C is
+		// positive inside and is twice the area of the sub
+		// triangle, so E / area is the barycentric of vertex k
+		float A[3], B[3], C[3];
+		for( int k = 0; k < 3; ++k ) {
+			int a = ( k + 1 ) % 3, b = ( k + 2 ) % 3;
+			A[k] = tri.y[a] - tri.y[b];
+			B[k] = tri.x[b] - tri.x[a];
+			C[k] = tri.x[a] * tri.y[b] - tri.x[b] * tri.y[a];
+		}
+		float invArea = 1.0f / ( C[0] + C[1] + C[2] );
+		float zA = ( A[0] * tri.iz[0] + A[1] * tri.iz[1] + A[2] * tri.iz[2] ) * invArea;
+		float zB = ( B[0] * tri.iz[0] + B[1] * tri.iz[1] + B[2] * tri.iz[2] ) * invArea;
+		float zC = ( C[0] * tri.iz[0] + C[1] * tri.iz[1] + C[2] * tri.iz[2] ) * invArea;
+
+		int x0 = tri.minX & ~3;
+		for( int y = y0; y <= y1; ++y ) {
+			float py = y + 0.5f;
+			float * row = levels[0] + y * width;
+#ifdef OCC_SSE
+			__m128 e0Row = _mm_set1_ps(B[0] * py + C[0]);
+			__m128 e1Row = _mm_set1_ps(B[1] * py + C[1]);
+			__m128 e2Row = _mm_set1_ps(B[2] * py + C[2]);
+			__m128 zRow = _mm_set1_ps(zB * py + zC);
+			__m128 a0 = _mm_set1_ps(A[0]), a1 = _mm_set1_ps(A[1]), a2 = _mm_set1_ps(A[2]);
+			__m128 za = _mm_set1_ps(zA);
+			const __m128 zero = _mm_setzero_ps();
+			for( int x = x0; x <= tri.maxX; x += 4 ) {
+				__m128 px = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+				__m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), e0Row);
+				__m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), e1Row);
+				__m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), e2Row);
+				__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)), _mm_cmpge_ps(e2, zero));
+				__m128 z = _mm_add_ps(_mm_mul_ps(za, px), zRow);
+				__m128 old = _mm_loadu_ps(row + x);
+				__m128 closer = _mm_max_ps(old, z);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, closer), _mm_andnot_ps(inside, old)));
+			}
+#else
+			for( int x = x0; x <= tri.maxX; ++x ) {
+				float px = x + 0.5f;
+				if( A[0] * px + B[0] * py + C[0] >= 0.0f && A[1] * px + B[1] * py + C[1] >= 0.0f
+					&& A[2] * px + B[2] * py + C[2] >= 0.0f ) {
+					float z = zA * px + zB * py + zC;
+					row[x] = std::max(row[x], z);
+				}
+			}
+#endif
+		}
+	}
+}
+
+// Each level keeps the farthest of the 2x2 below it
+void OcclusionBuffer::ReduceBand(int band)
+{
+	for( int level = 1; level <= OCC_HIZ_LEVELS; ++level ) {
+		int w = width >> level;
+		int srcW = width >> ( level - 1 );
+		int y0 = ( band * OCC_BAND_HEIGHT ) >> level;
+		int y1 = ( ( band + 1 ) * OCC_BAND_HEIGHT ) >> level;
+		const float * src = levels[level - 1];
+		float * dst = levels[level];
+		for( int y = y0; y < y1; ++y ) {
+			const float * r0 = src + ( y * 2 ) * srcW;
+			const float * r1 = r0 + srcW;
+			for( int x = 0; x < w; ++x ) {
+				float a = std::min(r0[x * 2], r0[x * 2 + 1]);
+				float b = std::min(r1[x * 2], r1[x * 2 + 1]);
+				dst[y * w + x] = std::min(a, b);
+			}
+		}
+	}
+}
+
+bool OcclusionBuffer::IsOccluded(const Mat4& clip, const Vec3& mins, const Vec3& maxs) const
+{
+	float x0 = FLT_MAX, x1 = -FLT_MAX, y0 = FLT_MAX, y1 = -FLT_MAX;
+	float nearest = 0.0f;
+	for( int i = 0; i < 8; ++i ) {
+		Vec3 p(( i & 1 ) ? maxs[0] : mins[0], ( i & 2 ) ? maxs[1] : mins[1], ( i & 4 ) ? maxs[2] : mins[2]);
+		Vec4 c = clip.Mul(p);
+		if( c[3] < curNear ) {
+			// Reaches the camera, too close to tell
+			return false;
+		}
+		float iw = 1.0f / c[3];
+		float sx = ( c[0] * iw * 0.5f + 0.5f ) * viewW;
+		float sy = ( c[1] * iw * 0.5f + 0.5f ) * viewH;
+		x0 = std::min(x0, sx);
+		x1 = std::max(x1, sx);
+		y0 = std::min(y0, sy);
+		y1 = std::max(y1, sy);
+		nearest = std::max(nearest, iw);
+	}
+
+	int tx0 = std::max((int)floorf(x0), 0);
+	int tx1 = std::min((int)floorf(x1), viewW - 1);
+	int ty0 = std::max((int)floorf(y0), 0);
+	int ty1 = std::min((int)floorf(y1), viewH - 1);
+	if( tx0 > tx1 || ty0 > ty1 ) {
+		return false;
+	}
+
+	// Coarsest level the box spans at most 2x2 blocks of
+	int level = 0;
+	while( level < OCC_HIZ_LEVELS && ( ( tx1 >> level ) - ( tx0 >> level ) > 1 || ( ty1 >> level ) - ( ty0 >> level ) > 1 ) ) {
+		level++;
+	}
+	int w = width >> level;
+	const float * hiz = levels[level];
+	for( int y = ty0 >> level; y <= ty1 >> level; ++y ) {
+		for( int x = tx0 >> level; x <= tx1 >> level; ++x ) {
+			if( hiz[y * w + x] <= nearest ) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
@@ -0,0 +1,96 @@
+/*
+ * ===============================================================
+ *
+ * Software occlusion culling.
+ *
+ * A few big occluders are drawn into a small CPU depth buffer,
+ * then the bounding box of every other entity is tested against
+ * it before it goes into the render queue.
+ *
+ * The buffer holds 1/w, which is linear across a triangle on
+ * screen; larger is closer and 0 is empty. Rows are split into
+ * bands of OCC_BAND_HEIGHT, one job each, so workers never write
+ * the same texel. Each band also reduces its own part of the
+ * hierarchical Z pyramid, every level keeping the farthest depth
+ * of the 2x2 texels under it. A box is hidden if its nearest
+ * point is behind the farthest occluder depth in every pyramid
+ * block it covers.
+ *
+ * Four texels of a row are filled at a time with SSE where it is
+ * there. Occluders are drawn front faces only, from the finest
+ * LOD under OCC_MAX_TRIS. Triangles crossing the near plane are
+ * left out, which only ever makes the buffer hide less.
+ *
+ *================================================================
+ */
+#ifndef _OCCLUSION_H
+#define _OCCLUSION_H
+
+#include "Math.h"
+#include <vector>
+
+class Entity;
+
+// Window pixels per depth texel along each axis
+#define OCC_DOWNSCALE		4
+// Levels above the full buffer, block of the last is 16x16
+#define OCC_HIZ_LEVELS		4
+// Rows per raster job, a whole block of the last level
+#define OCC_BAND_HEIGHT		( 1 << OCC_HIZ_LEVELS )
+#define OCC_MAX_OCCLUDERS	16
+// Share of the screen a bounding sphere needs to be picked
+#define OCC_MIN_SCREEN_AREA	0.02f
+// Triangles per occluder, coarser LODs are used above this
+#define OCC_MAX_TRIS		1024
+
+// One occluder triangle on screen
+struct occ_tri_t {
+	float			x[3], y[3];
+	float			iz[3];			// 1/w
+	int				minX, maxX;		// inclusive texel bounds, empty if minX > maxX
+	int				minY, maxY;
+};
+
+class OcclusionBuffer
+{
+public:
+					OcclusionBuffer();
+					~OcclusionBuffer();
+
+	// Size of the view in depth texels
+	void			Init(int viewWidth, int viewHeight);
+
+	// Clear, draw the occluders and build the pyramid. Spreads
+	// the work over the job system and returns when done.
+	void			Render(const Mat4& viewProj, float zNear, Entity ** occluders, int count);
+	// clip is projection x view x model, box is in model space
+	bool			IsOccluded(const Mat4& clip, const Vec3& mins, const Vec3& maxs) const;
+
+	int				GetNumTris() const { return (int)tris.size(); }
+	// Texels of a pyramid level, for debugging
+	const float *	GetLevel(int level, int& w, int& h) const;
+
+private:
+	static void		SetupJob(void * data, int begin, int end);
+	static void		BandJob(void * data, int begin, int end);
+	void			RasterBand(int band);
+	void			ReduceBand(int band);
+
+private:
+	int				viewW, viewH;
+	int				width, height;		// padded to whole bands and blocks
+	float *			depth;				// all levels, level 0 first
+	float *			levels[OCC_HIZ_LEVELS + 1];
+
+	// Current Render call
+	Mat4			curViewProj;
+	float			curNear;
+	Entity **		curOccluders;
+	std::vector<int>		triStart;	// first tri of each occluder
+	std::vector<occ_tri_t>	tris;
+
+	OcclusionBuffer(const OcclusionBuffer&) {}
+	OcclusionBuffer& operator=(const OcclusionBuffer&) { return *this; }
+};
+
+#endif /* !_OCCLUSION_H */
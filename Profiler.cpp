@@ -0,0 +1,302 @@
+#include "Profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+// Single producer (owning thread), single consumer (Drain)
+struct profile_ring_t {
+	profile_zone_t	zones[PROFILE_RING_SIZE];
+	volatile unsigned int	head;	// written by owner only
+	volatile unsigned int	tail;	// written by Drain only
+	int				depth;
+	int				id;
+	unsigned int	dropped;
+	char			name[32];
+};
+
+static profile_ring_t *	rings[PROFILE_MAX_THREADS];
+static volatile int		numRings;
+static __thread profile_ring_t * threadRing;
+
+profile_time_t Sys_Nanoseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (profile_time_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Ring of calling thread, registered on first use
+static profile_ring_t * R_ThreadRing()
+{
+	if( threadRing ) {
+		return threadRing;
+	}
+	int id = __sync_fetch_and_add(&numRings, 1);
+	if( id >= PROFILE_MAX_THREADS ) {
+		return NULL;
+	}
+	profile_ring_t * ring = (profile_ring_t*)calloc(1, sizeof(profile_ring_t));
+	if( !ring ) {
+		return NULL;
+	}
+	ring->id = id;
+	snprintf(ring->name, sizeof(ring->name), "thread %d", id);
+	// Contents before the pointer becomes visible to Drain
+	__sync_synchronize();
+	rings[id] = ring;
+	threadRing = ring;
+	return ring;
+}
+
+Profiler::Profiler() : frameStart(0), numFrames(0), sinceSummary(0), capturing(false), capturedGpu(false), logger(NULL)
+{
+	captureStart = Sys_Nanoseconds();
+	memset(frameMs, 0, sizeof(frameMs));
+	capturePath[0] = '\0';
+}
+
+Profiler::~Profiler()
+{
+	if( capturing ) {
+		StopCapture();
+	}
+}
+
+void Profiler::SetThreadName(const char * name)
+{
+	profile_ring_t * ring = R_ThreadRing();
+	if( ring ) {
+		snprintf(ring->name, sizeof(ring->name), "%s", name);
+	}
+}
+
+int Profiler::EnterZone()
+{
+	profile_ring_t * ring = R_ThreadRing();
+	return ring ? ring->depth++ : -1;
+}
+
+void Profiler::LeaveZone(const char * name, profile_time_t begin, int depth)
+{
+	profile_time_t end = Sys_Nanoseconds();
+	profile_ring_t * ring = threadRing;
+	if( !ring || depth < 0 ) {
+		return;
+	}
+	ring->depth = depth;
+
+	unsigned int head = ring->head;
+	if( head - ring->tail >= PROFILE_RING_SIZE ) {
+		// Nobody drained in time
+		ring->dropped++;
+		return;
+	}
+	profile_zone_t * z = &ring->zones[head & (PROFILE_RING_SIZE - 1)];
+	z->name = name;
+	z->begin = begin;
+	z->end = end;
+	z->depth = depth;
+	// Zone is complete before Drain can see it
+	__sync_synchronize();
+	ring->head = head + 1;
+}
+
+void Profiler::BeginFrame()
+{
+	frameStart = Sys_Nanoseconds();
+}
+
+void Profiler::EndFrame()
+{
+	profile_time_t now = Sys_Nanoseconds();
+	frameMs[numFrames % PROFILE_FRAME_HISTORY] = (now - frameStart) * 1e-6f;
+	numFrames++;
+
+	Drain();
+
+	if( ++sinceSummary >= PROFILE_SUMMARY_FRAMES ) {
+		LogSummary();
+	}
+}
+
+void Profiler::Drain()
+{
+	int count = std::min((int)numRings, PROFILE_MAX_THREADS);
+	for( int r = 0; r < count; ++r ) {
+		profile_ring_t * ring = rings[r];
+		if( !ring ) {
+			// Registered, not published yet
+			continue;
+		}
+		unsigned int head = ring->head;
+		__sync_synchronize();
+
+		for( unsigned int t = ring->tail; t != head; ++t ) {
+			const profile_zone_t& z = ring->zones[t & (PROFILE_RING_SIZE - 1)];
+
+			AddTotal(z.name, z.end - z.begin);
+			if( capturing ) {
+				captured.push_back(z);
+				capturedThread.push_back(ring->id);
+			}
+		}
+		// Slots are read before the owner may reuse them
+		__sync_synchronize();
+		ring->tail = head;
+	}
+}
+
+void Profiler::AddTotal(const char * name, profile_time_t time)
+{
+	size_t i = 0;
+	while( i < totals.size() && totals[i].name != name ) {
+		i++;
+	}
+	if( i == totals.size() ) {
+		profile_total_t zt = { name, 0, 0 };
+		totals.push_back(zt);
+	}
+	totals[i].total += time;
+	totals[i].count++;
+}
+
+void Profiler::AddGpuZone(const char * name, profile_time_t begin, profile_time_t end)
+{
+	AddTotal(name, end - begin);
+	if( capturing ) {
+		profile_zone_t z = { name, begin, end, 0 };
+		captured.push_back(z);
+		capturedThread.push_back(PROFILE_GPU_TRACK);
+		capturedGpu = true;
+	}
+}
+
+void Profiler::GetFramePercentiles(float * p50, float * p95, float * p99) const
+{
+	int n = std::min(numFrames, PROFILE_FRAME_HISTORY);
+	if( !n ) {
+		*p50 = *p95 = *p99 = 0.0f;
+		return;
+	}
+	float sorted[PROFILE_FRAME_HISTORY];
+	memcpy(sorted, frameMs, n * sizeof(float));
+	std::sort(sorted, sorted + n);
+	*p50 = sorted[(int)(0.50f * (n - 1) + 0.5f)];
+	*p95 = sorted[(int)(0.95f * (n - 1) + 0.5f)];
+	*p99 = sorted[(int)(0.99f * (n - 1) + 0.5f)];
+}
+
+static bool R_ZoneTotalCmp(const profile_total_t& a, const profile_total_t& b)
+{
+	return a.total > b.total;
+}
+
+void Profiler::LogSummary()
+{
+	float p50, p95, p99;
+	GetFramePercentiles(&p50, &p95, &p99);
+
+	char line[256];
+	snprintf(line, sizeof(line), "Frame ms over last %d: p50 %.2f p95 %.2f p99 %.2f",
+		std::min(numFrames, PROFILE_FRAME_HISTORY), p50, p95, p99);
+	if( logger ) {
+		LOG_NORMAL(logger, LC_PROFILE, "%s", line);
+	} else {
+		printf("%s\n", line);
+	}
+
+	// Most expensive zones, per frame averages
+	std::sort(totals.begin(), totals.end(), R_ZoneTotalCmp);
+	for( size_t i = 0; i < totals.size() && i < 8; ++i ) {
+		snprintf(line, sizeof(line), "  %-24s %8.3f ms/frame %6d calls/frame", totals[i].name,
+			totals[i].total * 1e-6f / sinceSummary, totals[i].count / sinceSummary);
+		if( logger ) {
+			LOG_NORMAL(logger, LC_PROFILE, "%s", line);
+		} else {
+			printf("%s\n", line);
+		}
+	}
+
+	int count = std::min((int)numRings, PROFILE_MAX_THREADS);
+	for( int r = 0; r < count; ++r ) {
+		if( rings[r] && rings[r]->dropped ) {
+			snprintf(line, sizeof(line), "  %s dropped %u zones, ring too small", rings[r]->name, rings[r]->dropped);
+			if( logger ) {
+				LOG_WARNING(logger, LC_PROFILE, "%s", line);
+			} else {
+				printf("%s\n", line);
+			}
+			rings[r]->dropped = 0;
+		}
+	}
+
+	totals.clear();
+	sinceSummary = 0;
+}
+
+void Profiler::StartCapture(const char * path)
+{
+	snprintf(capturePath, sizeof(capturePath), "%s", path);
+	// Whatever was recorded before belongs to no capture
+	Drain();
+	captured.clear();
+	capturedThread.clear();
+	capturedGpu = false;
+	captureStart = Sys_Nanoseconds();
+	capturing = true;
+}
+
+void Profiler::StopCapture()
+{
+	if( !capturing ) {
+		return;
+	}
+	Drain();
+	capturing = false;
+	if( !WriteTrace() ) {
+		fprintf(stderr, "Cannot write trace %s\n", capturePath);
+	}
+	captured.clear();
+	capturedThread.clear();
+}
+
+// Chrome trace event format, complete ("X") events in microseconds
+bool Profiler::WriteTrace()
+{
+	FILE * fp = fopen(capturePath, "w");
+	if( !fp ) {
+		return false;
+	}
+	fprintf(fp, "{\"traceEvents\":[\n");
+	int count = std::min((int)numRings, PROFILE_MAX_THREADS);
+	bool first = true;
+	for( int r = 0; r < count; ++r ) {
+		if( !rings[r] ) {
+			continue;
+		}
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", rings[r]->id, rings[r]->name);
+		first = false;
+	}
+	if( capturedGpu ) {
+		fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}",
+			first ? "" : ",\n", PROFILE_GPU_TRACK);
+		first = false;
+	}
+	for( size_t i = 0; i < captured.size(); ++i ) {
+		const profile_zone_t& z = captured[i];
+		if( z.begin < captureStart ) {
+			continue;
+		}
+		fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+			first ? "" : ",\n", z.name, capturedThread[i],
+			(z.begin - captureStart) * 1e-3, (z.end - z.begin) * 1e-3);
+		first = false;
+	}
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
@@ -0,0 +1,141 @@
+/*
+ * ===============================================================
+ *
+ * CPU frame profiler.
+ *
+ * PROFILE_SCOPE("name") times the rest of the enclosing block.
+ * Every thread writes finished zones into its own ring buffer,
+ * which the main thread drains once per frame, so recording takes
+ * no lock: one clock_gettime on entry, one on exit and a store.
+ * Zone names must be string literals, only the pointer is kept.
+ *
+ * Drained zones feed a rolling summary (frame time percentiles and
+ * the most expensive zones) and, while a capture is running, a
+ * Chrome trace file (chrome://tracing, Perfetto).
+ *
+ * Build with QENGINE_NO_PROFILE to compile the scopes out.
+ *
+ *================================================================
+ */
+#ifndef _PROFILER_H
+#define _PROFILER_H
+
+#include <vector>
+#include "Log.h"
+
+// Zones a thread can record between two drains, power of two
+#define PROFILE_RING_SIZE		8192
+#define PROFILE_MAX_THREADS		32
+// Trace track of zones measured on the GPU
+#define PROFILE_GPU_TRACK		PROFILE_MAX_THREADS
+// Frames the percentiles are taken over
+#define PROFILE_FRAME_HISTORY	256
+// Log a summary this often
+#define PROFILE_SUMMARY_FRAMES	300
+
+typedef unsigned long long	profile_time_t;
+
+// Monotonic nanoseconds
+profile_time_t	Sys_Nanoseconds();
+
+struct profile_zone_t {
+	const char *	name;
+	profile_time_t	begin;
+	profile_time_t	end;
+	int				depth;
+};
+
+// Time spent in one zone name over a summary window
+struct profile_total_t {
+	const char *	name;
+	profile_time_t	total;
+	int				count;
+};
+
+struct profile_ring_t;
+
+class Profiler
+{
+public:
+					Profiler();
+					~Profiler();
+
+	// Shows up as the thread name in traces; call on the thread
+	static void		SetThreadName(const char * name);
+
+	// Main thread, around each frame. EndFrame drains the rings.
+	void			BeginFrame();
+	void			EndFrame();
+
+	// Keep every zone from now on and write them as Chrome trace
+	// JSON on StopCapture
+	void			StartCapture(const char * path);
+	void			StopCapture();
+	bool			IsCapturing() const { return capturing; }
+
+	// Frame time percentiles over the history, in milliseconds
+	void			GetFramePercentiles(float * p50, float * p95, float * p99) const;
+	void			SetLogger(Log * l) { logger = l; }
+
+	// Zone measured on the GPU, already in Sys_Nanoseconds time
+	void			AddGpuZone(const char * name, profile_time_t begin, profile_time_t end);
+
+	// Zone recording, used by ProfileScope
+	static int		EnterZone();
+	static void		LeaveZone(const char * name, profile_time_t begin, int depth);
+
+private:
+	void			Drain();
+	void			AddTotal(const char * name, profile_time_t time);
+	void			LogSummary();
+	bool			WriteTrace();
+
+private:
+	profile_time_t	frameStart;
+	profile_time_t	captureStart;
+	float			frameMs[PROFILE_FRAME_HISTORY];
+	int				numFrames;		// ever recorded
+	int				sinceSummary;
+
+	// Zone totals since the last summary
+	std::vector<profile_total_t>	totals;
+
+	bool			capturing;
+	char			capturePath[256];
+	// Captured zones with the thread that ran them
+	std::vector<profile_zone_t>	captured;
+	std::vector<int>			capturedThread;
+	bool			capturedGpu;
+
+	Log *			logger;
+
+	Profiler(const Profiler&) {}
+	Profiler& operator=(const Profiler&) { return *this; }
+};
+
+class ProfileScope
+{
+public:
+					ProfileScope(const char * zoneName) : name(zoneName) {
+						depth = Profiler::EnterZone();
+						begin = Sys_Nanoseconds();
+					}
+					~ProfileScope() {
+						Profiler::LeaveZone(name, begin, depth);
+					}
+
+private:
+	const char *	name;
+	profile_time_t	begin;
+	int				depth;
+};
+
+#ifdef QENGINE_NO_PROFILE
+#define PROFILE_SCOPE(name)
+#else
+#define PROFILE_CONCAT2(a, b)	a##b
+#define PROFILE_CONCAT(a, b)	PROFILE_CONCAT2(a, b)
+#define PROFILE_SCOPE(name)		ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#endif
+
+#endif /* !_PROFILER_H */
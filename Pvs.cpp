@@ -0,0 +1,231 @@
+#include "Pvs.h"
+#include "WorldDB.h"
+#include "Mesh.h"
+#include "Thread.h"
+#include <cfloat>
+#include <algorithm>
+#include <map>
+
+extern JobSystem * jobs;
+
+// Ray ends this far short of its target, so a target point on a
+// surface doesn't hit that surface
+#define PVS_RAY_END			0.999f
+// Target points on an entity box are pulled in by this much
+#define PVS_TARGET_INSET	0.1f
+
+PvsBuilder::PvsBuilder() : instances(NULL), maxDistance(0.0f), info(NULL)
+{
+}
+
+bool PvsBuilder::Build(const std::vector<pvs_instance_t>& inst, float distance, bmap_pvs_t& out,
+	std::vector<bmap_pvs_cell_t>& cells, std::vector<bmap_pvs_word_t>& words)
+{
+	instances = &inst;
+	maxDistance = distance;
+	info = &out;
+
+	// World space boxes, rays go into model space to meet the
+	// full detail triangles
+	int n = (int)inst.size();
+	mins.resize(n);
+	maxs.resize(n);
+	toModel.resize(n);
+	Vec3 gridMins(FLT_MAX), gridMaxs(-FLT_MAX);
+	for( int i = 0; i < n; ++i ) {
+		const Mesh * mesh = inst[i].mesh;
+		const Mat4& m = inst[i].pos;
+		const Vec3& bmin = mesh->GetBoundMins();
+		const Vec3& bmax = mesh->GetBoundMaxs();
+		mins[i] = Vec3(FLT_MAX);
+		maxs[i] = Vec3(-FLT_MAX);
+		for( int c = 0; c < 8; ++c ) {
+			Vec4 p = m.Mul(Vec3(( c & 1 ) ? bmax[0] : bmin[0], ( c & 2 ) ? bmax[1] : bmin[1], ( c & 4 ) ? bmax[2] : bmin[2]));
+			for( int k = 0; k < 3; ++k ) {
+				mins[i][k] = std::min(mins[i][k], p[k]);
+				maxs[i][k] = std::max(maxs[i][k], p[k]);
+			}
+		}
+		// Background can be as big as the sky, it doesn't
+		// decide where the camera goes
+		if( !inst[i].background ) {
+			for( int k = 0; k < 3; ++k ) {
+				gridMins[k] = std::min(gridMins[k], mins[i][k]);
+				gridMaxs[k] = std::max(gridMaxs[k], maxs[i][k]);
+			}
+		}
+		toModel[i] = m.AffineInverse();
+	}
+	if( gridMins[0] > gridMaxs[0] ) {
+		return false;
+	}
+
+	float cellSize = PVS_CELL_SIZE;
+	float sizeX = gridMaxs[0] - gridMins[0];
+	float sizeZ = gridMaxs[2] - gridMins[2];
+	while( ( (int)( sizeX / cellSize ) + 1 ) * ( (int)( sizeZ / cellSize ) + 1 ) > PVS_MAX_CELLS ) {
+		cellSize *= 2.0f;
+	}
+	out.origin[0] = gridMins[0];
+	out.origin[1] = gridMins[2];
+	out.cellSize = cellSize;
+	out.cellsX = (int)( sizeX / cellSize ) + 1;
+	out.cellsZ = (int)( sizeZ / cellSize ) + 1;
+	out.minY = gridMins[1];
+	out.maxY = gridMaxs[1] + PVS_HEADROOM;
+
+	int numCells = out.cellsX * out.cellsZ;
+	cellWords.assign(numCells, std::vector<bmap_pvs_word_t>());
+	jobs->ParallelFor(numCells, 1, CellJob, this);
+
+	// Neighbouring cells often see the same
+	std::map<std::vector<unsigned int>, unsigned int> shared;
+	std::vector<unsigned int> key;
+	cells.resize(numCells);
+	words.clear();
+	for( int i = 0; i < numCells; ++i ) {
+		const std::vector<bmap_pvs_word_t>& cw = cellWords[i];
+		key.clear();
+		for( size_t k = 0; k < cw.size(); ++k ) {
+			key.push_back(cw[k].index);
+			key.push_back(cw[k].bits);
+		}
+		std::map<std::vector<unsigned int>, unsigned int>::iterator it = shared.find(key);
+		if( it == shared.end() ) {
+			it = shared.insert(std::make_pair(key, (unsigned int)words.size())).first;
+			words.insert(words.end(), cw.begin(), cw.end());
+		}
+		cells[i].firstWord = it->second;
+		cells[i].numWords = (unsigned int)cw.size();
+	}
+	cellWords.clear();
+	return true;
+}
+
+void PvsBuilder::CellJob(void * data, int begin, int end)
+{
+	PvsBuilder * pb = (PvsBuilder*)data;
+	std::vector<int> nearby;
+	std::vector<unsigned int> row(( pb->instances->size() + 31 ) / 32);
+	for( int cell = begin; cell < end; ++cell ) {
+		pb->BuildCell(cell, nearby, row);
+	}
+}
+
+void PvsBuilder::BuildCell(int cell, std::vector<int>& nearby, std::vector<unsigned int>& row)
+{
+	int cx = cell % info->cellsX;
+	int cz = cell / info->cellsX;
+	Vec3 cellMins(info->origin[0] + cx * info->cellSize, info->minY, info->origin[1] + cz * info->cellSize);
+	Vec3 cellMaxs(cellMins[0] + info->cellSize, info->maxY, cellMins[2] + info->cellSize);
+	std::fill(row.begin(), row.end(), 0);
+
+	// Entities in view distance of the cell are the targets
+	// and the only things that can block a ray
+	nearby.clear();
+	for( size_t i = 0; i < instances->size(); ++i ) {
+		float d2 = 0.0f;
+		for( int k = 0; k < 3; ++k ) {
+			float d = std::max(std::max(cellMins[k] - maxs[i][k], mins[i][k] - cellMaxs[k]), 0.0f);
+			d2 += d * d;
+		}
+		if( d2 <= maxDistance * maxDistance ) {
+			nearby.push_back((int)i);
+		}
+	}
+
+	Vec3 samples[PVS_CELL_SAMPLES * PVS_CELL_SAMPLES * PVS_HEIGHT_SAMPLES];
+	int numSamples = 0;
+	// Corners and edges included, the camera can be there
+	float step = PVS_CELL_SAMPLES > 1 ? 1.0f / ( PVS_CELL_SAMPLES - 1 ) : 0.0f;
+	float stepY = PVS_HEIGHT_SAMPLES > 1 ? 1.0f / ( PVS_HEIGHT_SAMPLES - 1 ) : 0.0f;
+	for( int y = 0; y < PVS_HEIGHT_SAMPLES; ++y ) {
+		for( int z = 0; z < PVS_CELL_SAMPLES; ++z ) {
+			for( int x = 0; x < PVS_CELL_SAMPLES; ++x ) {
+				float fx = PVS_CELL_SAMPLES > 1 ? x * step : 0.5f;
+				float fz = PVS_CELL_SAMPLES > 1 ? z * step : 0.5f;
+				float fy = PVS_HEIGHT_SAMPLES > 1 ? y * stepY : 0.5f;
+				samples[numSamples++] = Vec3(cellMins[0] + fx * info->cellSize, cellMins[1] + fy * ( cellMaxs[1] - cellMins[1] ),
+					cellMins[2] + fz * info->cellSize);
+			}
+		}
+	}
+
+	for( size_t t = 0; t < nearby.size(); ++t ) {
+		int target = nearby[t];
+		bool visible = ( *instances )[target].background;
+		// Sharing space with the camera
+		bool overlaps = true;
+		for( int k = 0; k < 3; ++k ) {
+			overlaps = overlaps && mins[target][k] <= cellMaxs[k] && maxs[target][k] >= cellMins[k];
+		}
+		visible = visible || overlaps;
+
+		// Center first, it is the most likely to be seen
+		Vec3 center = ( mins[target] + maxs[target] ).Scale(0.5f);
+		for( int c = -1; c < 8 && !visible; ++c ) {
+			Vec3 to = center;
+			if( c >= 0 ) {
+				Vec3 corner(( c & 1 ) ? maxs[target][0] : mins[target][0], ( c & 2 ) ? maxs[target][1] : mins[target][1],
+					( c & 4 ) ? maxs[target][2] : mins[target][2]);
+				to = corner + ( center - corner ).Scale(PVS_TARGET_INSET);
+			}
+			for( int s = 0; s < numSamples && !visible; ++s ) {
+				visible = !IsBlocked(samples[s], to, target, nearby);
+			}
+		}
+		if( visible ) {
+			row[target >> 5] |= 1u << ( target & 31 );
+		}
+	}
+
+	std::vector<bmap_pvs_word_t>& out = cellWords[cell];
+	for( size_t i = 0; i < row.size(); ++i ) {
+		if( row[i] ) {
+			bmap_pvs_word_t w = { (unsigned int)i, row[i] };
+			out.push_back(w);
+		}
+	}
+}
+
+// Any triangle of another nearby entity on the segment
+bool PvsBuilder::IsBlocked(const Vec3& from, const Vec3& to, int target, const std::vector<int>& nearby) const
+{
+	Vec3 dir = to - from;
+	float invDir[3];
+	for( int k = 0; k < 3; ++k ) {
+		invDir[k] = dir[k] != 0.0f ? 1.0f / dir[k] : FLT_MAX;
+	}
+	for( size_t i = 0; i < nearby.size(); ++i ) {
+		int e = nearby[i];
+		if( e == target ) {
+			continue;
+		}
+		// Segment against the entity box
+		float tmin = 0.0f, tmax = PVS_RAY_END;
+		for( int k = 0; k < 3 && tmin <= tmax; ++k ) {
+			float t0 = ( mins[e][k] - from[k] ) * invDir[k];
+			float t1 = ( maxs[e][k] - from[k] ) * invDir[k];
+			if( t0 > t1 ) {
+				std::swap(t0, t1);
+			}
+			tmin = std::max(tmin, t0);
+			tmax = std::min(tmax, t1);
+		}
+		if( tmin > tmax ) {
+			continue;
+		}
+
+		// Same t in model space, the transform is affine. Both
+		// sides of a triangle block.
+		const Mat4& m = toModel[e];
+		Vec4 o = m.Mul(from);
+		Vec4 d = m.Mul(Vec4(dir[0], dir[1], dir[2], 0.0f));
+		ray_hit_t hit;
+		hit.t = PVS_RAY_END;
+		if( ( *instances )[e].mesh->GetBvh().Intersect(Vec3(o[0], o[1], o[2]), Vec3(d[0], d[1], d[2]), hit, true) ) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,80 @@
+/*
+ * ===============================================================
+ *
+ * Potentially visible set of a static map, built offline.
+ *
+ * The ground the map covers is split into square cells of
+ * PVS_CELL_SIZE, each one spanning the height of the map plus
+ * some headroom. Rays go from sample points spread over a cell
+ * to points on the bounding box of every entity within view
+ * distance. An entity is visible from the cell as soon as one
+ * ray reaches it without hitting a triangle of another entity,
+ * which the Bvh of that entity's mesh answers.
+ * Background entities are always visible.
+ *
+ * Each cell keeps a bitset of one bit per entity, in the order
+ * of the cooked instances, stored as its words that are not 0.
+ * Cooking sorts instances by place, so what a cell sees falls
+ * into few words. The renderer finds the camera cell and tests
+ * 32 entities a word. Sampling can miss gaps narrower than the
+ * sample spacing. Cells are built in parallel on the job system.
+ *
+ *================================================================
+ */
+#ifndef _PVS_H
+#define _PVS_H
+
+#include "Math.h"
+#include <vector>
+
+class Mesh;
+struct bmap_pvs_t;
+struct bmap_pvs_cell_t;
+struct bmap_pvs_word_t;
+
+#define PVS_CELL_SIZE		8.0f
+// Grids over this many cells get bigger cells instead
+#define PVS_MAX_CELLS		65536
+// Sample points along x and z of a cell, and heights
+#define PVS_CELL_SAMPLES	3
+#define PVS_HEIGHT_SAMPLES	2
+// Camera space above the tallest entity that still has cells
+#define PVS_HEADROOM		PVS_CELL_SIZE
+
+struct pvs_instance_t {
+	Mesh *		mesh;
+	Mat4		pos;
+	bool		background;
+};
+
+class PvsBuilder
+{
+public:
+					PvsBuilder();
+
+	// instances are in cooked order. Nothing further than
+	// maxDistance from a cell is visible from it. Returns false
+	// if there is nothing to build cells around.
+	bool			Build(const std::vector<pvs_instance_t>& instances, float maxDistance,
+						bmap_pvs_t& info, std::vector<bmap_pvs_cell_t>& cells, std::vector<bmap_pvs_word_t>& words);
+
+private:
+	static void		CellJob(void * data, int begin, int end);
+	// nearby and row are scratch of the calling job
+	void			BuildCell(int cell, std::vector<int>& nearby, std::vector<unsigned int>& row);
+	bool			IsBlocked(const Vec3& from, const Vec3& to, int target, const std::vector<int>& nearby) const;
+
+private:
+	const std::vector<pvs_instance_t> *	instances;
+	float					maxDistance;
+	bmap_pvs_t *			info;
+	// Words of each cell until they are merged
+	std::vector< std::vector<bmap_pvs_word_t> >	cellWords;
+	// Per instance, world space
+	std::vector<Vec3>		mins;
+	std::vector<Vec3>		maxs;
+	// World to model, rays are tested against the mesh Bvh
+	std::vector<Mat4>		toModel;
+};
+
+#endif /* !_PVS_H */
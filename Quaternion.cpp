@@ -1,15 +1,17 @@
 #include "Quaternion.h"
+#include <string.h>
 
 
 // This will blow out your mind
 static float InvSqrt( float x )
 {
-    long i;
+    // Has to be 32 bits, long reads past x on 64 bit targets
+    int i;
     float y, r;
     y = x * 0.5f;
-    i = *(long*)(&x);
+    memcpy(&i, &x, sizeof(i));
     i = 0x5f3759df - ( i >> 1 );
-    r = *(float*)(&i);
+    memcpy(&r, &i, sizeof(r));
     r = r * ( 1.5f - r * r * y );
 
     return r;
@@ -81,14 +83,14 @@ Mat3 Quaternion::ToMatrix() const
         float xy2 = w[0] * y2;
         float wz2 = w[3] * z2;
         m[0][1] = xy2 - wz2;
-        m[1][0] = xy2 - wz2;
+        m[1][0] = xy2 + wz2;
     }
 
     {
         float xz2 = w[0] * z2;
         float wy2 = w[3] * y2;
         m[2][0] = xz2 - wy2;
-        m[1][2] = xz2 - wy2;
+        m[0][2] = xz2 + wy2;
     }
 
     return m;
@@ -1,43 +1,83 @@
 #include "String.h"
 
-qStr::qStr() : data(NULL), len(0)
+qStr::qStr() : data(buffer), len(0), alloced(0)
 {
+	buffer[0] = '\0';
 }
 
-qStr::qStr(const char *s)
+qStr::qStr(const char *s) : data(buffer), len(0), alloced(0)
 {
-	size_t l = strlen(s);
-	data = (char*)malloc(l+1);
-	memcpy(data, s, l + 1); // Copy the '\0' too
-	len = l;
+	Set(s, s ? strlen(s) : 0);
 }
 
-qStr::qStr(const char *s, int l)
+qStr::qStr(const char *s, int l) : data(buffer), len(0), alloced(0)
 {
 	int nLen = strlen(s);
 	if( l <= 0 || l > nLen )
 		l = nLen;
+	Set(s, l);
+}
 
-	data = (char*)malloc(l + 1);
-	memcpy(data, s, l);
-	data[l] = '\0';
-	len = l;
+qStr::qStr(const qStr& other) : data(buffer), len(0), alloced(0)
+{
+	Set(other.data, other.len);
 }
 
-qStr::qStr(const qStr& other)
+#if __cplusplus >= 201103L
+qStr::qStr(qStr&& other) noexcept : data(buffer), len(0), alloced(0)
 {
-	data = (char*)malloc(other.len + 1);
-	memcpy(data, other.Ptr(), other.len + 1);
-	len = other.len;
+	*this = static_cast<qStr&&>(other);
 }
+#endif
 
 qStr::~qStr()
 {
-	if (data) {
+	if( !IsInline() ) {
 		free(data);
 	}
 }
 
+void qStr::Reserve(size_t l)
+{
+	size_t cap = IsInline() ? QSTR_INLINE : alloced;
+	if( l + 1 <= cap ) {
+		return;
+	}
+	// Double so appending in a loop stays linear
+	size_t grown = cap * 2;
+	if( grown < l + 1 ) {
+		grown = l + 1;
+	}
+	char *p;
+	if( IsInline() ) {
+		p = static_cast<char*>(malloc(grown));
+		if( p ) {
+			memcpy(p, buffer, len + 1);
+		}
+	} else {
+		p = static_cast<char*>(realloc(data, grown));
+	}
+	if( !p ) {
+		fprintf(stderr, "qStr: Cannot allocate %u bytes\n", (unsigned int)grown);
+		abort();
+	}
+	data = p;
+	alloced = grown;
+}
+
+// Replace the contents, s may not point into this string
+void qStr::Set(const char *s, size_t l)
+{
+	len = 0;
+	data[0] = '\0';
+	Reserve(l);
+	if( l ) {
+		memcpy(data, s, l);
+	}
+	data[l] = '\0';
+	len = l;
+}
+
 void qStr::Clear()
 {
 	data[0] = '\0';
@@ -80,21 +120,28 @@ void qStr::ToUpper()
 
 void qStr::ConcatSelf(const char *s)
 {
-	int newLen = len + strlen(s);
-	if( data ) {
-		data = static_cast<char*>(realloc(data, newLen+1));
-	} else {
-		data = static_cast<char*>(malloc(newLen+1));
+	size_t sLen = strlen(s);
+	if( s >= data && s <= data + len ) {
+		// Appending to itself, Reserve may move the source
+		qStr copy(s);
+		ConcatSelf(copy);
+		return;
 	}
-
-	memcpy(data +len, s, strlen(s));
-	data[newLen] = '\0';
-	len = newLen;
+	Reserve(len + sLen);
+	memcpy(data + len, s, sLen + 1);
+	len += sLen;
 }
 
 void qStr::ConcatSelf(const qStr& other)
 {
-	ConcatSelf(other.Ptr());
+	if( &other == this ) {
+		qStr copy(other);
+		ConcatSelf(copy);
+		return;
+	}
+	Reserve(len + other.len);
+	memcpy(data + len, other.data, other.len + 1);
+	len += other.len;
 }
 
 void qStr::ConcatSelf(const int n)
@@ -102,29 +149,24 @@ void qStr::ConcatSelf(const int n)
 	char sNum[256];
 	sprintf(sNum, "%d", n);
 
-	Concat(sNum);
+	ConcatSelf(sNum);
 }
 
-qStr qStr::Concat(const char *s)
+qStr qStr::Concat(const char *s) const
 {
-	qStr sNew(data);
+	qStr sNew;
+	sNew.Reserve(len + strlen(s));
+	sNew.ConcatSelf(*this);
 	sNew.ConcatSelf(s);
 	return sNew;
 }
 
-bool qStr::Contains(const char *s)
+bool qStr::Contains(const char *s) const
 {
-	if( strlen(s) > len )
-		return false;
-
-	for( size_t i = 0; i < len-strlen(s); ++i ) {
-		if( !memcmp(s, data+i, strlen(s)))
-			return true;
-	}
-	return false;
+	return strstr(data, s) != NULL;
 }
 
-bool qStr::EndsWith(const char *s)
+bool qStr::EndsWith(const char *s) const
 {
 	int diff = len - strlen(s);
 	if (diff < 0) {
@@ -142,37 +184,72 @@ qStr& qStr::operator=(const qStr& other)
 {
 	if( this == &other )
 		return *this;
-	if (data)
-		free(data);
-	len = other.len;
-	data = (char*)malloc(len + 1);
-	memcpy(data, other.data, len + 1); /* Copy '\0' as well */
+	// Keeps the buffer it has if that is big enough
+	Set(other.data, other.len);
 	return *this;
 }
 
-bool qStr::operator==(const char *other)
+#if __cplusplus >= 201103L
+qStr& qStr::operator=(qStr&& other) noexcept
 {
-	if( !other)
-		return false;
+	if( this == &other )
+		return *this;
+	if( other.IsInline() ) {
+		Set(other.data, other.len);
+	} else {
+		if( !IsInline() ) {
+			free(data);
+		}
+		data = other.data;
+		len = other.len;
+		alloced = other.alloced;
+		other.data = other.buffer;
+		other.alloced = 0;
+	}
+	other.data[0] = '\0';
+	other.len = 0;
+	return *this;
+}
+#endif
 
-	if( len != strlen(other))
+qStr& qStr::operator=(const char *s)
+{
+	if( s >= data && s <= data + len ) {
+		qStr copy(s);
+		return *this = copy;
+	}
+	Set(s, s ? strlen(s) : 0);
+	return *this;
+}
+
+bool qStr::operator==(const char *other) const
+{
+	if( !other)
 		return false;
 
 	return !strcmp(other, data);
 }
 
-bool qStr::operator!=(const char *other)
+bool qStr::operator!=(const char *other) const
 {
 	return !operator==(other);
 }
 
+bool qStr::operator==(const qStr& other) const
+{
+	return len == other.len && !memcmp(data, other.data, len);
+}
+
 void qStr::RemoveQuotes()
 {
+	if( !len ) {
+		return;
+	}
 	char *start = data;
 	char *end = data + len - 1;
-	while( *start == '\'' || *start == '"' )
+	while( start <= end && ( *start == '\'' || *start == '"' ) )
 		start++;
-	while( *end == '\'' || *end == '"')
+	while( end >= start && ( *end == '\'' || *end == '"' ) )
 		end--;
 
 	int nlen = end - start + 1;
@@ -263,11 +340,16 @@ void qStr::Insert(const char *prefix)
 	if( !prefix || !strlen(prefix) ) {
 		return;
 	}
-	// Probably very bad efficiency
-	qStr sPrefix = prefix;
+	qStr sPrefix;
+	sPrefix.Reserve(strlen(prefix) + len);
+	sPrefix.ConcatSelf(prefix);
 	sPrefix.ConcatSelf(*this);
 	//fprintf(stderr, "sPrefix: %s\n", sPrefix.Ptr());
+#if __cplusplus >= 201103L
+	*this = static_cast<qStr&&>(sPrefix);
+#else
 	*this = sPrefix;
+#endif
 }
 
 // Change path separator in the string
@@ -279,8 +361,7 @@ void qStr::AdjustSep()
 
 bool qStr::IsOnlyFileName(const char * name)
 {
-    char * p = const_cast<char *>(name);
-    while( *p != 0 ) {
+    for( const char * p = name; *p != 0; ++p ) {
         if( *p == '/' || *p == '\\' )
             return false;
     }
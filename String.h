@@ -17,6 +17,9 @@
 	#define PATH_SEPRATOR	'/'
 #endif
 
+// Strings shorter than this live inside the object, no heap
+#define QSTR_INLINE		24
+
 class qStr
 {
 public:
@@ -24,31 +27,44 @@ public:
 			qStr(const char *s);
 			qStr(const qStr& other);
 			qStr(const char *s, int l);
+#if __cplusplus >= 201103L
+			// Takes the heap buffer of other, which is left empty
+			qStr(qStr&& other) noexcept;
+#endif
 			//qStr(const std::string& other);
 			~qStr();
 
 	qStr&			operator=(const qStr& other);
+#if __cplusplus >= 201103L
+	qStr&			operator=(qStr&& other) noexcept;
+#endif
+	qStr&			operator=(const char *s);
 	const size_t	Length() const { return len; }
+	// Never NULL, an empty string is ""
 	const char*		Ptr() const { return data; }
 	void			Clear();
-	bool			Empty() { return !len;  };
+	bool			Empty() const { return !len;  };
+	// Room for l characters without reallocating
+	void			Reserve(size_t l);
 	void			ToLower();
 	void			ToUpper();
 	void			ConcatSelf(const qStr& other);
 	void			ConcatSelf(const int num);
 	void			ConcatSelf(const char *str);
-	qStr			Concat(const char *str);
-	bool			Contains(const char *s);
-	bool			EndsWith(const char *s);
+	qStr			Concat(const char *str) const;
+	bool			Contains(const char *s) const;
+	bool			EndsWith(const char *s) const;
 	void			Insert(const char *prefix);
 	void			RemoveQuotes();
 	// Use them carefully !!!
-	int				ToInteger() { return atoi(data); }
-	float			ToFloat() { return static_cast<float>(atof(data)); }
+	int				ToInteger() const { return atoi(data); }
+	float			ToFloat() const { return static_cast<float>(atof(data)); }
 
 	// Compare with raw string
-	bool			operator==(const char *other);
-	bool			operator!=(const char *other);
+	bool			operator==(const char *other) const;
+	bool			operator!=(const char *other) const;
+	bool			operator==(const qStr& other) const;
+	bool			operator!=(const qStr& other) const { return !operator==(other); }
 #ifdef _WIN32
 	LPWSTR			GetWideStr();
 	static LPSTR	GetCStr(LPWSTR wStr);
@@ -62,8 +78,13 @@ public:
 	void			AdjustSep();
 
 private:
-	char	*data;
+	void			Set(const char *s, size_t l);
+	bool			IsInline() const { return data == buffer; }
+
+	char	*data;		// buffer or heap, always terminated
 	size_t	len;
+	size_t	alloced;	// heap bytes, 0 while inline
+	char	buffer[QSTR_INLINE];
 };
 
 
@@ -0,0 +1,370 @@
+#include "TangentSpace.h"
+#include "Thread.h"
+#include <math.h>
+
+#if defined(__SSE__) || defined(_M_X64)
+	#include <xmmintrin.h>
+	#define TS_SSE
+#endif
+
+extern Common * common;
+extern JobSystem * jobs;
+
+// Below this many vertices threading costs more than it saves
+#define TS_MIN_VERTS_PER_JOB	2048
+#define TS_MIN_GROUPS_PER_JOB	256
+
+TangentSpace::TangentSpace() : numVert(0), numFace(0), indices(NULL), cornerOffset(NULL), corners(NULL), cornerW(NULL),
+	curVerts(NULL), curTangents(NULL), curMode(NORMAL_WEIGHT_ANGLE)
+{
+	for( int i = 0; i < 3; ++i ) {
+		faceN[i] = faceT[i] = faceB[i] = NULL;
+	}
+}
+
+TangentSpace::~TangentSpace()
+{
+	Free();
+}
+
+void TangentSpace::Free()
+{
+	free(cornerOffset);
+	free(corners);
+	free(cornerW);
+	for( int i = 0; i < 3; ++i ) {
+		free(faceN[i]);
+		free(faceT[i]);
+		free(faceB[i]);
+		faceN[i] = faceT[i] = faceB[i] = NULL;
+	}
+	cornerOffset = corners = NULL;
+	cornerW = NULL;
+	numVert = numFace = 0;
+}
+
+void TangentSpace::Build(const unsigned short * idx, int numIndex, int nVert)
+{
+	Free();
+	if( nVert <= 0 || numIndex < 3 ) {
+		return;
+	}
+
+	indices = idx;
+	numVert = nVert;
+	numFace = numIndex / 3;
+	int padded = (numFace + 3) & ~3;
+
+	cornerOffset = (int*)calloc(numVert + 1, sizeof(int));
+	corners = (int*)malloc(numFace * 3 * sizeof(int));
+	cornerW = (float*)malloc(padded * 3 * sizeof(float));
+	for( int i = 0; i < 3; ++i ) {
+		faceN[i] = (float*)malloc(padded * sizeof(float));
+		faceT[i] = (float*)malloc(padded * sizeof(float));
+		faceB[i] = (float*)malloc(padded * sizeof(float));
+		if( !faceN[i] || !faceT[i] || !faceB[i] ) {
+			common->FatalError("TangentSpace: Cannot allocate more memory");
+		}
+	}
+	if( !cornerOffset || !corners || !cornerW ) {
+		common->FatalError("TangentSpace: Cannot allocate more memory");
+	}
+
+	// Count corners per vertex, then fill rows
+	for( int c = 0; c < numFace * 3; ++c ) {
+		cornerOffset[idx[c] + 1]++;
+	}
+	for( int v = 0; v < numVert; ++v ) {
+		cornerOffset[v + 1] += cornerOffset[v];
+	}
+	int * cursor = (int*)malloc(numVert * sizeof(int));
+	memcpy(cursor, cornerOffset, numVert * sizeof(int));
+	for( int c = 0; c < numFace * 3; ++c ) {
+		corners[cursor[idx[c]]++] = c;
+	}
+	free(cursor);
+}
+
+
+/*=============================================================
+ *
+ *  Face pass
+ *
+ *============================================================
+ */
+
+#ifdef TS_SSE
+// acos approximation, Abramowitz & Stegun 4.4.45, error < 7e-5
+static inline __m128 R_AcosPS(__m128 x)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	__m128 neg = _mm_cmplt_ps(x, _mm_setzero_ps());
+	__m128 ax = _mm_andnot_ps(signMask, x);
+
+	__m128 p = _mm_set1_ps(-0.0187293f);
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(0.0742610f));
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(-0.2121144f));
+	p = _mm_add_ps(_mm_mul_ps(p, ax), _mm_set1_ps(1.5707288f));
+	__m128 r = _mm_mul_ps(p, _mm_sqrt_ps(_mm_sub_ps(one, ax)));
+
+	// acos(-x) = pi - acos(x)
+	__m128 flipped = _mm_sub_ps(_mm_set1_ps((float)M_PI), r);
+	return _mm_or_ps(_mm_and_ps(neg, flipped), _mm_andnot_ps(neg, r));
+}
+
+static inline __m128 R_Dot3PS(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+}
+
+// Cosine of angle between two vectors, clamped to [-1, 1]
+static inline __m128 R_CosAnglePS(__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz)
+{
+	const __m128 tiny = _mm_set1_ps(1.0e-20f);
+	__m128 la = _mm_max_ps(R_Dot3PS(ax, ay, az, ax, ay, az), tiny);
+	__m128 lb = _mm_max_ps(R_Dot3PS(bx, by, bz, bx, by, bz), tiny);
+	__m128 c = _mm_div_ps(R_Dot3PS(ax, ay, az, bx, by, bz), _mm_sqrt_ps(_mm_mul_ps(la, lb)));
+	c = _mm_min_ps(c, _mm_set1_ps(1.0f));
+	return _mm_max_ps(c, _mm_set1_ps(-1.0f));
+}
+#endif
+
+// begin/end count groups of four faces
+void TangentSpace::FaceNormalJob(void * data, int begin, int end)
+{
+	TangentSpace * ts = (TangentSpace*)data;
+	const vertex_t * verts = ts->curVerts;
+	const unsigned short * idx = ts->indices;
+	bool angle = ( ts->curMode == NORMAL_WEIGHT_ANGLE );
+	int last = ts->numFace - 1;
+
+	for( int g = begin; g < end; ++g ) {
+		int f0 = g * 4;
+#ifdef TS_SSE
+		// Gather four faces into SoA lanes. Padding lanes repeat
+		// the last face and are never read back.
+		float p[3][3][4];
+		for( int lane = 0; lane < 4; ++lane ) {
+			int f = f0 + lane <= last ? f0 + lane : last;
+			for( int k = 0; k < 3; ++k ) {
+				const Vec3& pos = verts[idx[f * 3 + k]].pos;
+				p[k][0][lane] = pos[0];
+				p[k][1][lane] = pos[1];
+				p[k][2][lane] = pos[2];
+			}
+		}
+		__m128 ax = _mm_loadu_ps(p[0][0]), ay = _mm_loadu_ps(p[0][1]), az = _mm_loadu_ps(p[0][2]);
+		__m128 bx = _mm_loadu_ps(p[1][0]), by = _mm_loadu_ps(p[1][1]), bz = _mm_loadu_ps(p[1][2]);
+		__m128 cx = _mm_loadu_ps(p[2][0]), cy = _mm_loadu_ps(p[2][1]), cz = _mm_loadu_ps(p[2][2]);
+
+		// ab, bc, ca edges
+		__m128 e0x = _mm_sub_ps(bx, ax), e0y = _mm_sub_ps(by, ay), e0z = _mm_sub_ps(bz, az);
+		__m128 e1x = _mm_sub_ps(cx, bx), e1y = _mm_sub_ps(cy, by), e1z = _mm_sub_ps(cz, bz);
+		__m128 e2x = _mm_sub_ps(ax, cx), e2y = _mm_sub_ps(ay, cy), e2z = _mm_sub_ps(az, cz);
+
+		// n = ab x ac = e0 x -e2, length is twice the area
+		__m128 nx = _mm_sub_ps(_mm_mul_ps(e2y, e0z), _mm_mul_ps(e2z, e0y));
+		__m128 ny = _mm_sub_ps(_mm_mul_ps(e2z, e0x), _mm_mul_ps(e2x, e0z));
+		__m128 nz = _mm_sub_ps(_mm_mul_ps(e2x, e0y), _mm_mul_ps(e2y, e0x));
+
+		// Corner angles are needed by tangents in either mode
+		const __m128 zero = _mm_setzero_ps();
+		__m128 w0 = R_AcosPS(R_CosAnglePS(e0x, e0y, e0z, _mm_sub_ps(zero, e2x), _mm_sub_ps(zero, e2y), _mm_sub_ps(zero, e2z)));
+		__m128 w1 = R_AcosPS(R_CosAnglePS(e1x, e1y, e1z, _mm_sub_ps(zero, e0x), _mm_sub_ps(zero, e0y), _mm_sub_ps(zero, e0z)));
+		__m128 w2 = R_AcosPS(R_CosAnglePS(e2x, e2y, e2z, _mm_sub_ps(zero, e1x), _mm_sub_ps(zero, e1y), _mm_sub_ps(zero, e1z)));
+
+		if( angle ) {
+			__m128 len = _mm_sqrt_ps(_mm_max_ps(R_Dot3PS(nx, ny, nz, nx, ny, nz), _mm_set1_ps(1.0e-30f)));
+			__m128 inv = _mm_div_ps(_mm_set1_ps(1.0f), len);
+			nx = _mm_mul_ps(nx, inv);
+			ny = _mm_mul_ps(ny, inv);
+			nz = _mm_mul_ps(nz, inv);
+		}
+		_mm_storeu_ps(ts->faceN[0] + f0, nx);
+		_mm_storeu_ps(ts->faceN[1] + f0, ny);
+		_mm_storeu_ps(ts->faceN[2] + f0, nz);
+
+		// Interleave corner weights back to face * 3 + k order
+		float cw[3][4];
+		_mm_storeu_ps(cw[0], w0);
+		_mm_storeu_ps(cw[1], w1);
+		_mm_storeu_ps(cw[2], w2);
+		for( int lane = 0; lane < 4; ++lane ) {
+			float * dst = ts->cornerW + (f0 + lane) * 3;
+			dst[0] = cw[0][lane];
+			dst[1] = cw[1][lane];
+			dst[2] = cw[2][lane];
+		}
+#else
+		for( int f = f0; f < f0 + 4 && f <= last; ++f ) {
+			const Vec3& a = verts[idx[f * 3]].pos;
+			const Vec3& b = verts[idx[f * 3 + 1]].pos;
+			const Vec3& c = verts[idx[f * 3 + 2]].pos;
+			Vec3 e[3] = { b - a, c - b, a - c };
+			Vec3 n = e[0].CrossProduct(e[2].Scale(-1.0f));
+			for( int k = 0; k < 3; ++k ) {
+				Vec3 u = e[k];
+				Vec3 w = e[(k + 2) % 3].Scale(-1.0f);
+				float l = sqrtf(u.DotProduct(u) * w.DotProduct(w));
+				float cs = l > 0.0f ? u.DotProduct(w) / l : 1.0f;
+				cs = cs > 1.0f ? 1.0f : (cs < -1.0f ? -1.0f : cs);
+				ts->cornerW[f * 3 + k] = acosf(cs);
+			}
+			if( angle ) {
+				float l = sqrtf(n.DotProduct(n));
+				if( l > 0.0f ) {
+					n = n.Scale(1.0f / l);
+				}
+			}
+			ts->faceN[0][f] = n[0];
+			ts->faceN[1][f] = n[1];
+			ts->faceN[2][f] = n[2];
+		}
+#endif
+	}
+}
+
+void TangentSpace::VertexNormalJob(void * data, int begin, int end)
+{
+	TangentSpace * ts = (TangentSpace*)data;
+	vertex_t * verts = ts->curVerts;
+	bool angle = ( ts->curMode == NORMAL_WEIGHT_ANGLE );
+	const float * nx = ts->faceN[0];
+	const float * ny = ts->faceN[1];
+	const float * nz = ts->faceN[2];
+
+	for( int v = begin; v < end; ++v ) {
+		float sx = 0.0f, sy = 0.0f, sz = 0.0f;
+		for( int i = ts->cornerOffset[v]; i < ts->cornerOffset[v + 1]; ++i ) {
+			int c = ts->corners[i];
+			int f = c / 3;
+			float w = angle ? ts->cornerW[c] : 1.0f;
+			sx += nx[f] * w;
+			sy += ny[f] * w;
+			sz += nz[f] * w;
+		}
+		float l = sqrtf(sx * sx + sy * sy + sz * sz);
+		if( l > 0.0f ) {
+			l = 1.0f / l;
+			verts[v].normal = Vec3(sx * l, sy * l, sz * l);
+		} else {
+			// Unreferenced or only degenerate faces around it
+			verts[v].normal = Vec3(0.0f, 0.0f, 1.0f);
+		}
+	}
+}
+
+void TangentSpace::CalcNormals(vertex_t * verts, normal_weight_t mode)
+{
+	if( !IsBuilt() ) {
+		return;
+	}
+	curVerts = verts;
+	curMode = mode;
+
+	int groups = (numFace + 3) / 4;
+	jobs->ParallelFor(groups, TS_MIN_GROUPS_PER_JOB, FaceNormalJob, this);
+	jobs->ParallelFor(numVert, TS_MIN_VERTS_PER_JOB, VertexNormalJob, this);
+
+	curVerts = NULL;
+}
+
+
+/*=============================================================
+ *
+ *  Tangents
+ *
+ *============================================================
+ */
+
+void TangentSpace::FaceTangentJob(void * data, int begin, int end)
+{
+	TangentSpace * ts = (TangentSpace*)data;
+	const vertex_t * verts = ts->curVerts;
+	const unsigned short * idx = ts->indices;
+
+	for( int f = begin; f < end; ++f ) {
+		const vertex_t& a = verts[idx[f * 3]];
+		const vertex_t& b = verts[idx[f * 3 + 1]];
+		const vertex_t& c = verts[idx[f * 3 + 2]];
+		Vec3 e1 = b.pos - a.pos;
+		Vec3 e2 = c.pos - a.pos;
+		float s1 = (float)b.st[0] - a.st[0], t1 = (float)b.st[1] - a.st[1];
+		float s2 = (float)c.st[0] - a.st[0], t2 = (float)c.st[1] - a.st[1];
+		float det = s1 * t2 - s2 * t1;
+
+		Vec3 t, bt;
+		if( std::abs(det) > MI_EPSILON ) {
+			// Only direction matters, magnitude is dropped on projection
+			float r = det > 0.0f ? 1.0f : -1.0f;
+			t = (e1.Scale(t2) - e2.Scale(t1)).Scale(r);
+			bt = (e2.Scale(s1) - e1.Scale(s2)).Scale(r);
+		}
+		for( int k = 0; k < 3; ++k ) {
+			ts->faceT[k][f] = t[k];
+			ts->faceB[k][f] = bt[k];
+		}
+	}
+}
+
+void TangentSpace::VertexTangentJob(void * data, int begin, int end)
+{
+	TangentSpace * ts = (TangentSpace*)data;
+	const vertex_t * verts = ts->curVerts;
+	Vec4 * out = ts->curTangents;
+
+	for( int v = begin; v < end; ++v ) {
+		Vec3 n = verts[v].normal;
+		Vec3 tsum, bsum;
+		for( int i = ts->cornerOffset[v]; i < ts->cornerOffset[v + 1]; ++i ) {
+			int c = ts->corners[i];
+			int f = c / 3;
+			float w = ts->cornerW[c];
+			Vec3 t(ts->faceT[0][f], ts->faceT[1][f], ts->faceT[2][f]);
+			Vec3 b(ts->faceB[0][f], ts->faceB[1][f], ts->faceB[2][f]);
+			// Project onto tangent plane of the vertex normal
+			// before weighting, as MikkTSpace does
+			t = t - n.Scale(n.DotProduct(t));
+			float lt = sqrtf(t.DotProduct(t));
+			if( lt > 0.0f ) {
+				tsum = tsum + t.Scale(w / lt);
+			}
+			b = b - n.Scale(n.DotProduct(b));
+			float lb = sqrtf(b.DotProduct(b));
+			if( lb > 0.0f ) {
+				bsum = bsum + b.Scale(w / lb);
+			}
+		}
+
+		float l = sqrtf(tsum.DotProduct(tsum));
+		if( l <= 0.0f ) {
+			// Degenerate uv, any vector perpendicular to normal
+			tsum = std::abs(n[0]) < 0.9f ? Vec3(1, 0, 0) : Vec3(0, 1, 0);
+			tsum = tsum - n.Scale(n.DotProduct(tsum));
+			l = sqrtf(tsum.DotProduct(tsum));
+		}
+		tsum = tsum.Scale(1.0f / l);
+		float w = n.CrossProduct(tsum).DotProduct(bsum) < 0.0f ? -1.0f : 1.0f;
+		out[v] = Vec4(tsum[0], tsum[1], tsum[2], w);
+	}
+}
+
+void TangentSpace::CalcTangents(const vertex_t * verts, Vec4 * out)
+{
+	if( !IsBuilt() ) {
+		return;
+	}
+	curVerts = const_cast<vertex_t*>(verts);
+	curTangents = out;
+
+	// Corner angles come from the face pass of CalcNormals.
+	// Refresh them in case positions moved since.
+	curMode = NORMAL_WEIGHT_ANGLE;
+	jobs->ParallelFor((numFace + 3) / 4, TS_MIN_GROUPS_PER_JOB, FaceNormalJob, this);
+	jobs->ParallelFor(numFace, TS_MIN_GROUPS_PER_JOB * 4, FaceTangentJob, this);
+	jobs->ParallelFor(numVert, TS_MIN_VERTS_PER_JOB, VertexTangentJob, this);
+
+	curVerts = NULL;
+	curTangents = NULL;
+}
@@ -0,0 +1,76 @@
+/*
+ * ===============================================================
+ *
+ * Vertex normal and tangent generation.
+ *
+ * Topology is analysed once (Build) and kept, so normals can be
+ * regenerated every frame from deformed positions, eg. after
+ * skinning, without allocating. Face terms are computed four
+ * faces at a time with SSE. Vertices are then split among worker
+ * threads; each thread gathers from the faces around its own
+ * vertices, so nothing is written twice and no atomics are
+ * needed.
+ *
+ * Tangents follow MikkTSpace conventions: face tangents from uv
+ * gradients, projected onto each vertex normal plane and
+ * weighted by corner angle before summing, sign of bitangent
+ * kept in w.
+ *
+ *================================================================
+ */
+#ifndef _TANGENTSPACE_H
+#define _TANGENTSPACE_H
+
+#include "Mesh.h"
+
+typedef enum { NORMAL_WEIGHT_AREA, NORMAL_WEIGHT_ANGLE } normal_weight_t;
+
+class TangentSpace
+{
+public:
+					TangentSpace();
+					~TangentSpace();
+
+	// Analyse index buffer; call again if topology changes
+	void			Build(const unsigned short * idx, int numIndex, int numVert);
+	bool			IsBuilt() const { return numVert > 0; }
+
+	// Write verts[i].normal from verts[i].pos
+	void			CalcNormals(vertex_t * verts, normal_weight_t mode);
+	// Needs normals already in place. out has one entry per vertex
+	void			CalcTangents(const vertex_t * verts, Vec4 * out);
+
+private:
+	static void		FaceNormalJob(void * data, int begin, int end);
+	static void		VertexNormalJob(void * data, int begin, int end);
+	static void		FaceTangentJob(void * data, int begin, int end);
+	static void		VertexTangentJob(void * data, int begin, int end);
+
+	void			Free();
+
+private:
+	int					numVert;
+	int					numFace;
+	const unsigned short *	indices;	// not owned, must outlive us
+
+	// Corners (face * 3 + k) around each vertex, compressed rows
+	int *				cornerOffset;
+	int *				corners;
+
+	// Per face SoA results, padded to a multiple of 4
+	float *				faceN[3];		// normal, area weighted or unit
+	float *				faceT[3];		// uv tangent
+	float *				faceB[3];		// uv bitangent
+	// Per corner weight, angle or 1
+	float *				cornerW;
+
+	// State of the pass in flight, read by jobs
+	vertex_t *			curVerts;
+	Vec4 *				curTangents;
+	normal_weight_t		curMode;
+
+	TangentSpace(const TangentSpace&) {}
+	TangentSpace& operator=(const TangentSpace&) { return *this; }
+};
+
+#endif /* !_TANGENTSPACE_H */
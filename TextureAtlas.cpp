@@ -0,0 +1,233 @@
+#include "TextureAtlas.h"
+#include <algorithm>
+
+static inline int R_AlignUp(int v, int a)
+{
+	return (v + a - 1) / a * a;
+}
+
+static inline int R_NextPow2(int v)
+{
+	int p = 1;
+	while( p < v ) {
+		p <<= 1;
+	}
+	return p;
+}
+
+// Tallest first keeps shelves tight
+static bool R_TileCmp(const atlas_tile_t * a, const atlas_tile_t * b)
+{
+	if( a->footH != b->footH ) {
+		return a->footH > b->footH;
+	}
+	return a->footW > b->footW;
+}
+
+TextureAtlas::~TextureAtlas()
+{
+	for( size_t i = 0; i < tiles.size(); ++i ) {
+		delete tiles[i];
+	}
+}
+
+int TextureAtlas::Build(std::vector<Texture*>& textures, std::vector<Mesh*>& meshes)
+{
+	std::vector<atlas_tile_t*> group[2];	// RGB, RGBA
+
+	for( size_t i = 0; i < textures.size(); ++i ) {
+		Texture * tex = textures[i];
+		const byte * pixels = tex->GetPixels();
+		int w = tex->GetWidth(), h = tex->GetHeight();
+		if( !pixels || w > ATLAS_MAX_TILE || h > ATLAS_MAX_TILE ) {
+			continue;
+		}
+
+		// Every user has to stay inside the tile
+		bool used = false, unit = true;
+		for( size_t m = 0; m < meshes.size(); ++m ) {
+			if( meshes[m]->GetTexAtom() != tex->GetNameAtom() ) {
+				continue;
+			}
+			used = true;
+			unit = unit && meshes[m]->HasUnitTexCoords();
+		}
+		if( !used || !unit ) {
+			continue;
+		}
+
+		int channels = ( tex->GetFormat() == TEXTURE_GL_RGBA ) ? 4 : 3;
+		atlas_tile_t * t = new atlas_tile_t;
+		t->name = tex->GetNameAtom();
+		t->page = NULL;
+		t->x = t->y = 0;
+		t->width = w;
+		t->height = h;
+		t->footW = R_AlignUp(w + 2 * ATLAS_GUTTER, ATLAS_GUTTER);
+		t->footH = R_AlignUp(h + 2 * ATLAS_GUTTER, ATLAS_GUTTER);
+		R_GenMipChain(pixels, w, h, channels, t->chain);
+		group[channels == 4].push_back(t);
+	}
+
+	for( int g = 0; g < 2; ++g ) {
+		if( group[g].size() < 2 ) {
+			// Nothing to share a page with
+			for( size_t i = 0; i < group[g].size(); ++i ) {
+				delete group[g][i];
+			}
+			continue;
+		}
+		PackGroup(group[g], g ? 4 : 3);
+		tiles.insert(tiles.end(), group[g].begin(), group[g].end());
+	}
+
+	// Point texture coordinates at the tiles
+	for( size_t m = 0; m < meshes.size(); ++m ) {
+		RemapMesh(meshes[m]);
+	}
+
+	// Pages replace the textures they hold
+	for( size_t i = 0; i < textures.size(); ) {
+		if( Find(textures[i]->GetNameAtom()) ) {
+			delete textures[i];
+			textures.erase(textures.begin() + i);
+		} else {
+			++i;
+		}
+	}
+	textures.insert(textures.end(), pages.begin(), pages.end());
+
+	return (int)tiles.size();
+}
+
+Texture * TextureAtlas::Find(qAtom name) const
+{
+	if( name.IsEmpty() ) {
+		return NULL;
+	}
+	for( size_t i = 0; i < tiles.size(); ++i ) {
+		if( tiles[i]->name == name ) {
+			return tiles[i]->page;
+		}
+	}
+	return NULL;
+}
+
+bool TextureAtlas::RemapMesh(Mesh * mesh) const
+{
+	const atlas_tile_t * t = NULL;
+	for( size_t i = 0; i < tiles.size() && !t; ++i ) {
+		if( tiles[i]->name == mesh->GetTexAtom() ) {
+			t = tiles[i];
+		}
+	}
+	if( !t ) {
+		return true;
+	}
+	if( !mesh->HasUnitTexCoords() ) {
+		return false;
+	}
+	float pw = (float)t->page->GetWidth(), ph = (float)t->page->GetHeight();
+	float scale[2] = { t->width / pw, t->height / ph };
+	float offset[2] = { t->x / pw, t->y / ph };
+	mesh->RemapTexCoords(scale, offset);
+	return true;
+}
+
+void TextureAtlas::PackGroup(std::vector<atlas_tile_t*>& group, int channels)
+{
+	std::sort(group.begin(), group.end(), R_TileCmp);
+
+	std::vector<atlas_tile_t*> onPage;
+	int x = 0, y = 0, shelfH = 0, usedW = 0;
+
+	for( size_t i = 0; i <= group.size(); ++i ) {
+		atlas_tile_t * t = i < group.size() ? group[i] : NULL;
+		if( t && x + t->footW > ATLAS_PAGE_SIZE ) {
+			// Next shelf
+			x = 0;
+			y += shelfH;
+			shelfH = 0;
+		}
+		if( !t || y + t->footH > ATLAS_PAGE_SIZE ) {
+			// Page is full, or we're done. Trim to what's used.
+			int pageW = R_NextPow2(usedW);
+			int pageH = R_NextPow2(y + shelfH);
+			qStr name(channels == 4 ? "atlas_rgba" : "atlas_rgb");
+			name.ConcatSelf((int)pages.size());
+			Texture * page = new Texture(name);
+			ComposePage(page, pageW, pageH, channels, onPage);
+			pages.push_back(page);
+
+			onPage.clear();
+			x = y = shelfH = usedW = 0;
+			if( !t ) {
+				break;
+			}
+		}
+
+		t->x = x + ATLAS_GUTTER;
+		t->y = y + ATLAS_GUTTER;
+		x += t->footW;
+		shelfH = std::max(shelfH, t->footH);
+		usedW = std::max(usedW, x);
+		onPage.push_back(t);
+	}
+}
+
+void TextureAtlas::ComposePage(Texture * page, int pageW, int pageH, int channels, std::vector<atlas_tile_t*>& onPage)
+{
+	std::vector<image_mip_t> levels;
+
+	for( int level = 0; level <= ATLAS_CLEAN_MIPS; ++level ) {
+		image_mip_t lvl;
+		lvl.width = std::max(pageW >> level, 1);
+		lvl.height = std::max(pageH >> level, 1);
+		lvl.pixels.assign(lvl.width * lvl.height * channels, 0);
+		int g = ATLAS_GUTTER >> level;
+
+		for( size_t i = 0; i < onPage.size(); ++i ) {
+			atlas_tile_t * t = onPage[i];
+			const image_mip_t& src = t->chain[std::min(level, (int)t->chain.size() - 1)];
+			int ox = t->x >> level, oy = t->y >> level;
+
+			// Inner texels plus gutter, clamped back into the tile
+			for( int dy = -g; dy < src.height + g; ++dy ) {
+				int py = oy + dy;
+				if( py < 0 || py >= lvl.height ) {
+					continue;
+				}
+				int sy = std::min(std::max(dy, 0), src.height - 1);
+				for( int dx = -g; dx < src.width + g; ++dx ) {
+					int px = ox + dx;
+					if( px < 0 || px >= lvl.width ) {
+						continue;
+					}
+					int sx = std::min(std::max(dx, 0), src.width - 1);
+					memcpy(&lvl.pixels[(py * lvl.width + px) * channels],
+						&src.pixels[(sy * src.width + sx) * channels], channels);
+				}
+			}
+		}
+		levels.push_back(lvl);
+		if( lvl.width == 1 && lvl.height == 1 ) {
+			break;
+		}
+	}
+
+	// Tiles are too small to keep apart beyond this
+	const image_mip_t& last = levels.back();
+	if( last.width > 1 || last.height > 1 ) {
+		std::vector<image_mip_t> rest;
+		R_GenMipChain(&last.pixels[0], last.width, last.height, channels, rest);
+		levels.insert(levels.end(), rest.begin() + 1, rest.end());
+	}
+
+	page->LoadMemory(channels == 4 ? IMAGE_FORMAT_RGBA8 : IMAGE_FORMAT_RGB8, levels);
+
+	for( size_t i = 0; i < onPage.size(); ++i ) {
+		onPage[i]->page = page;
+		// Source texels live in the page now
+		std::vector<image_mip_t>().swap(onPage[i]->chain);
+	}
+}
@@ -0,0 +1,70 @@
+/*
+ * ===============================================================
+ *
+ * Packs small textures into shared pages so props drawn one after
+ * another in the sorted queue don't need a texture bind each.
+ *
+ * Tiles are placed with a shelf packer. Each tile is surrounded by
+ * a gutter of its own edge texels, and tile corners sit on a grid
+ * of ATLAS_GUTTER pixels. For the first ATLAS_CLEAN_MIPS levels
+ * every tile is reduced on its own, with its gutter, so filtering
+ * never reaches a neighbour. Coarser levels are reduced from the
+ * whole page.
+ *
+ * Only decoded PNG textures are packed, and only when every mesh
+ * using them keeps st within [0, 1]; there is no wrapping inside
+ * a page. Mesh texture coordinates are remapped into the tile.
+ *
+ *================================================================
+ */
+#ifndef _TEXTUREATLAS_H
+#define _TEXTUREATLAS_H
+
+#include "Mesh.h"
+
+#define ATLAS_PAGE_SIZE		1024
+// Bigger textures keep their own binding
+#define ATLAS_MAX_TILE		256
+// Edge texels repeated around a tile, also the placement grid
+#define ATLAS_CLEAN_MIPS	3
+#define ATLAS_GUTTER		(1 << ATLAS_CLEAN_MIPS)
+
+struct atlas_tile_t {
+	qAtom		name;		// name of the source texture
+	Texture *	page;
+	int			x, y;		// inner rect in page pixels
+	int			width, height;
+	int			footW, footH;	// with gutter, on grid
+	std::vector<image_mip_t> chain;
+};
+
+class TextureAtlas
+{
+public:
+					TextureAtlas() {}
+					~TextureAtlas();
+
+	// Pack what qualifies. Packed textures are removed from
+	// textures and deleted, pages are added to it. Must run
+	// before meshes are uploaded. Returns textures packed.
+	int				Build(std::vector<Texture*>& textures, std::vector<Mesh*>& meshes);
+	// Page holding the texture called name, or NULL
+	Texture *		Find(qAtom name) const;
+	// Point st of a mesh whose texture is packed at its tile,
+	// for meshes loaded after Build. False if st leave [0, 1].
+	bool			RemapMesh(Mesh * mesh) const;
+	int				NumPages() const { return (int)pages.size(); }
+
+private:
+	void			PackGroup(std::vector<atlas_tile_t*>& group, int channels);
+	void			ComposePage(Texture * page, int pageW, int pageH, int channels, std::vector<atlas_tile_t*>& onPage);
+
+private:
+	std::vector<atlas_tile_t*>	tiles;
+	std::vector<Texture*>		pages;	// owned by whoever owns the texture list
+
+	TextureAtlas(const TextureAtlas&) {}
+	TextureAtlas& operator=(const TextureAtlas&) { return *this; }
+};
+
+#endif /* !_TEXTUREATLAS_H */
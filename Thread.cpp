@@ -0,0 +1,256 @@
+#include "Thread.h"
+#include "Profiler.h"
+#include <unistd.h>
+#include <sched.h>
+#include <stdio.h>
+
+/*=============================================================
+ *
+ *  Thread
+ *
+ *============================================================
+ */
+
+bool Thread::Start(thread_func_t func, void * arg)
+{
+	if( running ) {
+		return false;
+	}
+	if( pthread_create(&handle, NULL, func, arg) != 0 ) {
+		fprintf(stderr, "Cannot create thread\n");
+		return false;
+	}
+	running = true;
+	return true;
+}
+
+void Thread::Join()
+{
+	if( !running ) {
+		return;
+	}
+	pthread_join(handle, NULL);
+	running = false;
+}
+
+int Thread::NumCores()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+static bool Sys_SetAffinity(pthread_t t, int core)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if( core < 0 ) {
+		for( int i = 0; i < Thread::NumCores(); ++i ) {
+			CPU_SET(i, &set);
+		}
+	} else {
+		CPU_SET(core % Thread::NumCores(), &set);
+	}
+	return pthread_setaffinity_np(t, sizeof(set), &set) == 0;
+#else
+	return false;
+#endif
+}
+
+bool Thread::SetAffinity(int core)
+{
+	if( !running ) {
+		return false;
+	}
+	return Sys_SetAffinity(handle, core);
+}
+
+bool Thread::SetCurrentAffinity(int core)
+{
+	return Sys_SetAffinity(pthread_self(), core);
+}
+
+
+/*=============================================================
+ *
+ *  Job system
+ *
+ *============================================================
+ */
+
+JobSystem::JobSystem() : head(0), quit(false)
+{
+}
+
+JobSystem::~JobSystem()
+{
+	Shutdown();
+}
+
+bool JobSystem::Init(int numWorkers)
+{
+	if( !workers.empty() ) {
+		return true;
+	}
+	if( numWorkers <= 0 ) {
+		numWorkers = Thread::NumCores() - 1;
+	}
+
+	quit = false;
+	for( int i = 0; i < numWorkers; ++i ) {
+		Thread * t = new Thread();
+		if( !t->Start(WorkerMain, this) ) {
+			delete t;
+			break;
+		}
+		workers.push_back(t);
+	}
+	return true;
+}
+
+void JobSystem::Shutdown()
+{
+	queueLock.Lock();
+	quit = true;
+	queueCond.Broadcast();
+	queueLock.Unlock();
+
+	for( size_t i = 0; i < workers.size(); ++i ) {
+		workers[i]->Join();
+		delete workers[i];
+	}
+	workers.clear();
+}
+
+void JobSystem::Execute(const job_t& job)
+{
+	if( job.rangeFunc ) {
+		job.rangeFunc(job.data, job.begin, job.end);
+	} else {
+		job.func(job.data);
+	}
+	__sync_fetch_and_sub(&job.counter->pending, 1);
+}
+
+void JobSystem::Push(const job_t& job)
+{
+	queueLock.Lock();
+	queue.push_back(job);
+	queueCond.Signal();
+	queueLock.Unlock();
+}
+
+bool JobSystem::TryPop(job_t& job)
+{
+	bool got = false;
+	queueLock.Lock();
+	if( head < queue.size() ) {
+		job = queue[head++];
+		got = true;
+		// Queue drained, reuse storage from the start
+		if( head == queue.size() ) {
+			queue.clear();
+			head = 0;
+		}
+	}
+	queueLock.Unlock();
+	return got;
+}
+
+void * JobSystem::WorkerMain(void * arg)
+{
+	JobSystem * self = (JobSystem*)arg;
+	Profiler::SetThreadName("worker");
+	for( ;; ) {
+		self->queueLock.Lock();
+		while( !self->quit && self->head >= self->queue.size() ) {
+			self->queueCond.Wait(self->queueLock);
+		}
+		if( self->quit ) {
+			self->queueLock.Unlock();
+			break;
+		}
+		job_t job = self->queue[self->head++];
+		if( self->head == self->queue.size() ) {
+			self->queue.clear();
+			self->head = 0;
+		}
+		self->queueLock.Unlock();
+
+		Execute(job);
+	}
+	return NULL;
+}
+
+void JobSystem::ParallelFor(int count, int minChunk, job_range_func_t func, void * data)
+{
+	if( count <= 0 ) {
+		return;
+	}
+	if( minChunk < 1 ) {
+		minChunk = 1;
+	}
+
+	// A few chunks per thread keeps everyone busy when
+	// ranges take uneven time
+	int numThreads = NumWorkers() + 1;
+	int numChunks = numThreads * 4;
+	int chunk = (count + numChunks - 1) / numChunks;
+	if( chunk < minChunk ) {
+		chunk = minChunk;
+	}
+
+	if( workers.empty() || chunk >= count ) {
+		func(data, 0, count);
+		return;
+	}
+
+	job_counter_t counter;
+	counter.pending = (count + chunk - 1) / chunk;
+
+	queueLock.Lock();
+	for( int begin = 0; begin < count; begin += chunk ) {
+		job_t job;
+		job.rangeFunc = func;
+		job.func = NULL;
+		job.data = data;
+		job.begin = begin;
+		job.end = begin + chunk < count ? begin + chunk : count;
+		job.counter = &counter;
+		queue.push_back(job);
+	}
+	queueCond.Broadcast();
+	queueLock.Unlock();
+
+	Wait(&counter);
+}
+
+void JobSystem::Submit(job_func_t func, void * data, job_counter_t * counter)
+{
+	__sync_fetch_and_add(&counter->pending, 1);
+
+	job_t job;
+	job.rangeFunc = NULL;
+	job.func = func;
+	job.data = data;
+	job.begin = job.end = 0;
+	job.counter = counter;
+
+	if( workers.empty() ) {
+		Execute(job);
+		return;
+	}
+	Push(job);
+}
+
+void JobSystem::Wait(job_counter_t * counter)
+{
+	job_t job;
+	while( __sync_fetch_and_add(&counter->pending, 0) > 0 ) {
+		if( TryPop(job) ) {
+			Execute(job);
+		} else {
+			sched_yield();
+		}
+	}
+}
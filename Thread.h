@@ -0,0 +1,133 @@
+#ifndef _THREAD_H
+#define _THREAD_H
+
+#include <pthread.h>
+#include <vector>
+
+/*
+================================================
+
+Thin wrappers over pthread plus a small pool of
+worker threads. Work is handed out either as
+parallel-for ranges or as single jobs tracked by
+a counter.
+
+================================================
+*/
+
+class Mutex
+{
+public:
+					Mutex()		{ pthread_mutex_init(&mutex, NULL); }
+					~Mutex()	{ pthread_mutex_destroy(&mutex); }
+
+	void			Lock()		{ pthread_mutex_lock(&mutex); }
+	void			Unlock()	{ pthread_mutex_unlock(&mutex); }
+	pthread_mutex_t *	Native()	{ return &mutex; }
+
+private:
+	pthread_mutex_t	mutex;
+
+	Mutex(const Mutex&) {}
+	Mutex& operator=(const Mutex&) { return *this; }
+};
+
+class Condition
+{
+public:
+					Condition()		{ pthread_cond_init(&cond, NULL); }
+					~Condition()	{ pthread_cond_destroy(&cond); }
+
+	// Mutex must be locked by caller
+	void			Wait(Mutex& m)	{ pthread_cond_wait(&cond, m.Native()); }
+	void			Signal()		{ pthread_cond_signal(&cond); }
+	void			Broadcast()		{ pthread_cond_broadcast(&cond); }
+
+private:
+	pthread_cond_t	cond;
+
+	Condition(const Condition&) {}
+	Condition& operator=(const Condition&) { return *this; }
+};
+
+typedef void * (*thread_func_t)(void *);
+
+class Thread
+{
+public:
+					Thread() : running(false) {}
+
+	bool			Start(thread_func_t func, void * arg);
+	void			Join();
+	bool			IsRunning() const { return running; }
+	// Pin to one core, -1 lets scheduler decide
+	bool			SetAffinity(int core);
+
+	static int		NumCores();
+	// Pin calling thread
+	static bool		SetCurrentAffinity(int core);
+
+private:
+	pthread_t		handle;
+	bool			running;
+};
+
+
+// Range job, [begin, end) of whatever data points to
+typedef void (*job_range_func_t)(void * data, int begin, int end);
+// Single job
+typedef void (*job_func_t)(void * data);
+
+// Number of jobs still in flight. Waiters spin on it
+// while helping with the queue.
+struct job_counter_t {
+	volatile int	pending;
+};
+
+struct job_t {
+	job_range_func_t	rangeFunc;
+	job_func_t			func;
+	void *				data;
+	int					begin;
+	int					end;
+	job_counter_t *		counter;
+};
+
+class JobSystem
+{
+public:
+					JobSystem();
+					~JobSystem();
+
+	// numWorkers <= 0 uses one worker per core but one
+	bool			Init(int numWorkers);
+	void			Shutdown();
+	int				NumWorkers() const { return (int)workers.size(); }
+
+	// Split [0, count) into chunks of at least minChunk and run
+	// them on workers and the calling thread. Returns when done.
+	void			ParallelFor(int count, int minChunk, job_range_func_t func, void * data);
+	// Queue a job; counter is decremented once it has run
+	void			Submit(job_func_t func, void * data, job_counter_t * counter);
+	// Block until counter drops to zero, running queued jobs meanwhile
+	void			Wait(job_counter_t * counter);
+
+private:
+	static void *	WorkerMain(void * arg);
+	void			Push(const job_t& job);
+	bool			TryPop(job_t& job);
+	static void		Execute(const job_t& job);
+
+private:
+	std::vector<Thread*>	workers;
+	std::vector<job_t>		queue;
+	size_t					head;
+	Mutex					queueLock;
+	Condition				queueCond;
+	volatile bool			quit;
+
+	JobSystem(const JobSystem&) {}
+	JobSystem& operator=(const JobSystem&) { return *this; }
+};
+
+#endif /* !_THREAD_H */
@@ -6,7 +6,7 @@ extern qEngine * engine;
 void Timer::Pause()
 {
 	paused = true;
-	timediff = 0;
+	frameNs = 0;
 }
 
 void Timer::Resume()
@@ -15,8 +15,8 @@ void Timer::Resume()
 		return;
 
 	paused = false;
-	lastTime = GetSysMilliseconds();
-	currentTime = lastTime;
+	// Time spent paused is not simulated
+	lastTime = GetSysNanoseconds();
 }
 
 void Timer::Tick()
@@ -24,49 +24,89 @@ void Timer::Tick()
 	if( paused )
 		return;
 
-	lastTime = currentTime;
-	currentTime = GetSysMilliseconds();
+	long long now = GetSysNanoseconds();
+	if( !lastTime ) {
+		lastTime = now;
+	}
+	frameNs = now - lastTime;
+	lastTime = now;
+
+	accumulator += frameNs < TIMER_MAX_FRAME_NS ? frameNs : TIMER_MAX_FRAME_NS;
+}
+
+bool Timer::StepSimulation()
+{
+	if( paused || accumulator < stepNs ) {
+		return false;
+	}
+	accumulator -= stepNs;
+	simulationTime += stepNs;
+	return true;
+}
 
-	extraPrecision += 0.6666667f;
-	timediff = 16 + (int)extraPrecision;
-	extraPrecision -= timediff - 16;
+float Timer::GetAlpha() const
+{
+	return (float)accumulator / (float)stepNs;
+}
 
-	simulationTime += timediff;
+void Timer::SetStepHz(int hz)
+{
+	if( hz > 0 ) {
+		stepNs = 1000000000LL / hz;
+	}
 }
 
 void Timer::Reset()
 {
-	Tick();
+	lastTime = GetSysNanoseconds();
 	simulationTime = 0;
-	extraPrecision = 0;
-	timediff = 0;
+	accumulator = 0;
+	frameNs = 0;
 }
 
 
 #ifdef _WIN32
 #include <Windows.h>
-#include <MMSystem.h>
-int Timer::GetSysMilliseconds()
+long long Timer::GetSysNanoseconds()
 {
-	return (int)timeGetTime();
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if( !freq.QuadPart ) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&now);
+	return (long long)( now.QuadPart / freq.QuadPart ) * 1000000000LL
+		+ (long long)( now.QuadPart % freq.QuadPart ) * 1000000000LL / freq.QuadPart;
 }
 
-#elif __linux__
-#include <sys/time.h>
-int Timer::GetSysMilliseconds()
+void Timer::SleepUntil(long long deadline)
 {
-	struct timeval tp;
-	static int secbase;
+	long long left = deadline - GetSysNanoseconds();
+	if( left > 0 ) {
+		Sleep((DWORD)( left / 1000000 ));
+	}
+}
 
-	gettimeofday(&tp, 0);
+#elif __linux__
+#include <time.h>
+#include <errno.h>
+long long Timer::GetSysNanoseconds()
+{
+	// Not affected by wall clock changes
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-	if( !secbase )
-	{
-		secbase = tp.tv_sec;
-		return tp.tv_usec / 1000;
+void Timer::SleepUntil(long long deadline)
+{
+	// Absolute deadline, so neither signals nor the time spent
+	// getting here make the sleep longer
+	struct timespec ts;
+	ts.tv_sec = (time_t)( deadline / 1000000000LL );
+	ts.tv_nsec = (long)( deadline % 1000000000LL );
+	while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR ) {
 	}
-
-	return (tp.tv_sec - secbase) * 1000 + tp.tv_usec / 1000;
 }
 
-#endif
\ No newline at end of file
+#endif
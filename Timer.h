@@ -1,9 +1,19 @@
 #ifndef _TIMER_H
 #define _TIMER_H
 
-/* Timer, timer, timer! Full of tricks and subtles. So
-   for the time being, I just copied the implementation from
-   Shmup which has a lucid and simple timer
+// Simulation steps per second, whatever the frame rate
+#define TIMER_STEP_HZ			60
+// Wall time of one frame is cut to this, after a hitch the
+// simulation slows down instead of running many steps to catch up
+#define TIMER_MAX_FRAME_NS		250000000LL
+
+/* Timer, timer, timer! Full of tricks and subtles.
+
+   Fixed step simulation with an accumulator: Tick adds the
+   wall time of the frame, StepSimulation hands it out in whole
+   steps, and what is left over says how far rendering is
+   between the last two simulation states (GetAlpha).
+   Time comes from the monotonic clock in nanoseconds.
 */
 class Timer
 {
@@ -11,30 +21,42 @@ public:
 			Timer();
 	void	Pause();
 	void	Resume();
+	// Once per frame, before the simulation steps
 	void	Tick();
-	int		GetOneTick() const { return timediff; }
+	// True while a step is due, takes it from the accumulator
+	bool	StepSimulation();
+	// Fraction of a step since the last simulation state
+	float	GetAlpha() const;
+	// Length of one simulation step
+	int		GetOneTick() const { return (int)( stepNs / 1000000 ); }
+	float	GetStepSeconds() const { return stepNs * 1e-9f; }
+	void	SetStepHz(int hz);
+	// Wall clock milliseconds between the last two ticks
+	int		GetRealTick() const { return (int)( frameNs / 1000000 ); }
+	long long	GetFrameNanoseconds() const { return frameNs; }
+	// Simulated time so far
+	long long	GetSimulationTime() const { return simulationTime; }
 	void	Reset();
 
-private:
-	int		GetSysMilliseconds();
+	static long long	GetSysNanoseconds();
+	// Sleep until GetSysNanoseconds() reaches deadline
+	static void			SleepUntil(long long deadline);
 
 private:
-	int		timediff;
-	int		simulationTime;
-	int		currentTime;
-	int		lastTime;
-	int		fps;
-
-	float	extraPrecision;
+	long long	stepNs;
+	long long	accumulator;
+	long long	simulationTime;
+	long long	lastTime;
+	long long	frameNs;
 
 	bool	paused;
 };
 
-inline Timer::Timer() : timediff(0), simulationTime(0), currentTime(0),
-lastTime(0), fps(0), extraPrecision(0), paused(false)
+inline Timer::Timer() : stepNs(1000000000LL / TIMER_STEP_HZ), accumulator(0), simulationTime(0),
+lastTime(0), frameNs(0), paused(false)
 {
 
 }
 
 
-#endif /* !_TIMER_H */
\ No newline at end of file
+#endif /* !_TIMER_H */
@@ -1,10 +1,20 @@
 #include "WorldDB.h"
+#include "Pvs.h"
+#include "Timer.h"
+#include "Thread.h"
+#include "Profiler.h"
+#include <cfloat>
+#include <algorithm>
 /**
  * Implementation of WorldDB class
  */
 
 extern qEngine * engine;
 extern Common * common;
+extern JobSystem * jobs;
+
+// Rays are cheap, one job takes a run of them
+#define WORLD_RAYS_PER_JOB  64
 
 WorldDB* WorldDB::self = NULL;
 
@@ -12,6 +22,21 @@ WorldDB::WorldDB()
 {
     numEnt = 0;
 	mapName = NULL;
+	loaded = false;
+	numBgEntities = 0;
+	entityPool = NULL;
+	lightBlock = NULL;
+	numSections = 0;
+	sections = NULL;
+	sectionRefs = NULL;
+	pvs = NULL;
+	pvsCells = NULL;
+	pvsWords = NULL;
+	numAreas = 0;
+	areas = NULL;
+	portals = NULL;
+	portalPoints = NULL;
+	areaRefs = NULL;
 }
 
 WorldDB::~WorldDB()
@@ -40,6 +65,15 @@ Vec3 ReadVec3(LexerFile * lex)
 }
 
 
+// Full path of a map in the game folder
+qStr WorldDB::MapPath(const char * map) const
+{
+	qStr fn(map);
+	fn.Insert("/map/");
+	fn.Insert(engine->GetGameDir().Ptr());
+	return fn;
+}
+
 bool WorldDB::LoadMap(const char *map)
 {
     if( !map || map[0] == 0 ) {
@@ -47,12 +81,9 @@ bool WorldDB::LoadMap(const char *map)
         return false;
     }
 
-	qStr dataDir = engine->GetGameDir();
-    qStr fn(map);
-	fn.Insert("/map/");
-	fn.Insert(dataDir.Ptr());
-
-    if( fn.GetFileExtension() != "map" ) {
+    qStr fn = MapPath(map);
+    qStr ext = fn.GetFileExtension();
+    if( ext != "map" && ext != "bmap" ) {
         fprintf(stderr, "Incorrect map file extension.");
         return false;
     }
@@ -61,21 +92,94 @@ bool WorldDB::LoadMap(const char *map)
         Reset();
     }
 
-    LexerFile lex(fn);
+    if( ext == "bmap" ) {
+        if( !LoadBinaryMap(fn) ) {
+            return false;
+        }
+        BuildRayBvh();
+        loaded = true;
+        return true;
+    }
+
+    // A cooked version of the same map wins, unless it is
+    // from an older build
+    qStr cooked(fn.Ptr(), fn.Length() - ext.Length());
+    cooked.ConcatSelf("bmap");
+    struct stat st;
+    if( stat(cooked.Ptr(), &st) == 0 ) {
+        if( LoadBinaryMap(cooked) ) {
+            BuildRayBvh();
+            loaded = true;
+            return true;
+        }
+        fprintf(stderr, "Falling back to %s\n", fn.Ptr());
+    }
+
+    map_source_t src;
+    if( !ParseMap(fn, src) ) {
+        return false;
+    }
+    LoadParsed(src);
+	return true;
+}
+
+void WorldDB::LoadParsed(const map_source_t& src)
+{
+    if( loaded ) {
+        Reset();
+    }
+    numBgEntities = src.numBgEntities;
+    numEnt = (int)src.entities.size();
+    entityPool = new Entity[numEnt];
+    entities.reserve(numEnt);
+    for( int i = 0; i < numEnt; ++i ) {
+        const map_entity_t& e = src.entities[i];
+        // file name is enough to identifier a mesh instance
+        qStr meshName = e.mesh.GetFileName();
+
+        // Mesh is already loaded by engine
+        Mesh * mesh = engine->GetModel(meshName.Ptr());
+        if( !mesh ) {
+            common->FatalError("Mesh doesn't exist.\n");
+        }
+
+        Entity * ent = &entityPool[i];
+        ent->AttachMesh(mesh);
+        ent->SetModelToWorldMat(e.pos);
+        ent->SetOccluder(e.occluder);
+        // Placed, not moved, nothing to blend from
+        ent->SavePrevState();
+        ent->Interpolate(1.0f);
+        entities.push_back(ent);
+    }
+    if( !src.lights.empty() ) {
+        AddLights(&src.lights[0], (int)src.lights.size());
+    }
+    SetAreas(src);
+
+    BuildRayBvh();
+    loaded = true;
+}
+
+bool WorldDB::ParseMap(const qStr& path, map_source_t& src)
+{
+    src.numBgEntities = 0;
+    LexerFile lex(path);
     while( lex.MoreToken() ) {
         lex.ReadToken();
         qStr val = lex.TokenValue();
         // Background entities
         if( val == "numBackgroundEntities" ) {
             lex.ReadToken();
-			numBgEntities = lex.TokenValue().ToInteger();
+			src.numBgEntities = lex.TokenValue().ToInteger();
 			continue;
         } 
 
         // Parse a whole entity
 		if( val == "matrix" ) {
+            map_entity_t ent;
             lex.ReadToken();    // '{'    
-            Mat4 pos = ReadMat4(&lex);
+            ent.pos = ReadMat4(&lex);
             lex.ReadToken();    // '}'
             
             lex.ReadToken();
@@ -85,52 +189,639 @@ bool WorldDB::LoadMap(const char *map)
             }
 
             lex.ReadToken();
-            qStr fmt = lex.TokenValue();
+            ent.format = lex.TokenValue();
 
             lex.ReadToken();    // '{'
             lex.ReadToken();    // 'model'
             lex.ReadToken();   
-            qStr path = lex.TokenValue();
+            // file name is enough to identifier a mesh instance
+            ent.mesh = lex.TokenValue().GetFileName();
 
-            AddEntity(pos, fmt, path);
+            // Optional flag, otherwise this reads the '}'
+            lex.ReadToken();
+            ent.occluder = ( lex.TokenValue() == "occluder" );
+
+            src.entities.push_back(ent);
 		} else if( val == "light" ) {
-            static int lightId = 0;
-            light_t * l = (light_t*)malloc(sizeof(*l));
-            l->id = lightId++;
+            bmap_light_t l;
+            l.id = (unsigned int)src.lights.size();
 			lex.ReadToken();
 			assert( lex.TokenValue() == "{" );
 
             lex.ReadToken();    // 'enabled' label
             lex.ReadToken();
-			l->enabled = (lex.TokenValue().ToInteger() == 1);
+			l.enabled = (lex.TokenValue().ToInteger() == 1);
 
             lex.ReadToken();    // 'position' label 
-            l->pos = ReadVec4(&lex);
+            Vec4 pos = ReadVec4(&lex);
 
             lex.ReadToken();    // 'ambientColor' label
-            l->ambient = ReadVec3(&lex);
+            Vec3 ambient = ReadVec3(&lex);
 
             lex.ReadToken();    // 'diffuseColor' label
-            l->diffuse = ReadVec3(&lex);
+            Vec3 diffuse = ReadVec3(&lex);
 
             lex.ReadToken();    // 'specularColor' label
-            l->specular = ReadVec3(&lex);
+            Vec3 specular = ReadVec3(&lex);
+
+            for( int i = 0; i < 4; ++i ) {
+                l.pos[i] = pos[i];
+            }
+            for( int i = 0; i < 3; ++i ) {
+                l.ambient[i] = ambient[i];
+                l.diffuse[i] = diffuse[i];
+                l.specular[i] = specular[i];
+            }
 
             lex.ReadToken();
-            l->constantAttenuation = lex.TokenValue().ToFloat();
+            l.constantAttenuation = lex.TokenValue().ToFloat();
 
             lex.ReadToken();
-            l->linearAttenuation = lex.TokenValue().ToFloat();
-            
-            l->directional = (l->pos[3] == 0);
+            l.linearAttenuation = lex.TokenValue().ToFloat();
 
 			lex.ReadToken();	// '}'
-            engine->AddLight(l);
+            src.lights.push_back(l);
+        } else if( val == "area" ) {
+            bmap_area_t a;
+            memset(&a, 0, sizeof(a));
+            lex.ReadToken();    // '{'
+            lex.ReadToken();    // 'mins' label
+            Vec3 mins = ReadVec3(&lex);
+            lex.ReadToken();    // 'maxs' label
+            Vec3 maxs = ReadVec3(&lex);
+            lex.ReadToken();    // '}'
+            for( int i = 0; i < 3; ++i ) {
+                a.mins[i] = mins[i];
+                a.maxs[i] = maxs[i];
+            }
+            src.areas.push_back(a);
+        } else if( val == "portal" ) {
+            map_portal_t p;
+            lex.ReadToken();    // '{'
+            lex.ReadToken();    // 'areas' label
+            lex.ReadToken();
+            p.areas[0] = lex.TokenValue().ToInteger();
+            lex.ReadToken();
+            p.areas[1] = lex.TokenValue().ToInteger();
+            lex.ReadToken();    // 'numPoints' label
+            lex.ReadToken();
+            int numPoints = lex.TokenValue().ToInteger();
+            for( int i = 0; i < numPoints && lex.MoreToken(); ++i ) {
+                p.points.push_back(ReadVec3(&lex));
+            }
+            lex.ReadToken();    // '}'
+            src.portals.push_back(p);
         }
     }    
 
-    loaded = true;
-	return true;
+    // Portals can come before the areas they join
+    for( size_t i = 0; i < src.portals.size(); ++i ) {
+        const map_portal_t& p = src.portals[i];
+        int n = (int)src.areas.size();
+        if( p.areas[0] < 0 || p.areas[0] >= n || p.areas[1] < 0 || p.areas[1] >= n || p.areas[0] == p.areas[1]
+            || p.points.size() < 3 || p.points.size() > WINDING_MAX_VERTS ) {
+            fprintf(stderr, "Bad portal %d in map file.\n", (int)i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Portals twice, once from each side, grouped by area. Entities,
+// background aside, go to every area their bounding sphere reaches.
+static void R_BuildAreas(const map_source_t& src, const std::vector<Vec3>& centers, const std::vector<float>& radii,
+    const std::vector<bool>& background,
+    std::vector<bmap_area_t>& areas, std::vector<bmap_portal_t>& portals, std::vector<float>& points, std::vector<unsigned int>& refs)
+{
+    areas = src.areas;
+    portals.clear();
+    points.clear();
+    refs.clear();
+    for( size_t a = 0; a < areas.size(); ++a ) {
+        areas[a].firstPortal = (unsigned int)portals.size();
+        for( size_t i = 0; i < src.portals.size(); ++i ) {
+            const map_portal_t& p = src.portals[i];
+            if( p.areas[0] != (int)a && p.areas[1] != (int)a ) {
+                continue;
+            }
+            bmap_portal_t out;
+            out.area = p.areas[0] == (int)a ? p.areas[1] : p.areas[0];
+            out.firstPoint = (unsigned int)points.size() / 3;
+            out.numPoints = (unsigned int)p.points.size();
+            for( size_t k = 0; k < p.points.size(); ++k ) {
+                points.insert(points.end(), &p.points[k][0], &p.points[k][0] + 3);
+            }
+            portals.push_back(out);
+        }
+        areas[a].numPortals = (unsigned int)portals.size() - areas[a].firstPortal;
+
+        areas[a].firstRef = (unsigned int)refs.size();
+        for( size_t e = 0; e < centers.size(); ++e ) {
+            if( background[e] ) {
+                continue;
+            }
+            int k = 0;
+            for( ; k < 3 && centers[e][k] + radii[e] >= areas[a].mins[k] && centers[e][k] - radii[e] <= areas[a].maxs[k]; ++k ) {
+            }
+            if( k == 3 ) {
+                refs.push_back((unsigned int)e);
+            }
+        }
+        areas[a].numRefs = (unsigned int)refs.size() - areas[a].firstRef;
+    }
+}
+
+void WorldDB::SetAreas(const map_source_t& src)
+{
+    std::vector<Vec3> centers(numEnt);
+    std::vector<float> radii(numEnt);
+    std::vector<bool> background(numEnt);
+    for( int i = 0; i < numEnt; ++i ) {
+        // World bounding sphere, same as the renderer uses
+        Mat4 m = entities[i]->GetModelToWorldMat();
+        const Mesh * mesh = entities[i]->GetModel();
+        Vec4 c = m.Mul(mesh->GetBoundCenter());
+        float scale = 0.0f;
+        for( int k = 0; k < 3; ++k ) {
+            Vec3 axis(m[k][0], m[k][1], m[k][2]);
+            scale = std::max(scale, axis.DotProduct(axis));
+        }
+        centers[i] = Vec3(c[0], c[1], c[2]);
+        radii[i] = mesh->GetBoundRadius() * sqrtf(scale);
+        background[i] = i < numBgEntities;
+    }
+    R_BuildAreas(src, centers, radii, background, textAreas, textPortals, textPortalPoints, textAreaRefs);
+    numAreas = (int)textAreas.size();
+    areas = textAreas.empty() ? NULL : &textAreas[0];
+    portals = textPortals.empty() ? NULL : &textPortals[0];
+    portalPoints = textPortalPoints.empty() ? NULL : &textPortalPoints[0];
+    areaRefs = textAreaRefs.empty() ? NULL : &textAreaRefs[0];
+    BuildEntityAreas();
+}
+
+void WorldDB::BuildEntityAreas()
+{
+    entityInArea.clear();
+    if( !numAreas ) {
+        return;
+    }
+    entityInArea.assign(numEnt, false);
+    for( int a = 0; a < numAreas; ++a ) {
+        for( unsigned int k = 0; k < areas[a].numRefs; ++k ) {
+            entityInArea[areaRefs[areas[a].firstRef + k]] = true;
+        }
+    }
+}
+
+int WorldDB::FindArea(const Vec3& pos) const
+{
+    for( int a = 0; a < numAreas; ++a ) {
+        const bmap_area_t& area = areas[a];
+        if( pos[0] >= area.mins[0] && pos[0] <= area.maxs[0] && pos[1] >= area.mins[1] && pos[1] <= area.maxs[1]
+            && pos[2] >= area.mins[2] && pos[2] <= area.maxs[2] ) {
+            return a;
+        }
+    }
+    return -1;
+}
+
+// Lights go to the engine in one block
+void WorldDB::AddLights(const bmap_light_t * src, int count)
+{
+    light_t * lights = (light_t*)malloc(count * sizeof(light_t));
+    if( !lights ) {
+        common->FatalError("WorldDB: Cannot allocate more memory");
+    }
+    lightBlock = lights;
+    for( int i = 0; i < count; ++i ) {
+        const bmap_light_t& s = src[i];
+        light_t * l = &lights[i];
+        l->id = s.id;
+        l->enabled = s.enabled != 0;
+        l->pos = Vec4(s.pos[0], s.pos[1], s.pos[2], s.pos[3]);
+        l->ambient = Vec3(s.ambient[0], s.ambient[1], s.ambient[2]);
+        l->diffuse = Vec3(s.diffuse[0], s.diffuse[1], s.diffuse[2]);
+        l->specular = Vec3(s.specular[0], s.specular[1], s.specular[2]);
+        l->constantAttenuation = s.constantAttenuation;
+        l->linearAttenuation = s.linearAttenuation;
+        l->directional = (s.pos[3] == 0);
+        l->next = NULL;
+        engine->AddLight(l);
+    }
+}
+
+// count elements of elemSize at offset lie inside a file of size bytes
+static bool R_InFile(unsigned int offset, unsigned int count, size_t elemSize, size_t size)
+{
+    return offset % 4 == 0 && offset <= size && count <= ( size - offset ) / elemSize;
+}
+
+bool WorldDB::LoadBinaryMap(const qStr& path)
+{
+    if( !mapFile.Open(path.Ptr()) ) {
+        fprintf(stderr, "Cannot open map %s\n", path.Ptr());
+        return false;
+    }
+    const byte * base = mapFile.GetData();
+    size_t size = mapFile.GetSize();
+
+    const bmap_header_t * h = (const bmap_header_t*)base;
+    if( size < sizeof(*h) || h->magic != BMAP_MAGIC || h->version != BMAP_VERSION
+        || !R_InFile(h->stringsOffset, h->stringsSize, 1, size)
+        || !R_InFile(h->meshesOffset, h->numMeshes, sizeof(bmap_mesh_t), size)
+        || !R_InFile(h->instancesOffset, h->numInstances, 16 * sizeof(float), size)
+        || !R_InFile(h->instanceFlagsOffset, h->numInstances, 1, size)
+        || !R_InFile(h->lightsOffset, h->numLights, sizeof(bmap_light_t), size)
+        || !R_InFile(h->sectionsOffset, h->numSections, sizeof(bmap_section_t), size)
+        || !R_InFile(h->sectionRefsOffset, h->numSectionRefs, sizeof(unsigned int), size)
+        || !h->stringsSize || base[h->stringsOffset + h->stringsSize - 1] != '\0' ) {
+        fprintf(stderr, "%s is not a valid cooked map\n", path.Ptr());
+        mapFile.Close();
+        return false;
+    }
+
+    const char * strings = (const char*)( base + h->stringsOffset );
+    const bmap_mesh_t * meshes = (const bmap_mesh_t*)( base + h->meshesOffset );
+    const float * instances = (const float*)( base + h->instancesOffset );
+    const byte * flags = base + h->instanceFlagsOffset;
+
+    numBgEntities = h->numBgEntities;
+    entityPool = new Entity[h->numInstances];
+    entities.reserve(h->numInstances);
+    for( unsigned int i = 0; i < h->numMeshes; ++i ) {
+        const bmap_mesh_t& m = meshes[i];
+        if( m.name >= h->stringsSize || m.firstInstance + m.numInstances > h->numInstances
+            || m.firstInstance + m.numInstances < m.firstInstance ) {
+            fprintf(stderr, "%s is not a valid cooked map\n", path.Ptr());
+            Reset();
+            return false;
+        }
+        // Every instance of a mesh shares one lookup
+        Mesh * mesh = engine->GetModel(qAtom::Find(strings + m.name));
+        if( !mesh ) {
+            common->FatalError("Mesh doesn't exist.\n");
+        }
+        for( unsigned int k = m.firstInstance; k < m.firstInstance + m.numInstances; ++k ) {
+            Entity * ent = &entityPool[k];
+            ent->AttachMesh(mesh);
+            ent->SetModelToWorldMat(Mat4(instances + k * 16));
+            ent->SetOccluder(( flags[k] & BMAP_INSTANCE_OCCLUDER ) != 0);
+            ent->SavePrevState();
+            ent->Interpolate(1.0f);
+        }
+    }
+    // Instances no mesh record covers would be drawn without a mesh
+    for( unsigned int k = 0; k < h->numInstances; ++k ) {
+        if( !entityPool[k].GetModel() ) {
+            fprintf(stderr, "%s is not a valid cooked map\n", path.Ptr());
+            Reset();
+            return false;
+        }
+        entities.push_back(&entityPool[k]);
+    }
+    numEnt = h->numInstances;
+
+    numSections = h->numSections;
+    sections = (const bmap_section_t*)( base + h->sectionsOffset );
+    sectionRefs = (const unsigned int*)( base + h->sectionRefsOffset );
+    for( int i = 0; i < numSections; ++i ) {
+        const bmap_section_t& s = sections[i];
+        bool ok = s.firstRef <= h->numSectionRefs && s.numRefs <= h->numSectionRefs - s.firstRef;
+        for( unsigned int k = 0; ok && k < s.numRefs; ++k ) {
+            ok = sectionRefs[s.firstRef + k] < h->numInstances;
+        }
+        if( !ok ) {
+            fprintf(stderr, "%s is not a valid cooked map\n", path.Ptr());
+            Reset();
+            return false;
+        }
+    }
+
+    if( h->pvsOffset ) {
+        pvs = (const bmap_pvs_t*)( base + h->pvsOffset );
+        bool ok = R_InFile(h->pvsOffset, 1, sizeof(bmap_pvs_t), size)
+            && pvs->cellsX > 0 && pvs->cellsZ > 0 && pvs->cellSize > 0.0f
+            && (unsigned long long)pvs->cellsX * pvs->cellsZ <= size / sizeof(bmap_pvs_cell_t)
+            && R_InFile(h->pvsCellsOffset, pvs->cellsX * pvs->cellsZ, sizeof(bmap_pvs_cell_t), size)
+            && R_InFile(h->pvsWordsOffset, h->numPvsWords, sizeof(bmap_pvs_word_t), size);
+        if( ok ) {
+            pvsCells = (const bmap_pvs_cell_t*)( base + h->pvsCellsOffset );
+            pvsWords = (const bmap_pvs_word_t*)( base + h->pvsWordsOffset );
+            for( int i = 0; ok && i < pvs->cellsX * pvs->cellsZ; ++i ) {
+                ok = pvsCells[i].firstWord <= h->numPvsWords && pvsCells[i].numWords <= h->numPvsWords - pvsCells[i].firstWord;
+            }
+            for( unsigned int i = 0; ok && i < h->numPvsWords; ++i ) {
+                ok = pvsWords[i].index < ( h->numInstances + 31 ) / 32;
+            }
+        }
+        if( !ok ) {
+            fprintf(stderr, "%s is not a valid cooked map\n", path.Ptr());
+            Reset();
+            return false;
+        }
+    }
+
+    if( h->numAreas ) {
+        bool ok = R_InFile(h->areasOffset, h->numAreas, sizeof(bmap_area_t), size)
+            && R_InFile(h->portalsOffset, h->numPortals, sizeof(bmap_portal_t), size)
+            && R_InFile(h->portalPointsOffset, h->numPortalPoints, 3 * sizeof(float), size)
+            && R_InFile(h->areaRefsOffset, h->numAreaRefs, sizeof(unsigned int), size);
+        if( ok ) {
+            areas = (const bmap_area_t*)( base + h->areasOffset );
+            portals = (const bmap_portal_t*)( base + h->portalsOffset );
+            portalPoints = (const float*)( base + h->portalPointsOffset );
+            areaRefs = (const unsigned int*)( base + h->areaRefsOffset );
+            for( unsigned int i = 0; ok && i < h->numAreas; ++i ) {
+                const bmap_area_t& a = areas[i];
+                ok = a.firstPortal <= h->numPortals && a.numPortals <= h->numPortals - a.firstPortal
+                    && a.firstRef <= h->numAreaRefs && a.numRefs <= h->numAreaRefs - a.firstRef;
+            }
+            for( unsigned int i = 0; ok && i < h->numPortals; ++i ) {
+                const bmap_portal_t& p = portals[i];
+                ok = p.area < h->numAreas && p.numPoints >= 3 && p.numPoints <= WINDING_MAX_VERTS
+                    && p.firstPoint <= h->numPortalPoints && p.numPoints <= h->numPortalPoints - p.firstPoint;
+            }
+            for( unsigned int i = 0; ok && i < h->numAreaRefs; ++i ) {
+                ok = areaRefs[i] < h->numInstances;
+            }
+        }
+        if( !ok ) {
+            fprintf(stderr, "%s is not a valid cooked map\n", path.Ptr());
+            Reset();
+            return false;
+        }
+        numAreas = h->numAreas;
+        BuildEntityAreas();
+    }
+
+    if( h->numLights ) {
+        AddLights((const bmap_light_t*)( base + h->lightsOffset ), h->numLights);
+    }
+    return true;
+}
+
+// Appends bytes at a 4 byte boundary, returns their offset
+static unsigned int R_Append(std::vector<byte>& out, const void * data, size_t bytes)
+{
+    while( out.size() % 4 ) {
+        out.push_back(0);
+    }
+    unsigned int offset = (unsigned int)out.size();
+    out.insert(out.end(), (const byte*)data, (const byte*)data + bytes);
+    return offset;
+}
+
+// Offset of str in the string table, added if not there yet
+static unsigned int R_AddString(std::vector<char>& table, const qStr& str)
+{
+    for( size_t i = 0; i < table.size(); i += strlen(&table[i]) + 1 ) {
+        if( str == &table[i] ) {
+            return (unsigned int)i;
+        }
+    }
+    unsigned int offset = (unsigned int)table.size();
+    table.insert(table.end(), str.Ptr(), str.Ptr() + str.Length() + 1);
+    return offset;
+}
+
+struct cook_instance_t {
+    int         entity;
+    int         mesh;
+    int         x, z;       // section
+    Vec3        center;
+    float       radius;
+};
+
+// By mesh, then by section so entities close to each other
+// share PVS words
+static bool R_InstanceCmp(const cook_instance_t& a, const cook_instance_t& b)
+{
+    if( a.mesh != b.mesh ) {
+        return a.mesh < b.mesh;
+    }
+    if( a.z != b.z ) {
+        return a.z < b.z;
+    }
+    if( a.x != b.x ) {
+        return a.x < b.x;
+    }
+    return a.entity < b.entity;
+}
+
+static bool R_SectionCmp(const cook_instance_t * a, const cook_instance_t * b)
+{
+    if( a->z != b->z ) {
+        return a->z < b->z;
+    }
+    return a->x < b->x;
+}
+
+/*
+================================================
+
+Map cooker. Parses the text map once and writes
+what LoadMap needs, ready to use in place.
+
+================================================
+*/
+bool WorldDB::CookMap(const char * map, float pvsDistance)
+{
+    qStr fn = MapPath(map);
+    qStr ext = fn.GetFileExtension();
+    if( ext != "map" ) {
+        fprintf(stderr, "Only text maps can be cooked.\n");
+        return false;
+    }
+
+    map_source_t src;
+    if( !ParseMap(fn, src) ) {
+        return false;
+    }
+
+    std::vector<char> strings;
+    std::vector<bmap_mesh_t> meshes;
+    std::vector<cook_instance_t> inst(src.entities.size());
+    for( size_t i = 0; i < src.entities.size(); ++i ) {
+        const map_entity_t& e = src.entities[i];
+        Mesh * mesh = engine->GetModel(e.mesh.Ptr());
+        if( !mesh ) {
+            fprintf(stderr, "Mesh %s doesn't exist.\n", e.mesh.Ptr());
+            return false;
+        }
+        unsigned int name = R_AddString(strings, e.mesh);
+        unsigned int format = R_AddString(strings, e.format);
+        size_t m = 0;
+        for( ; m < meshes.size() && ( meshes[m].name != name || meshes[m].format != format ); ++m ) {
+        }
+        if( m == meshes.size() ) {
+            bmap_mesh_t rec = { name, format, 0, 0 };
+            meshes.push_back(rec);
+        }
+        meshes[m].numInstances++;
+
+        // World bounding sphere, same as the renderer uses
+        cook_instance_t& c = inst[i];
+        c.entity = (int)i;
+        c.mesh = (int)m;
+        Vec4 center = e.pos.Mul(mesh->GetBoundCenter());
+        float scale = 0.0f;
+        for( int k = 0; k < 3; ++k ) {
+            Vec3 axis(e.pos[k][0], e.pos[k][1], e.pos[k][2]);
+            scale = std::max(scale, axis.DotProduct(axis));
+        }
+        c.center = Vec3(center[0], center[1], center[2]);
+        c.radius = mesh->GetBoundRadius() * sqrtf(scale);
+        c.x = (int)floorf(c.center[0] / BMAP_SECTION_SIZE);
+        c.z = (int)floorf(c.center[2] / BMAP_SECTION_SIZE);
+    }
+
+    // Instances of a mesh next to each other
+    std::sort(inst.begin(), inst.end(), R_InstanceCmp);
+    unsigned int first = 0;
+    for( size_t m = 0; m < meshes.size(); ++m ) {
+        meshes[m].firstInstance = first;
+        first += meshes[m].numInstances;
+    }
+
+    std::vector<float> matrices(inst.size() * 16);
+    std::vector<byte> flags(inst.size());
+    for( size_t i = 0; i < inst.size(); ++i ) {
+        const map_entity_t& e = src.entities[inst[i].entity];
+        memcpy(&matrices[i * 16], e.pos.GetRawPtr(), 16 * sizeof(float));
+        flags[i] = e.occluder ? BMAP_INSTANCE_OCCLUDER : 0;
+    }
+
+    // Sections, refs are indices into the sorted instances.
+    // Background entities stay out of them.
+    std::vector<const cook_instance_t*> order;
+    for( size_t i = 0; i < inst.size(); ++i ) {
+        if( inst[i].entity >= src.numBgEntities ) {
+            order.push_back(&inst[i]);
+        }
+    }
+    std::sort(order.begin(), order.end(), R_SectionCmp);
+    std::vector<bmap_section_t> sections;
+    std::vector<unsigned int> refs(order.size());
+    for( size_t i = 0; i < order.size(); ++i ) {
+        const cook_instance_t * c = order[i];
+        if( sections.empty() || sections.back().x != c->x || sections.back().z != c->z ) {
+            bmap_section_t s;
+            s.x = c->x;
+            s.z = c->z;
+            for( int k = 0; k < 3; ++k ) {
+                s.mins[k] = FLT_MAX;
+                s.maxs[k] = -FLT_MAX;
+            }
+            s.firstRef = (unsigned int)i;
+            s.numRefs = 0;
+            sections.push_back(s);
+        }
+        bmap_section_t& s = sections.back();
+        for( int k = 0; k < 3; ++k ) {
+            s.mins[k] = std::min(s.mins[k], c->center[k] - c->radius);
+            s.maxs[k] = std::max(s.maxs[k], c->center[k] + c->radius);
+        }
+        s.numRefs++;
+        refs[i] = (unsigned int)( c - &inst[0] );
+    }
+
+    bmap_header_t h;
+    memset(&h, 0, sizeof(h));
+    std::vector<byte> out;
+    R_Append(out, &h, sizeof(h));
+    strings.push_back('\0');
+    h.magic = BMAP_MAGIC;
+    h.version = BMAP_VERSION;
+    h.numBgEntities = src.numBgEntities;
+    h.stringsSize = (unsigned int)strings.size();
+    h.stringsOffset = R_Append(out, &strings[0], strings.size());
+    h.numMeshes = (unsigned int)meshes.size();
+    h.meshesOffset = R_Append(out, meshes.empty() ? NULL : &meshes[0], meshes.size() * sizeof(bmap_mesh_t));
+    h.numInstances = (unsigned int)inst.size();
+    h.instancesOffset = R_Append(out, matrices.empty() ? NULL : &matrices[0], matrices.size() * sizeof(float));
+    h.instanceFlagsOffset = R_Append(out, flags.empty() ? NULL : &flags[0], flags.size());
+    h.numLights = (unsigned int)src.lights.size();
+    h.lightsOffset = R_Append(out, src.lights.empty() ? NULL : &src.lights[0], src.lights.size() * sizeof(bmap_light_t));
+    h.numSections = (unsigned int)sections.size();
+    h.sectionsOffset = R_Append(out, sections.empty() ? NULL : &sections[0], sections.size() * sizeof(bmap_section_t));
+    h.numSectionRefs = (unsigned int)refs.size();
+    h.sectionRefsOffset = R_Append(out, refs.empty() ? NULL : &refs[0], refs.size() * sizeof(unsigned int));
+
+    // Areas, refs into the sorted instances like sections
+    if( !src.areas.empty() ) {
+        std::vector<Vec3> centers(inst.size());
+        std::vector<float> radii(inst.size());
+        std::vector<bool> background(inst.size());
+        for( size_t i = 0; i < inst.size(); ++i ) {
+            centers[i] = inst[i].center;
+            radii[i] = inst[i].radius;
+            background[i] = inst[i].entity < src.numBgEntities;
+        }
+        std::vector<bmap_area_t> areas;
+        std::vector<bmap_portal_t> portals;
+        std::vector<float> points;
+        std::vector<unsigned int> areaRefs;
+        R_BuildAreas(src, centers, radii, background, areas, portals, points, areaRefs);
+        h.numAreas = (unsigned int)areas.size();
+        h.areasOffset = R_Append(out, &areas[0], areas.size() * sizeof(bmap_area_t));
+        h.numPortals = (unsigned int)portals.size();
+        h.portalsOffset = R_Append(out, portals.empty() ? NULL : &portals[0], portals.size() * sizeof(bmap_portal_t));
+        h.numPortalPoints = (unsigned int)points.size() / 3;
+        h.portalPointsOffset = R_Append(out, points.empty() ? NULL : &points[0], points.size() * sizeof(float));
+        h.numAreaRefs = (unsigned int)areaRefs.size();
+        h.areaRefsOffset = R_Append(out, areaRefs.empty() ? NULL : &areaRefs[0], areaRefs.size() * sizeof(unsigned int));
+    }
+
+    if( pvsDistance > 0.0f ) {
+        std::vector<pvs_instance_t> pvsInst(inst.size());
+        for( size_t i = 0; i < inst.size(); ++i ) {
+            const map_entity_t& e = src.entities[inst[i].entity];
+            pvsInst[i].mesh = engine->GetModel(e.mesh.Ptr());
+            pvsInst[i].pos = e.pos;
+            pvsInst[i].background = inst[i].entity < src.numBgEntities;
+        }
+        long long start = Timer::GetSysNanoseconds();
+        PvsBuilder builder;
+        bmap_pvs_t info;
+        std::vector<bmap_pvs_cell_t> cells;
+        std::vector<bmap_pvs_word_t> words;
+        if( builder.Build(pvsInst, pvsDistance, info, cells, words) ) {
+            h.pvsOffset = R_Append(out, &info, sizeof(info));
+            h.pvsCellsOffset = R_Append(out, &cells[0], cells.size() * sizeof(bmap_pvs_cell_t));
+            h.numPvsWords = (unsigned int)words.size();
+            h.pvsWordsOffset = R_Append(out, words.empty() ? NULL : &words[0], words.size() * sizeof(bmap_pvs_word_t));
+            size_t visible = 0;
+            for( size_t i = 0; i < cells.size(); ++i ) {
+                for( unsigned int k = 0; k < cells[i].numWords; ++k ) {
+                    for( unsigned int w = words[cells[i].firstWord + k].bits; w; w &= w - 1 ) {
+                        visible++;
+                    }
+                }
+            }
+            printf("PVS: %d cells of %.1f, %.1f of %u entities visible per cell, %u words, %.2f s\n", (int)cells.size(),
+                info.cellSize, (double)visible / cells.size(), h.numInstances, h.numPvsWords,
+                ( Timer::GetSysNanoseconds() - start ) * 1e-9);
+        }
+    }
+    memcpy(&out[0], &h, sizeof(h));
+
+    qStr outPath(fn.Ptr(), fn.Length() - ext.Length());
+    outPath.ConcatSelf("bmap");
+    FILE * fp = fopen(outPath.Ptr(), "wb");
+    if( !fp ) {
+        fprintf(stderr, "Cannot open %s for writing\n", outPath.Ptr());
+        return false;
+    }
+    bool ok = fwrite(&out[0], out.size(), 1, fp) == 1;
+    fclose(fp);
+    if( !ok ) {
+        fprintf(stderr, "Failed writing %s\n", outPath.Ptr());
+        remove(outPath.Ptr());
+        return false;
+    }
+    printf("Cooked %s: %u entities of %u meshes, %u lights, %u sections, %u areas, %u bytes\n",
+        outPath.Ptr(), h.numInstances, h.numMeshes, h.numLights, h.numSections, h.numAreas, (unsigned int)out.size());
+    return true;
 }
 
 Mat4 WorldDB::ReadMat4(LexerFile * lex)
@@ -145,27 +836,125 @@ Mat4 WorldDB::ReadMat4(LexerFile * lex)
     return res;
 }
 
-void WorldDB::AddEntity(Mat4 pos, qStr fmt, qStr path)
+const bmap_pvs_word_t * WorldDB::GetVisibleSet(const Vec3& pos, int& numWords) const
+{
+    numWords = 0;
+    if( !pvs || pos[1] < pvs->minY || pos[1] > pvs->maxY ) {
+        return NULL;
+    }
+    float x = floorf(( pos[0] - pvs->origin[0] ) / pvs->cellSize);
+    float z = floorf(( pos[2] - pvs->origin[1] ) / pvs->cellSize);
+    if( x < 0.0f || z < 0.0f || x >= pvs->cellsX || z >= pvs->cellsZ ) {
+        return NULL;
+    }
+    const bmap_pvs_cell_t& cell = pvsCells[(int)z * pvs->cellsX + (int)x];
+    numWords = cell.numWords;
+    return pvsWords + cell.firstWord;
+}
+
+void WorldDB::BuildRayBvh()
 {
-    // file name is enough to identifier a mesh instance
-    qStr meshName = path.GetFileName();
+    PROFILE_SCOPE("BuildRayBvh");
+    std::vector<Vec3> mins(numEnt), maxs(numEnt);
+    worldToModel.resize(numEnt);
+    for( int i = 0; i < numEnt; ++i ) {
+        const Mesh * mesh = entities[i]->GetModel();
+        Mat4 m = entities[i]->GetModelToWorldMat();
+        const Vec3& bmin = mesh->GetBoundMins();
+        const Vec3& bmax = mesh->GetBoundMaxs();
+        mins[i] = Vec3(FLT_MAX);
+        maxs[i] = Vec3(-FLT_MAX);
+        for( int c = 0; c < 8; ++c ) {
+            Vec4 p = m.Mul(Vec3(( c & 1 ) ? bmax[0] : bmin[0], ( c & 2 ) ? bmax[1] : bmin[1], ( c & 4 ) ? bmax[2] : bmin[2]));
+            for( int k = 0; k < 3; ++k ) {
+                mins[i][k] = std::min(mins[i][k], p[k]);
+                maxs[i][k] = std::max(maxs[i][k], p[k]);
+            }
+        }
+        worldToModel[i] = m.AffineInverse();
+    }
+    entityBvh.Build(numEnt ? &mins[0] : NULL, numEnt ? &maxs[0] : NULL, numEnt);
+}
 
-    // Mesh is already loaded by engine
-    Mesh * mesh = engine->GetModel(meshName.Ptr());
-    
-    if( !mesh ) {
-        common->FatalError("Mesh doesn't exist.\n");
-    } 
+// Entities of a world Bvh leaf, ray taken to each model space
+struct world_leaf_t {
+    const Entity * const *  entities;
+    const Mat4 *            worldToModel;
+    const int *             prims;
+    Vec3                    origin;
+    Vec3                    dir;
+    ray_hit_t *             hit;
+    bool                    anyHit;
+    bool                    found;
+
+    bool operator()(int first, int count, float& tMax)
+    {
+        for( int i = first; i < first + count; ++i ) {
+            int e = prims[i];
+            const Mat4& m = worldToModel[e];
+            // An affine transform keeps t, tMax carries over
+            Vec4 o = m.Mul(origin);
+            Vec4 d = m.Mul(Vec4(dir[0], dir[1], dir[2], 0.0f));
+            ray_hit_t h;
+            h.t = tMax;
+            if( entities[e]->GetModel()->GetBvh().Intersect(Vec3(o[0], o[1], o[2]), Vec3(d[0], d[1], d[2]), h, anyHit) ) {
+                h.entity = e;
+                *hit = h;
+                tMax = h.t;
+                found = true;
+                if( anyHit ) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
 
-    Entity * ent = new Entity();   
-    ent->AttachMesh(mesh);
-    ent->SetModelToWorldMat(pos);
+bool WorldDB::CastRay(const ray_t& ray, ray_hit_t& hit, bool anyHit) const
+{
+    hit.t = ray.tMax;
+    hit.tri = -1;
+    hit.u = hit.v = 0.0f;
+    hit.entity = -1;
+    if( entityBvh.IsEmpty() ) {
+        return false;
+    }
 
-    entities.push_back(ent);
-    numEnt++;
+    world_leaf_t leaf;
+    leaf.entities = &entities[0];
+    leaf.worldToModel = &worldToModel[0];
+    leaf.prims = entityBvh.GetPrimitives();
+    leaf.origin = ray.origin;
+    leaf.dir = ray.dir;
+    leaf.hit = &hit;
+    leaf.anyHit = anyHit;
+    leaf.found = false;
+    float tMax = ray.tMax;
+    entityBvh.Traverse(ray.origin, ray.dir, tMax, leaf);
+    return leaf.found;
 }
 
+struct ray_batch_t {
+    const WorldDB *     db;
+    const ray_t *       rays;
+    ray_hit_t *         hits;
+    bool                anyHit;
+};
 
+static void R_CastRayJob(void * data, int begin, int end)
+{
+    ray_batch_t * batch = (ray_batch_t*)data;
+    for( int i = begin; i < end; ++i ) {
+        batch->db->CastRay(batch->rays[i], batch->hits[i], batch->anyHit);
+    }
+}
+
+void WorldDB::CastRays(const ray_t * rays, ray_hit_t * hits, int count, bool anyHit) const
+{
+    ray_batch_t batch = { this, rays, hits, anyHit };
+    jobs->ParallelFor(count, WORLD_RAYS_PER_JOB, R_CastRayJob, &batch);
+}
 
 Entity * WorldDB::operator[](int n) const
 {
@@ -18,6 +18,158 @@
 #include <vector>
 #include <assert.h>
 
+struct light_t;
+
+/*
+================================================
+
+Cooked binary map (.bmap), written by --cook-map.
+LoadMap maps the file and uses it in place.
+
+Everything is 4 byte aligned, offsets are bytes
+from the start of the file. Names are offsets
+into the string table. Instances are grouped by
+mesh so one mesh record covers a run of them,
+and sections index instances by world position.
+Background entities are in no section, they are
+always loaded. Maps cooked with --pvs also have
+what each camera cell can see, see Pvs.h.
+
+Indoor maps can have areas, boxes the rooms are
+in, joined by portals, the convex polygons of the
+doorways. Each portal is stored once per area it
+joins, leading to the other one. Each area refers
+to the entities whose bounds reach into it, so one
+standing in a doorway is in both rooms. Entities
+in no area are always drawn.
+
+================================================
+*/
+#define BMAP_MAGIC			0x50414D42	// 'BMAP'
+#define BMAP_VERSION		5
+// Side of a square section on the ground (x, z) plane
+#define BMAP_SECTION_SIZE	32.0f
+// Instance flags
+#define BMAP_INSTANCE_OCCLUDER	1
+
+struct bmap_header_t {
+	unsigned int	magic;
+	unsigned int	version;
+	unsigned int	numBgEntities;
+	unsigned int	stringsOffset;		// NUL terminated names
+	unsigned int	stringsSize;
+	unsigned int	numMeshes;
+	unsigned int	meshesOffset;		// bmap_mesh_t
+	unsigned int	numInstances;
+	unsigned int	instancesOffset;	// 16 floats each, Mat4 layout
+	unsigned int	instanceFlagsOffset;	// one byte each
+	unsigned int	numLights;
+	unsigned int	lightsOffset;		// bmap_light_t
+	unsigned int	numSections;
+	unsigned int	sectionsOffset;		// bmap_section_t
+	unsigned int	numSectionRefs;
+	unsigned int	sectionRefsOffset;	// instance indices
+	unsigned int	pvsOffset;			// bmap_pvs_t, 0 if there is none
+	unsigned int	pvsCellsOffset;		// bmap_pvs_cell_t, x first
+	unsigned int	numPvsWords;
+	unsigned int	pvsWordsOffset;		// bmap_pvs_word_t
+	unsigned int	numAreas;
+	unsigned int	areasOffset;		// bmap_area_t
+	unsigned int	numPortals;
+	unsigned int	portalsOffset;		// bmap_portal_t, by area
+	unsigned int	numPortalPoints;
+	unsigned int	portalPointsOffset;	// 3 floats each
+	unsigned int	numAreaRefs;
+	unsigned int	areaRefsOffset;		// instance indices
+};
+
+struct bmap_mesh_t {
+	unsigned int	name;				// mesh file name
+	unsigned int	format;
+	unsigned int	firstInstance;
+	unsigned int	numInstances;
+};
+
+struct bmap_light_t {
+	unsigned int	id;
+	unsigned int	enabled;
+	float			pos[4];				// w is 0 for directional
+	float			ambient[3];
+	float			diffuse[3];
+	float			specular[3];
+	float			constantAttenuation;
+	float			linearAttenuation;
+};
+
+// Cell (x, z) covers origin + cellSize * (x, z) on the ground
+// and heights minY to maxY
+struct bmap_pvs_t {
+	float			origin[2];			// x, z
+	float			cellSize;
+	int				cellsX, cellsZ;
+	float			minY, maxY;
+};
+
+// Instances seen from a cell, as the words of a bitset that
+// are not 0. Cells that see the same share their words.
+struct bmap_pvs_cell_t {
+	unsigned int	firstWord;
+	unsigned int	numWords;
+};
+
+// Bit k set if instance index * 32 + k can be seen
+struct bmap_pvs_word_t {
+	unsigned int	index;
+	unsigned int	bits;
+};
+
+struct bmap_section_t {
+	int				x, z;				// grid cell
+	float			mins[3];			// bounds of the instances in it
+	float			maxs[3];
+	unsigned int	firstRef;			// into the section refs
+	unsigned int	numRefs;
+};
+
+struct bmap_area_t {
+	float			mins[3];
+	float			maxs[3];
+	unsigned int	firstPortal;		// the ones leading out
+	unsigned int	numPortals;
+	unsigned int	firstRef;			// into the area refs
+	unsigned int	numRefs;
+};
+
+struct bmap_portal_t {
+	unsigned int	area;				// on the other side
+	unsigned int	firstPoint;			// convex, in order
+	unsigned int	numPoints;
+};
+
+// One portal of a text map, between two areas
+struct map_portal_t {
+	int					areas[2];
+	std::vector<Vec3>	points;
+};
+
+// One entity of a text map
+struct map_entity_t {
+	Mat4			pos;
+	qStr			format;
+	qStr			mesh;				// file name
+	bool			occluder;
+};
+
+// Text map parsed, before it becomes entities or gets cooked
+struct map_source_t {
+	int							numBgEntities;
+	std::vector<map_entity_t>	entities;
+	std::vector<bmap_light_t>	lights;
+	// Only mins and maxs are read
+	std::vector<bmap_area_t>	areas;
+	std::vector<map_portal_t>	portals;
+};
+
 
 class WorldDB
 {
@@ -31,18 +183,66 @@ public:
         return self;
     }
 
+    // A cooked .bmap next to a .map is used instead
     bool    LoadMap(const char *map);
+    // Text map into src. Touches nothing else, any thread can
+    // parse while the loaded map is in use.
+    static bool ParseMap(const qStr& path, map_source_t& src);
+    // Replaces what is loaded with a map ParseMap read
+    void    LoadParsed(const map_source_t& src);
+    // Ray casts see meshes as they were when this last ran,
+    // again after they changed
+    void    BuildRayBvh();
+    // Writes map as a .bmap next to it, meshes must be loaded.
+    // With a pvsDistance above 0 the PVS is built, nothing
+    // further than that from a cell counts as visible.
+    bool    CookMap(const char *map, float pvsDistance);
     int     Count() const;    
     void    Reset();
-    void    AddEntity(Mat4 pos, qStr fmt, qStr path);
     // For iteration
     Entity * operator[](int n) const;
 
+    // Spatial sections of a cooked map, none for a text map.
+    // Section refs are entity indices.
+    int                     GetNumSections() const { return numSections; }
+    const bmap_section_t&   GetSection(int n) const { return sections[n]; }
+    const unsigned int *    GetSectionRefs() const { return sectionRefs; }
+    // PVS words of the cell holding pos, entity indices as in
+    // bmap_pvs_word_t. NULL without a PVS or outside the cells,
+    // then everything may show.
+    const bmap_pvs_word_t * GetVisibleSet(const Vec3& pos, int& numWords) const;
+
+    // Areas and portals, none for maps without them. Area refs
+    // and IsInArea are entity indices.
+    int                     GetNumAreas() const { return numAreas; }
+    const bmap_area_t&      GetArea(int n) const { return areas[n]; }
+    const bmap_portal_t&    GetPortal(int n) const { return portals[n]; }
+    const Vec3 *            GetPortalPoints() const { return (const Vec3*)portalPoints; }
+    const unsigned int *    GetAreaRefs() const { return areaRefs; }
+    // First area holding pos, -1 for none
+    int                     FindArea(const Vec3& pos) const;
+    // Referred to by some area, portals decide if it shows
+    bool                    IsInArea(int n) const { return !entityInArea.empty() && entityInArea[n]; }
+
+    // Nearest triangle of an entity on the ray before ray.tMax,
+    // with anyHit the first one found. Entities are where the
+    // map put them. Safe to call from several jobs at once.
+    bool    CastRay(const ray_t& ray, ray_hit_t& hit, bool anyHit = false) const;
+    // count rays spread over the job system
+    void    CastRays(const ray_t * rays, ray_hit_t * hits, int count, bool anyHit = false) const;
+
 private:
     WorldDB();
     ~WorldDB();
 
-    Mat4    ReadMat4(LexerFile * lex);
+    static Mat4 ReadMat4(LexerFile * lex);
+    bool    LoadBinaryMap(const qStr& path);
+    void    AddLights(const bmap_light_t * src, int count);
+    qStr    MapPath(const char * map) const;
+    // Areas of a text map, entities must be in
+    void    SetAreas(const map_source_t& src);
+    // entityInArea from the area refs
+    void    BuildEntityAreas();
 
 private:
     static WorldDB *        self;
@@ -58,6 +258,32 @@ private:
     bool                    loaded;
 	// Nr of background entities
 	int						numBgEntities;
+	// Entities of the loaded map live in one block
+	Entity *				entityPool;
+	// Lights handed to the engine, one block
+	light_t *				lightBlock;
+	// Cooked map, mapped for as long as the map is loaded
+	MappedFile				mapFile;
+	int						numSections;
+	const bmap_section_t *	sections;
+	const unsigned int *	sectionRefs;
+	const bmap_pvs_t *		pvs;
+	const bmap_pvs_cell_t *	pvsCells;
+	const bmap_pvs_word_t *	pvsWords;
+	// Areas, in the cooked map or the text ones below
+	int						numAreas;
+	const bmap_area_t *		areas;
+	const bmap_portal_t *	portals;
+	const float *			portalPoints;
+	const unsigned int *	areaRefs;
+	std::vector<bmap_area_t>	textAreas;
+	std::vector<bmap_portal_t>	textPortals;
+	std::vector<float>			textPortalPoints;
+	std::vector<unsigned int>	textAreaRefs;
+	std::vector<bool>		entityInArea;
+	// Ray casts go through the entity boxes to the mesh Bvh
+	Bvh						entityBvh;
+	std::vector<Mat4>		worldToModel;
 	// Disable copy and assign ctor
 	WorldDB(const WorldDB&) {}
 	WorldDB& operator=(const WorldDB&) { return *this; /* silence compiler */}
@@ -66,14 +292,38 @@ private:
 
 inline void WorldDB::Reset()
 {
-    if( !loaded ) {
-        return;
-    }
-
     if( mapName ) {
         free(mapName);
         mapName = 0;
     } 
+
+    delete[] entityPool;
+    entityPool = NULL;
+    entities.clear();
+    numEnt = 0;
+    // The engine drops its list of them before loading a map
+    free(lightBlock);
+    lightBlock = NULL;
+
+    mapFile.Close();
+    numSections = 0;
+    sections = NULL;
+    sectionRefs = NULL;
+    pvs = NULL;
+    pvsCells = NULL;
+    pvsWords = NULL;
+    numAreas = 0;
+    areas = NULL;
+    portals = NULL;
+    portalPoints = NULL;
+    areaRefs = NULL;
+    textAreas.clear();
+    textPortals.clear();
+    textPortalPoints.clear();
+    textAreaRefs.clear();
+    entityInArea.clear();
+    entityBvh.Clear();
+    worldToModel.clear();
      
     loaded = false;
 }
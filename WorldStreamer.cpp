@@ -0,0 +1,319 @@
+#include "WorldStreamer.h"
+#include "WorldDB.h"
+#include "CameraPath.h"
+#include "Timer.h"
+#include "Profiler.h"
+#include <map>
+#include <algorithm>
+#include <climits>
+#include <cfloat>
+#include <string.h>
+
+extern JobSystem * jobs;
+
+static void R_ReadJob(void * data)
+{
+	( (Texture*)data )->Prefetch();
+}
+
+// Index of p in table, added with no references if new
+template<class T>
+static int R_ResourceIndex(std::map<T*, int>& index, std::vector<T*>& table, T * p)
+{
+	typename std::map<T*, int>::iterator it = index.find(p);
+	if( it != index.end() ) {
+		return it->second;
+	}
+	int n = (int)table.size();
+	index[p] = n;
+	table.push_back(p);
+	return n;
+}
+
+static bool R_NearerCell(const stream_cell_t * a, const stream_cell_t * b)
+{
+	return a->distance < b->distance;
+}
+
+WorldStreamer::WorldStreamer() : world(NULL), primed(false)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+void WorldStreamer::Shutdown()
+{
+	// Jobs write into textures, let them finish
+	for( size_t i = 0; i < cells.size(); ++i ) {
+		if( cells[i].state == CELL_READING ) {
+			jobs->Wait(&cells[i].job);
+		}
+	}
+	cells.clear();
+	meshes.clear();
+	meshRes.clear();
+	textures.clear();
+	texRes.clear();
+	world = NULL;
+	primed = false;
+	memset(&stats, 0, sizeof(stats));
+}
+
+void WorldStreamer::Init(WorldDB * w)
+{
+	Shutdown();
+	world = w;
+	int numSections = world->GetNumSections();
+	if( !numSections ) {
+		return;
+	}
+
+	std::map<Mesh*, int> meshIndex;
+	std::map<Texture*, int> texIndex;
+	std::vector<bool> inCell(world->Count(), false);
+	const unsigned int * refs = world->GetSectionRefs();
+
+	cells.resize(numSections);
+	for( int i = 0; i < numSections; ++i ) {
+		const bmap_section_t& s = world->GetSection(i);
+		stream_cell_t& cell = cells[i];
+		cell.state = CELL_UNLOADED;
+		cell.mins[0] = s.mins[0];
+		cell.mins[1] = s.mins[2];
+		cell.maxs[0] = s.maxs[0];
+		cell.maxs[1] = s.maxs[2];
+		cell.firstEntity = s.firstRef;
+		cell.numEntities = s.numRefs;
+		cell.job.pending = 0;
+		cell.distance = FLT_MAX;
+
+		for( unsigned int k = 0; k < s.numRefs; ++k ) {
+			int e = refs[s.firstRef + k];
+			Entity * ent = (*world)[e];
+			inCell[e] = true;
+			ent->SetResident(false);
+			int m = R_ResourceIndex(meshIndex, meshes, ent->GetModel());
+			if( std::find(cell.meshes.begin(), cell.meshes.end(), m) == cell.meshes.end() ) {
+				cell.meshes.push_back(m);
+			}
+			if( ent->GetTexture() ) {
+				int t = R_ResourceIndex(texIndex, textures, ent->GetTexture());
+				if( std::find(cell.textures.begin(), cell.textures.end(), t) == cell.textures.end() ) {
+					cell.textures.push_back(t);
+				}
+			}
+		}
+	}
+
+	resource_t none = { 0, false };
+	meshRes.assign(meshes.size(), none);
+	texRes.assign(textures.size(), none);
+
+	// Background entities keep what they use loaded
+	for( int e = 0; e < world->Count(); ++e ) {
+		if( inCell[e] ) {
+			continue;
+		}
+		Entity * ent = (*world)[e];
+		std::map<Mesh*, int>::iterator m = meshIndex.find(ent->GetModel());
+		if( m != meshIndex.end() ) {
+			meshRes[m->second].refs++;
+		}
+		std::map<Texture*, int>::iterator t = texIndex.find(ent->GetTexture());
+		if( t != texIndex.end() ) {
+			texRes[t->second].refs++;
+		}
+	}
+	stats.numCells = numSections;
+}
+
+// Distance on the ground plane from pos to the cell bounds
+float WorldStreamer::Distance(const stream_cell_t& cell, const Vec3& pos) const
+{
+	float dx = std::max(std::max(cell.mins[0] - pos[0], pos[0] - cell.maxs[0]), 0.0f);
+	float dz = std::max(std::max(cell.mins[1] - pos[2], pos[2] - cell.maxs[1]), 0.0f);
+	return sqrtf(dx * dx + dz * dz);
+}
+
+void WorldStreamer::BeginLoad(stream_cell_t& cell)
+{
+	for( size_t i = 0; i < cell.meshes.size(); ++i ) {
+		meshRes[cell.meshes[i]].refs++;
+	}
+	cell.reading.clear();
+	for( size_t i = 0; i < cell.textures.size(); ++i ) {
+		int t = cell.textures[i];
+		resource_t& r = texRes[t];
+		// First user of a texture that was dropped reads it back
+		if( !r.refs && !r.reading && textures[t]->CanRelease() && !textures[t]->IsUploaded() ) {
+			r.reading = true;
+			cell.reading.push_back(t);
+		}
+		r.refs++;
+	}
+
+	if( cell.reading.empty() ) {
+		cell.state = CELL_UPLOADING;
+		return;
+	}
+	cell.state = CELL_READING;
+	for( size_t i = 0; i < cell.reading.size(); ++i ) {
+		jobs->Submit(R_ReadJob, textures[cell.reading[i]], &cell.job);
+	}
+}
+
+void WorldStreamer::FinishRead(stream_cell_t& cell)
+{
+	jobs->Wait(&cell.job);
+	for( size_t k = 0; k < cell.reading.size(); ++k ) {
+		texRes[cell.reading[k]].reading = false;
+	}
+	cell.reading.clear();
+	cell.state = CELL_UPLOADING;
+}
+
+bool WorldStreamer::Upload(stream_cell_t& cell, long long deadline)
+{
+	for( size_t i = 0; i < cell.meshes.size(); ++i ) {
+		Mesh * mesh = meshes[cell.meshes[i]];
+		if( mesh->IsUploaded() ) {
+			continue;
+		}
+		if( Timer::GetSysNanoseconds() >= deadline ) {
+			return false;
+		}
+		stats.bytesUploaded += mesh->UploadGPU();
+	}
+	for( size_t i = 0; i < cell.textures.size(); ++i ) {
+		int t = cell.textures[i];
+		Texture * tex = textures[t];
+		if( tex->IsUploaded() ) {
+			continue;
+		}
+		// Another cell's job is still reading it
+		if( texRes[t].reading ) {
+			return false;
+		}
+		if( Timer::GetSysNanoseconds() >= deadline ) {
+			return false;
+		}
+		// Coarse levels, the rest streams in with the others
+		stats.bytesUploaded += tex->UploadGPU();
+	}
+	return true;
+}
+
+void WorldStreamer::Unload(stream_cell_t& cell)
+{
+	SetResident(cell, false);
+	for( size_t i = 0; i < cell.meshes.size(); ++i ) {
+		int m = cell.meshes[i];
+		if( --meshRes[m].refs == 0 ) {
+			meshes[m]->ReleaseGPU();
+		}
+	}
+	for( size_t i = 0; i < cell.textures.size(); ++i ) {
+		int t = cell.textures[i];
+		if( --texRes[t].refs == 0 ) {
+			textures[t]->ReleaseGPU();
+		}
+	}
+	cell.state = CELL_UNLOADED;
+}
+
+void WorldStreamer::SetResident(const stream_cell_t& cell, bool on)
+{
+	const unsigned int * refs = world->GetSectionRefs();
+	for( int k = 0; k < cell.numEntities; ++k ) {
+		(*world)[refs[cell.firstEntity + k]]->SetResident(on);
+	}
+}
+
+void WorldStreamer::Update(const Vec3& pos, const CameraPath * path)
+{
+	if( cells.empty() ) {
+		return;
+	}
+	PROFILE_SCOPE("StreamWorld");
+	long long start = Timer::GetSysNanoseconds();
+	stats.cellsLoaded = stats.cellsUnloaded = 0;
+	stats.bytesUploaded = 0;
+
+	// Where the path will be soon, so cells are ready on arrival
+	Vec3 ahead = pos;
+	if( path && path->IsPlaying() ) {
+		camera_frame_t frame;
+		path->Evaluate(path->GetPlayTime() + STREAM_LOOKAHEAD, frame);
+		ahead = frame.position;
+	}
+
+	for( size_t i = 0; i < cells.size(); ++i ) {
+		stream_cell_t& cell = cells[i];
+		if( cell.state == CELL_READING ) {
+			if( cell.job.pending > 0 && primed ) {
+				continue;
+			}
+			FinishRead(cell);
+		}
+
+		float d = std::min(Distance(cell, pos), Distance(cell, ahead));
+		cell.distance = d;
+		if( cell.state == CELL_UNLOADED && d <= STREAM_RADIUS ) {
+			BeginLoad(cell);
+			if( !primed && cell.state == CELL_READING ) {
+				FinishRead(cell);
+			}
+		} else if( ( cell.state == CELL_RESIDENT || cell.state == CELL_UPLOADING ) && d > STREAM_UNLOAD_RADIUS ) {
+			Unload(cell);
+			stats.cellsUnloaded++;
+		}
+	}
+
+	// Uploads get what is left of the budget, all of it on
+	// the first frame. Nearest cells first, they are needed
+	// soonest and least likely to be dropped again.
+	uploadOrder.clear();
+	for( size_t i = 0; i < cells.size(); ++i ) {
+		if( cells[i].state == CELL_UPLOADING ) {
+			uploadOrder.push_back(&cells[i]);
+		}
+	}
+	std::sort(uploadOrder.begin(), uploadOrder.end(), R_NearerCell);
+	long long deadline = primed ? start + STREAM_UPLOAD_BUDGET_NS : LLONG_MAX;
+	long long uploadStart = Timer::GetSysNanoseconds();
+	for( size_t i = 0; i < uploadOrder.size(); ++i ) {
+		stream_cell_t& cell = *uploadOrder[i];
+		if( !Upload(cell, deadline) ) {
+			continue;
+		}
+		cell.state = CELL_RESIDENT;
+		SetResident(cell, true);
+		stats.cellsLoaded++;
+	}
+	stats.uploadNs = Timer::GetSysNanoseconds() - uploadStart;
+	primed = true;
+
+	stats.residentCells = stats.loadingCells = stats.residentEntities = 0;
+	for( size_t i = 0; i < cells.size(); ++i ) {
+		const stream_cell_t& cell = cells[i];
+		if( cell.state == CELL_RESIDENT ) {
+			stats.residentCells++;
+			stats.residentEntities += cell.numEntities;
+		} else if( cell.state != CELL_UNLOADED ) {
+			stats.loadingCells++;
+		}
+	}
+	stats.residentMeshes = stats.residentTextures = 0;
+	stats.gpuBytes = 0;
+	for( size_t i = 0; i < meshes.size(); ++i ) {
+		if( meshes[i]->IsUploaded() ) {
+			stats.residentMeshes++;
+			stats.gpuBytes += meshes[i]->GetGPUSize();
+		}
+	}
+	for( size_t i = 0; i < textures.size(); ++i ) {
+		if( textures[i]->IsUploaded() ) {
+			stats.residentTextures++;
+			stats.gpuBytes += textures[i]->GetGPUSize();
+		}
+	}
+}
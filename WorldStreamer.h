@@ -0,0 +1,131 @@
+/*
+ * ===============================================================
+ *
+ * Keeps the part of a large map around the camera on the GPU.
+ *
+ * Cells are the spatial sections of a cooked map. Cells within
+ * STREAM_RADIUS of the camera, or of where the current camera
+ * path will be STREAM_LOOKAHEAD seconds from now, are loaded.
+ * Cells further than STREAM_UNLOAD_RADIUS from both are unloaded,
+ * the gap between the two keeps cells on the edge from flapping.
+ *
+ * Loading has two halves. Disk reads (cooked texture files) run
+ * as jobs on the workers. Buffer and texture uploads need the GL
+ * thread and run in Update, until STREAM_UPLOAD_BUDGET_NS is
+ * spent for the frame. A cell's entities are drawn once all of
+ * its meshes and textures are up.
+ *
+ * Meshes and textures are counted by the cells holding them and
+ * released when the last one goes. Entities outside every cell
+ * (background) pin theirs. Meshes keep their CPU copy, only
+ * cooked textures can be dropped, PNG ones stay.
+ *
+ * A text map has no sections and everything stays loaded.
+ *
+ *================================================================
+ */
+#ifndef _WORLDSTREAMER_H
+#define _WORLDSTREAMER_H
+
+#include "Math.h"
+#include "Thread.h"
+#include <vector>
+
+// World units around the camera that are kept loaded
+#define STREAM_RADIUS			64.0f
+#define STREAM_UNLOAD_RADIUS	96.0f
+// Seconds ahead on the camera path that are loaded too
+#define STREAM_LOOKAHEAD		2.0f
+// GL upload time per frame
+#define STREAM_UPLOAD_BUDGET_NS	2000000LL
+
+class Mesh;
+class Texture;
+class WorldDB;
+class CameraPath;
+
+typedef enum {
+	CELL_UNLOADED,
+	CELL_READING,		// job reading files
+	CELL_UPLOADING,		// waiting for GL uploads
+	CELL_RESIDENT
+} cell_state_t;
+
+struct stream_cell_t {
+	cell_state_t		state;
+	float				mins[2];	// x, z
+	float				maxs[2];
+	int					firstEntity;	// into section refs
+	int					numEntities;
+	float				distance;		// from the camera, last Update
+	// Indices into the resource tables
+	std::vector<int>	meshes;
+	std::vector<int>	textures;
+	// Textures being read for this cell
+	std::vector<int>	reading;
+	job_counter_t		job;
+};
+
+struct stream_stats_t {
+	int				numCells;
+	int				residentCells;
+	int				loadingCells;		// reading or uploading
+	int				residentEntities;
+	int				residentMeshes;
+	int				residentTextures;
+	unsigned int	gpuBytes;			// of streamed meshes and textures
+	// This frame
+	int				cellsLoaded;
+	int				cellsUnloaded;
+	unsigned int	bytesUploaded;
+	long long		uploadNs;
+};
+
+class WorldStreamer
+{
+public:
+					WorldStreamer();
+
+	// Build cells from a loaded map. Cell entities start out
+	// of residency until the first Update.
+	void			Init(WorldDB * world);
+	void			Shutdown();
+	bool			IsActive() const { return !cells.empty(); }
+
+	// Once per frame on the GL thread. The first call after
+	// Init loads what is around pos and does not return
+	// before it is all there.
+	void			Update(const Vec3& pos, const CameraPath * path);
+	const stream_stats_t&	GetStats() const { return stats; }
+
+private:
+	struct resource_t {
+		int			refs;
+		bool		reading;		// a job owns it
+	};
+
+	float			Distance(const stream_cell_t& cell, const Vec3& pos) const;
+	void			BeginLoad(stream_cell_t& cell);
+	// Waits for the read job, the cell moves on to uploading
+	void			FinishRead(stream_cell_t& cell);
+	// False when out of budget or a resource is still being read
+	bool			Upload(stream_cell_t& cell, long long deadline);
+	void			Unload(stream_cell_t& cell);
+	void			SetResident(const stream_cell_t& cell, bool on);
+
+private:
+	WorldDB *				world;
+	std::vector<stream_cell_t>	cells;
+	std::vector<Mesh*>		meshes;
+	std::vector<resource_t>	meshRes;
+	std::vector<Texture*>	textures;
+	std::vector<resource_t>	texRes;
+	std::vector<stream_cell_t*>	uploadOrder;
+	bool					primed;
+	stream_stats_t			stats;
+
+	WorldStreamer(const WorldStreamer&) {}
+	WorldStreamer& operator=(const WorldStreamer&) { return *this; }
+};
+
+#endif /* !_WORLDSTREAMER_H */
@@ -0,0 +1,769 @@
+/*
+ * ===============================================================
+ *
+ * Microbenchmarks of engine core kernels.
+ *
+ * Every case is a function running its kernel a given number of
+ * times. The harness grows that number until one sample takes at
+ * least BENCH_MIN_SAMPLE_NS, so timer resolution stops mattering,
+ * throws away a few warmup samples and then takes the requested
+ * number of samples on a thread pinned to one core. Reported per
+ * case: min, median, mean, standard deviation and the 95%
+ * confidence interval of the mean, all in ns per operation, and
+ * millions of work items a second for cases that have them.
+ * Threaded cases run last, with the job workers up and the pin
+ * released.
+ *
+ * Nothing here needs a GL context or the data folder, meshes and
+ * files are generated on the fly.
+ *
+ * Usage: qEngineBench [--filter str] [--samples n] [--core n]
+ *                     [--out file.json]
+ *
+ *================================================================
+ */
+#include "../qEngine.h"
+#include "../Geometry.h"
+#include "../Quaternion.h"
+#include "../Timer.h"
+#include "../Thread.h"
+#include "../Profiler.h"
+#include "../Atom.h"
+#include <math.h>
+#include <cfloat>
+#include <algorithm>
+
+// The engine objects expect these, normally from Main_linux.cpp
+qEngine * engine = NULL;
+Common commonInstance;
+Common * common = &commonInstance;
+Timer timer_obj;
+Timer * timer = &timer_obj;
+JobSystem jobs_obj;
+JobSystem * jobs = &jobs_obj;
+Profiler profiler_obj;
+Profiler * profiler = &profiler_obj;
+
+#define BENCH_MIN_SAMPLE_NS		2000000
+#define BENCH_WARMUP_SAMPLES	3
+#define BENCH_DEFAULT_SAMPLES	31
+// Synthetic sphere, about 9k triangles like a typical model
+#define BENCH_SPHERE_RINGS		48
+#define BENCH_SPHERE_SEGMENTS	96
+#define BENCH_MESH_PATH			"/tmp/qengine_bench.md5mesh"
+#define BENCH_CP_PATH			"/tmp/qengine_bench.cp"
+// Camera keys, one per second
+#define BENCH_CP_KEYS			256
+
+typedef void (*bench_func_t)(void * data, int iterations);
+
+struct bench_case_t {
+	const char *	name;
+	bench_func_t	func;
+	void *			data;
+	// Work items in one operation, for throughput
+	int				items;
+	const char *	itemName;
+	// Spreads its work over the job workers
+	bool			threaded;
+};
+
+struct bench_result_t {
+	const char *	name;
+	int				iterations;		// per sample
+	double			min, median, mean, stddev, ci95;
+	int				items;
+	const char *	itemName;
+	int				workers;
+};
+
+// Results land here so the compiler cannot drop the work
+static volatile float	benchSink;
+
+/*
+==============================================================
+
+Kernels
+
+==============================================================
+*/
+
+struct mat_chain_t {
+	Mat4	m[8];
+};
+
+static void Bench_Mat4Chain(void * data, int iterations)
+{
+	mat_chain_t * c = (mat_chain_t*)data;
+	for( int it = 0; it < iterations; ++it ) {
+		Mat4 r = c->m[0];
+		for( int i = 1; i < 8; ++i ) {
+			r = r.RightMul(c->m[i]);
+		}
+		benchSink += r[3][0];
+	}
+}
+
+struct slerp_data_t {
+	Quaternion	q[64];
+};
+
+static void Bench_Slerp(void * data, int iterations)
+{
+	slerp_data_t * d = (slerp_data_t*)data;
+	for( int it = 0; it < iterations; ++it ) {
+		int i = it & 63;
+		Quaternion r = d->q[i].Slerp(d->q[(i + 1) & 63], (it & 255) / 256.0f + 0.001f);
+		benchSink += r[0];
+	}
+}
+
+static void Bench_CalcNormals(void * data, int iterations)
+{
+	Mesh * mesh = (Mesh*)data;
+	for( int it = 0; it < iterations; ++it ) {
+		mesh->CalcNormals(true);
+	}
+	benchSink += mesh->GetVertexArray()[0].normal[0];
+}
+
+static void Bench_LexerReadToken(void * data, int iterations)
+{
+	const char * path = (const char*)data;
+	for( int it = 0; it < iterations; ++it ) {
+		LexerFile lex(path);
+		int tokens = 0;
+		while( lex.MoreToken() ) {
+			lex.ReadToken();
+			tokens++;
+		}
+		benchSink += tokens;
+	}
+}
+
+static void Bench_EntityBound(void * data, int iterations)
+{
+	Entity * ent = (Entity*)data;
+	for( int it = 0; it < iterations; ++it ) {
+		BBox b = ent->Bound();
+		benchSink += b.GetMax()[0];
+	}
+}
+
+struct bbox_set_t {
+	Frustum *			frustum;
+	std::vector<BBox>	boxes;
+};
+
+static void Bench_FrustumClipBBox(void * data, int iterations)
+{
+	bbox_set_t * s = (bbox_set_t*)data;
+	int visible = 0;
+	for( int it = 0; it < iterations; ++it ) {
+		for( size_t i = 0; i < s->boxes.size(); ++i ) {
+			visible += s->frustum->ClipBBox(s->boxes[i]);
+		}
+	}
+	benchSink += visible;
+}
+
+struct poly_set_t {
+	std::vector<Poly>	polys;
+	Plane				plane;
+};
+
+static void Bench_PolyClip(void * data, int iterations)
+{
+	poly_set_t * s = (poly_set_t*)data;
+	int verts = 0;
+	for( int it = 0; it < iterations; ++it ) {
+		for( size_t i = 0; i < s->polys.size(); ++i ) {
+			verts += s->polys[i].Clip(s->plane).Size();
+		}
+	}
+	benchSink += verts;
+}
+
+// The same polygons as poly_clip, no heap
+struct winding_set_t {
+	std::vector<winding_t>	windings;
+	Plane					plane;
+};
+
+static void Bench_WindingClip(void * data, int iterations)
+{
+	winding_set_t * s = (winding_set_t*)data;
+	int verts = 0;
+	for( int it = 0; it < iterations; ++it ) {
+		for( size_t i = 0; i < s->windings.size(); ++i ) {
+			winding_t out;
+			verts += R_ClipWinding(s->windings[i], s->plane, out);
+		}
+	}
+	benchSink += verts;
+}
+
+#define BENCH_CLIP_TRIS		1024
+
+struct tri_set_t {
+	Frustum *	frustum;
+	Vec3		in[BENCH_CLIP_TRIS * 3];
+	// Up to seven pieces a triangle
+	Vec3		out[BENCH_CLIP_TRIS * 3 * 7];
+};
+
+static void Bench_FrustumClipTris(void * data, int iterations)
+{
+	tri_set_t * s = (tri_set_t*)data;
+	int tris = 0;
+	for( int it = 0; it < iterations; ++it ) {
+		tris += s->frustum->ClipTriangles(s->in, BENCH_CLIP_TRIS, s->out, BENCH_CLIP_TRIS * 7);
+	}
+	benchSink += tris;
+}
+
+struct silhouette_data_t {
+	Mesh *		mesh;
+	light_t		light;
+};
+
+static void Bench_Silhouette(void * data, int iterations)
+{
+	silhouette_data_t * d = (silhouette_data_t*)data;
+	for( int it = 0; it < iterations; ++it ) {
+		silhouette_t * si = R_ExtractSilhouette(d->mesh, &d->light, NULL);
+		if( si ) {
+			benchSink += si->numSilEdges;
+			R_FreeSilhouette(si);
+		}
+	}
+}
+
+// The mix a model load puts through qStr
+static void Bench_StrOps(void * data, int iterations)
+{
+	int n = 0;
+	for( int it = 0; it < iterations; ++it ) {
+		qStr dir("/home/user/qengine/data");
+		qStr path = dir.Concat("/model/");
+		path.ConcatSelf("soldier_");
+		path.ConcatSelf(it & 1023);
+		path.AppendExtension("md5mesh");
+		qStr name = path.GetFileName();
+		qStr ext = path.GetFileExtension();
+		if( ext == "md5mesh" ) {
+			n++;
+		}
+		qStr copy(name);
+		copy.ToLower();
+		n += copy.Length() + path.Contains("model");
+	}
+	benchSink += n;
+}
+
+#define BENCH_NUM_RAYS		4096
+#define BENCH_RAYS_PER_JOB	64
+
+struct ray_set_t {
+	const MeshBvh *	bvh;
+	ray_t			rays[BENCH_NUM_RAYS];
+	ray_hit_t		hits[BENCH_NUM_RAYS];
+	bool			anyHit;
+};
+
+static void Bench_RayRange(ray_set_t * s, int begin, int end)
+{
+	for( int i = begin; i < end; ++i ) {
+		ray_hit_t& hit = s->hits[i];
+		hit.t = s->rays[i].tMax;
+		s->bvh->Intersect(s->rays[i].origin, s->rays[i].dir, hit, s->anyHit);
+	}
+}
+
+static void Bench_RayMesh(void * data, int iterations)
+{
+	ray_set_t * s = (ray_set_t*)data;
+	for( int it = 0; it < iterations; ++it ) {
+		Bench_RayRange(s, 0, BENCH_NUM_RAYS);
+	}
+	benchSink += s->hits[0].t;
+}
+
+static void Bench_RayJob(void * data, int begin, int end)
+{
+	Bench_RayRange((ray_set_t*)data, begin, end);
+}
+
+static void Bench_RayMeshJobs(void * data, int iterations)
+{
+	ray_set_t * s = (ray_set_t*)data;
+	for( int it = 0; it < iterations; ++it ) {
+		jobs->ParallelFor(BENCH_NUM_RAYS, BENCH_RAYS_PER_JOB, Bench_RayJob, s);
+	}
+	benchSink += s->hits[0].t;
+}
+
+/*
+==============================================================
+
+Inputs
+
+==============================================================
+*/
+
+// Camera circling the origin
+static bool Bench_WriteCameraPath(const char * path)
+{
+	FILE * fp = fopen(path, "w");
+	if( !fp ) {
+		return false;
+	}
+	fprintf(fp, "cp1\nnumFrames %d\n", BENCH_CP_KEYS);
+	for( int i = 0; i < BENCH_CP_KEYS; ++i ) {
+		float a = i * 0.3f;
+		fprintf(fp, "time %d position %f %f %f lookat 0 0 0 up 0 1 0\n", i * 1000,
+			cosf(a) * 20.0f, 5.0f + sinf(i * 0.1f), sinf(a) * 20.0f);
+	}
+	fclose(fp);
+	return true;
+}
+
+// Closed UV sphere with shared seam, so every edge has two
+// triangles. One weight per vertex.
+static bool Bench_WriteSphere(const char * path)
+{
+	FILE * fp = fopen(path, "w");
+	if( !fp ) {
+		return false;
+	}
+	const int rings = BENCH_SPHERE_RINGS, segs = BENCH_SPHERE_SEGMENTS;
+	int numVerts = 2 + (rings - 1) * segs;
+	int numTris = 2 * segs * (rings - 1);
+
+	fprintf(fp, "MD5Version 10\nnumJoints 1\nnumMeshes 1\n\n");
+	fprintf(fp, "joints {\n\t\"origin\" -1 ( 0 0 0 ) ( 0 0 0 )\n}\n\n");
+	fprintf(fp, "mesh {\n\tshader \"bench.png\"\n\n\tnumverts %d\n", numVerts);
+	for( int i = 0; i < numVerts; ++i ) {
+		fprintf(fp, "\tvert %d ( %f %f ) %d 1\n", i, (i % segs) / (float)segs, (i / segs) / (float)rings, i);
+	}
+
+	// Vertex 0 is the top pole, numVerts - 1 the bottom one
+	fprintf(fp, "\n\tnumtris %d\n", numTris);
+	int t = 0;
+	for( int s = 0; s < segs; ++s ) {
+		int a = 1 + s, b = 1 + (s + 1) % segs;
+		fprintf(fp, "\ttri %d %d %d %d\n", t++, 0, a, b);
+	}
+	for( int r = 0; r < rings - 2; ++r ) {
+		for( int s = 0; s < segs; ++s ) {
+			int a = 1 + r * segs + s, b = 1 + r * segs + (s + 1) % segs;
+			int c = a + segs, d = b + segs;
+			fprintf(fp, "\ttri %d %d %d %d\n", t++, a, c, b);
+			fprintf(fp, "\ttri %d %d %d %d\n", t++, b, c, d);
+		}
+	}
+	int last = 1 + (rings - 2) * segs;
+	for( int s = 0; s < segs; ++s ) {
+		int a = last + s, b = last + (s + 1) % segs;
+		fprintf(fp, "\ttri %d %d %d %d\n", t++, a, numVerts - 1, b);
+	}
+
+	fprintf(fp, "\n\tnumweights %d\n", numVerts);
+	for( int i = 0; i < numVerts; ++i ) {
+		float x, y, z;
+		if( i == 0 || i == numVerts - 1 ) {
+			x = z = 0.0f;
+			y = ( i == 0 ) ? 1.0f : -1.0f;
+		} else {
+			float theta = (float)M_PI * (1 + (i - 1) / segs) / rings;
+			float phi = 2.0f * (float)M_PI * ((i - 1) % segs) / segs;
+			x = sinf(theta) * cosf(phi);
+			y = cosf(theta);
+			z = -sinf(theta) * sinf(phi);
+		}
+		fprintf(fp, "\tweight %d 0 1.0 ( %f %f %f )\n", i, x, y, z);
+	}
+	fprintf(fp, "}\n");
+	fclose(fp);
+	return true;
+}
+
+// Deterministic, so runs compare
+static float Bench_Rand(unsigned int * state)
+{
+	*state = *state * 1664525u + 1013904223u;
+	return (*state >> 8) / 16777216.0f;
+}
+
+#define BENCH_CAMERA_SAMPLES	256
+
+struct camera_eval_t {
+	CameraPath *	path;
+	float			times[BENCH_CAMERA_SAMPLES];
+};
+
+// Random times, each one a fresh segment search
+static void Bench_CameraEval(void * data, int iterations)
+{
+	camera_eval_t * d = (camera_eval_t*)data;
+	camera_frame_t frame;
+	float sum = 0.0f;
+	for( int it = 0; it < iterations; ++it ) {
+		for( int i = 0; i < BENCH_CAMERA_SAMPLES; ++i ) {
+			d->path->Evaluate(d->times[i], frame);
+			sum += frame.position[0] + frame.orientation[3];
+		}
+	}
+	benchSink += sum;
+}
+
+#define BENCH_NUM_NAMES		64
+
+// Resource names as a level has them, mostly short
+struct name_set_t {
+	qStr	names[BENCH_NUM_NAMES];
+	qAtom	atoms[BENCH_NUM_NAMES];
+};
+
+static void Bench_StrCopy(void * data, int iterations)
+{
+	name_set_t * d = (name_set_t*)data;
+	int n = 0;
+	for( int it = 0; it < iterations; ++it ) {
+		qStr copies[BENCH_NUM_NAMES];
+		for( int i = 0; i < BENCH_NUM_NAMES; ++i ) {
+			copies[i] = d->names[i];
+		}
+		n += copies[it & (BENCH_NUM_NAMES - 1)].Length();
+	}
+	benchSink += n;
+}
+
+// Find every name by scanning the list, like a cache lookup
+static void Bench_StrLookup(void * data, int iterations)
+{
+	name_set_t * d = (name_set_t*)data;
+	int n = 0;
+	for( int it = 0; it < iterations; ++it ) {
+		for( int i = 0; i < BENCH_NUM_NAMES; ++i ) {
+			for( int k = 0; k < BENCH_NUM_NAMES; ++k ) {
+				if( d->names[k] == d->names[i] ) {
+					n += k;
+					break;
+				}
+			}
+		}
+	}
+	benchSink += n;
+}
+
+static void Bench_AtomLookup(void * data, int iterations)
+{
+	name_set_t * d = (name_set_t*)data;
+	int n = 0;
+	for( int it = 0; it < iterations; ++it ) {
+		for( int i = 0; i < BENCH_NUM_NAMES; ++i ) {
+			for( int k = 0; k < BENCH_NUM_NAMES; ++k ) {
+				if( d->atoms[k] == d->atoms[i] ) {
+					n += k;
+					break;
+				}
+			}
+		}
+	}
+	benchSink += n;
+}
+
+/*
+==============================================================
+
+Harness
+
+==============================================================
+*/
+
+static double Bench_Sample(const bench_case_t& c, int iterations)
+{
+	profile_time_t begin = Sys_Nanoseconds();
+	c.func(c.data, iterations);
+	return (double)(Sys_Nanoseconds() - begin);
+}
+
+static bench_result_t Bench_Run(const bench_case_t& c, int numSamples)
+{
+	// Grow until a sample is long enough to time reliably
+	int iterations = 1;
+	while( Bench_Sample(c, iterations) < BENCH_MIN_SAMPLE_NS && iterations < (1 << 30) ) {
+		iterations *= 2;
+	}
+	for( int i = 0; i < BENCH_WARMUP_SAMPLES; ++i ) {
+		Bench_Sample(c, iterations);
+	}
+
+	std::vector<double> ns(numSamples);
+	double sum = 0.0;
+	for( int i = 0; i < numSamples; ++i ) {
+		ns[i] = Bench_Sample(c, iterations) / iterations;
+		sum += ns[i];
+	}
+	double mean = sum / numSamples;
+	double var = 0.0;
+	for( int i = 0; i < numSamples; ++i ) {
+		var += (ns[i] - mean) * (ns[i] - mean);
+	}
+	var /= std::max(numSamples - 1, 1);
+	std::sort(ns.begin(), ns.end());
+
+	bench_result_t r;
+	r.name = c.name;
+	r.iterations = iterations;
+	r.min = ns.front();
+	r.median = ( numSamples & 1 ) ? ns[numSamples / 2] : 0.5 * (ns[numSamples / 2 - 1] + ns[numSamples / 2]);
+	r.mean = mean;
+	r.stddev = sqrt(var);
+	// Normal approximation, close enough from ~30 samples on
+	r.ci95 = 1.96 * r.stddev / sqrt((double)numSamples);
+	r.items = c.items;
+	r.itemName = c.itemName;
+	r.workers = c.threaded ? jobs->NumWorkers() : 0;
+	return r;
+}
+
+static void Bench_WriteJSON(FILE * fp, const std::vector<bench_result_t>& results, int core, int numSamples)
+{
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"version\": \"%s\",\n", QENGINE_VERSION);
+	fprintf(fp, "  \"core\": %d,\n", core);
+	fprintf(fp, "  \"samples\": %d,\n", numSamples);
+	fprintf(fp, "  \"cases\": [\n");
+	for( size_t i = 0; i < results.size(); ++i ) {
+		const bench_result_t& r = results[i];
+		fprintf(fp, "    {\"name\": \"%s\", \"iterations\": %d, \"nsPerOp\": {\"min\": %.2f, \"median\": %.2f, \"mean\": %.2f, \"stddev\": %.2f, \"ci95\": %.2f}",
+			r.name, r.iterations, r.min, r.median, r.mean, r.stddev, r.ci95);
+		if( r.items > 1 ) {
+			fprintf(fp, ", \"items\": %d, \"itemName\": \"%s\", \"nsPerItem\": %.3f, \"mItemsPerSec\": %.3f", r.items, r.itemName,
+				r.median / r.items, 1e3 * r.items / r.median);
+		}
+		if( r.workers ) {
+			fprintf(fp, ", \"workers\": %d", r.workers);
+		}
+		fprintf(fp, "}%s\n", i + 1 < results.size() ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+}
+
+int main(int argc, char ** argv)
+{
+	const char * filter = NULL;
+	const char * outPath = NULL;
+	int numSamples = BENCH_DEFAULT_SAMPLES;
+	int core = 0;
+
+	for( int i = 1; i < argc; ++i ) {
+		if( !strcmp(argv[i], "--filter") && i + 1 < argc ) {
+			filter = argv[++i];
+		} else if( !strcmp(argv[i], "--samples") && i + 1 < argc ) {
+			numSamples = std::max(atoi(argv[++i]), 2);
+		} else if( !strcmp(argv[i], "--core") && i + 1 < argc ) {
+			core = atoi(argv[++i]);
+		} else if( !strcmp(argv[i], "--out") && i + 1 < argc ) {
+			outPath = argv[++i];
+		} else {
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	// One core, no migrations in the middle of a sample
+	if( !Thread::SetCurrentAffinity(core) ) {
+		fprintf(stderr, "Cannot pin to core %d, results will be noisier\n", core);
+	}
+	Profiler::SetThreadName("bench");
+
+	if( !Bench_WriteSphere(BENCH_MESH_PATH) ) {
+		fprintf(stderr, "Cannot write %s\n", BENCH_MESH_PATH);
+		return 1;
+	}
+	Mesh mesh(BENCH_MESH_PATH);
+	if( !mesh.LoadMD5() ) {
+		fprintf(stderr, "Cannot load %s\n", BENCH_MESH_PATH);
+		return 1;
+	}
+	int numTris = mesh.GetNumIndex() / 3;
+
+	if( !Bench_WriteCameraPath(BENCH_CP_PATH) ) {
+		fprintf(stderr, "Cannot write %s\n", BENCH_CP_PATH);
+		return 1;
+	}
+	CameraPath cameraPath(BENCH_CP_PATH);
+	if( cameraPath.GetNumKeys() != BENCH_CP_KEYS ) {
+		fprintf(stderr, "Cannot load %s\n", BENCH_CP_PATH);
+		return 1;
+	}
+
+	int tokens = 0;
+	{
+		LexerFile lex(BENCH_MESH_PATH);
+		while( lex.MoreToken() ) {
+			lex.ReadToken();
+			tokens++;
+		}
+	}
+
+	unsigned int seed = 12345;
+	mat_chain_t chain;
+	for( int i = 0; i < 8; ++i ) {
+		Entity e;
+		e.Rotate(Vec3(Bench_Rand(&seed), Bench_Rand(&seed), Bench_Rand(&seed)));
+		e.MoveTo(Vec3(Bench_Rand(&seed), Bench_Rand(&seed), Bench_Rand(&seed)));
+		chain.m[i] = e.GetModelToWorldMat();
+	}
+
+	slerp_data_t slerp;
+	for( int i = 0; i < 64; ++i ) {
+		slerp.q[i] = Quaternion(Bench_Rand(&seed) - 0.5f, Bench_Rand(&seed) - 0.5f, Bench_Rand(&seed) - 0.5f, Bench_Rand(&seed) - 0.5f);
+		slerp.q[i].Normalize();
+	}
+
+	Entity ent;
+	ent.AttachMesh(&mesh);
+
+	Frustum frustum(0.2f, 50.0f, 70.0f * DEG_TO_RAD, 70.0f * DEG_TO_RAD);
+	bbox_set_t boxes;
+	boxes.frustum = &frustum;
+	for( int i = 0; i < 1024; ++i ) {
+		Vec3 c((Bench_Rand(&seed) - 0.5f) * 100, (Bench_Rand(&seed) - 0.5f) * 100, -Bench_Rand(&seed) * 60);
+		Vec3 half(Bench_Rand(&seed) * 4, Bench_Rand(&seed) * 4, Bench_Rand(&seed) * 4);
+		boxes.boxes.push_back(BBox(c - half, c + half));
+	}
+
+	poly_set_t polys;
+	polys.plane = Plane(Vec3(0, 0, 1), 4.0f);
+	for( int i = 0; i < 256; ++i ) {
+		std::vector<Vec3> v;
+		Vec3 c((Bench_Rand(&seed) - 0.5f) * 20, (Bench_Rand(&seed) - 0.5f) * 20, (Bench_Rand(&seed) - 0.5f) * 20);
+		for( int k = 0; k < 6; ++k ) {
+			float a = k * 2.0f * (float)M_PI / 6;
+			v.push_back(c + Vec3(cosf(a) * 3, sinf(a) * 3, cosf(a) * 3));
+		}
+		polys.polys.push_back(Poly(v));
+	}
+
+	winding_set_t windings;
+	windings.plane = polys.plane;
+	for( size_t i = 0; i < polys.polys.size(); ++i ) {
+		winding_t w;
+		w.numVerts = polys.polys[i].Size();
+		for( int k = 0; k < w.numVerts; ++k ) {
+			w.verts[k] = polys.polys[i][k];
+		}
+		windings.windings.push_back(w);
+	}
+
+	// Scattered around the edges of the frustum, so all three
+	// kinds show up
+	tri_set_t * triSet = new tri_set_t;
+	triSet->frustum = &frustum;
+	for( int i = 0; i < BENCH_CLIP_TRIS; ++i ) {
+		Vec3 c((Bench_Rand(&seed) - 0.5f) * 80, (Bench_Rand(&seed) - 0.5f) * 80, -Bench_Rand(&seed) * 60);
+		for( int k = 0; k < 3; ++k ) {
+			triSet->in[i * 3 + k] = c + Vec3((Bench_Rand(&seed) - 0.5f) * 8, (Bench_Rand(&seed) - 0.5f) * 8, (Bench_Rand(&seed) - 0.5f) * 8);
+		}
+	}
+
+	silhouette_data_t sil;
+	sil.mesh = &mesh;
+	sil.light.id = 0;
+	sil.light.enabled = true;
+	sil.light.directional = false;
+	sil.light.next = NULL;
+	sil.light.pos = Vec4(10.0f, 5.0f, 3.0f, 1.0f);
+
+	camera_eval_t cameraEval;
+	cameraEval.path = &cameraPath;
+	for( int i = 0; i < BENCH_CAMERA_SAMPLES; ++i ) {
+		cameraEval.times[i] = Bench_Rand(&seed) * cameraPath.GetDuration();
+	}
+
+	name_set_t names;
+	for( int i = 0; i < BENCH_NUM_NAMES; ++i ) {
+		char buf[64];
+		// Shared prefixes make strcmp work for it
+		snprintf(buf, sizeof(buf), i & 3 ? "prop_crate_%02d" : "models/props/industrial/crate_%02d", i);
+		names.names[i] = buf;
+		names.atoms[i] = qAtom(names.names[i]);
+	}
+
+	// From around the sphere at points near its center, so
+	// most rays hit and some graze or miss
+	ray_set_t * raySet = new ray_set_t;
+	raySet->bvh = &mesh.GetBvh();
+	raySet->anyHit = false;
+	for( int i = 0; i < BENCH_NUM_RAYS; ++i ) {
+		Vec3 from(Bench_Rand(&seed) - 0.5f, Bench_Rand(&seed) - 0.5f, Bench_Rand(&seed) - 0.5f);
+		from = from.Normalize();
+		Vec3 to((Bench_Rand(&seed) - 0.5f) * 2.2f, (Bench_Rand(&seed) - 0.5f) * 2.2f, (Bench_Rand(&seed) - 0.5f) * 2.2f);
+		raySet->rays[i].origin = from.Scale(3.0f);
+		raySet->rays[i].dir = to - raySet->rays[i].origin;
+		raySet->rays[i].tMax = FLT_MAX;
+	}
+	ray_set_t * anySet = new ray_set_t(*raySet);
+	anySet->anyHit = true;
+
+	bench_case_t cases[] = {
+		{ "mat4_rightmul_chain8",	Bench_Mat4Chain,		&chain,		7,							"mul" },
+		{ "quaternion_slerp",		Bench_Slerp,			&slerp,		1,							"slerp" },
+		{ "mesh_calc_normals",		Bench_CalcNormals,		&mesh,		numTris,					"tri" },
+		{ "lexer_read_token",		Bench_LexerReadToken,	(void*)BENCH_MESH_PATH, tokens,		"token" },
+		{ "entity_bound",			Bench_EntityBound,		&ent,		mesh.GetNumVert(),			"vert" },
+		{ "frustum_clip_bbox",		Bench_FrustumClipBBox,	&boxes,		(int)boxes.boxes.size(),	"box" },
+		{ "poly_clip",				Bench_PolyClip,			&polys,		(int)polys.polys.size(),	"poly" },
+		{ "winding_clip",			Bench_WindingClip,		&windings,	(int)windings.windings.size(),	"poly" },
+		{ "frustum_clip_tris",		Bench_FrustumClipTris,	triSet,		BENCH_CLIP_TRIS,			"tri" },
+		{ "silhouette_extract",		Bench_Silhouette,		&sil,		numTris,					"tri" },
+		{ "qstr_path_ops",			Bench_StrOps,			NULL,		1,							"op" },
+		{ "camera_path_eval",		Bench_CameraEval,		&cameraEval, BENCH_CAMERA_SAMPLES,		"sample" },
+		{ "qstr_copy",				Bench_StrCopy,			&names,		BENCH_NUM_NAMES,			"copy" },
+		{ "name_lookup_qstr",		Bench_StrLookup,		&names,		BENCH_NUM_NAMES,			"lookup" },
+		{ "name_lookup_atom",		Bench_AtomLookup,		&names,		BENCH_NUM_NAMES,			"lookup" },
+		{ "bvh_ray_mesh",			Bench_RayMesh,			raySet,		BENCH_NUM_RAYS,				"ray" },
+		{ "bvh_ray_mesh_any",		Bench_RayMesh,			anySet,		BENCH_NUM_RAYS,				"ray" },
+		{ "bvh_ray_mesh_jobs",		Bench_RayMeshJobs,		raySet,		BENCH_NUM_RAYS,				"ray",		true },
+	};
+
+	std::vector<bench_result_t> results;
+	for( int threaded = 0; threaded < 2; ++threaded ) {
+		if( threaded ) {
+			Thread::SetCurrentAffinity(-1);
+			jobs->Init(0);
+		}
+		for( size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i ) {
+			if( cases[i].threaded != ( threaded != 0 ) || ( filter && !strstr(cases[i].name, filter) ) ) {
+				continue;
+			}
+			bench_result_t r = Bench_Run(cases[i], numSamples);
+			if( r.items > 1 ) {
+				fprintf(stderr, "%-24s %12.1f ns/op  +-%.1f  %10.2f M%s/s\n", r.name, r.median, r.ci95, 1e3 * r.items / r.median, r.itemName);
+			} else {
+				fprintf(stderr, "%-24s %12.1f ns/op  +-%.1f\n", r.name, r.median, r.ci95);
+			}
+			results.push_back(r);
+		}
+	}
+	jobs->Shutdown();
+
+	FILE * fp = outPath ? fopen(outPath, "w") : stdout;
+	if( !fp ) {
+		fprintf(stderr, "Cannot write %s\n", outPath);
+		return 1;
+	}
+	Bench_WriteJSON(fp, results, core, numSamples);
+	if( fp != stdout ) {
+		fclose(fp);
+	}
+	delete triSet;
+	delete raySet;
+	delete anySet;
+	remove(BENCH_MESH_PATH);
+	return 0;
+}
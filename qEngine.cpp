@@ -1,16 +1,26 @@
 #include "qEngine.h"
 #include "Geometry.h"
 #include "Timer.h"
+#include "Thread.h"
+#include "Profiler.h"
+#include "AllocTracker.h"
+#include <algorithm>
 
 // Global indicating if engine is on or off
 extern bool engineOn;
 extern Common * common;
 extern Timer * timer;
-
-Mat4 textureMatrix = Mat4( 1.0f/32767,0,0,0,0,1.0f/32767,0,0,0,0,1,0,0,0,0,1 );
+extern JobSystem * jobs;
 
 bool qEngine::Init()
 {
+	// Resource loading below reports through the logger
+	logger = new Log();
+	// In development, set maximum logging 
+	logger->SetLevel(L_NORMAL);
+	common->SetLogger(logger);
+	frameArena.Init(FRAME_ARENA_SIZE);
+	occlusion.Init(windowWidth / OCC_DOWNSCALE, windowHeight / OCC_DOWNSCALE);
 
 #ifdef _WIN32
 		wchar_t sBuf[256];
@@ -36,6 +46,9 @@ bool qEngine::Init()
      */
 	InitModelCache();
 	InitTextureCache();
+	// Needs decoded pixels and meshes not yet uploaded
+	int packed = atlas.Build(texCache, meshCache);
+	logger->LogNormal("Atlas: %d textures packed into %d pages", packed, atlas.NumPages());
     // Camera path is a relatively light-weight resources so we
     // load them all at the beginning.
     PreloadCP();
@@ -46,9 +59,6 @@ bool qEngine::Init()
 	world = NULL;
 	engineOn = true;
 	debugOn = true;
-	logger = new Log();
-	// In development, set maximum logging 
-	logger->SetLevel(L_NORMAL);
 
 	//free(dirName);
     
@@ -66,6 +76,7 @@ system later
 */
 bool qEngine::InitModelCache()
 {
+	PROFILE_SCOPE("InitModelCache");
 	qStr modelDir = dataDir.Concat("/model");
 	struct stat st;
 	if( stat(modelDir.Ptr(), &st) || !st.st_mode & S_IFDIR ) {
@@ -86,6 +97,8 @@ bool qEngine::InitModelCache()
 			logger->LogWarning("Cannot load model %s", (*it).Ptr());
 			continue;
 		}
+		logger->LogNormal("Model %s: %d tris, ACMR %.3f -> %.3f", mobj->GetName().Ptr(),
+			mobj->GetNumIndex() / 3, mobj->GetACMRBefore(), mobj->GetACMRAfter());
 		meshCache.push_back(mobj);
 	}
 
@@ -94,6 +107,7 @@ bool qEngine::InitModelCache()
 
 bool qEngine::InitTextureCache()
 {
+	PROFILE_SCOPE("InitTextureCache");
 	qStr texDir = dataDir.Concat("/texture");
 	struct stat st;
 	if( stat(texDir.Ptr(), &st) || !st.st_mode & S_IFDIR ) {
@@ -106,16 +120,141 @@ bool qEngine::InitTextureCache()
 		logger->LogWarning("Cannot find texure in folder");
 		return false;
 	}
+	std::vector<Texture*> pngs;
 
 	for( std::vector<qStr>::iterator it = texFiles.begin(); it != texFiles.end(); ++it ) {
+		qStr ext = it->GetFileExtension();
 		Texture *tobj = new Texture(*it);
-		tobj->LoadPNG();
+		if( ext == "qtex" ) {
+			if( !tobj->LoadCooked() ) {
+				logger->LogWarning("Cannot load cooked texture %s", it->Ptr());
+				delete tobj;
+				continue;
+			}
+		} else {
+			// A cooked version of the same texture wins
+			qStr cooked(it->Ptr(), it->Length() - ext.Length());
+			cooked.ConcatSelf("qtex");
+			if( stat(cooked.Ptr(), &st) == 0 ) {
+				delete tobj;
+				continue;
+			}
+			// Pixels are decoded below, all at once
+			if( !tobj->ReadPNGHeader() ) {
+				logger->LogWarning("Cannot load texture %s", it->Ptr());
+				delete tobj;
+				continue;
+			}
+			pngs.push_back(tobj);
+		}
 		texCache.push_back(tobj);
 	}
 
+	DecodeTextures(pngs);
 	return true;
 }
 
+struct texture_decode_t {
+	Texture **	textures;
+	bool *		ok;
+};
+
+static void R_DecodeTextureJob(void * data, int begin, int end)
+{
+	texture_decode_t * d = (texture_decode_t*)data;
+	for( int i = begin; i < end; ++i ) {
+		PROFILE_SCOPE("DecodePNG");
+		d->ok[i] = d->textures[i]->LoadPNG();
+	}
+}
+
+// Decode PNG pixels of textures whose headers are read, one file
+// per job.
+void qEngine::DecodeTextures(std::vector<Texture*>& pngs)
+{
+	PROFILE_SCOPE("DecodeTextures");
+	int count = (int)pngs.size();
+	if( !count ) {
+		return;
+	}
+	bool * ok = new bool[count];
+
+	texture_decode_t job = { &pngs[0], ok };
+	jobs->ParallelFor(count, 1, R_DecodeTextureJob, &job);
+
+	int failed = 0;
+	for( int i = 0; i < count; ++i ) {
+		if( !ok[i] ) {
+			logger->LogWarning("Cannot decode texture %s", pngs[i]->GetName().Ptr());
+			texCache.erase(std::find(texCache.begin(), texCache.end(), pngs[i]));
+			delete pngs[i];
+			failed++;
+		}
+	}
+	logger->LogNormal("Decoded %d textures on %d threads, %d failed", count, jobs->NumWorkers() + 1, failed);
+	delete[] ok;
+}
+
+/*
+================================================
+
+Texture cooker. Writes a .qtex mip chain next to
+every PNG in the texture folder. Textures with
+alpha stay uncompressed.
+
+================================================
+*/
+void qEngine::CookTextures(image_format_t fmt)
+{
+	qStr texDir = dataDir.Concat("/texture");
+	std::vector<qStr> texFiles = common->ListFiles(texDir.Ptr());
+
+	for( std::vector<qStr>::iterator it = texFiles.begin(); it != texFiles.end(); ++it ) {
+		qStr ext = it->GetFileExtension();
+		if( ext != "png" ) {
+			continue;
+		}
+		Texture tex(*it);
+		if( !tex.LoadPNG() ) {
+			logger->LogWarning("Cannot cook %s", it->Ptr());
+			continue;
+		}
+		qStr out(it->Ptr(), it->Length() - ext.Length());
+		out.ConcatSelf("qtex");
+		if( !tex.Cook(fmt, out.Ptr()) ) {
+			logger->LogWarning("Cannot write %s", out.Ptr());
+			continue;
+		}
+		struct stat st;
+		stat(out.Ptr(), &st);
+		logger->LogNormal("Cooked %s: %ux%u, %u bytes raw -> %u bytes with mips",
+			tex.GetName().Ptr(), tex.GetWidth(), tex.GetHeight(),
+			tex.GetWidth() * tex.GetHeight() * ( tex.GetFormat() == TEXTURE_GL_RGBA ? 4 : 3 ),
+			(unsigned int)st.st_size);
+	}
+}
+
+// Bring streamed textures closer to full detail, spending at
+// most about TEXTURE_STREAM_BUDGET bytes of uploads per frame
+void qEngine::StreamTextures()
+{
+	PROFILE_SCOPE("StreamTextures");
+	unsigned int spent = 0;
+	frameStats.textureBytes = 0;
+	for( std::vector<Texture*>::iterator it = texCache.begin(); it != texCache.end(); ++it ) {
+		Texture * tex = *it;
+		while( spent < TEXTURE_STREAM_BUDGET && tex->IsUploaded() && !tex->IsResident() ) {
+			spent += tex->StreamNext();
+			if( tex->IsResident() ) {
+				LOG_NORMAL(logger, LC_RESOURCE, "Texture %s resident: %ux%u, %u bytes GPU",
+					tex->GetName().Ptr(), tex->GetWidth(), tex->GetHeight(), tex->GetGPUSize());
+			}
+		}
+		frameStats.textureBytes += tex->GetGPUSize();
+	}
+	frameStats.bytesUploaded += spent;
+}
+
 bool qEngine::PreloadCP()
 {
     qStr cpDir = dataDir.Concat("/cp");
@@ -137,6 +276,12 @@ bool qEngine::PreloadCP()
 
 void qEngine::Shutdown()
 {
+	watcher.Stop();
+	for( size_t i = 0; i < reloads.size(); ++i ) {
+		ResourceWatcher::FreeReload(reloads[i]);
+	}
+	reloads.clear();
+	streamer.Shutdown();
 	// Release mesh object
 	for( std::vector<Mesh*>::iterator it = meshCache.begin(); it != meshCache.end(); ++it) {
 		//delete (*it);
@@ -147,6 +292,7 @@ void qEngine::Shutdown()
 	}
 
 	if( logger ) {
+		common->SetLogger(NULL);
 		delete logger;
 	}
 
@@ -168,18 +314,23 @@ void qEngine::Set3D()
 	glShadeModel(GL_SMOOTH);
 
 	glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+	// Pixel rows handed to GL are never padded
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glEnableClientState(GL_NORMAL_ARRAY);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 
 	// Unbind everything
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	glColor4f(1, 1, 1, 1);
 
 	// Setup initial camera parameter
 	SetupCamera(70.0f, (float)windowWidth / (float)windowHeight, 0.2f, 50.0f); 
 	MoveCamera(Vec3(0.0f, 0.0f, 10.0f), Vec3(0, 1, 0));
 	LookAt(Vec3(0.0f, 0.0f, 0.0f));
+	prevCamera = camera;
+	view = camera;
 
 }
 
@@ -207,10 +358,14 @@ void qEngine::SetLighting()
 
 void qEngine::SetProjectionMat()
 {
-	float f = (float)(1 / tan(camera.fov * DEG_TO_RAD / 2));
-	float zNear = camera.zNear;
-	float zFar  = camera.zFar;	
-	projectionMat[0][0] = f / camera.aspect;
+	float f = (float)(1 / tan(view.fov * DEG_TO_RAD / 2));
+	float zNear = view.zNear;
+	float zFar  = view.zFar;	
+	// Frustum planes are taken from all of it
+	for( int i = 0; i < 4; ++i ) {
+		projectionMat[i] = Vec4(0.0f, 0.0f, 0.0f, 0.0f);
+	}
+	projectionMat[0][0] = f / view.aspect;
 	projectionMat[1][1] = f;
 	projectionMat[2][2] = (zFar + zNear) / (zNear - zFar);
 	projectionMat[2][3] = -1;
@@ -219,9 +374,9 @@ void qEngine::SetProjectionMat()
 
 void qEngine::SetViewMat()
 {
-	Vec3 vN = camera.pos - camera.lookAt;
+	Vec3 vN = view.pos - view.lookAt;
 
-	Vec3 vU = camera.up.CrossProduct(vN);
+	Vec3 vU = view.up.CrossProduct(vN);
 
 	vN = vN.Normalize();
 	vU = vU.Normalize();
@@ -232,18 +387,24 @@ void qEngine::SetViewMat()
 	modelViewMat[0][2] = vN[0];		modelViewMat[1][2] = vN[1];		modelViewMat[2][2] = vN[2]; modelViewMat[3][2] = 0.0f;
 	modelViewMat[0][3] = 0.0f;		modelViewMat[1][3] = 0.0f;		modelViewMat[2][3] = 0.0f;	modelViewMat[3][3] = 1.0f;
 	// Optimize a bit so don't need to do matrix concatenation of Rotation matrix and Translation matrix
-	modelViewMat[3][0] = -camera.pos.DotProduct(vU);
-	modelViewMat[3][1] = -camera.pos.DotProduct(vV);
-	modelViewMat[3][2] = -camera.pos.DotProduct(vN);	
+	modelViewMat[3][0] = -view.pos.DotProduct(vU);
+	modelViewMat[3][1] = -view.pos.DotProduct(vV);
+	modelViewMat[3][2] = -view.pos.DotProduct(vN);	
 }
 
 Mesh * qEngine::GetModel(const char * name) const
 {
-	if( !name || strlen(name) == 0) {
+	// A name never interned can't belong to a loaded mesh
+	return GetModel(qAtom::Find(name));
+}
+
+Mesh * qEngine::GetModel(qAtom name) const
+{
+	if( name.IsEmpty() ) {
 		return NULL;
 	}
 	for( std::vector<Mesh*>::const_iterator it = meshCache.begin(); it != meshCache.end(); ++it ) {
-		if( (*it)->GetName() == name ) {
+		if( (*it)->GetNameAtom() == name ) {
 			return *it;
 		}
 	}
@@ -252,11 +413,20 @@ Mesh * qEngine::GetModel(const char * name) const
 
 Texture * qEngine::GetTexture(const char * name) const
 {
-	if( !name || strlen(name) == 0 ) {
+	return GetTexture(qAtom::Find(name));
+}
+
+Texture * qEngine::GetTexture(qAtom name) const
+{
+	if( name.IsEmpty() ) {
 		return NULL;
 	}
+	Texture * page = atlas.Find(name);
+	if( page ) {
+		return page;
+	}
 	for( std::vector<Texture*>::const_iterator it = texCache.begin(); it != texCache.end(); ++it ) {
-		if( (*it)->GetName() == name ) {
+		if( (*it)->GetNameAtom() == name ) {
 			return *it;
 		}
 	}
@@ -264,15 +434,242 @@ Texture * qEngine::GetTexture(const char * name) const
 }
 
 
+bool qEngine::CookMap(const char * map, bool pvs)
+{
+	if( !world ) {
+		world = WorldDB::getInstance();
+	}
+	// Nothing past the far plane is drawn anyway
+	return world->CookMap(map, pvs ? camera.zFar : 0.0f);
+}
+
 void qEngine::LoadMap(const char * map)
 {
 	if( !world ) {
 		world = WorldDB::getInstance();
 	}
 	// init the world database
+	// Old cells refer to entities LoadMap is about to free
+	streamer.Shutdown();
+	ClearLights();
 	if( !world->LoadMap(map) ) {
 		common->FatalError("Aborting...");
 	}
+	mapName = map;
+	StartMap();
+}
+
+void qEngine::StartMap()
+{
+	// Streaming counts textures per entity, resolve them now
+	for( int i = 0; i < world->Count(); ++i ) {
+		GetEntityTexture((*world)[i]);
+	}
+	streamer.Init(world);
+	if( streamer.IsActive() ) {
+		logger->LogNormal("Map %s: %d entities in %d streamed cells", mapName.Ptr(), world->Count(), streamer.GetStats().numCells);
+	}
+}
+
+void qEngine::ClearLights()
+{
+	lights = NULL;
+	numLights = 0;
+}
+
+bool qEngine::SetHotReload(bool on)
+{
+	if( !on ) {
+		watcher.Stop();
+		return true;
+	}
+	if( !watcher.Start(dataDir) ) {
+		logger->LogWarning("Cannot watch %s for changes", dataDir.Ptr());
+		return false;
+	}
+	logger->LogNormal("Watching %s for changes", dataDir.Ptr());
+	return true;
+}
+
+/*
+================================================
+
+Hot reload. Fresh data goes into the objects
+already in the caches, so every pointer to them
+stays good and GPU copies keep their names.
+
+================================================
+*/
+static bool R_IsMeshReload(const reload_t& r)
+{
+	return r.type == RELOAD_MESH;
+}
+
+void qEngine::ApplyReloads()
+{
+	if( !watcher.IsActive() ) {
+		return;
+	}
+	watcher.TakeReloads(reloads);
+	if( reloads.empty() ) {
+		return;
+	}
+	PROFILE_SCOPE("ApplyReloads");
+	// Models first, a map saved with them may already use them
+	std::stable_partition(reloads.begin(), reloads.end(), R_IsMeshReload);
+	// Workers may be reading cooked textures for cells
+	bool streaming = streamer.GetStats().loadingCells > 0;
+	bool meshesChanged = false;
+	size_t kept = 0;
+	for( size_t i = 0; i < reloads.size(); ++i ) {
+		reload_t& r = reloads[i];
+		if( streaming && r.type == RELOAD_TEXTURE && !r.failed ) {
+			reloads[kept++] = r;
+			continue;
+		}
+		if( r.failed ) {
+			logger->LogWarning("Cannot reload %s", r.path.Ptr());
+			continue;
+		}
+		switch( r.type ) {
+			case RELOAD_MESH:
+				ReloadMesh(r);
+				meshesChanged = true;
+				break;
+			case RELOAD_TEXTURE:
+				ReloadTexture(r);
+				break;
+			case RELOAD_CAMERAPATH:
+				ReloadCameraPath(r);
+				break;
+			case RELOAD_MAP:
+				ReloadMap(r);
+				break;
+		}
+		ResourceWatcher::FreeReload(r);
+	}
+	reloads.resize(kept);
+	if( meshesChanged && world ) {
+		world->BuildRayBvh();
+	}
+}
+
+void qEngine::ReloadMesh(reload_t& r)
+{
+	Mesh * fresh = r.mesh;
+	Mesh * live = GetModel(fresh->GetNameAtom());
+	if( !live ) {
+		// New file, maps loaded from now on can use it
+		fresh->SetVertexFormat(compactVertex ? VERTEX_FORMAT_COMPACT : VERTEX_FORMAT_FLOAT);
+		if( !atlas.RemapMesh(fresh) ) {
+			logger->LogWarning("Model %s: texture coordinates leave its atlas tile", fresh->GetName().Ptr());
+		}
+		meshCache.push_back(fresh);
+		r.mesh = NULL;
+		LOG_NORMAL(logger, LC_RESOURCE, "Model %s added: %d tris", fresh->GetName().Ptr(), fresh->GetNumIndex() / 3);
+		return;
+	}
+
+	qAtom oldTex = live->GetTexAtom();
+	live->TakeData(*fresh);
+	if( !atlas.RemapMesh(live) ) {
+		logger->LogWarning("Model %s: texture coordinates leave its atlas tile", live->GetName().Ptr());
+	}
+	frameStats.bytesUploaded += live->UpdateGPU();
+	if( world && live->GetTexAtom() != oldTex ) {
+		for( int i = 0; i < world->Count(); ++i ) {
+			if( (*world)[i]->GetModel() == live ) {
+				(*world)[i]->AttachTexture(NULL);
+			}
+		}
+		// Cells count textures per entity, build them again
+		streamer.Shutdown();
+		StartMap();
+	}
+	LOG_NORMAL(logger, LC_RESOURCE, "Model %s reloaded: %d tris", live->GetName().Ptr(), live->GetNumIndex() / 3);
+}
+
+void qEngine::ReloadTexture(reload_t& r)
+{
+	Texture * fresh = r.tex;
+	if( atlas.Find(fresh->GetNameAtom()) ) {
+		logger->LogWarning("Texture %s is packed into the atlas, restart to see it", fresh->GetName().Ptr());
+		return;
+	}
+	Texture * live = NULL;
+	for( std::vector<Texture*>::iterator it = texCache.begin(); it != texCache.end() && !live; ++it ) {
+		if( (*it)->GetNameAtom() == fresh->GetNameAtom() ) {
+			live = *it;
+		}
+	}
+	if( !live ) {
+		// Entities without a texture look for it every frame
+		texCache.push_back(fresh);
+		r.tex = NULL;
+		LOG_NORMAL(logger, LC_RESOURCE, "Texture %s added", fresh->GetName().Ptr());
+		return;
+	}
+
+	live->TakeData(*fresh);
+	// Cooked ones come back coarse first, then stream
+	frameStats.bytesUploaded += live->UpdateGPU();
+	LOG_NORMAL(logger, LC_RESOURCE, "Texture %s reloaded: %ux%u", live->GetName().Ptr(), live->GetWidth(), live->GetHeight());
+}
+
+void qEngine::ReloadCameraPath(reload_t& r)
+{
+	qStr name = r.path.GetFileName();
+	int avail = -1;
+	for( int i = 0; i < MAX_CAMERAPATH; ++i ) {
+		if( !cameraPath[i] ) {
+			avail = avail < 0 ? i : avail;
+			continue;
+		}
+		if( cameraPathFile[i].GetFileName() == name ) {
+			cameraPath[i]->TakeKeys(*r.cameraPath);
+			LOG_NORMAL(logger, LC_RESOURCE, "Camera path %s reloaded: %d keys", name.Ptr(), cameraPath[i]->GetNumKeys());
+			return;
+		}
+	}
+	if( avail < 0 ) {
+		logger->LogWarning("Reached maximum number of camera path.");
+		return;
+	}
+	cameraPath[avail] = r.cameraPath;
+	cameraPathFile[avail] = r.path;
+	r.cameraPath = NULL;
+	LOG_NORMAL(logger, LC_RESOURCE, "Camera path %s added as %d", name.Ptr(), avail);
+}
+
+void qEngine::ReloadMap(reload_t& r)
+{
+	// Only the map being played
+	if( !world || mapName.Empty() || r.path.GetFileName() != mapName.GetFileName() ) {
+		return;
+	}
+	// A bad edit keeps the map being played, LoadParsed can't
+	// load entities without their mesh
+	if( r.map ) {
+		for( size_t i = 0; i < r.map->entities.size(); ++i ) {
+			qStr meshName = r.map->entities[i].mesh.GetFileName();
+			if( !GetModel(meshName.Ptr()) ) {
+				logger->LogWarning("Cannot reload map %s, model %s doesn't exist", mapName.Ptr(), meshName.Ptr());
+				return;
+			}
+		}
+	}
+	streamer.Shutdown();
+	ClearLights();
+	// Entities are new
+	DetachCamera();
+	if( r.map ) {
+		world->LoadParsed(*r.map);
+	} else if( !world->LoadMap(mapName.Ptr()) ) {
+		logger->LogWarning("Cannot reload map %s, nothing is drawn until it loads", mapName.Ptr());
+		return;
+	}
+	StartMap();
+	LOG_NORMAL(logger, LC_RESOURCE, "Map %s reloaded: %d entities", mapName.Ptr(), world->Count());
 }
 
 
@@ -282,29 +679,37 @@ void qEngine::LoadMap(const char * map)
  * to spin camera around the world and examine rendering results.
  * Also it's an exercise of quaternion manipulation as well.
  */
-void qEngine::LoadCameraPath(const char * pathFile)
+int qEngine::LoadCameraPath(const char * pathFile)
 {      
     qStr fn = qStr(pathFile);
     if( fn.Empty() ) {
         logger->LogWarning("Cannot load files outside engine directory");
-        return;
+        return -1;
     }    
+    struct stat st;
+    if( stat(fn.Ptr(), &st) ) {
+        // Bare names live in the camera path folder
+        fn = dataDir.Concat("/cp/");
+        fn.ConcatSelf(pathFile);
+    }
 
     int avail = 0;
     for( ; avail < MAX_CAMERAPATH && cameraPath[avail] != NULL; avail++);
     if( avail == MAX_CAMERAPATH ) {
         logger->LogWarning("Reached maximum number of camera path.");
-        return;
+        return -1;
     }
 
     CameraPath * cp = new CameraPath(fn.Ptr());
-    cp->ExpandPath();
-    if( cp->GetNumFrames() == 0 ) {
+    if( cp->GetNumKeys() == 0 ) {
         logger->LogWarning("Zero camera frame is loaded !");
-        return;
+        delete cp;
+        return -1;
     }    
    
     cameraPath[avail] = cp;
+    cameraPathFile[avail] = fn;
+    return avail;
 }
 
 void qEngine::SetCurrentCameraPath(int id) 
@@ -322,6 +727,42 @@ CameraPath* qEngine::GetCurrentCameraPath() const
     return currentCameraPath;
 }
 
+void qEngine::InitGpuTimer(gl_proc_loader_t loader)
+{
+	if( gpuTimer.Init(loader) ) {
+		logger->LogNormal("GPU timer queries enabled");
+	} else {
+		logger->LogNormal("GPU timer queries not supported, GPU zones disabled");
+	}
+}
+
+// Switch all cached meshes to the compact vertex layout. Has
+// to happen before the first frame uploads them.
+void qEngine::SetCompactVertex(bool on)
+{
+	vertex_format_t fmt = on ? VERTEX_FORMAT_COMPACT : VERTEX_FORMAT_FLOAT;
+	compactVertex = on;
+	for( std::vector<Mesh*>::iterator it = meshCache.begin(); it != meshCache.end(); ++it ) {
+		Mesh * m = *it;
+		m->SetVertexFormat(fmt);
+		if( !on ) {
+			continue;
+		}
+		// Per mesh savings, both in memory and in vertex
+		// fetch bandwidth for every draw of it
+		unsigned int full = m->GetNumVert() * sizeof(vertex_t);
+		unsigned int compact = m->GetNumVert() * sizeof(vertex_compact_t);
+		logger->LogNormal("Model %s: vertex buffer %u -> %u bytes, %u bytes less per draw",
+			m->GetName().Ptr(), full, compact, full - compact);
+	}
+	if( on ) {
+		// snorm8 normals are not exactly unit length
+		glEnable(GL_NORMALIZE);
+	} else {
+		glDisable(GL_NORMALIZE);
+	}
+}
+
 void qEngine::SetupCamera(float fov_y, float aspect, float zNear, float zFar)
 {
     camera.fov = fov_y;
@@ -349,42 +790,84 @@ void qEngine::DetachCamera()
 
 void qEngine::UpdateWorld()
 {
-	timer->Tick();
+	PROFILE_SCOPE("UpdateWorld");
+	// Rendering blends from here to the state this step makes
+	prevCamera = camera;
+	for( int i = 0; i < world->Count(); ++i ) {
+		(*world)[i]->SavePrevState();
+	}
+
     CameraPath * curCp = GetCurrentCameraPath();
     if( !curCp )
         return;
 
-    camera_frame_t *cf = curCp->GetPlayingFrame();
-	if( !cf ) {
-		frameCount++;
+    camera_frame_t cf;
+	if( !curCp->GetPlayingFrame(cf) ) {
         return;
 	}
-    Quaternion quat = cf->orientation;
+    Quaternion quat = cf.orientation;
     Mat3 axis = quat.ToMatrix();
 	
 	Vec3 forward = axis[2].Scale(-1.0f);
     Vec3 up = axis[1];
-	Vec3 lookat = cf->position + forward;
+	Vec3 lookat = cf.position + forward;
 
-    MoveCamera(cf->position, up);
+    MoveCamera(cf.position, up);
     LookAt(lookat);
 	
-	// Proceed one camera frame
-	curCp->Advance();
-    logger->LogNormal("Frame: %d", frameCount);
-    frameCount++;
+	float step = cameraStep;
+	if( step <= 0.0f ) {
+		step = timer->GetStepSeconds();
+	}
+	curCp->Advance(step);
+    LOG_NORMAL(logger, LC_FRAME, "Frame: %d", frameCount);
+}
+
+// Group by texture first, then by mesh, so atlas pages and
+// vertex arrays are both set up as rarely as possible
+static bool R_SortByTextureMesh(const Entity * a, const Entity * b)
+{
+	if( a->GetTexture() != b->GetTexture() ) {
+		return a->GetTexture() < b->GetTexture();
+	}
+	return a->GetModel() < b->GetModel();
 }
 
 // Heavy lifting
-void qEngine::RenderFrame()
+// Camera between the last two simulation states
+static void R_LerpCamera(const camera_t& from, const camera_t& to, float alpha, camera_t& out)
 {
-    
-	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );	
+	out = to;
+	if( alpha >= 1.0f ) {
+		return;
+	}
+	out.pos = from.pos + (to.pos - from.pos).Scale(alpha);
+	out.lookAt = from.lookAt + (to.lookAt - from.lookAt).Scale(alpha);
+	Vec3 up = from.up + (to.up - from.up).Scale(alpha);
+	out.up = up.Normalize();
+}
+
+void qEngine::RenderFrame(float alpha)
+{
+	PROFILE_SCOPE("RenderFrame");
+	memset(&frameStats, 0, sizeof(frameStats));
+	// Nothing of this frame has used the caches yet
+	ApplyReloads();
+	// Array state may have been changed by someone else
+	boundMesh = NULL;
+	boundTexture = NULL;
+	lastTexMesh = NULL;
+
+	// Results of a few frames ago go out with this
+	gpuTimer.BeginFrame();
+	{
+		GpuScope gpu(gpuTimer, "GPU Clear");
+		glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+	}
     
 	Entity *ent;
 
-	glMatrixMode(GL_TEXTURE);
-	glLoadMatrixf(textureMatrix.GetRawPtr());
+	R_LerpCamera(prevCamera, camera, alpha, view);
 
 	glMatrixMode(GL_PROJECTION);
 	SetProjectionMat();
@@ -395,17 +878,127 @@ void qEngine::RenderFrame()
 	glLoadMatrixf(modelViewMat.GetRawPtr());
 
 	glViewport(0, 0, windowWidth, windowHeight);
+	SetFrustumPlanes();
 
+	// Before the draw list, cells finishing now draw this frame
+	streamer.Update(view.pos, GetCurrentCameraPath());
+	frameStats.bytesUploaded += streamer.GetStats().bytesUploaded;
 
 	glEnable(GL_CULL_FACE);
 	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);	// Why set color here?
     
     
-	for( int i = 0; i < world->Count(); ++ i ) {
-		ent = (*world)[i];
-		RenderEntity(ent);
+	bool portalCull = FlowPortals(view.pos);
+
+	// What the camera cell of a cooked map can see, a word
+	// covers 32 entities. Without one every word is full.
+	int count = world->Count();
+	int numWords;
+	const bmap_pvs_word_t * pvs = world->GetVisibleSet(view.pos, numWords);
+	if( !pvs ) {
+		numWords = ( count + 31 ) / 32;
+	}
+	int considered = 0;
+	drawList.clear();
+	for( int w = 0; w < numWords; ++w ) {
+		int base = pvs ? pvs[w].index * 32 : w * 32;
+		unsigned int visible = pvs ? pvs[w].bits : ~0u;
+		int n = std::min(count - base, 32);
+		for( int k = 0; k < n; ++k ) {
+			if( !( visible & ( 1u << k ) ) ) {
+				continue;
+			}
+			considered++;
+			int index = base + k;
+			if( portalCull && !( portalVisible[index >> 5] & ( 1u << ( index & 31 ) ) ) && world->IsInArea(index) ) {
+				frameStats.entitiesOutsidePortals++;
+				continue;
+			}
+			ent = (*world)[index];
+			if( !ent->IsResident() ) {
+				continue;
+			}
+			ent->Interpolate(alpha);
+			if( CullEntity(ent) ) {
+				frameStats.entitiesCulled++;
+				continue;
+			}
+			// Sort key needs it
+			GetEntityTexture(ent);
+			drawList.push_back(ent);
+		}
+	}
+	frameStats.entitiesNotInPvs = count - considered;
+	if( occlusionEnabled ) {
+		CullOccluded();
+	}
+	std::sort(drawList.begin(), drawList.end(), R_SortByTextureMesh);
+
+	{
+		GpuScope gpu(gpuTimer, "GPU Opaque");
+		for( size_t i = 0; i < drawList.size(); ++i ) {
+			RenderEntity(drawList[i]);
+		}
+	}
+
+	if( boundMesh ) {
+		boundMesh->UnBind();
+		boundMesh = NULL;
 	}
 
+	if( debugDraw ) {
+		PROFILE_SCOPE("DebugDraw");
+		GpuScope gpu(gpuTimer, "GPU Debug");
+		for( size_t i = 0; i < drawList.size(); ++i ) {
+			// Boxes and normals are in model space
+			glPushMatrix();
+			glMultMatrixf(drawList[i]->GetRenderMat().GetRawPtr());
+			RenderBBox(drawList[i]);
+			RenderNormal(drawList[i]);
+			glPopMatrix();
+		}
+	}
+
+	if( frameCount == snapshotFrame ) {
+		PROFILE_SCOPE("Snapshot");
+		GpuScope gpu(gpuTimer, "GPU Snapshot");
+		Snapshot();
+	}
+	gpuTimer.EndFrame();
+
+	// After the draws, so new textures show their coarse
+	// levels this frame and finer ones arrive over the next
+	StreamTextures();
+
+	if( frameCount % 100 == 0 ) {
+		LOG_NORMAL(logger, LC_FRAME, "Frame %d: %d tris submitted, %d without LOD", frameCount,
+			frameStats.trisSubmitted, frameStats.trisFullDetail);
+		LOG_NORMAL(logger, LC_FRAME, "Frame %d: %d texture binds, %d saved by atlas", frameCount,
+			frameStats.texBinds, frameStats.texBindsSaved);
+		LOG_NORMAL(logger, LC_FRAME, "Frame %d: %d entities drawn, %d culled, %d outside the PVS", frameCount,
+			(int)drawList.size(), frameStats.entitiesCulled, frameStats.entitiesNotInPvs);
+		LOG_NORMAL(logger, LC_FRAME, "Frame %d: %d entities occluded by %d tris", frameCount,
+			frameStats.entitiesOccluded, frameStats.occluderTris);
+		LOG_NORMAL(logger, LC_FRAME, "Frame %d: %d areas visited, %d entities outside the portals", frameCount,
+			frameStats.areasVisited, frameStats.entitiesOutsidePortals);
+	}
+	const stream_stats_t& ss = streamer.GetStats();
+	if( ss.cellsLoaded || ss.cellsUnloaded ) {
+		LOG_NORMAL(logger, LC_RESOURCE, "Frame %d: %d cells loaded, %d unloaded in %.2f ms, %d of %d resident, %d loading, %u bytes GPU",
+			frameCount, ss.cellsLoaded, ss.cellsUnloaded, ss.uploadNs * 1e-6, ss.residentCells, ss.numCells,
+			ss.loadingCells, ss.gpuBytes);
+	}
+	if( frameStats.bytesUploaded ) {
+		LOG_NORMAL(logger, LC_RESOURCE, "Frame %d uploaded %u bytes", frameCount, frameStats.bytesUploaded);
+	}
+}
+
+void qEngine::EndFrame()
+{
+	// Arena data was consumed by the draws of this frame
+	frameArena.Reset();
+	AllocTracker::EndFrame(frameCount, logger);
+	frameCount++;
 }
 
 // Draw normals vectors on the surface of entity
@@ -417,7 +1010,7 @@ void qEngine::RenderNormal(Entity * entity)
 
 	vertex_t * verts = 	entity->GetModel()->GetVertexArray();
 	unsigned int sz = 	entity->GetModel()->GetNumVert();
-	float * buf = (float*)malloc( sz * 3 * 2 * sizeof(float));		// For vertex and normal
+	float * buf = frameArena.Alloc<float>(sz * 3 * 2);		// For vertex and normal
 	float * start = buf;
 	float scale = 0.5;
 	for( size_t i = 0; i < sz; ++i ) {
@@ -434,22 +1027,25 @@ void qEngine::RenderNormal(Entity * entity)
 		start += 6;
 	}
 
+	// Client arrays need buffer bindings released. Next
+	// entity sets up its mesh again.
 	entity->GetModel()->UnBind();
+	boundMesh = NULL;
 	glDisable(GL_TEXTURE_2D);
 	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 	glDisableClientState(GL_NORMAL_ARRAY);
 	
 	glColor4f(1, 0, 0, 1);
 	glVertexPointer(3, GL_FLOAT, 0, buf);
-	glDrawArrays(GL_LINES, 0, sz);
+	glDrawArrays(GL_LINES, 0, sz * 2);
+	frameStats.bytesUploaded += sz * 3 * 2 * sizeof(float);
+	frameStats.drawCalls++;
 
 	// Restore
 	glColor4f(1, 1, 1, 1);
 	glEnable(GL_TEXTURE_2D);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
 	glEnableClientState(GL_NORMAL_ARRAY);
-
-	free(buf);
 }
 
 
@@ -461,23 +1057,21 @@ void qEngine::RenderBBox(Entity * entity)
 		return;
 
 	BBox box = entity->Bound();
-	std::vector<Vec3> verts = box.GetVertex();
-	if( verts.size() == 0 ) {
-		logger->LogNormal("Entity %d has invalid bounding box", entity->GetId());
-		return;
-	}
+	Vec3 verts[BBOX_LINE_VERTS];
+	box.GetVertex(verts);
 
-	float * buf = (float*)malloc( verts.size() * 3 * sizeof(float));
+	float * buf = frameArena.Alloc<float>(BBOX_LINE_VERTS * 3);
 	float * start = buf;
-	for( size_t i = 0; i < verts.size(); ++i ) {
+	for( size_t i = 0; i < BBOX_LINE_VERTS; ++i ) {
 		*start++ = verts[i][0];
 		*start++ = verts[i][1];
 		*start++ = verts[i][2];
 	}
 
 	// Unbind the GL_ARRAY_BUFFER, so we can use it to draw
-	// basic geometry
+	// basic geometry. Next entity sets up its mesh again.
 	entity->GetModel()->UnBind();
+	boundMesh = NULL;
 
 	glDisable(GL_TEXTURE_2D);
 	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
@@ -485,68 +1079,374 @@ void qEngine::RenderBBox(Entity * entity)
 
 	glColor4f(0, 1, 0, 1);
 	glVertexPointer(3, GL_FLOAT, 0, buf);
-	glDrawArrays(GL_LINES, 0, verts.size());
+	glDrawArrays(GL_LINES, 0, BBOX_LINE_VERTS);
+	frameStats.bytesUploaded += BBOX_LINE_VERTS * 3 * sizeof(float);
+	frameStats.drawCalls++;
 
 	glColor4f(1, 1, 1, 1);
 	glEnable(GL_TEXTURE_2D);
 	glEnableClientState(GL_NORMAL_ARRAY);
 	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
-
-	free(buf);
 }
 
 
 void qEngine::RenderEntity(Entity * entity)
 {
+	PROFILE_SCOPE("RenderEntity");
 	// We are in GL_MODELVIEW mode
 	glPushMatrix();
 
-	Mat4 matrix = entity->GetModelToWorldMat();
-	glMultMatrixf(matrix.GetRawPtr());
+	glMultMatrixf(entity->GetRenderMat().GetRawPtr());
 
-	if (!entity->GetModel()->IsUploaded()) {
-		entity->GetModel()->UploadGPU();
+	Mesh * model = entity->GetModel();
+	if( !model->IsUploaded() ) {
+		frameStats.bytesUploaded += model->UploadGPU();
+		// Upload leaves its own buffers bound
+		boundMesh = NULL;
+	}
+	if( model != boundMesh ) {
+		model->Bind();
+		boundMesh = model;
+		frameStats.meshBinds++;
 	}
 
 
-	qStr texName = entity->GetModel()->GetTexName();
-	if( !texName.Empty() ) {
-		Texture * tex = GetTexture(texName.Ptr());
-		if( !tex ) {
-			logger->LogWarning("Cannot find texture for entity");
-			//fprintf(stderr, "Cannot find texture for entity\n");
-		} else {
-			if( !tex->IsUploaded() ) {
-				tex->UploadGPU();
+	Texture * tex = entity->GetTexture();
+	if( tex ) {
+		if( !tex->IsUploaded() ) {
+			frameStats.bytesUploaded += tex->UploadGPU();
+			if( tex->IsResident() ) {
+				LOG_NORMAL(logger, LC_RESOURCE, "Texture %s resident: %ux%u, %u bytes GPU",
+					tex->GetName().Ptr(), tex->GetWidth(), tex->GetHeight(), tex->GetGPUSize());
+			}
+			// Upload binds it
+			boundTexture = NULL;
+		}
+		// A change of source texture between consecutive draws
+		// would be a bind if the textures were not packed together
+		if( model != lastTexMesh ) {
+			if( lastTexMesh && tex == boundTexture
+				&& lastTexMesh->GetTexAtom() != model->GetTexAtom() ) {
+				frameStats.texBindsSaved++;
 			}
-			entity->AttachTexture(tex);
+			lastTexMesh = model;
+		}
+		if( tex != boundTexture ) {
+			tex->Bind();
+			boundTexture = tex;
+			frameStats.texBinds++;
 		}
 	}
 	float specularColor[3] = {1, 1, 1};
 	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, 1.0f);
 	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, specularColor);
 
-	glVertexPointer(3, GL_FLOAT, sizeof(vertex_t), 0 /*(char*)((char*)&entity->GetModel()->GetVertexArray()[0].pos - (char*)&entity->GetModel()->GetVertexArray()[0].pos)*/);
-	glTexCoordPointer(2, GL_SHORT, sizeof(vertex_t), (char*)((char*)&entity->GetModel()->GetVertexArray()[0].st[0] - (char*)&entity->GetModel()->GetVertexArray()[0].pos));
-	glNormalPointer(     GL_FLOAT, sizeof(vertex_t), (char*)((char*)&entity->GetModel()->GetVertexArray()[0].normal[0] - (char*)&entity->GetModel()->GetVertexArray()[0].pos));
-	glDrawElements(GL_TRIANGLES, entity->GetModel()->GetNumIndex(), GL_UNSIGNED_SHORT, entity->GetModel()->GetIndexArray());
+	// Quantized positions are expanded by modelview
+	bool compact = ( model->GetVertexFormat() == VERTEX_FORMAT_COMPACT );
+	if( compact ) {
+		glPushMatrix();
+		glMultMatrixf(model->GetDequantMat().GetRawPtr());
+	}
 
-	if( GetFrameCount() == 100 ) {
-		Snapshot();
+	int level = SelectLod(entity);
+	entity->SetLod(level);
+	const mesh_lod_t& lod = model->GetLod(level);
+
+	// Indices are sourced from the bound GL_ELEMENT_ARRAY_BUFFER
+	glDrawElements(GL_TRIANGLES, lod.numIndex, GL_UNSIGNED_SHORT, (const GLvoid*)(lod.firstIndex * sizeof(unsigned short)));
+	frameStats.drawCalls++;
+	frameStats.trisSubmitted += lod.numIndex / 3;
+	frameStats.trisFullDetail += model->GetNumIndex() / 3;
+	frameStats.vertexBytes += model->GetNumVert() * model->GetVertexStride();
+
+	if( compact ) {
+		glPopMatrix();
 	}
 
-    GLenum err;
-	while ((err = glGetError()) != GL_NO_ERROR) {
-        logger->LogWarning("GLerror: %u", err);
+	// glGetError can stall the pipeline, only ask if it gets logged
+	if( logger->IsEnabled(L_WARNING, LC_RENDER) ) {
+		GLenum err;
+		while ((err = glGetError()) != GL_NO_ERROR) {
+			LOG_WARNING(logger, LC_RENDER, "GLerror: %u", err);
+		}
 	}
 
 	
-	//RenderBBox(entity);
-	//RenderNormal(entity);
-
 	glPopMatrix();
 }
 
+// Resolve and remember the texture of an entity's mesh
+Texture * qEngine::GetEntityTexture(Entity * entity)
+{
+	Texture * tex = entity->GetTexture();
+	if( tex ) {
+		return tex;
+	}
+	qAtom texName = entity->GetModel()->GetTexAtom();
+	if( texName.IsEmpty() ) {
+		return NULL;
+	}
+	tex = GetTexture(texName);
+	if( !tex ) {
+		logger->LogWarning("Cannot find texture for entity");
+		return NULL;
+	}
+	entity->AttachTexture(tex);
+	return tex;
+}
+
+// Pick coarsest level whose simplification error projects to
+// less than LOD_PIXEL_ERROR pixels. Moving between levels needs
+// to clear the threshold by LOD_HYSTERESIS so entities sitting
+// right on it don't pop back and forth.
+int qEngine::SelectLod(Entity * entity) const
+{
+	Mesh * model = entity->GetModel();
+	if( !lodEnabled || model->GetNumLods() <= 1 ) {
+		return 0;
+	}
+
+	Vec3 c;
+	float radius;
+	GetWorldSphere(entity, c, radius);
+
+	Vec3 d = c - view.pos;
+	float dist = sqrtf(d.DotProduct(d));
+	if( dist <= radius ) {
+		return 0;
+	}
+
+	// World units to pixels at that distance
+	float pixels = (windowHeight * 0.5f) / (dist * tanf(view.fov * DEG_TO_RAD * 0.5f));
+	float radiusPixels = radius * pixels;
+
+	int current = entity->GetLod();
+	if( current >= model->GetNumLods() ) {
+		current = model->GetNumLods() - 1;
+	}
+
+	int desired = 0;
+	for( int i = model->GetNumLods() - 1; i > 0; --i ) {
+		if( model->GetLod(i).error * radiusPixels < LOD_PIXEL_ERROR ) {
+			desired = i;
+			break;
+		}
+	}
+
+	if( desired > current ) {
+		// Coarser only once well under the threshold
+		if( model->GetLod(desired).error * radiusPixels >= LOD_PIXEL_ERROR * (1.0f - LOD_HYSTERESIS) ) {
+			desired = current;
+		}
+	} else if( desired < current ) {
+		// Finer only once well over it
+		if( model->GetLod(current).error * radiusPixels <= LOD_PIXEL_ERROR * (1.0f + LOD_HYSTERESIS) ) {
+			desired = current;
+		}
+	}
+	return desired;
+}
+
+void qEngine::GetWorldSphere(Entity * entity, Vec3& center, float& radius) const
+{
+	Mesh * model = entity->GetModel();
+	const Mat4& m = entity->GetRenderMat();
+	Vec4 c = m.Mul(model->GetBoundCenter());
+	// Largest axis scale of the entity transform
+	float scale = 0.0f;
+	for( int i = 0; i < 3; ++i ) {
+		Vec3 axis(m[i][0], m[i][1], m[i][2]);
+		scale = std::max(scale, axis.DotProduct(axis));
+	}
+	center = Vec3(c[0], c[1], c[2]);
+	radius = model->GetBoundRadius() * sqrtf(scale);
+}
+
+// Clip planes straight from the rows of projection x view
+// (Gribb & Hartmann), already in world space
+void qEngine::SetFrustumPlanes()
+{
+	Mat4 clip = projectionMat.RightMul(modelViewMat);
+	for( int i = 0; i < 6; ++i ) {
+		int row = i / 2;
+		float sign = ( i & 1 ) ? -1.0f : 1.0f;
+		Vec4 p;
+		for( int j = 0; j < 4; ++j ) {
+			p[j] = clip[j][3] + sign * clip[j][row];
+		}
+		float len = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+		if( len > 0.0f ) {
+			p = Vec4(p[0] / len, p[1] / len, p[2] / len, p[3] / len);
+		}
+		frustum[i] = p;
+	}
+}
+
+// True if the bounding sphere is entirely outside one plane
+bool qEngine::CullEntity(Entity * entity) const
+{
+	Vec3 c;
+	float radius;
+	GetWorldSphere(entity, c, radius);
+	for( int i = 0; i < 6; ++i ) {
+		const Vec4& p = frustum[i];
+		if( p[0] * c[0] + p[1] * c[1] + p[2] * c[2] + p[3] < -radius ) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Longest chain of portals followed from the camera area
+#define PORTAL_MAX_DEPTH	16
+
+bool qEngine::FlowPortals(const Vec3& eye)
+{
+	if( !portalsEnabled ) {
+		return false;
+	}
+	int area = world->FindArea(eye);
+	if( area < 0 ) {
+		return false;
+	}
+	PROFILE_SCOPE("Portals");
+	int numAreas = world->GetNumAreas();
+	int numWords = ( world->Count() + 31 ) / 32;
+	portalVisible = frameArena.Alloc<unsigned int>(numWords);
+	areaOnPath = frameArena.Alloc<byte>(numAreas);
+	areaSeen = frameArena.Alloc<byte>(numAreas);
+	memset(portalVisible, 0, numWords * sizeof(unsigned int));
+	memset(areaOnPath, 0, numAreas);
+	memset(areaSeen, 0, numAreas);
+
+	// Planes the entities are culled with but near, it would cut
+	// off the doorway the camera stands in
+	Plane planes[5];
+	int numPlanes = 0;
+	for( int i = 0; i < 6; ++i ) {
+		if( i != 4 ) {
+			planes[numPlanes++] = Plane(Vec3(frustum[i][0], frustum[i][1], frustum[i][2]), -frustum[i][3]);
+		}
+	}
+	WalkPortals(area, Frustum(planes, numPlanes), eye, 0);
+	return true;
+}
+
+// Entities of area inside view are marked, then every portal
+// out of it that shows narrows view for the area behind. An
+// area can be reached along several chains, not twice on one.
+void qEngine::WalkPortals(int area, const Frustum& view, const Vec3& eye, int depth)
+{
+	const bmap_area_t& a = world->GetArea(area);
+	if( !areaSeen[area] ) {
+		areaSeen[area] = 1;
+		frameStats.areasVisited++;
+	}
+	areaOnPath[area] = 1;
+
+	const unsigned int * refs = world->GetAreaRefs() + a.firstRef;
+	for( unsigned int i = 0; i < a.numRefs; ++i ) {
+		unsigned int e = refs[i];
+		if( portalVisible[e >> 5] & ( 1u << ( e & 31 ) ) ) {
+			continue;
+		}
+		Vec3 c;
+		float radius;
+		GetWorldSphere((*world)[e], c, radius);
+		if( !view.CullSphere(c, radius) ) {
+			portalVisible[e >> 5] |= 1u << ( e & 31 );
+		}
+	}
+
+	if( depth < PORTAL_MAX_DEPTH ) {
+		const Vec3 * points = world->GetPortalPoints();
+		for( unsigned int i = 0; i < a.numPortals; ++i ) {
+			const bmap_portal_t& p = world->GetPortal(a.firstPortal + i);
+			if( areaOnPath[p.area] ) {
+				continue;
+			}
+			winding_t w;
+			w.numVerts = p.numPoints;
+			std::copy(points + p.firstPoint, points + p.firstPoint + p.numPoints, w.verts);
+			Frustum narrowed;
+			if( view.Narrow(eye, w, narrowed) ) {
+				WalkPortals(p.area, narrowed, eye, depth + 1);
+			}
+		}
+	}
+	areaOnPath[area] = 0;
+}
+
+struct occ_candidate_t {
+	float		area;
+	Entity *	entity;
+};
+
+static bool R_SortByArea(const occ_candidate_t& a, const occ_candidate_t& b)
+{
+	return a.area > b.area;
+}
+
+void qEngine::CullOccluded()
+{
+	PROFILE_SCOPE("Occlusion");
+	// Marked occluders first, then whatever covers most of the
+	// screen. Share of the screen from the bounding sphere.
+	occ_candidate_t * cand = frameArena.Alloc<occ_candidate_t>(drawList.size());
+	int numCand = 0;
+	float pixels = ( windowHeight * 0.5f ) / tanf(view.fov * DEG_TO_RAD * 0.5f);
+	float screenArea = (float)windowWidth * windowHeight;
+	for( size_t i = 0; i < drawList.size(); ++i ) {
+		Entity * ent = drawList[i];
+		Vec3 c;
+		float radius;
+		GetWorldSphere(ent, c, radius);
+		Vec3 d = c - view.pos;
+		float dist = sqrtf(d.DotProduct(d));
+		float area = 1.0f;
+		if( dist > radius ) {
+			float r = radius * pixels / dist;
+			area = std::min((float)M_PI * r * r / screenArea, 1.0f);
+		}
+		if( ent->IsOccluder() ) {
+			area += 1.0f;
+		} else if( area < OCC_MIN_SCREEN_AREA ) {
+			continue;
+		}
+		cand[numCand].area = area;
+		cand[numCand].entity = ent;
+		numCand++;
+	}
+	if( !numCand ) {
+		return;
+	}
+	std::sort(cand, cand + numCand, R_SortByArea);
+	numCand = std::min(numCand, OCC_MAX_OCCLUDERS);
+	occluders.clear();
+	for( int i = 0; i < numCand; ++i ) {
+		occluders.push_back(cand[i].entity);
+	}
+
+	Mat4 clip = projectionMat.RightMul(modelViewMat);
+	occlusion.Render(clip, view.zNear, &occluders[0], numCand);
+	frameStats.occluderTris = occlusion.GetNumTris();
+
+	size_t kept = 0;
+	for( size_t i = 0; i < drawList.size(); ++i ) {
+		Entity * ent = drawList[i];
+		// An occluder would hide itself
+		if( std::find(occluders.begin(), occluders.end(), ent) == occluders.end() ) {
+			Mesh * model = ent->GetModel();
+			if( occlusion.IsOccluded(clip.RightMul(ent->GetRenderMat()), model->GetBoundMins(), model->GetBoundMaxs()) ) {
+				frameStats.entitiesOccluded++;
+				continue;
+			}
+		}
+		drawList[kept++] = ent;
+	}
+	drawList.resize(kept);
+}
+
 void qEngine::GetColorBuffer(unsigned char * buf)
 {
 	if( !buf ) {
@@ -568,10 +1468,7 @@ void qEngine::Snapshot()
 	name.ConcatSelf( common->GetTime() );
     name.AppendExtension("tga");
     // RGBA
-    unsigned char * data = (unsigned char*)calloc(windowWidth * windowHeight, 4 * sizeof(unsigned char));
-    if( !data ) {
-        common->FatalError("qEngine Snapshot: Cannot locate more memory");
-    }
+    unsigned char * data = frameArena.Alloc<unsigned char>(windowWidth * windowHeight * 4);
     GetColorBuffer(data);
 
     unsigned char header[18];
@@ -607,7 +1504,7 @@ void qEngine::AddLight(light_t * l)
         return;
     }
 
-    light_t * first = l->next;
+    light_t * first = lights->next;
     lights->next = l;
     l->next = first;
 }
@@ -630,13 +1527,24 @@ light_t* qEngine::GetDefaultLight()
  *======================================================
  */
 
-static void R_SilCullFacing(unsigned short* tri, int numIndex, vertex_t* vert, light_t* light, silhouette_t& sil)
+// Zeroed, from the frame arena if there is one
+static void * R_SilAlloc(FrameArena * arena, size_t bytes)
+{
+    if( !arena ) {
+        return calloc(1, bytes);
+    }
+    void * p = arena->Alloc(bytes);
+    memset(p, 0, bytes);
+    return p;
+}
+
+static void R_SilCullFacing(unsigned short* tri, int numIndex, vertex_t* vert, light_t* light, silhouette_t& sil, FrameArena * arena)
 {
     if( numIndex <= 0) {
         return;
     }
     int numTri = numIndex / 3;
-    sil.facing = (byte*)malloc(numTri * sizeof(byte));
+    sil.facing = (byte*)R_SilAlloc(arena, numTri * sizeof(byte));
     for( int i = 0; i < numTri; ++i ) {
         Vec3 v1 = vert[tri[i*3]].pos;
         Vec3 v2 = vert[tri[i*3+1]].pos;
@@ -681,8 +1589,9 @@ static int edge_cmp_f(const void * a, const void * b)
     }
 }
 
-// For faster accessing a sorted edge_t array. We use a
-// index array to provide random access on p1
+// For faster accessing a sorted edge_t array. Edges starting
+// at vertex v are [index[v], index[v + 1]), so the array has
+// room for one past the largest vertex.
 struct siledge_index_t
 {
     siledge_index_t()
@@ -695,47 +1604,54 @@ struct siledge_index_t
         index = (int*)malloc(capacity * sizeof(int));
     }
 
+    ~siledge_index_t()
+    {
+        free(index);
+    }
+
     int*    index;
 };
 
 static void R_SilIndexing(qArr<edge_t>& edges, siledge_index_t** index)
 {
-    int maxIndex = edges.Last().p1;
-    *index = new siledge_index_t(maxIndex);
+    delete *index;
+    int maxIndex = edges.Size() ? edges.Last().p1 : 0;
+    *index = new siledge_index_t(maxIndex + 2);
     siledge_index_t * si = *index;
-    memset(si->index, -1, sizeof(int) * maxIndex);
 
-    for( int i = 0; i < edges.Size(); ++i ) {
-        int j = edges[i].p1;
-        if( si->index[j] == -1 ) {
-            si->index[j] = i;
+    int e = 0;
+    for( int v = 0; v <= maxIndex + 1; ++v ) {
+        while( e < edges.Size() && edges[e].p1 < v ) {
+            e++;
         }
+        si->index[v] = e;
     }
 }
 
+static int R_SilFindTwin(qArr<edge_t>& edges, const edge_t& ea, siledge_index_t* si, int maxIndex)
+{
+    if( ea.p2 > maxIndex ) {
+        return -1;
+    }
+    for( int j = si->index[ea.p2]; j < si->index[ea.p2 + 1]; ++j ) {
+        if( edges[j].p2 == ea.p1 ) {
+            return j;
+        }
+    }
+    return -1;
+}
 
 // Assuming edges are sorted, elimenate dangling edges. Hopefully there
 // aren't many of them
 static void R_SilPrune(qArr<edge_t>& edges, siledge_index_t** index)
 {
-    if( !*index ) {
-        R_SilIndexing(edges, index);
-    }
+    R_SilIndexing(edges, index);
     siledge_index_t * idx = *index;
+    int maxIndex = edges.Size() ? edges.Last().p1 : 0;
 
     qArr<edge_t> processed(edges.Size());
     for( int i = 0; i < edges.Size(); ++i ) {
-        int p1 = edges[i].p1;
-        int p2 = edges[i].p2;
-        if( !idx->index[p2] ) {
-            continue;
-        }
-        bool found = false;
-        for( int j = idx->index[p2]; j < std::min<int>(idx->index[p2+1], edges.Size()); ++j ) {
-            if( edges[j].p2 == p1 )
-                found = true;
-        }
-        if( !found ) {
+        if( R_SilFindTwin(edges, edges[i], idx, maxIndex) < 0 ) {
             continue;
         }
         processed.Add(edges[i]);
@@ -743,31 +1659,8 @@ static void R_SilPrune(qArr<edge_t>& edges, siledge_index_t** index)
     edges.Replace(processed);
 }
 
-
-static int R_SilNextAvailIndex(siledge_index_t* si, int n)
-{
-    for( int k = n + 1; ; k++ ) {
-        if( si->index[k] != -1 ) 
-            return k;
-    }
-}
-
-
-static int R_SilFindOtherTri(qArr<edge_t>& edges, edge_t ea, siledge_index_t* si)
-{
-    int k = si->index[ea.p2];
-    for( int j = k; j < std::min<int>(R_SilNextAvailIndex(si, k), edges.Size()); ++j ) {
-        edge_t eb = edges[j];
-        if( eb.p2 == ea.p1 ) {
-            return eb.tri;
-        }
-    }
-    // Should never happen
-    return -1;
-}
-
 // This code is stupid !
-static void R_SilClean(silhouette_t* si)
+static void R_SilClean(silhouette_t* si, FrameArena * arena)
 {
     if( !si || !si->sil ) {
         return;
@@ -779,13 +1672,16 @@ static void R_SilClean(silhouette_t* si)
     }
 
     siledge_t* old = si->sil;
-    si->sil = (siledge_t*)calloc(1, count * sizeof(siledge_t));
+    si->sil = (siledge_t*)R_SilAlloc(arena, count * sizeof(siledge_t));
     int n = 0;
     for( int j = 0; j < si->numSilEdges; ++j ) {
         if( old[j].flag ) {
             si->sil[n++] = old[j];
         }
     }
+    if( !arena ) {
+        free(old);
+    }
     si->numSilEdges = n;
 }
 
@@ -799,10 +1695,12 @@ static void R_SilFillEdge(Mesh* model, light_t* light, silhouette_t& sil)
 
     R_SilPrune(es, &si);
     R_SilIndexing(es, &si);
+    int maxIndex = es.Size() ? es.Last().p1 : 0;
 
     for( int i = 0; i < es.Size(); ++i ) {
         edge_t k = es[i];
-        if( k.marked )
+        // Every edge left has a twin, take each pair once
+        if( k.p1 > k.p2 )
             continue;
     
         siledge_t* se = &sil.sil[sil.numSilEdges++];
@@ -811,29 +1709,24 @@ static void R_SilFillEdge(Mesh* model, light_t* light, silhouette_t& sil)
 
         se->p1 = k.tri;
         // find another triangle share this edge
-        se->p2 = R_SilFindOtherTri(es, k, si);
-		k.marked = 1;
+        se->p2 = es[R_SilFindTwin(es, k, si, maxIndex)].tri;
     }
+    delete si;
 }
 
-// Get silhoutte from current light
-silhouette_t* qEngine::GetSilhouette(const Entity * entity, light_t * light)
+// Silhouette of a mesh against a light, NULL if the mesh has
+// no triangles. Lives until the arena is reset, or until
+// R_FreeSilhouette without one.
+silhouette_t * R_ExtractSilhouette(Mesh * model, light_t * light, FrameArena * arena)
 {
-    if( !entity || !light ) {
+    if( model->GetNumIndex() < 3 ) {
         return NULL;
     }
-    silhouette_t* si = (silhouette_t*)calloc(1, sizeof(*si));
-    si->sil = (siledge_t*)calloc(1, sizeof(siledge_t) * entity->GetModel()->GetNumIndex());
-    si->entity = const_cast<Entity*>(entity);
+    silhouette_t* si = (silhouette_t*)R_SilAlloc(arena, sizeof(*si));
+    si->sil = (siledge_t*)R_SilAlloc(arena, sizeof(siledge_t) * model->GetNumIndex());
 
-    Mesh* model = entity->GetModel();
     R_SilFillEdge  (model, light, *si);
-    R_SilCullFacing(model->GetIndexArray(), model->GetNumIndex(), model->GetVertexArray(), light, *si);
-
-    if( !si->facing ) {
-        logger->LogWarning("Failed generating facing info for entity");
-        return NULL;
-    }
+    R_SilCullFacing(model->GetIndexArray(), model->GetNumIndex(), model->GetVertexArray(), light, *si, arena);
 
     // Now we have all potential silhouette edges, let's
     // find out the real ones	
@@ -846,7 +1739,33 @@ silhouette_t* qEngine::GetSilhouette(const Entity * entity, light_t * light)
         }
     } 
 
-    R_SilClean(si);
+    R_SilClean(si, arena);
+    return si;
+}
+
+void R_FreeSilhouette(silhouette_t * si)
+{
+    if( !si ) {
+        return;
+    }
+    free(si->sil);
+    free(si->facing);
+    free(si);
+}
+
+// Get silhoutte from current light
+silhouette_t* qEngine::GetSilhouette(const Entity * entity, light_t * light)
+{
+	PROFILE_SCOPE("GetSilhouette");
+    if( !entity || !light ) {
+        return NULL;
+    }
+    silhouette_t* si = R_ExtractSilhouette(entity->GetModel(), light, &frameArena);
+    if( !si ) {
+        logger->LogWarning("Failed generating facing info for entity");
+        return NULL;
+    }
+    si->entity = const_cast<Entity*>(entity);
     return si;
 }
 
@@ -23,10 +23,22 @@
 #include "Log.h"
 #include "CameraPath.h"
 #include "qArr.h"
+#include "TextureAtlas.h"
+#include "GpuTimer.h"
+#include "FrameArena.h"
+#include "WorldStreamer.h"
+#include "Occlusion.h"
+#include "HotReload.h"
 
 #define QENGINE_VERSION	"0.1"
 #define MAX_ENTITY_NUMBER	256
 #define MAX_CAMERAPATH 15
+// LOD is switched once simplification error covers this many pixels
+#define LOD_PIXEL_ERROR		1.0f
+// Band around the threshold where current LOD is kept
+#define LOD_HYSTERESIS		0.25f
+// Texture bytes streamed to the GPU per frame
+#define TEXTURE_STREAM_BUDGET	(256 * 1024)
 
 #define DISALLOW_DEFAULT_AND_COPY_CTOR(NAME) \
 	private: \
@@ -79,6 +91,33 @@ struct silhouette_t {
     byte*       facing; 
 };
 
+// Silhouette edges of a mesh seen from a light. Kept outside
+// qEngine so they can be run without a GL context. With an
+// arena the result lasts the frame, without one it's freed by
+// R_FreeSilhouette.
+silhouette_t *  R_ExtractSilhouette(Mesh * model, light_t * light, FrameArena * arena);
+void            R_FreeSilhouette(silhouette_t * si);
+
+
+// Counters collected over one RenderFrame
+struct render_stats_t {
+    unsigned int    bytesUploaded;  // buffer and texture data handed to driver
+    int             drawCalls;
+    int             meshBinds;      // vertex array setups
+    unsigned int    vertexBytes;    // vertex data fetched by draws
+    int             trisSubmitted;
+    int             trisFullDetail; // what we would submit without LOD
+    unsigned int    textureBytes;   // GPU memory held by textures
+    int             texBinds;
+    int             texBindsSaved;  // binds the same queue needs without the atlas
+    int             entitiesCulled; // outside the view frustum
+    int             entitiesNotInPvs; // not seen from the camera cell
+    int             entitiesOccluded; // behind the occluders
+    int             occluderTris;   // drawn into the occlusion buffer
+    int             areasVisited;   // reached through portals
+    int             entitiesOutsidePortals; // in areas or parts not seen
+};
+
 
 class Texture;
 class WorldDB;
@@ -101,15 +140,18 @@ public:
 	void	    Shutdown();
 	bool	    IsOn();
 	// The root game directory
-	qStr	    GetGameDir() const;
+	const qStr& GetGameDir() const;
 
-	void	    RenderFrame();
+	// alpha is how far between the last two simulation
+	// states to draw, see Timer::GetAlpha
+	void	    RenderFrame(float alpha = 1.0f);
 	void	    RenderEntity(Entity * entity);
 	void	    RenderBBox(Entity * entity);
 	void	    RenderNormal(Entity * entity);
 	void	    SetProjectionMat();
 	void	    SetViewMat();
     void        SetLighting();
+	// One fixed simulation step
 	void	    UpdateWorld();
 
 	// Load entities into world
@@ -121,19 +163,53 @@ public:
 	void	    MoveCamera(const Vec3 vPos, const Vec3 vUp);
 	void	    AttachCamera(const Entity * entity);
 	void	    DetachCamera();
-	void	    LoadCameraPath(const char * pathFile);
+	// Slot of the loaded path, -1 on failure
+	int		    LoadCameraPath(const char * pathFile);
     void        SetCurrentCameraPath(int id);
     CameraPath* GetCurrentCameraPath() const;
+    // Seconds the camera path moves per update, 0 for the
+    // simulation step
+    void        SetCameraStep(float seconds) { cameraStep = seconds; }
 
     // Light configuration
     void        AddLight(light_t *l);
     light_t *   GetDefaultLight();
 
+	// Use vertex_compact_t for GPU copies of meshes
+	void	    SetCompactVertex(bool on);
+	void	    SetLodEnabled(bool on) { lodEnabled = on; }
+	// Software occlusion test after frustum culling
+	void	    SetOcclusionEnabled(bool on) { occlusionEnabled = on; }
+	// Portal walk through the areas of indoor maps
+	void	    SetPortalsEnabled(bool on) { portalsEnabled = on; }
+	// Bounding boxes and normals after the opaque pass
+	void	    SetDebugDraw(bool on) { debugDraw = on; }
+	// Watch data/ and bring in edited meshes, textures, camera
+	// paths and the current map at the start of a frame
+	bool	    SetHotReload(bool on);
+	// Timestamp queries if the driver has them
+	void	    InitGpuTimer(gl_proc_loader_t loader);
+	// Write .qtex files for all PNG textures
+	void	    CookTextures(image_format_t fmt);
+	// Binary .bmap of a text map, LoadMap picks it up. pvs
+	// adds what can be seen from where, takes a while.
+	bool	    CookMap(const char * map, bool pvs);
+
 	Mesh *	    GetModel(const char *name) const;
+	Mesh *	    GetModel(qAtom name) const;
 	Log *	    GetLogger() const;
 
 	int		    GetFrameCount() const { return frameCount; }
+    const render_stats_t& GetFrameStats() const { return frameStats; }
+    // Cells of a cooked map around the camera
+    const stream_stats_t& GetStreamStats() const { return streamer.GetStats(); }
+    // After the buffer swap. Drops per frame allocations.
+    void        EndFrame();
+    // Scratch memory valid until EndFrame
+    FrameArena& GetFrameArena() { return frameArena; }
     void        Snapshot();
+    // Frame a screenshot is taken on, -1 for none
+    void        SetSnapshotFrame(int frame) { snapshotFrame = frame; }
 
 private:
 	void	    Set3D();
@@ -141,10 +217,35 @@ private:
 	bool	    InitTextureCache();
     bool        PreloadCP();
 	Texture*    GetTexture(const char *name) const;
+	Texture*    GetTexture(qAtom name) const;
+	Texture*    GetEntityTexture(Entity * entity);
+	void	    StreamTextures();
+	void	    DecodeTextures(std::vector<Texture*>& pngs);
 	void	    AddEntity(qStr modelName, Vec3 modelPos);
 	void	    GetColorBuffer(unsigned char *);
     silhouette_t*     GetSilhouette(const Entity * entity, light_t * l);
+    int         SelectLod(Entity * entity) const;
+    // Bounding sphere of the entity in world space
+    void        GetWorldSphere(Entity * entity, Vec3& center, float& radius) const;
+    void        SetFrustumPlanes();
+    bool        CullEntity(Entity * entity) const;
+    // Drops draw list entries hidden behind the biggest ones
+    void        CullOccluded();
+    // Marks entities seen through portals in portalVisible.
+    // False without areas or with the camera outside them.
+    bool        FlowPortals(const Vec3& eye);
+    void        WalkPortals(int area, const Frustum& view, const Vec3& eye, int depth);
     void        R_SilDebugDraw(silhouette_t *);
+    // After the world got a map
+    void        StartMap();
+    // Map lights belong to the world, it frees them with the map
+    void        ClearLights();
+    // Loads the watcher finished, at the start of a frame
+    void        ApplyReloads();
+    void        ReloadMesh(reload_t& r);
+    void        ReloadTexture(reload_t& r);
+    void        ReloadCameraPath(reload_t& r);
+    void        ReloadMap(reload_t& r);
 
 private:
 	// place to find all resources
@@ -156,28 +257,71 @@ private:
 	Mat4					projectionMat;
 	// World sapce to view space
 	Mat4					modelViewMat;
+	// World space clip planes of the current view, normals
+	// pointing inwards: left, right, bottom, top, near, far
+	Vec4					frustum[6];
 	camera_t				camera;
+	// Camera before the last simulation step
+	camera_t				prevCamera;
+	// Camera drawn this frame, between the two
+	camera_t				view;
     light_t *               lights;
     int                     numLights;
 	CameraPath*     		cameraPath[MAX_CAMERAPATH];
+	// File each camera path came from
+	qStr					cameraPathFile[MAX_CAMERAPATH];
     CameraPath*             currentCameraPath;
 	Entity *				attachedEntity;
 	WorldDB*				world;
+	// As given to LoadMap
+	qStr					mapName;
+	ResourceWatcher			watcher;
+	// Taken from the watcher, waiting for streaming reads
+	std::vector<reload_t>	reloads;
+	// Entities of current frame, grouped by mesh
+	std::vector<Entity*>	drawList;
+	// Mesh whose vertex arrays are currently set up
+	Mesh *					boundMesh;
+	Texture *				boundTexture;
+	// Previous draw's mesh, to count binds the atlas saved
+	Mesh *					lastTexMesh;
+	TextureAtlas			atlas;
+	GpuTimer				gpuTimer;
+	FrameArena				frameArena;
+	render_stats_t			frameStats;
+	WorldStreamer			streamer;
+	OcclusionBuffer			occlusion;
+	// Picked from the draw list each frame
+	std::vector<Entity*>	occluders;
+	// Portal walk, frame arena. A bit per entity, and a byte per
+	// area for being on the current portal chain or seen at all.
+	unsigned int *			portalVisible;
+	byte *					areaOnPath;
+	byte *					areaSeen;
 
 	bool					engineOn;
 	bool					debugOn;
+	bool					lodEnabled;
+	// Layout of meshes loaded later
+	bool					compactVertex;
+	bool					occlusionEnabled;
+	bool					portalsEnabled;
+	bool					debugDraw;
 	unsigned int			windowWidth;
 	unsigned int			windowHeight;
     int                     frameCount;
+    int                     snapshotFrame;
+    float                   cameraStep;
 
 	Log	*					logger;
 
 	DISALLOW_DEFAULT_AND_COPY_CTOR(qEngine)
 };
 
-inline qEngine::qEngine(unsigned int width, unsigned int height) : lights(0), numLights(0), currentCameraPath(0), attachedEntity(0), engineOn(false), debugOn(true), windowWidth(width), windowHeight(height), frameCount(0)
+inline qEngine::qEngine(unsigned int width, unsigned int height) : lights(0), numLights(0), currentCameraPath(0), attachedEntity(0), boundMesh(0), boundTexture(0), lastTexMesh(0), portalVisible(0), areaOnPath(0), areaSeen(0), engineOn(false), debugOn(true), lodEnabled(true), compactVertex(false), occlusionEnabled(true), portalsEnabled(true), debugDraw(false), windowWidth(width), windowHeight(height), frameCount(0), snapshotFrame(100), cameraStep(0)
 {
     memset(cameraPath, 0, sizeof(CameraPath*) * MAX_CAMERAPATH);
+    memset(&frameStats, 0, sizeof(frameStats));
 	Init();
 }
 
@@ -208,7 +352,7 @@ inline void qEngine::Stop()
 	engineOn = false;
 }
 
-inline qStr qEngine::GetGameDir() const
+inline const qStr& qEngine::GetGameDir() const
 {
 	return dataDir;
 }